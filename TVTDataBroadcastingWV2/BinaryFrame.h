@@ -0,0 +1,398 @@
+﻿#pragma once
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// ストリームのデータを送るための2進のフレーム形式
+// Windowsに依存しないのでこのヘッダだけで書き込み側と読み込み側の両方を使える
+// フレームは[version:1][type:1][flags:2][length:4][payload:length]を並べたもの (数値はリトルエンディアン)
+// 読み込み側は知らないtypeのフレームを読み飛ばす。versionが異なれば読まない
+// ページにはPostWebMessageAsJsonで文字列としてしか送れないのでフレームの列をPackUtf16で文字列に詰めて送る
+
+constexpr uint8_t binaryFrameVersion = 1;
+constexpr size_t binaryFrameHeaderSize = 8;
+
+enum BinaryFrameType : uint8_t
+{
+    // TSパケットの列
+    BINARY_FRAME_PACKETS = 1,
+    // [PID:2][セクション]
+    BINARY_FRAME_SECTION = 2,
+    // [component_tag:1][moduleId:2][モジュールの中身]
+    BINARY_FRAME_MODULE = 3,
+    // [program_clock_reference_base:8][program_clock_reference_extension:2]
+    BINARY_FRAME_TIMESTAMP = 4,
+    // UTF-8のJSONで表された制御メッセージ ({"type":"streamReset"}など)
+    BINARY_FRAME_CONTROL = 5,
+    // 組み立て済みのPES [stream_id:1][flags:1][PTS (90kHz):8][PES_packet_data_byte]
+    // flagsのビット0が立っていればPTSが有効
+    BINARY_FRAME_PES = 6,
+    // UTF-8のJSONで表されたweb-bmlのResponseMessage ({"type":"currentTime"}など)
+    BINARY_FRAME_RESPONSE = 7,
+};
+
+constexpr uint8_t binaryFramePESFlagPTS = 1;
+constexpr size_t binaryFramePESHeaderSize = 10;
+constexpr size_t binaryFrameSectionHeaderSize = 2;
+constexpr size_t binaryFrameModuleHeaderSize = 3;
+
+inline void WriteBinaryFrameHeader(uint8_t* header, BinaryFrameType type, uint16_t flags, uint32_t length)
+{
+    header[0] = binaryFrameVersion;
+    header[1] = type;
+    header[2] = (uint8_t)flags;
+    header[3] = (uint8_t)(flags >> 8);
+    header[4] = (uint8_t)length;
+    header[5] = (uint8_t)(length >> 8);
+    header[6] = (uint8_t)(length >> 16);
+    header[7] = (uint8_t)(length >> 24);
+}
+
+// 中身を書き込まずにフレームをバッファの末尾に加えて中身の位置を返す
+inline uint8_t* AppendBinaryFrame(std::vector<uint8_t>& buffer, BinaryFrameType type, size_t size, uint16_t flags = 0)
+{
+    auto offset = buffer.size();
+    buffer.resize(offset + binaryFrameHeaderSize + size);
+    WriteBinaryFrameHeader(buffer.data() + offset, type, flags, (uint32_t)size);
+    return buffer.data() + offset + binaryFrameHeaderSize;
+}
+
+// フレームをバッファの末尾に加える
+inline void AppendBinaryFrame(std::vector<uint8_t>& buffer, BinaryFrameType type, const void* payload, size_t size, uint16_t flags = 0)
+{
+    auto offset = buffer.size();
+    buffer.resize(offset + binaryFrameHeaderSize + size);
+    WriteBinaryFrameHeader(buffer.data() + offset, type, flags, (uint32_t)size);
+    if (size)
+    {
+        memcpy(buffer.data() + offset + binaryFrameHeaderSize, payload, size);
+    }
+}
+
+// [PID:2][セクション]のフレームを加える
+inline void AppendSectionFrame(std::vector<uint8_t>& buffer, uint16_t pid, const uint8_t* section, size_t size)
+{
+    auto frame = AppendBinaryFrame(buffer, BINARY_FRAME_SECTION, binaryFrameSectionHeaderSize + size);
+    frame[0] = (uint8_t)pid;
+    frame[1] = (uint8_t)(pid >> 8);
+    if (size)
+    {
+        memcpy(frame + binaryFrameSectionHeaderSize, section, size);
+    }
+}
+
+// [component_tag:1][moduleId:2][モジュールの中身]のフレームを加える
+inline void AppendModuleFrame(std::vector<uint8_t>& buffer, uint8_t componentTag, uint16_t moduleId, const uint8_t* data, size_t size)
+{
+    auto frame = AppendBinaryFrame(buffer, BINARY_FRAME_MODULE, binaryFrameModuleHeaderSize + size);
+    frame[0] = componentTag;
+    frame[1] = (uint8_t)moduleId;
+    frame[2] = (uint8_t)(moduleId >> 8);
+    if (size)
+    {
+        memcpy(frame + binaryFrameModuleHeaderSize, data, size);
+    }
+}
+
+struct BinaryFrameView
+{
+    BinaryFrameType type;
+    uint16_t flags;
+    const uint8_t* payload;
+    size_t size;
+};
+
+class BinaryFrameReader
+{
+    const uint8_t* p;
+    const uint8_t* end;
+    bool error = false;
+public:
+    BinaryFrameReader(const uint8_t* data, size_t size) : p(data), end(data + size)
+    {
+    }
+
+    // 次のフレームがあればtrue 末尾のフレームヘッダに満たない余りは無視する
+    bool Next(BinaryFrameView& frame)
+    {
+        while (!this->error && (size_t)(this->end - this->p) >= binaryFrameHeaderSize)
+        {
+            if (this->p[0] != binaryFrameVersion)
+            {
+                this->error = true;
+                return false;
+            }
+            auto length = (size_t)this->p[4] | ((size_t)this->p[5] << 8) | ((size_t)this->p[6] << 16) | ((size_t)this->p[7] << 24);
+            if ((size_t)(this->end - this->p) - binaryFrameHeaderSize < length)
+            {
+                this->error = true;
+                return false;
+            }
+            frame.type = (BinaryFrameType)this->p[1];
+            frame.flags = (uint16_t)(this->p[2] | (this->p[3] << 8));
+            frame.payload = this->p + binaryFrameHeaderSize;
+            frame.size = length;
+            this->p += binaryFrameHeaderSize + length;
+            if (frame.type >= BINARY_FRAME_PACKETS && frame.type <= BINARY_FRAME_RESPONSE)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool HasError() const
+    {
+        return this->error;
+    }
+};
+
+// SECTIONフレームのPIDとセクション 短すぎればfalse
+inline bool ReadSectionFrame(const BinaryFrameView& frame, uint16_t& pid, const uint8_t*& section, size_t& size)
+{
+    if (frame.type != BINARY_FRAME_SECTION || frame.size < binaryFrameSectionHeaderSize)
+    {
+        return false;
+    }
+    pid = (uint16_t)(frame.payload[0] | (frame.payload[1] << 8));
+    section = frame.payload + binaryFrameSectionHeaderSize;
+    size = frame.size - binaryFrameSectionHeaderSize;
+    return true;
+}
+
+// MODULEフレームのcomponent_tag、moduleIdとモジュールの中身 短すぎればfalse
+inline bool ReadModuleFrame(const BinaryFrameView& frame, uint8_t& componentTag, uint16_t& moduleId, const uint8_t*& data, size_t& size)
+{
+    if (frame.type != BINARY_FRAME_MODULE || frame.size < binaryFrameModuleHeaderSize)
+    {
+        return false;
+    }
+    componentTag = frame.payload[0];
+    moduleId = (uint16_t)(frame.payload[1] | (frame.payload[2] << 8));
+    data = frame.payload + binaryFrameModuleHeaderSize;
+    size = frame.size - binaryFrameModuleHeaderSize;
+    return true;
+}
+
+inline uint64_t ReadBinaryFrameUint64(const uint8_t* p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+// TSDecoderで解析したフレームをweb-bmlのResponseMessage (ws_api) と同じ形のJSONにする
+// PES、TIMESTAMP、RESPONSE以外のフレームはfalse
+inline bool FormatResponseMessage(const BinaryFrameView& frame, std::string& json)
+{
+    char number[32];
+    auto appendNumber = [&json, &number](auto value)
+    {
+        auto result = std::to_chars(number, number + sizeof(number), value);
+        json.append(number, result.ptr);
+    };
+    json.clear();
+    switch (frame.type)
+    {
+    case BINARY_FRAME_PES:
+    {
+        if (frame.size < binaryFramePESHeaderSize)
+        {
+            return false;
+        }
+        json += R"({"type":"pes","streamId":)";
+        appendNumber((int)frame.payload[0]);
+        json += R"(,"data":[)";
+        json.reserve(json.size() + (frame.size - binaryFramePESHeaderSize) * 4 + 64);
+        for (size_t i = binaryFramePESHeaderSize; i < frame.size; i++)
+        {
+            if (i != binaryFramePESHeaderSize)
+            {
+                json += ',';
+            }
+            appendNumber((int)frame.payload[i]);
+        }
+        json += ']';
+        if (frame.payload[1] & binaryFramePESFlagPTS)
+        {
+            // ミリ秒
+            json += R"(,"pts":)";
+            appendNumber(ReadBinaryFrameUint64(frame.payload + 2) / 90.0);
+        }
+        json += '}';
+        return true;
+    }
+    case BINARY_FRAME_TIMESTAMP:
+    {
+        if (frame.size < 10)
+        {
+            return false;
+        }
+        json += R"({"type":"pcr","pcrBase":)";
+        appendNumber(ReadBinaryFrameUint64(frame.payload));
+        json += R"(,"pcrExtension":)";
+        appendNumber(frame.payload[8] | (frame.payload[9] << 8));
+        json += '}';
+        return true;
+    }
+    case BINARY_FRAME_RESPONSE:
+        json.assign((const char*)frame.payload, frame.size);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// 15ビットずつU+4000からU+BFFFの文字に詰める
+// JSONでエスケープが必要な文字やサロゲートを含まないのでそのままJSONの文字列にできる
+// 1バイトあたりUTF-16で約1.07バイトになる (Base64では2.67バイト)
+constexpr uint16_t packedUtf16Base = 0x4000;
+
+constexpr size_t PackedUtf16Length(size_t size)
+{
+    return (size * 8 + 14) / 15;
+}
+
+// 詰めた文字列から戻せる最大のバイト数 最大で1バイト余分になるのでフレームの長さで判断すること
+constexpr size_t UnpackedUtf16Size(size_t length)
+{
+    return length * 15 / 8;
+}
+
+// 1バイトずつ読み書きするがコンパイラがバイトスワップ1回にまとめる
+inline uint64_t ReadBigEndianUint64(const uint8_t* p)
+{
+    return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+        ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+}
+
+inline void WriteBigEndianUint64(uint8_t* p, uint64_t value)
+{
+    p[0] = (uint8_t)(value >> 56);
+    p[1] = (uint8_t)(value >> 48);
+    p[2] = (uint8_t)(value >> 40);
+    p[3] = (uint8_t)(value >> 32);
+    p[4] = (uint8_t)(value >> 24);
+    p[5] = (uint8_t)(value >> 16);
+    p[6] = (uint8_t)(value >> 8);
+    p[7] = (uint8_t)value;
+}
+
+// 複数回に分けて書き込めるようにしたもの
+class Utf16Packer
+{
+    uint16_t* out;
+    uint32_t bits = 0;
+    int bitCount = 0;
+public:
+    explicit Utf16Packer(uint16_t* out) : out(out)
+    {
+    }
+
+    void Write(const uint8_t* data, size_t size)
+    {
+        auto out = this->out;
+        auto bits = this->bits;
+        auto bitCount = this->bitCount;
+        size_t i = 0;
+        while (i < size)
+        {
+            if (!bitCount && size - i >= 15)
+            {
+                // 端数がなければ15バイト(120ビット)ずつ8文字にまとめて詰める
+                for (; size - i >= 15; i += 15, out += 8)
+                {
+                    uint64_t high = ReadBigEndianUint64(data + i);
+                    uint64_t low = ReadBigEndianUint64(data + i + 7) & 0xffffffffffffff;
+                    out[0] = (uint16_t)(packedUtf16Base + ((high >> 49) & 0x7fff));
+                    out[1] = (uint16_t)(packedUtf16Base + ((high >> 34) & 0x7fff));
+                    out[2] = (uint16_t)(packedUtf16Base + ((high >> 19) & 0x7fff));
+                    out[3] = (uint16_t)(packedUtf16Base + ((high >> 4) & 0x7fff));
+                    out[4] = (uint16_t)(packedUtf16Base + (((high << 11) | (low >> 45)) & 0x7fff));
+                    out[5] = (uint16_t)(packedUtf16Base + ((low >> 30) & 0x7fff));
+                    out[6] = (uint16_t)(packedUtf16Base + ((low >> 15) & 0x7fff));
+                    out[7] = (uint16_t)(packedUtf16Base + (low & 0x7fff));
+                }
+                continue;
+            }
+            bits = (bits << 8) | data[i++];
+            bitCount += 8;
+            if (bitCount >= 15)
+            {
+                bitCount -= 15;
+                *out++ = (uint16_t)(packedUtf16Base + ((bits >> bitCount) & 0x7fff));
+                bits &= (1u << bitCount) - 1;
+            }
+        }
+        this->out = out;
+        this->bits = bits;
+        this->bitCount = bitCount;
+    }
+
+    // 残りのビットを書き出して次に書き込む位置を返す
+    uint16_t* Finish()
+    {
+        if (this->bitCount)
+        {
+            *this->out++ = (uint16_t)(packedUtf16Base + ((this->bits << (15 - this->bitCount)) & 0x7fff));
+            this->bits = 0;
+            this->bitCount = 0;
+        }
+        return this->out;
+    }
+};
+
+// 戻したバイト数を返す 範囲外の文字があれば0
+inline size_t UnpackUtf16(const uint16_t* in, size_t length, uint8_t* out)
+{
+    uint32_t bits = 0;
+    int bitCount = 0;
+    size_t size = 0;
+    size_t i = 0;
+    while (i < length)
+    {
+        if (!bitCount && length - i >= 8)
+        {
+            // 端数がなければ8文字ずつ15バイトにまとめて戻す
+            for (; length - i >= 8; i += 8, size += 15)
+            {
+                uint32_t invalid = 0;
+                uint64_t values[8];
+                for (int j = 0; j < 8; j++)
+                {
+                    values[j] = (uint16_t)(in[i + j] - packedUtf16Base);
+                    invalid |= values[j];
+                }
+                if (invalid > 0x7fff)
+                {
+                    return 0;
+                }
+                uint64_t high = (values[0] << 49) | (values[1] << 34) | (values[2] << 19) | (values[3] << 4) | (values[4] >> 11);
+                uint64_t low = (values[4] << 45) | (values[5] << 30) | (values[6] << 15) | values[7];
+                WriteBigEndianUint64(out + size, high);
+                WriteBigEndianUint64(out + size + 7, (high << 56) | (low & 0xffffffffffffff));
+            }
+            continue;
+        }
+        auto value = (uint32_t)in[i++] - packedUtf16Base;
+        if (value > 0x7fff)
+        {
+            return 0;
+        }
+        bits = (bits << 15) | value;
+        bitCount += 15;
+        while (bitCount >= 8)
+        {
+            bitCount -= 8;
+            out[size++] = (uint8_t)(bits >> bitCount);
+        }
+        bits &= (1u << bitCount) - 1;
+    }
+    return size;
+}
@@ -0,0 +1,65 @@
+﻿#include "pch.h"
+#include "Histogram.h"
+#include <bit>
+
+void Log2Histogram::Add(uint64_t value)
+{
+    this->buckets[std::bit_width(value)]++;
+    this->count++;
+    this->sum += value;
+    this->max = std::max(this->max, value);
+}
+
+void Log2Histogram::Clear()
+{
+    *this = {};
+}
+
+std::wstring Log2Histogram::Format() const
+{
+    WCHAR buf[100];
+    swprintf_s(buf, L"count=%llu avg=%.2f max=%llu", this->count, this->count ? (double)this->sum / this->count : 0.0, this->max);
+    std::wstring result(buf);
+    for (size_t i = 0; i < numBuckets; i++)
+    {
+        if (!this->buckets[i])
+        {
+            continue;
+        }
+        if (i == 0)
+        {
+            swprintf_s(buf, L" 0:%llu", this->buckets[i]);
+        }
+        else if (i == numBuckets - 1)
+        {
+            swprintf_s(buf, L" [%llu,):%llu", 1ull << (i - 1), this->buckets[i]);
+        }
+        else
+        {
+            swprintf_s(buf, L" [%llu,%llu):%llu", 1ull << (i - 1), 1ull << i, this->buckets[i]);
+        }
+        result += buf;
+    }
+    return result;
+}
+
+nlohmann::json Log2Histogram::ToJson() const
+{
+    auto buckets = nlohmann::json::array();
+    for (size_t i = 0; i < numBuckets; i++)
+    {
+        if (!this->buckets[i])
+        {
+            continue;
+        }
+        nlohmann::json lower = i == 0 ? 0 : 1ull << (i - 1);
+        nlohmann::json upper = i == 0 ? nlohmann::json(1) : i == numBuckets - 1 ? nlohmann::json(nullptr) : nlohmann::json(1ull << i);
+        buckets.push_back({ lower, upper, this->buckets[i] });
+    }
+    return {
+        { "count", this->count },
+        { "sum", this->sum },
+        { "max", this->max },
+        { "buckets", buckets },
+    };
+}
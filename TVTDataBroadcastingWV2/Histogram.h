@@ -0,0 +1,23 @@
+﻿#pragma once
+
+// 2のべき乗ごとの区間で値の分布を数える
+class Log2Histogram
+{
+    // 区間iは[2^(i-1), 2^i) 区間0は0のみ
+    static constexpr size_t numBuckets = 65;
+    uint64_t buckets[numBuckets] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+public:
+    void Add(uint64_t value);
+    void Clear();
+    uint64_t Count() const
+    {
+        return this->count;
+    }
+    // "count=3 avg=1.67 max=3 [1,2):1 [2,4):2" のような形式
+    std::wstring Format() const;
+    // {"count":3,"sum":5,"max":3,"buckets":[[1,2,1],[2,4,2]]} 区間は[下限,上限,数] 上限がない区間はnull
+    nlohmann::json ToJson() const;
+};
@@ -0,0 +1,340 @@
+﻿#include "pch.h"
+#include "JsonReader.h"
+#include <charconv>
+#include <cmath>
+
+namespace
+{
+    void SkipWhitespace(LPCWSTR& p)
+    {
+        while (*p == L' ' || *p == L'\t' || *p == L'\n' || *p == L'\r')
+        {
+            p++;
+        }
+    }
+
+    // 開始の"の次から終わりの"まで pは終わりの"の次を指す
+    bool ScanString(LPCWSTR& p, std::wstring_view& raw)
+    {
+        auto begin = p;
+        while (*p != L'"')
+        {
+            if (*p == L'\0' || *p < 0x20)
+            {
+                return false;
+            }
+            if (*p == L'\\')
+            {
+                p++;
+                if (*p == L'\0')
+                {
+                    return false;
+                }
+            }
+            p++;
+        }
+        raw = std::wstring_view(begin, p - begin);
+        p++;
+        return true;
+    }
+
+    bool MatchLiteral(LPCWSTR& p, std::wstring_view literal)
+    {
+        if (std::wstring_view(p, wcsnlen(p, literal.size())) != literal)
+        {
+            return false;
+        }
+        p += literal.size();
+        return true;
+    }
+
+    // オブジェクトや配列を対応する括弧まで読み飛ばす pは開始の括弧を指す
+    bool SkipContainer(LPCWSTR& p)
+    {
+        int depth = 0;
+        do
+        {
+            switch (*p)
+            {
+            case L'\0':
+                return false;
+            case L'{':
+            case L'[':
+                depth++;
+                p++;
+                break;
+            case L'}':
+            case L']':
+                depth--;
+                p++;
+                break;
+            case L'"':
+            {
+                p++;
+                std::wstring_view raw;
+                if (!ScanString(p, raw))
+                {
+                    return false;
+                }
+                break;
+            }
+            default:
+                p++;
+                break;
+            }
+        } while (depth > 0);
+        return true;
+    }
+
+    int HexValue(WCHAR c)
+    {
+        if (c >= L'0' && c <= L'9')
+        {
+            return c - L'0';
+        }
+        if (c >= L'a' && c <= L'f')
+        {
+            return c - L'a' + 10;
+        }
+        if (c >= L'A' && c <= L'F')
+        {
+            return c - L'A' + 10;
+        }
+        return -1;
+    }
+}
+
+bool JsonMessageReader::Parse(LPCWSTR json)
+{
+    this->numMembers = 0;
+    auto p = json;
+    SkipWhitespace(p);
+    if (*p != L'{')
+    {
+        return false;
+    }
+    p++;
+    SkipWhitespace(p);
+    if (*p == L'}')
+    {
+        return true;
+    }
+    while (true)
+    {
+        if (this->numMembers >= maxMembers)
+        {
+            return false;
+        }
+        auto&& member = this->members[this->numMembers];
+        if (*p != L'"')
+        {
+            return false;
+        }
+        p++;
+        if (!ScanString(p, member.key))
+        {
+            return false;
+        }
+        SkipWhitespace(p);
+        if (*p != L':')
+        {
+            return false;
+        }
+        p++;
+        SkipWhitespace(p);
+        auto valueBegin = p;
+        switch (*p)
+        {
+        case L'"':
+            p++;
+            member.kind = ValueKind::String;
+            if (!ScanString(p, member.raw))
+            {
+                return false;
+            }
+            break;
+        case L'{':
+        case L'[':
+            member.kind = *p == L'{' ? ValueKind::Object : ValueKind::Array;
+            if (!SkipContainer(p))
+            {
+                return false;
+            }
+            member.raw = std::wstring_view(valueBegin, p - valueBegin);
+            break;
+        case L't':
+        case L'f':
+            member.kind = ValueKind::Boolean;
+            if (!MatchLiteral(p, L"true") && !MatchLiteral(p, L"false"))
+            {
+                return false;
+            }
+            member.raw = std::wstring_view(valueBegin, p - valueBegin);
+            break;
+        case L'n':
+            member.kind = ValueKind::Null;
+            if (!MatchLiteral(p, L"null"))
+            {
+                return false;
+            }
+            member.raw = std::wstring_view(valueBegin, p - valueBegin);
+            break;
+        default:
+            member.kind = ValueKind::Number;
+            while (*p == L'-' || *p == L'+' || *p == L'.' || *p == L'e' || *p == L'E' || (*p >= L'0' && *p <= L'9'))
+            {
+                p++;
+            }
+            if (p == valueBegin)
+            {
+                return false;
+            }
+            member.raw = std::wstring_view(valueBegin, p - valueBegin);
+            break;
+        }
+        this->numMembers++;
+        SkipWhitespace(p);
+        if (*p == L'}')
+        {
+            return true;
+        }
+        if (*p != L',')
+        {
+            return false;
+        }
+        p++;
+        SkipWhitespace(p);
+    }
+}
+
+const JsonMessageReader::Member* JsonMessageReader::Find(std::wstring_view key) const
+{
+    for (size_t i = 0; i < this->numMembers; i++)
+    {
+        if (this->members[i].key == key)
+        {
+            return &this->members[i];
+        }
+    }
+    return nullptr;
+}
+
+std::wstring_view JsonMessageReader::Type() const
+{
+    auto member = this->Find(L"type");
+    if (!member || member->kind != ValueKind::String || member->raw.find(L'\\') != std::wstring_view::npos)
+    {
+        return {};
+    }
+    return member->raw;
+}
+
+bool JsonMessageReader::GetBool(std::wstring_view key, bool& value) const
+{
+    auto member = this->Find(key);
+    if (!member || member->kind != ValueKind::Boolean)
+    {
+        return false;
+    }
+    value = member->raw[0] == L't';
+    return true;
+}
+
+bool JsonMessageReader::GetNumber(std::wstring_view key, double& value) const
+{
+    auto member = this->Find(key);
+    if (!member || member->kind != ValueKind::Number)
+    {
+        return false;
+    }
+    // 数値はASCIIのみなのでそのまま狭めてfrom_charsに渡す
+    char buf[64];
+    if (member->raw.size() > sizeof(buf))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < member->raw.size(); i++)
+    {
+        buf[i] = (char)member->raw[i];
+    }
+    auto end = buf + member->raw.size();
+    auto result = std::from_chars(buf, end, value);
+    return result.ec == std::errc() && result.ptr == end;
+}
+
+bool JsonMessageReader::GetInt(std::wstring_view key, int& value) const
+{
+    double number;
+    if (!this->GetNumber(key, number) || number != std::trunc(number) || number < INT_MIN || number > INT_MAX)
+    {
+        return false;
+    }
+    value = (int)number;
+    return true;
+}
+
+bool JsonMessageReader::GetString(std::wstring_view key, std::wstring& value) const
+{
+    auto member = this->Find(key);
+    if (!member || member->kind != ValueKind::String)
+    {
+        return false;
+    }
+    // clearしても確保済みの領域は解放されない
+    value.clear();
+    auto&& raw = member->raw;
+    for (size_t i = 0; i < raw.size(); i++)
+    {
+        auto c = raw[i];
+        if (c != L'\\')
+        {
+            value += c;
+            continue;
+        }
+        i++;
+        switch (raw[i])
+        {
+        case L'b':
+            value += L'\b';
+            break;
+        case L'f':
+            value += L'\f';
+            break;
+        case L'n':
+            value += L'\n';
+            break;
+        case L'r':
+            value += L'\r';
+            break;
+        case L't':
+            value += L'\t';
+            break;
+        case L'u':
+        {
+            // サロゲートペアもUTF-16のコード単位としてそのまま並べればよい
+            if (i + 4 >= raw.size())
+            {
+                return false;
+            }
+            int code = 0;
+            for (size_t j = 1; j <= 4; j++)
+            {
+                auto digit = HexValue(raw[i + j]);
+                if (digit < 0)
+                {
+                    return false;
+                }
+                code = (code << 4) | digit;
+            }
+            value += (WCHAR)code;
+            i += 4;
+            break;
+        }
+        default:
+            // \" \\ \/
+            value += raw[i];
+            break;
+        }
+    }
+    return true;
+}
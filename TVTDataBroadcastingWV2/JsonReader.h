@@ -0,0 +1,53 @@
+﻿#pragma once
+#include <string_view>
+
+// ページから届くメッセージ用の簡易JSONリーダ
+// トップレベルのオブジェクトのメンバをUTF-16のまま走査し、値は元の文字列を指すだけで複製しない
+// ネストしたオブジェクトや配列は読み飛ばすので必要なメッセージはnlohmann::jsonで読むこと
+class JsonMessageReader
+{
+public:
+    enum class ValueKind
+    {
+        Null,
+        Boolean,
+        Number,
+        String,
+        Object,
+        Array,
+    };
+private:
+    struct Member
+    {
+        std::wstring_view key;
+        ValueKind kind;
+        // Stringはエスケープを含んだままの中身
+        std::wstring_view raw;
+    };
+    static constexpr size_t maxMembers = 16;
+    Member members[maxMembers];
+    size_t numMembers = 0;
+    const Member* Find(std::wstring_view key) const;
+public:
+    // 読めなかった場合やメンバが多すぎる場合はfalse
+    bool Parse(LPCWSTR json);
+    // "type"の値 エスケープを含む場合は空
+    std::wstring_view Type() const;
+    bool GetBool(std::wstring_view key, bool& value) const;
+    bool GetNumber(std::wstring_view key, double& value) const;
+    bool GetInt(std::wstring_view key, int& value) const;
+    // エスケープを解除してvalueに書き込む
+    bool GetString(std::wstring_view key, std::wstring& value) const;
+};
+
+// typeの振り分け用ハッシュ (FNV-1a)
+// switchのcaseに並べるので既知のtype同士で衝突すればコンパイルエラーになる
+constexpr uint32_t JsonMessageTypeHash(std::wstring_view type)
+{
+    uint32_t hash = 2166136261u;
+    for (auto c : type)
+    {
+        hash = (hash ^ (uint32_t)c) * 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,105 @@
+﻿#include "pch.h"
+#include "JsonWriter.h"
+#include <charconv>
+#include <cmath>
+
+JsonMessageWriter& JsonMessageWriter::Begin(LPCWSTR type)
+{
+    // clearしても確保済みの領域は解放されない
+    this->buffer.clear();
+    this->buffer += L"{\"type\":";
+    this->String(type);
+    return *this;
+}
+
+void JsonMessageWriter::Key(LPCWSTR key)
+{
+    this->buffer += L',';
+    this->String(key);
+    this->buffer += L':';
+}
+
+void JsonMessageWriter::String(LPCWSTR value)
+{
+    static const WCHAR hex[] = L"0123456789abcdef";
+    this->buffer += L'"';
+    for (auto p = value; *p; p++)
+    {
+        auto c = *p;
+        switch (c)
+        {
+        case L'"':
+            this->buffer += L"\\\"";
+            break;
+        case L'\\':
+            this->buffer += L"\\\\";
+            break;
+        case L'\n':
+            this->buffer += L"\\n";
+            break;
+        case L'\r':
+            this->buffer += L"\\r";
+            break;
+        case L'\t':
+            this->buffer += L"\\t";
+            break;
+        default:
+            if (c < 0x20)
+            {
+                WCHAR escaped[] = { L'\\', L'u', L'0', L'0', hex[c >> 4], hex[c & 15] };
+                this->buffer.append(escaped, _countof(escaped));
+            }
+            else
+            {
+                this->buffer += c;
+            }
+            break;
+        }
+    }
+    this->buffer += L'"';
+}
+
+JsonMessageWriter& JsonMessageWriter::Add(LPCWSTR key, int value)
+{
+    this->Key(key);
+    char buf[16];
+    auto result = std::to_chars(buf, buf + sizeof(buf), value);
+    this->buffer.append(buf, result.ptr);
+    return *this;
+}
+
+JsonMessageWriter& JsonMessageWriter::Add(LPCWSTR key, double value)
+{
+    this->Key(key);
+    if (!std::isfinite(value))
+    {
+        // nlohmann::jsonと同様にnullにする
+        this->buffer += L"null";
+        return *this;
+    }
+    // 最短で元の値に戻せる表現
+    char buf[32];
+    auto result = std::to_chars(buf, buf + sizeof(buf), value);
+    this->buffer.append(buf, result.ptr);
+    return *this;
+}
+
+JsonMessageWriter& JsonMessageWriter::Add(LPCWSTR key, bool value)
+{
+    this->Key(key);
+    this->buffer += value ? L"true" : L"false";
+    return *this;
+}
+
+JsonMessageWriter& JsonMessageWriter::Add(LPCWSTR key, LPCWSTR value)
+{
+    this->Key(key);
+    this->String(value);
+    return *this;
+}
+
+LPCWSTR JsonMessageWriter::End()
+{
+    this->buffer += L'}';
+    return this->buffer.c_str();
+}
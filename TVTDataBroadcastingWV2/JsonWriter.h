@@ -0,0 +1,19 @@
+﻿#pragma once
+
+// ページに送るメッセージ用のJSONを直接UTF-16で書き出す
+// バッファは使いまわすので書き出したものは次にBeginを呼ぶまでの間のみ有効
+class JsonMessageWriter
+{
+    std::wstring buffer;
+    void Key(LPCWSTR key);
+    void String(LPCWSTR value);
+public:
+    // {"type":"<type>" まで書き出す
+    JsonMessageWriter& Begin(LPCWSTR type);
+    JsonMessageWriter& Add(LPCWSTR key, int value);
+    JsonMessageWriter& Add(LPCWSTR key, double value);
+    JsonMessageWriter& Add(LPCWSTR key, bool value);
+    JsonMessageWriter& Add(LPCWSTR key, LPCWSTR value);
+    // 閉じてNUL終端された文字列を返す
+    LPCWSTR End();
+};
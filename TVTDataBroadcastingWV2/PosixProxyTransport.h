@@ -0,0 +1,519 @@
+﻿#pragma once
+#ifndef _WIN32
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "ProxyTransport.h"
+
+// POSIXのソケットでHTTP/1.1のリクエストを行うProxyTransport
+// プラグイン本体では使わず、Linux上でプロキシの処理をローカルのスタブサーバーに対して負荷試験するためのもの
+// リクエストごとにスレッドを作る TLSには対応しないのでhttps://はRequestAsyncが失敗する
+// keepAliveでなければConnection: closeで送る。keepAliveであれば応答を読み終えた接続を(ホスト, ポート)ごとに保持して使いまわす
+// どちらの場合もWinHTTPのWINHTTP_OPTION_MAX_CONNS_PER_SERVERと同じく、サーバーごとの接続がmaxConnectionsPerServerに達していれば空くまで待つ
+class PosixProxyTransport : public ProxyTransport
+{
+public:
+    struct Statistics
+    {
+        uint64_t connected = 0;
+        uint64_t reused = 0;
+        // 接続が空くのを待った回数
+        uint64_t waited = 0;
+    };
+private:
+    struct Worker
+    {
+        std::thread thread;
+        std::atomic<bool> done = false;
+    };
+    struct Server
+    {
+        // 使用中と保持しているものの合計
+        size_t connections = 0;
+        std::vector<int> idle;
+        // 接続が空くのを待つリクエストは来た順に進める
+        uint64_t nextTicket = 0;
+        uint64_t servingTicket = 0;
+    };
+    std::mutex mutex;
+    std::list<std::unique_ptr<Worker>> workers;
+    int timeoutSeconds;
+    bool keepAlive;
+    size_t maxConnectionsPerServer;
+    std::mutex connectionMutex;
+    std::condition_variable connectionReleased;
+    std::unordered_map<std::string, Server> servers;
+    Statistics statistics;
+
+    static bool SendAll(int fd, const char* data, size_t size)
+    {
+        while (size)
+        {
+            auto sent = send(fd, data, size, MSG_NOSIGNAL);
+            if (sent <= 0)
+            {
+                return false;
+            }
+            data += sent;
+            size -= (size_t)sent;
+        }
+        return true;
+    }
+
+    // 少なくともsize以上受信するまで読む 終端に達すればfalse
+    static bool ReceiveAtLeast(int fd, std::string& buffer, size_t size)
+    {
+        char chunk[16384];
+        while (buffer.size() < size)
+        {
+            auto received = recv(fd, chunk, sizeof(chunk), 0);
+            if (received <= 0)
+            {
+                return false;
+            }
+            buffer.append(chunk, (size_t)received);
+        }
+        return true;
+    }
+
+    // 空行までを読む 残りはbufferに残る
+    static bool ReceiveHead(int fd, std::string& buffer, std::string& head)
+    {
+        size_t searched = 0;
+        while (true)
+        {
+            auto end = buffer.find("\r\n\r\n", searched);
+            if (end != std::string::npos)
+            {
+                head = buffer.substr(0, end + 4);
+                buffer.erase(0, end + 4);
+                return true;
+            }
+            searched = buffer.size() < 3 ? 0 : buffer.size() - 3;
+            if (!ReceiveAtLeast(fd, buffer, buffer.size() + 1))
+            {
+                return false;
+            }
+        }
+    }
+
+    static bool FindHeader(std::wstring_view headers, std::wstring_view name, std::wstring& value)
+    {
+        while (!headers.empty())
+        {
+            auto end = headers.find(L"\r\n");
+            auto line = headers.substr(0, end);
+            headers.remove_prefix(end == std::wstring_view::npos ? headers.size() : end + 2);
+            auto colon = line.find(L':');
+            if (colon == std::wstring_view::npos || !ProxyEqualsIgnoreCase(line.substr(0, colon), name))
+            {
+                continue;
+            }
+            line.remove_prefix(colon + 1);
+            while (!line.empty() && (line.front() == L' ' || line.front() == L'\t'))
+            {
+                line.remove_prefix(1);
+            }
+            while (!line.empty() && (line.back() == L' ' || line.back() == L'\t'))
+            {
+                line.remove_suffix(1);
+            }
+            value = line;
+            return true;
+        }
+        return false;
+    }
+
+    static bool ParseSize(std::string_view s, int base, size_t& size)
+    {
+        size = 0;
+        if (s.empty())
+        {
+            return false;
+        }
+        for (auto c : s)
+        {
+            int digit;
+            if (c >= '0' && c <= '9')
+            {
+                digit = c - '0';
+            }
+            else if (base == 16 && c >= 'a' && c <= 'f')
+            {
+                digit = c - 'a' + 10;
+            }
+            else if (base == 16 && c >= 'A' && c <= 'F')
+            {
+                digit = c - 'A' + 10;
+            }
+            else
+            {
+                break;
+            }
+            if (size > (SIZE_MAX - digit) / base)
+            {
+                return false;
+            }
+            size = size * base + digit;
+        }
+        return true;
+    }
+
+    static bool ReceiveChunked(int fd, std::string& buffer, std::string& body)
+    {
+        while (true)
+        {
+            size_t lineEnd;
+            while ((lineEnd = buffer.find("\r\n")) == std::string::npos)
+            {
+                if (!ReceiveAtLeast(fd, buffer, buffer.size() + 1))
+                {
+                    return false;
+                }
+            }
+            size_t chunkSize;
+            // 拡張は無視する
+            if (!ParseSize(std::string_view(buffer).substr(0, lineEnd), 16, chunkSize))
+            {
+                return false;
+            }
+            buffer.erase(0, lineEnd + 2);
+            if (chunkSize == 0)
+            {
+                // 接続を使いまわせるように空行までのトレイラを読み飛ばす
+                while (true)
+                {
+                    while ((lineEnd = buffer.find("\r\n")) == std::string::npos)
+                    {
+                        if (!ReceiveAtLeast(fd, buffer, buffer.size() + 1))
+                        {
+                            return false;
+                        }
+                    }
+                    buffer.erase(0, lineEnd + 2);
+                    if (lineEnd == 0)
+                    {
+                        return true;
+                    }
+                }
+            }
+            if (!ReceiveAtLeast(fd, buffer, chunkSize + 2))
+            {
+                return false;
+            }
+            body.append(buffer, 0, chunkSize);
+            buffer.erase(0, chunkSize + 2);
+        }
+    }
+
+    static int Connect(const ProxyUrl& url, int timeoutSeconds)
+    {
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result = nullptr;
+        if (getaddrinfo(ProxyWideToUTF8(url.hostName).c_str(), std::to_string(url.port).c_str(), &hints, &result) != 0)
+        {
+            return -1;
+        }
+        int fd = -1;
+        for (auto ai = result; ai; ai = ai->ai_next)
+        {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0)
+            {
+                continue;
+            }
+            timeval timeout = { timeoutSeconds, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            {
+                break;
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(result);
+        return fd;
+    }
+
+    // 応答を読み終えて次のリクエストに使える状態であればreusable
+    static bool Exchange(int fd, const std::string& request, const std::vector<uint8_t>& payload, bool isHead, ProxyResponseHead& response, std::string& body, bool& reusable)
+    {
+        reusable = false;
+        if (!SendAll(fd, request.data(), request.size()) || !SendAll(fd, (const char*)payload.data(), payload.size()))
+        {
+            return false;
+        }
+        std::string buffer;
+        std::string head;
+        // 1xxは読み飛ばす
+        do
+        {
+            if (!ReceiveHead(fd, buffer, head) || !ParseResponseHead(head, response))
+            {
+                return false;
+            }
+        } while (response.statusCode >= 100 && response.statusCode < 200);
+        std::wstring value;
+        auto keepAlive = !FindHeader(response.headers, L"Connection", value) || !ProxyEqualsIgnoreCase(value, L"close");
+        if (isHead || response.statusCode == 204 || response.statusCode == 304)
+        {
+            reusable = keepAlive && buffer.empty();
+            return true;
+        }
+        if (FindHeader(response.headers, L"Transfer-Encoding", value) && ProxyEqualsIgnoreCase(value, L"chunked"))
+        {
+            if (!ReceiveChunked(fd, buffer, body))
+            {
+                return false;
+            }
+            reusable = keepAlive && buffer.empty();
+            return true;
+        }
+        if (FindHeader(response.headers, L"Content-Length", value))
+        {
+            size_t contentLength;
+            if (!ParseSize(ProxyWideToUTF8(value), 10, contentLength) || !ReceiveAtLeast(fd, buffer, contentLength))
+            {
+                return false;
+            }
+            reusable = keepAlive && buffer.size() == contentLength;
+            buffer.resize(contentLength);
+            body = std::move(buffer);
+            return true;
+        }
+        // 切断されるまで読む
+        ReceiveAtLeast(fd, buffer, SIZE_MAX);
+        body = std::move(buffer);
+        return true;
+    }
+
+    // 保持している接続があれば使い、なければ上限に達していない限り接続する
+    // 上限に達していれば他のリクエストが接続を返すまで待つ
+    int Acquire(const std::string& key, const ProxyUrl& url, bool& reused)
+    {
+        reused = false;
+        {
+            std::unique_lock<std::mutex> lock(this->connectionMutex);
+            auto& server = this->servers[key];
+            auto ticket = server.nextTicket++;
+            auto available = [this, &server, ticket] { return ticket == server.servingTicket && (!server.idle.empty() || server.connections < this->maxConnectionsPerServer); };
+            if (!available())
+            {
+                this->statistics.waited++;
+                this->connectionReleased.wait(lock, available);
+            }
+            server.servingTicket++;
+            this->connectionReleased.notify_all();
+            if (!server.idle.empty())
+            {
+                auto fd = server.idle.back();
+                server.idle.pop_back();
+                this->statistics.reused++;
+                reused = true;
+                return fd;
+            }
+            server.connections++;
+            this->statistics.connected++;
+        }
+        auto fd = Connect(url, this->timeoutSeconds);
+        if (fd < 0)
+        {
+            this->Release(key, fd, false);
+        }
+        return fd;
+    }
+
+    void Release(const std::string& key, int fd, bool reusable)
+    {
+        std::lock_guard<std::mutex> lock(this->connectionMutex);
+        auto& server = this->servers[key];
+        if (fd >= 0 && reusable && this->keepAlive)
+        {
+            server.idle.push_back(fd);
+        }
+        else
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            server.connections--;
+        }
+        this->connectionReleased.notify_all();
+    }
+
+    bool Request(const std::string& key, const ProxyUrl& url, const std::string& request, const std::vector<uint8_t>& payload, bool isHead, ProxyResponseHead& response, std::string& body)
+    {
+        while (true)
+        {
+            bool reused;
+            auto fd = this->Acquire(key, url, reused);
+            if (fd < 0)
+            {
+                return false;
+            }
+            bool reusable;
+            if (Exchange(fd, request, payload, isHead, response, body, reusable))
+            {
+                this->Release(key, fd, reusable);
+                return true;
+            }
+            this->Release(key, fd, false);
+            // 保持している間にサーバーから切られていた場合は別の接続でやり直す
+            if (!reused)
+            {
+                return false;
+            }
+            body.clear();
+        }
+    }
+
+    void Reap()
+    {
+        for (auto it = this->workers.begin(); it != this->workers.end();)
+        {
+            if ((*it)->done)
+            {
+                (*it)->thread.join();
+                it = this->workers.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+public:
+    // maxConnectionsPerServerが0であれば制限しない
+    explicit PosixProxyTransport(int timeoutSeconds = 30, bool keepAlive = false, size_t maxConnectionsPerServer = 0)
+        : timeoutSeconds(timeoutSeconds), keepAlive(keepAlive), maxConnectionsPerServer(maxConnectionsPerServer ? maxConnectionsPerServer : SIZE_MAX)
+    {
+    }
+
+    // 実行中のリクエストが全て終わるまで待つ
+    ~PosixProxyTransport()
+    {
+        while (true)
+        {
+            // 終わったリクエストから次のリクエストが開始されることがあるのでロックを持たずに待つ
+            std::list<std::unique_ptr<Worker>> workers;
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                workers.swap(this->workers);
+            }
+            if (workers.empty())
+            {
+                break;
+            }
+            for (auto&& worker : workers)
+            {
+                // コールバックが最後の参照を持っていた場合はそのワーカーのスレッドで破棄される 後は終わるだけなので待たない
+                if (worker->thread.get_id() == std::this_thread::get_id())
+                {
+                    worker->thread.detach();
+                }
+                else
+                {
+                    worker->thread.join();
+                }
+            }
+        }
+        for (auto&& server : this->servers)
+        {
+            for (auto fd : server.second.idle)
+            {
+                close(fd);
+            }
+        }
+    }
+
+    PosixProxyTransport(const PosixProxyTransport&) = delete;
+    PosixProxyTransport& operator=(const PosixProxyTransport&) = delete;
+
+    Statistics GetStatistics()
+    {
+        std::lock_guard<std::mutex> lock(this->connectionMutex);
+        return this->statistics;
+    }
+
+    bool RequestAsync
+    (
+        const wchar_t* url,
+        const wchar_t* verb,
+        std::vector<uint8_t> payload,
+        const std::vector<std::pair<const wchar_t*, const wchar_t*>>& headers,
+        std::shared_ptr<ProxySchedulerSlot> slot,
+        ErrorCallback errorCallback,
+        ResponseCallback callback
+    ) override
+    {
+        ProxyUrl components;
+        if (!CrackProxyUrl(url, components) || components.secure)
+        {
+            return false;
+        }
+        auto host = components.hostName.find(L':') == std::wstring::npos ? components.hostName : L"[" + components.hostName + L"]";
+        if (components.port != 80)
+        {
+            host += L":" + std::to_wstring(components.port);
+        }
+        std::wstring request = std::wstring(verb) + L" " + components.path + L" HTTP/1.1\r\nHost: " + host + L"\r\nAccept: */*\r\n";
+        if (!this->keepAlive)
+        {
+            request += L"Connection: close\r\n";
+        }
+        for (auto&& header : headers)
+        {
+            auto line = FormatRequestHeader(header.first, header.second);
+            if (line)
+            {
+                request += *line + L"\r\n";
+            }
+        }
+        if (!payload.empty())
+        {
+            request += L"Content-Length: " + std::to_wstring(payload.size()) + L"\r\n";
+        }
+        request += L"\r\n";
+        auto isHead = ProxyEqualsIgnoreCase(verb, L"HEAD");
+        auto key = ProxyWideToUTF8(components.hostName) + ":" + std::to_string(components.port);
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->Reap();
+        auto worker = std::make_unique<Worker>();
+        auto done = &worker->done;
+        worker->thread = std::thread([this, key = std::move(key), components = std::move(components), request = ProxyWideToUTF8(request), payload = std::move(payload), isHead, slot = std::move(slot), errorCallback = std::move(errorCallback), callback = std::move(callback), done]() mutable
+        {
+            ProxyResponseHead response;
+            std::string body;
+            // ソケットの処理は途中で止めないので開始前と受信後にだけ確かめる
+            if ((!slot || !slot->IsCancelled()) && this->Request(key, components, request, payload, isHead, response, body) && (!slot || !slot->IsCancelled()))
+            {
+                std::vector<uint8_t> content(body.begin(), body.end());
+                callback(response.statusCode, response.statusText.c_str(), response.headers.c_str(), content);
+            }
+            else
+            {
+                errorCallback();
+            }
+            // 枠を返すと次のリクエストがこのスレッドから開始されることがある
+            slot = nullptr;
+            *done = true;
+        });
+        this->workers.push_back(std::move(worker));
+        return true;
+    }
+};
+#endif
@@ -0,0 +1,510 @@
+﻿#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include "ProxyTransport.h"
+
+// 通信コンテンツのやりとりをファイルに記録し、後から上流なしで再生する
+// 放送局のサーバーがなくても同じ応答と同じ待ち時間でプロキシやページの性能を測れるようにする
+// LinuxでもPosixProxyTransportと一緒に使えるようにこのヘッダだけで完結させる
+
+struct ProxyExchange
+{
+    // 記録を始めてからリクエストを開始するまで
+    uint64_t startMilliseconds = 0;
+    // リクエストを開始してから応答を全て受け取るか失敗するまで
+    uint64_t durationMilliseconds = 0;
+    std::wstring method;
+    std::wstring url;
+    // 上流に送ったヘッダ
+    std::vector<std::pair<std::wstring, std::wstring>> requestHeaders;
+    std::vector<uint8_t> requestBody;
+    // 0であれば失敗した
+    uint32_t statusCode = 0;
+    std::wstring statusCodeText;
+    // ProxyHeaderRulesで書き換える前の応答ヘッダ
+    std::wstring responseHeaders;
+    std::vector<uint8_t> responseBody;
+};
+
+// ファイルは"TPA1"の後にレコードが続く
+// レコードは全体の大きさ(u32)と、整数はリトルエンディアン、文字列はUTF-8、可変長のものは長さ(u32)を前に置いて並べる
+// 書き込み中に終了した場合に備えて途中で切れたレコードは読み飛ばす
+class ProxyArchiveFormat
+{
+public:
+    static constexpr char magic[4] = { 'T', 'P', 'A', '1' };
+
+    static void PutInteger(std::string& out, uint64_t value, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            out.push_back((char)(value >> (i * 8)));
+        }
+    }
+
+    static void PutBytes(std::string& out, const void* data, size_t size)
+    {
+        PutInteger(out, size, 4);
+        out.append((const char*)data, size);
+    }
+
+    static void PutString(std::string& out, std::wstring_view s)
+    {
+        auto utf8 = ProxyWideToUTF8(s);
+        PutBytes(out, utf8.data(), utf8.size());
+    }
+
+    static std::string Encode(const ProxyExchange& exchange)
+    {
+        std::string record;
+        PutInteger(record, exchange.startMilliseconds, 8);
+        PutInteger(record, exchange.durationMilliseconds, 8);
+        PutString(record, exchange.method);
+        PutString(record, exchange.url);
+        PutInteger(record, exchange.requestHeaders.size(), 4);
+        for (auto&& [name, value] : exchange.requestHeaders)
+        {
+            PutString(record, name);
+            PutString(record, value);
+        }
+        PutBytes(record, exchange.requestBody.data(), exchange.requestBody.size());
+        PutInteger(record, exchange.statusCode, 4);
+        PutString(record, exchange.statusCodeText);
+        PutString(record, exchange.responseHeaders);
+        PutBytes(record, exchange.responseBody.data(), exchange.responseBody.size());
+        std::string result;
+        PutBytes(result, record.data(), record.size());
+        return result;
+    }
+
+    static bool GetInteger(std::string_view& in, uint64_t& value, size_t size)
+    {
+        if (in.size() < size)
+        {
+            return false;
+        }
+        value = 0;
+        for (size_t i = 0; i < size; i++)
+        {
+            value |= (uint64_t)(uint8_t)in[i] << (i * 8);
+        }
+        in.remove_prefix(size);
+        return true;
+    }
+
+    static bool GetBytes(std::string_view& in, std::string_view& bytes)
+    {
+        uint64_t size;
+        if (!GetInteger(in, size, 4) || in.size() < size)
+        {
+            return false;
+        }
+        bytes = in.substr(0, (size_t)size);
+        in.remove_prefix((size_t)size);
+        return true;
+    }
+
+    static bool GetString(std::string_view& in, std::wstring& s)
+    {
+        std::string_view bytes;
+        if (!GetBytes(in, bytes))
+        {
+            return false;
+        }
+        s = ProxyUTF8ToWide(bytes);
+        return true;
+    }
+
+    static bool GetBody(std::string_view& in, std::vector<uint8_t>& body)
+    {
+        std::string_view bytes;
+        if (!GetBytes(in, bytes))
+        {
+            return false;
+        }
+        body.assign(bytes.begin(), bytes.end());
+        return true;
+    }
+
+    static bool Decode(std::string_view record, ProxyExchange& exchange)
+    {
+        uint64_t headerCount, statusCode;
+        if (!GetInteger(record, exchange.startMilliseconds, 8) ||
+            !GetInteger(record, exchange.durationMilliseconds, 8) ||
+            !GetString(record, exchange.method) ||
+            !GetString(record, exchange.url) ||
+            !GetInteger(record, headerCount, 4))
+        {
+            return false;
+        }
+        for (uint64_t i = 0; i < headerCount; i++)
+        {
+            std::wstring name, value;
+            if (!GetString(record, name) || !GetString(record, value))
+            {
+                return false;
+            }
+            exchange.requestHeaders.push_back({ std::move(name), std::move(value) });
+        }
+        if (!GetBody(record, exchange.requestBody) ||
+            !GetInteger(record, statusCode, 4) ||
+            !GetString(record, exchange.statusCodeText) ||
+            !GetString(record, exchange.responseHeaders) ||
+            !GetBody(record, exchange.responseBody))
+        {
+            return false;
+        }
+        exchange.statusCode = (uint32_t)statusCode;
+        return true;
+    }
+};
+
+// ファイルが読めないか形式が違えばfalse
+inline bool ProxyReadArchive(const std::filesystem::path& path, std::vector<ProxyExchange>& exchanges)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::string_view in(data);
+    if (in.size() < sizeof(ProxyArchiveFormat::magic) || memcmp(in.data(), ProxyArchiveFormat::magic, sizeof(ProxyArchiveFormat::magic)))
+    {
+        return false;
+    }
+    in.remove_prefix(sizeof(ProxyArchiveFormat::magic));
+    std::string_view record;
+    while (ProxyArchiveFormat::GetBytes(in, record))
+    {
+        ProxyExchange exchange;
+        if (ProxyArchiveFormat::Decode(record, exchange))
+        {
+            exchanges.push_back(std::move(exchange));
+        }
+    }
+    return true;
+}
+
+// 記録したやりとりを順にファイルに追記する どのスレッドからも呼び出せる
+class ProxyArchiveWriter
+{
+    std::mutex mutex;
+    std::ofstream file;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+public:
+    explicit ProxyArchiveWriter(const std::filesystem::path& path) : file(path, std::ios::binary | std::ios::trunc)
+    {
+        this->file.write(ProxyArchiveFormat::magic, sizeof(ProxyArchiveFormat::magic));
+    }
+    ProxyArchiveWriter(const ProxyArchiveWriter&) = delete;
+    ProxyArchiveWriter& operator=(const ProxyArchiveWriter&) = delete;
+
+    bool IsOpen() const
+    {
+        return (bool)this->file;
+    }
+
+    // 作成してからのミリ秒
+    uint64_t Elapsed() const
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - this->origin).count();
+    }
+
+    void Write(const ProxyExchange& exchange)
+    {
+        auto record = ProxyArchiveFormat::Encode(exchange);
+        std::lock_guard<std::mutex> lock(this->mutex);
+        // 終了時に失われないようにレコードごとに書き出す
+        this->file.write(record.data(), record.size());
+        this->file.flush();
+    }
+};
+
+// 別のProxyTransportに委ね、やりとりをProxyArchiveWriterに記録する
+// 取り消されたリクエストは再生しても意味がないので記録しない
+class ProxyRecordingTransport : public ProxyTransport
+{
+    std::shared_ptr<ProxyTransport> inner;
+    std::shared_ptr<ProxyArchiveWriter> writer;
+public:
+    ProxyRecordingTransport(std::shared_ptr<ProxyTransport> inner, std::shared_ptr<ProxyArchiveWriter> writer) : inner(std::move(inner)), writer(std::move(writer))
+    {
+    }
+    ProxyRecordingTransport(const ProxyRecordingTransport&) = delete;
+    ProxyRecordingTransport& operator=(const ProxyRecordingTransport&) = delete;
+
+    bool RequestAsync
+    (
+        const wchar_t* url,
+        const wchar_t* verb,
+        std::vector<uint8_t> payload,
+        const std::vector<std::pair<const wchar_t*, const wchar_t*>>& headers,
+        std::shared_ptr<ProxySchedulerSlot> slot,
+        ErrorCallback errorCallback,
+        ResponseCallback callback
+    ) override
+    {
+        auto exchange = std::make_shared<ProxyExchange>();
+        exchange->startMilliseconds = this->writer->Elapsed();
+        exchange->method = verb;
+        exchange->url = url;
+        for (auto&& [name, value] : headers)
+        {
+            exchange->requestHeaders.push_back({ name, value });
+        }
+        exchange->requestBody = payload;
+        std::weak_ptr<ProxySchedulerSlot> weakSlot = slot;
+        return this->inner->RequestAsync(url, verb, std::move(payload), headers, std::move(slot),
+            [writer = this->writer, exchange, weakSlot, errorCallback = std::move(errorCallback)]() -> void
+        {
+            // 失敗を通知する時点ではリクエストがまだ枠を持っている
+            auto slot = weakSlot.lock();
+            if (!slot || !slot->IsCancelled())
+            {
+                exchange->durationMilliseconds = writer->Elapsed() - exchange->startMilliseconds;
+                writer->Write(*exchange);
+            }
+            errorCallback();
+        }, [writer = this->writer, exchange, callback = std::move(callback)](uint32_t statusCode, const wchar_t* statusCodeText, const wchar_t* headers, std::vector<uint8_t>& content) -> void
+        {
+            exchange->durationMilliseconds = writer->Elapsed() - exchange->startMilliseconds;
+            exchange->statusCode = statusCode;
+            exchange->statusCodeText = statusCodeText ? statusCodeText : L"";
+            exchange->responseHeaders = headers ? headers : L"";
+            // callbackがcontentを引き取るので先に写しておく
+            exchange->responseBody = content;
+            callback(statusCode, statusCodeText, headers, content);
+            writer->Write(*exchange);
+        });
+    }
+
+    void CancelAll() override
+    {
+        this->inner->CancelAll();
+    }
+};
+
+// 記録したやりとりを上流に接続せずに返す
+// メソッドとURLが同じものを記録した順に返し、使い切れば最後のものを返し続ける POSTは内容が同じものを優先する
+// 応答は記録した所要時間をspeedPercentで割った分だけ待ってから別スレッドで返す (0であれば待たない)
+// CancelAllで待っているものは全てすぐに失敗させる
+class ProxyReplayTransport : public ProxyTransport
+{
+public:
+    struct Statistics
+    {
+        uint64_t hits = 0;
+        // 記録にないリクエストの数 RequestAsyncはfalseを返す
+        uint64_t misses = 0;
+    };
+private:
+    struct Job
+    {
+        std::chrono::steady_clock::time_point due;
+        uint64_t sequence;
+        // 引数がtrueであれば取り消された
+        std::function<void(bool cancelled)> run;
+        bool cancelled = false;
+        bool operator>(const Job& other) const
+        {
+            return this->due != other.due ? this->due > other.due : this->sequence > other.sequence;
+        }
+    };
+    // コールバックが最後の参照を持っていた場合はスレッドの中で破棄されるので、スレッドが使うものはスレッドにも持たせる
+    struct State
+    {
+        const std::vector<ProxyExchange> exchanges;
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::priority_queue<Job, std::vector<Job>, std::greater<Job>> jobs;
+        uint64_t sequence = 0;
+        bool stopping = false;
+        explicit State(std::vector<ProxyExchange> exchanges) : exchanges(std::move(exchanges))
+        {
+        }
+    };
+    std::shared_ptr<State> state;
+    unsigned speedPercent;
+    // 以下はstate->mutexで保護する
+    // "メソッド URL"ごとの記録の位置と、それぞれを既に返したかどうか
+    std::map<std::wstring, std::pair<std::vector<size_t>, std::vector<bool>>> index;
+    Statistics statistics;
+    std::thread thread;
+
+    const ProxyExchange* Find(const wchar_t* url, const wchar_t* verb, const std::vector<uint8_t>& payload)
+    {
+        auto it = this->index.find(std::wstring(verb) + L" " + url);
+        if (it == this->index.end())
+        {
+            return nullptr;
+        }
+        auto& [candidates, used] = it->second;
+        // 内容が一致するものを飛ばして返しても、それより前のまだ返していないものは後で返せるように残す
+        auto chosen = candidates.size();
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            if (used[i])
+            {
+                continue;
+            }
+            if (chosen == candidates.size())
+            {
+                chosen = i;
+            }
+            if (this->state->exchanges[candidates[i]].requestBody == payload)
+            {
+                chosen = i;
+                break;
+            }
+        }
+        if (chosen == candidates.size())
+        {
+            return &this->state->exchanges[candidates.back()];
+        }
+        used[chosen] = true;
+        return &this->state->exchanges[candidates[chosen]];
+    }
+
+    // thisには触れない
+    static void Run(const std::shared_ptr<State>& state)
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        while (true)
+        {
+            if (state->jobs.empty())
+            {
+                if (state->stopping)
+                {
+                    break;
+                }
+                state->condition.wait(lock);
+                continue;
+            }
+            // 終了するときは残りを待たずに全て返す
+            if (!state->stopping && std::chrono::steady_clock::now() < state->jobs.top().due)
+            {
+                state->condition.wait_until(lock, state->jobs.top().due);
+                continue;
+            }
+            auto job = std::move(const_cast<Job&>(state->jobs.top()));
+            state->jobs.pop();
+            // 枠を返すと次のリクエストがこのスレッドから開始されるのでロックを持たずに呼ぶ
+            lock.unlock();
+            job.run(job.cancelled);
+            // コールバックが持っていた参照で破棄が始まることがあるので、ロックを取る前に手放す
+            job.run = nullptr;
+            lock.lock();
+        }
+    }
+public:
+    ProxyReplayTransport(std::vector<ProxyExchange> exchanges, unsigned speedPercent) : state(std::make_shared<State>(std::move(exchanges))), speedPercent(speedPercent)
+    {
+        for (size_t i = 0; i < this->state->exchanges.size(); i++)
+        {
+            auto& [candidates, used] = this->index[this->state->exchanges[i].method + L" " + this->state->exchanges[i].url];
+            candidates.push_back(i);
+            used.push_back(false);
+        }
+        this->thread = std::thread([state = this->state]() { Run(state); });
+    }
+
+    ~ProxyReplayTransport()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->state->mutex);
+            this->state->stopping = true;
+        }
+        this->state->condition.notify_one();
+        // スレッドの中で破棄された場合は残りを返して終わるだけなので待たない
+        if (this->thread.get_id() == std::this_thread::get_id())
+        {
+            this->thread.detach();
+        }
+        else
+        {
+            this->thread.join();
+        }
+    }
+
+    ProxyReplayTransport(const ProxyReplayTransport&) = delete;
+    ProxyReplayTransport& operator=(const ProxyReplayTransport&) = delete;
+
+    size_t Size() const
+    {
+        return this->state->exchanges.size();
+    }
+
+    bool RequestAsync
+    (
+        const wchar_t* url,
+        const wchar_t* verb,
+        std::vector<uint8_t> payload,
+        const std::vector<std::pair<const wchar_t*, const wchar_t*>>&,
+        std::shared_ptr<ProxySchedulerSlot> slot,
+        ErrorCallback errorCallback,
+        ResponseCallback callback
+    ) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->state->mutex);
+            auto exchange = this->Find(url, verb, payload);
+            if (!exchange)
+            {
+                this->statistics.misses++;
+                return false;
+            }
+            this->statistics.hits++;
+            auto delay = this->speedPercent ? std::chrono::milliseconds(exchange->durationMilliseconds * 100 / this->speedPercent) : std::chrono::milliseconds(0);
+            this->state->jobs.push({ std::chrono::steady_clock::now() + delay, this->state->sequence++, [exchange, slot = std::move(slot), errorCallback = std::move(errorCallback), callback = std::move(callback)](bool cancelled) mutable -> void
+            {
+                if (cancelled || (slot && slot->IsCancelled()) || !exchange->statusCode)
+                {
+                    errorCallback();
+                }
+                else
+                {
+                    auto content = exchange->responseBody;
+                    callback(exchange->statusCode, exchange->statusCodeText.c_str(), exchange->responseHeaders.c_str(), content);
+                }
+                slot = nullptr;
+            } });
+        }
+        this->state->condition.notify_one();
+        return true;
+    }
+
+    // 待っているものは記録した所要時間を待たずに失敗させる
+    void CancelAll() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->state->mutex);
+            std::vector<Job> jobs;
+            while (!this->state->jobs.empty())
+            {
+                jobs.push_back(std::move(const_cast<Job&>(this->state->jobs.top())));
+                this->state->jobs.pop();
+            }
+            for (auto&& job : jobs)
+            {
+                job.due = std::chrono::steady_clock::time_point::min();
+                job.cancelled = true;
+                this->state->jobs.push(std::move(job));
+            }
+        }
+        this->state->condition.notify_one();
+    }
+
+    Statistics GetStatistics()
+    {
+        std::lock_guard<std::mutex> lock(this->state->mutex);
+        return this->statistics;
+    }
+};
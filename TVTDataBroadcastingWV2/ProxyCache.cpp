@@ -0,0 +1,726 @@
+﻿#include "pch.h"
+#include "ProxyCache.h"
+#include <winhttp.h>
+#include <algorithm>
+#include <optional>
+
+namespace
+{
+    // ヒューリスティックな期限を使ってよいステータス (RFC 9110 15.1)
+    bool IsHeuristicallyCacheable(DWORD statusCode)
+    {
+        switch (statusCode)
+        {
+        case 200:
+        case 203:
+        case 204:
+        case 300:
+        case 301:
+        case 308:
+        case 404:
+        case 405:
+        case 410:
+        case 414:
+        case 501:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    std::wstring_view Trim(std::wstring_view s)
+    {
+        while (!s.empty() && (s.front() == L' ' || s.front() == L'\t'))
+        {
+            s.remove_prefix(1);
+        }
+        while (!s.empty() && (s.back() == L' ' || s.back() == L'\t' || s.back() == L'\r'))
+        {
+            s.remove_suffix(1);
+        }
+        return s;
+    }
+
+    bool EqualsIgnoreCase(std::wstring_view a, std::wstring_view b)
+    {
+        return a.size() == b.size() && !_wcsnicmp(a.data(), b.data(), a.size());
+    }
+
+    // ステータス行を除いたヘッダ行ごとにfを呼ぶ
+    template<class F>
+    void ForEachHeader(std::wstring_view headers, F f)
+    {
+        bool statusLine = true;
+        while (!headers.empty())
+        {
+            auto end = headers.find(L'\n');
+            auto line = headers.substr(0, end);
+            headers.remove_prefix(end == std::wstring_view::npos ? headers.size() : end + 1);
+            if (std::exchange(statusLine, false))
+            {
+                continue;
+            }
+            auto colon = line.find(L':');
+            if (colon == std::wstring_view::npos)
+            {
+                continue;
+            }
+            f(Trim(line.substr(0, colon)), Trim(line.substr(colon + 1)), line);
+        }
+    }
+
+    // 同じ名前のヘッダが複数あれば", "で連結する
+    std::optional<std::wstring> FindHeader(std::wstring_view headers, std::wstring_view name)
+    {
+        std::optional<std::wstring> result;
+        ForEachHeader(headers, [&](std::wstring_view n, std::wstring_view v, std::wstring_view) {
+            if (EqualsIgnoreCase(n, name))
+            {
+                if (result)
+                {
+                    result->append(L", ");
+                    result->append(v);
+                }
+                else
+                {
+                    result = std::wstring(v);
+                }
+            }
+        });
+        return result;
+    }
+
+    struct CacheControl
+    {
+        bool noStore = false;
+        bool noCache = false;
+        std::optional<int64_t> maxAge;
+    };
+
+    CacheControl ParseCacheControl(std::wstring_view value)
+    {
+        CacheControl cc;
+        while (!value.empty())
+        {
+            auto end = value.find(L',');
+            auto directive = Trim(value.substr(0, end));
+            value.remove_prefix(end == std::wstring_view::npos ? value.size() : end + 1);
+            auto eq = directive.find(L'=');
+            auto name = Trim(directive.substr(0, eq));
+            auto arg = eq == std::wstring_view::npos ? std::wstring_view() : Trim(directive.substr(eq + 1));
+            if (arg.size() >= 2 && arg.front() == L'"' && arg.back() == L'"')
+            {
+                arg = arg.substr(1, arg.size() - 2);
+            }
+            if (EqualsIgnoreCase(name, L"no-store"))
+            {
+                cc.noStore = true;
+            }
+            // no-cache="Set-Cookie"のようにフィールドを指定された場合も全体を再検証する
+            else if (EqualsIgnoreCase(name, L"no-cache"))
+            {
+                cc.noCache = true;
+            }
+            else if (EqualsIgnoreCase(name, L"max-age"))
+            {
+                int64_t maxAge = 0;
+                bool valid = !arg.empty();
+                for (auto c : arg)
+                {
+                    if (c < L'0' || c > L'9')
+                    {
+                        valid = false;
+                        break;
+                    }
+                    maxAge = std::min<int64_t>(maxAge * 10 + (c - L'0'), INT32_MAX);
+                }
+                // 不正な値は期限切れとして扱う
+                cc.maxAge = valid ? maxAge : 0;
+            }
+        }
+        return cc;
+    }
+
+    std::optional<int64_t> ParseHttpDate(const std::optional<std::wstring>& value)
+    {
+        SYSTEMTIME st;
+        FILETIME ft;
+        if (!value || !WinHttpTimeToSystemTime(value->c_str(), &st) || !SystemTimeToFileTime(&st, &ft))
+        {
+            return std::nullopt;
+        }
+        ULARGE_INTEGER t = { ft.dwLowDateTime, ft.dwHighDateTime };
+        return (int64_t)(t.QuadPart / 10000000) - 11644473600LL;
+    }
+
+    // ETag, Last-Modified, no-cacheをヘッダから読む
+    void ParseValidators(ProxyCacheEntry& entry)
+    {
+        auto cacheControl = FindHeader(entry.headers, L"Cache-Control");
+        if (cacheControl)
+        {
+            entry.mustRevalidate = ParseCacheControl(*cacheControl).noCache;
+        }
+        else
+        {
+            auto pragma = FindHeader(entry.headers, L"Pragma");
+            entry.mustRevalidate = pragma && ParseCacheControl(*pragma).noCache;
+        }
+        entry.etag = FindHeader(entry.headers, L"ETag").value_or(L"");
+        entry.lastModified = FindHeader(entry.headers, L"Last-Modified").value_or(L"");
+    }
+
+    // RFC 9111 4.2に従ってfreshUntilを求める
+    void ComputeFreshness(ProxyCacheEntry& entry, int64_t requestTime)
+    {
+        auto cacheControl = ParseCacheControl(FindHeader(entry.headers, L"Cache-Control").value_or(L""));
+        auto date = ParseHttpDate(FindHeader(entry.headers, L"Date")).value_or(entry.responseTime);
+        int64_t lifetime = 0;
+        if (cacheControl.maxAge)
+        {
+            lifetime = *cacheControl.maxAge;
+        }
+        else if (auto expiresHeader = FindHeader(entry.headers, L"Expires"))
+        {
+            // Expires: 0のような不正な値は期限切れ
+            auto expires = ParseHttpDate(expiresHeader);
+            lifetime = expires ? *expires - date : 0;
+        }
+        else if (auto lastModified = ParseHttpDate(FindHeader(entry.headers, L"Last-Modified")); lastModified && IsHeuristicallyCacheable(entry.statusCode))
+        {
+            // 更新されてからの経過時間の10% ただし1日まで
+            lifetime = std::min<int64_t>(std::max<int64_t>(date - *lastModified, 0) / 10, 24 * 60 * 60);
+        }
+        int64_t age = 0;
+        if (auto ageHeader = FindHeader(entry.headers, L"Age"))
+        {
+            age = std::max(_wtoi64(ageHeader->c_str()), 0LL);
+        }
+        auto apparentAge = std::max<int64_t>(entry.responseTime - date, 0);
+        auto correctedAge = std::max<int64_t>(apparentAge, age + std::max<int64_t>(entry.responseTime - requestTime, 0));
+        entry.freshUntil = entry.responseTime + lifetime - correctedAge;
+    }
+
+    // 304で置き換えてはいけないヘッダ
+    bool IsRepresentationHeader(std::wstring_view name)
+    {
+        return EqualsIgnoreCase(name, L"Content-Length") || EqualsIgnoreCase(name, L"Content-Type") || EqualsIgnoreCase(name, L"Content-Encoding") || EqualsIgnoreCase(name, L"Content-Range") || EqualsIgnoreCase(name, L"Transfer-Encoding");
+    }
+
+    // ディスク上のファイルの先頭 続けてURL, ステータステキスト, ヘッダ(UTF-16)と内容が並ぶ
+    struct DiskHeader
+    {
+        char magic[4];
+        uint32_t statusCode;
+        int64_t responseTime;
+        int64_t freshUntil;
+        uint32_t urlLength;
+        uint32_t statusCodeTextLength;
+        uint32_t headersLength;
+        uint32_t reserved;
+        uint64_t contentLength;
+    };
+    // 2: ヘッダはページに返す形に書き換えてから保存する
+    constexpr char diskMagic[4] = { 'T', 'P', 'C', '2' };
+}
+
+size_t ProxyCacheEntry::Size() const
+{
+    return this->content.size() + (this->statusCodeText.size() + this->headers.size() + this->etag.size() + this->lastModified.size()) * sizeof(WCHAR) + sizeof(ProxyCacheEntry);
+}
+
+ProxyCache::ProxyCache(size_t memoryMaxSize, const std::wstring& directory, size_t diskMaxSize, int64_t negativeLifetimeSeconds) : memoryMaxSize(memoryMaxSize), diskMaxSize(diskMaxSize), negativeLifetime(negativeLifetimeSeconds)
+{
+    if (directory.empty() || !diskMaxSize)
+    {
+        return;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    if (!std::filesystem::is_directory(directory, ec))
+    {
+        return;
+    }
+    this->directory = directory;
+    // 前回までに保存したものを最終使用時刻(最終更新時刻)順に並べる
+    std::vector<std::tuple<std::filesystem::file_time_type, std::wstring, size_t>> files;
+    for (auto&& file : std::filesystem::directory_iterator(directory, ec))
+    {
+        if (!file.is_regular_file(ec))
+        {
+            continue;
+        }
+        auto& path = file.path();
+        if (path.extension() == L".tmp")
+        {
+            std::filesystem::remove(path, ec);
+            continue;
+        }
+        if (path.extension() != L".cache")
+        {
+            continue;
+        }
+        files.emplace_back(file.last_write_time(ec), path.filename().wstring(), (size_t)file.file_size(ec));
+    }
+    std::sort(files.begin(), files.end(), [](auto& a, auto& b) {
+        return std::get<0>(a) > std::get<0>(b);
+    });
+    for (auto&& [time, name, size] : files)
+    {
+        this->diskLRU.push_back(name);
+        this->diskItems.emplace(name, DiskItem{ size, std::prev(this->diskLRU.end()) });
+        this->diskSize += size;
+    }
+    this->EvictDisk();
+}
+
+int64_t ProxyCache::Now()
+{
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    ULARGE_INTEGER t = { ft.dwLowDateTime, ft.dwHighDateTime };
+    return (int64_t)(t.QuadPart / 10000000) - 11644473600LL;
+}
+
+ProxyCacheMode ProxyCache::RequestHeaderMode(LPCWSTR name, LPCWSTR value)
+{
+    // ページ自身が条件付きリクエストをした場合304をそのまま返す必要がある
+    if (!_wcsicmp(name, L"If-Modified-Since") || !_wcsicmp(name, L"If-None-Match"))
+    {
+        return ProxyCacheMode::Bypass;
+    }
+    if (!_wcsicmp(name, L"Cache-Control") || !_wcsicmp(name, L"Pragma"))
+    {
+        auto cc = ParseCacheControl(value);
+        if (cc.noStore)
+        {
+            return ProxyCacheMode::Bypass;
+        }
+        if (cc.noCache || (cc.maxAge && *cc.maxAge == 0))
+        {
+            return ProxyCacheMode::Refresh;
+        }
+    }
+    return ProxyCacheMode::Use;
+}
+
+ProxyCache::Entry ProxyCache::Lookup(const std::wstring& url, int64_t now)
+{
+    Entry entry;
+    {
+        std::lock_guard<std::mutex> lock(this->memoryMutex);
+        auto it = this->memoryItems.find(url);
+        if (it != this->memoryItems.end())
+        {
+            this->memoryLRU.splice(this->memoryLRU.begin(), this->memoryLRU, it->second.lru);
+            entry = it->second.entry;
+        }
+    }
+    if (entry && entry->negative && !entry->IsFresh(now))
+    {
+        this->RemoveMemory(url);
+        entry = nullptr;
+    }
+    if (!entry)
+    {
+        entry = this->LoadDisk(url);
+        if (entry)
+        {
+            this->StoreMemory(url, entry);
+        }
+    }
+    this->Count(entry && entry->IsFresh(now) ? &Statistics::hits : &Statistics::misses);
+    if (entry && entry->negative && entry->IsFresh(now))
+    {
+        this->Count(&Statistics::negativeHits);
+    }
+    return entry;
+}
+
+ProxyCache::Entry ProxyCache::Store(const std::wstring& url, DWORD statusCode, LPCWSTR statusCodeText, LPCWSTR headers, std::vector<BYTE>& content, int64_t requestTime)
+{
+    std::wstring_view headersView(headers ? headers : L"");
+    auto cacheControl = ParseCacheControl(FindHeader(headersView, L"Cache-Control").value_or(L""));
+    auto vary = FindHeader(headersView, L"Vary");
+    // リクエストヘッダは固定なのでVary: *以外は無視できる
+    // Set-Cookieを含む応答を使いまわすとページ側のCookieが巻き戻るので保存しない
+    if (cacheControl.noStore || (vary && vary->find(L'*') != std::wstring::npos) || FindHeader(headersView, L"Set-Cookie"))
+    {
+        this->Invalidate(url);
+        return nullptr;
+    }
+    auto entry = std::make_shared<ProxyCacheEntry>();
+    entry->statusCode = statusCode;
+    entry->statusCodeText = statusCodeText ? statusCodeText : L"";
+    entry->headers = headersView;
+    entry->responseTime = ProxyCache::Now();
+    ParseValidators(*entry);
+    ComputeFreshness(*entry, requestTime);
+    // 期限も検証子もなければ次に使えない
+    if (!IsHeuristicallyCacheable(statusCode) || (!entry->HasValidator() && !entry->IsFresh(entry->responseTime)))
+    {
+        if (statusCode < 400 || !this->negativeLifetime)
+        {
+            this->Invalidate(url);
+            return nullptr;
+        }
+        // エラーの応答はno-cacheやmax-age=0でも短い間だけ返す ディスクにある以前の応答は期限が切れた後の再検証に使う
+        entry->negative = true;
+        entry->mustRevalidate = false;
+        entry->freshUntil = entry->responseTime + this->negativeLifetime;
+        entry->etag.clear();
+        entry->lastModified.clear();
+        entry->content = std::move(content);
+        content = {};
+        this->StoreMemory(url, entry);
+        return entry;
+    }
+    entry->content = std::move(content);
+    content = {};
+    this->StoreMemory(url, entry);
+    this->StoreDisk(url, *entry);
+    return entry;
+}
+
+ProxyCache::Entry ProxyCache::Revalidate(const std::wstring& url, const Entry& stale, LPCWSTR headers, int64_t requestTime)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->statisticsMutex);
+        if (this->statistics.misses)
+        {
+            this->statistics.misses--;
+        }
+        this->statistics.revalidated++;
+    }
+    // 304に含まれるヘッダで保持していたヘッダを置き換える
+    std::wstring_view updates(headers ? headers : L"");
+    std::wstring merged;
+    bool statusLine = true;
+    std::wstring_view storedHeaders(stale->headers);
+    while (!storedHeaders.empty())
+    {
+        auto end = storedHeaders.find(L'\n');
+        auto line = storedHeaders.substr(0, end);
+        storedHeaders.remove_prefix(end == std::wstring_view::npos ? storedHeaders.size() : end + 1);
+        if (Trim(line).empty())
+        {
+            continue;
+        }
+        if (!std::exchange(statusLine, false))
+        {
+            auto colon = line.find(L':');
+            if (colon != std::wstring_view::npos)
+            {
+                auto name = Trim(line.substr(0, colon));
+                if (!IsRepresentationHeader(name) && FindHeader(updates, name))
+                {
+                    continue;
+                }
+            }
+        }
+        merged.append(Trim(line));
+        merged.append(L"\r\n");
+    }
+    ForEachHeader(updates, [&](std::wstring_view name, std::wstring_view, std::wstring_view line) {
+        if (!IsRepresentationHeader(name))
+        {
+            merged.append(Trim(line));
+            merged.append(L"\r\n");
+        }
+    });
+    merged.append(L"\r\n");
+    auto entry = std::make_shared<ProxyCacheEntry>(*stale);
+    entry->headers = std::move(merged);
+    entry->responseTime = ProxyCache::Now();
+    ParseValidators(*entry);
+    ComputeFreshness(*entry, requestTime);
+    if (ParseCacheControl(FindHeader(updates, L"Cache-Control").value_or(L"")).noStore)
+    {
+        this->Invalidate(url);
+        return entry;
+    }
+    this->StoreMemory(url, entry);
+    this->StoreDisk(url, *entry);
+    return entry;
+}
+
+void ProxyCache::RemoveMemory(const std::wstring& url)
+{
+    std::lock_guard<std::mutex> lock(this->memoryMutex);
+    auto it = this->memoryItems.find(url);
+    if (it != this->memoryItems.end())
+    {
+        this->memorySize -= it->second.entry->Size();
+        this->memoryLRU.erase(it->second.lru);
+        this->memoryItems.erase(it);
+    }
+}
+
+void ProxyCache::Invalidate(const std::wstring& url)
+{
+    this->RemoveMemory(url);
+    this->RemoveDisk(url);
+}
+
+void ProxyCache::CountBypass()
+{
+    this->Count(&Statistics::bypassed);
+}
+
+size_t ProxyCache::MaxEntrySize() const
+{
+    return std::max(this->memoryMaxSize / 4, this->directory.empty() ? 0 : this->diskMaxSize / 4);
+}
+
+ProxyCache::Statistics ProxyCache::GetStatistics()
+{
+    Statistics result;
+    {
+        std::lock_guard<std::mutex> lock(this->statisticsMutex);
+        result = this->statistics;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->memoryMutex);
+        result.memorySize = this->memorySize;
+        result.memoryEntries = this->memoryItems.size();
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->diskMutex);
+        result.diskSize = this->diskSize;
+        result.diskEntries = this->diskItems.size();
+    }
+    return result;
+}
+
+void ProxyCache::Count(uint64_t Statistics::* counter)
+{
+    std::lock_guard<std::mutex> lock(this->statisticsMutex);
+    this->statistics.*counter += 1;
+}
+
+void ProxyCache::StoreMemory(const std::wstring& url, const Entry& entry)
+{
+    std::lock_guard<std::mutex> lock(this->memoryMutex);
+    auto it = this->memoryItems.find(url);
+    if (it != this->memoryItems.end())
+    {
+        this->memorySize -= it->second.entry->Size();
+        this->memoryLRU.erase(it->second.lru);
+        this->memoryItems.erase(it);
+    }
+    // 1つで大半を占めるものはディスクにだけ置く
+    if (entry->Size() > this->memoryMaxSize / 4)
+    {
+        return;
+    }
+    this->memoryLRU.push_front(url);
+    this->memoryItems.emplace(url, MemoryItem{ entry, this->memoryLRU.begin() });
+    this->memorySize += entry->Size();
+    this->EvictMemory();
+}
+
+void ProxyCache::EvictMemory()
+{
+    while (this->memorySize > this->memoryMaxSize && !this->memoryLRU.empty())
+    {
+        auto it = this->memoryItems.find(this->memoryLRU.back());
+        this->memorySize -= it->second.entry->Size();
+        this->memoryItems.erase(it);
+        this->memoryLRU.pop_back();
+    }
+}
+
+std::wstring ProxyCache::DiskFileName(const std::wstring& url)
+{
+    // FNV-1a 衝突した場合はファイル内のURLで区別する
+    uint64_t hash = 14695981039346656037ULL;
+    for (auto c : url)
+    {
+        hash ^= (uint16_t)c;
+        hash *= 1099511628211ULL;
+    }
+    WCHAR name[32];
+    swprintf_s(name, L"%016llx.cache", hash);
+    return name;
+}
+
+ProxyCache::Entry ProxyCache::LoadDisk(const std::wstring& url)
+{
+    if (this->directory.empty())
+    {
+        return nullptr;
+    }
+    auto name = DiskFileName(url);
+    std::lock_guard<std::mutex> lock(this->diskMutex);
+    auto item = this->diskItems.find(name);
+    if (item == this->diskItems.end())
+    {
+        return nullptr;
+    }
+    auto path = this->directory / name;
+    wil::unique_hfile file(CreateFileW(path.c_str(), GENERIC_READ | FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+    if (!file)
+    {
+        return nullptr;
+    }
+    auto read = [&](void* buffer, size_t size) -> bool {
+        DWORD readSize;
+        return size <= MAXDWORD && ReadFile(file.get(), buffer, (DWORD)size, &readSize, nullptr) && readSize == size;
+    };
+    // 壊れているか形式の異なるファイルは消して次からは探さない
+    auto discard = [&]() -> Entry {
+        file.reset();
+        DeleteFileW(path.c_str());
+        this->diskSize -= item->second.size;
+        this->diskLRU.erase(item->second.lru);
+        this->diskItems.erase(item);
+        return nullptr;
+    };
+    DiskHeader header;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file.get(), &fileSize) || !read(&header, sizeof(header)) || memcmp(header.magic, diskMagic, sizeof(diskMagic)))
+    {
+        return discard();
+    }
+    // 長さを信用して確保する前にファイルの大きさと一致するか確かめる
+    uint64_t stringsLength = (uint64_t)header.urlLength + header.statusCodeTextLength + header.headersLength;
+    if (header.contentLength > (uint64_t)fileSize.QuadPart ||
+        sizeof(header) + stringsLength * sizeof(WCHAR) + header.contentLength != (uint64_t)fileSize.QuadPart)
+    {
+        return discard();
+    }
+    if (header.urlLength != url.size())
+    {
+        // ハッシュが衝突した別のURL
+        return nullptr;
+    }
+    std::wstring storedUrl(header.urlLength, L'\0');
+    auto entry = std::make_shared<ProxyCacheEntry>();
+    entry->statusCode = header.statusCode;
+    entry->responseTime = header.responseTime;
+    entry->freshUntil = header.freshUntil;
+    entry->statusCodeText.resize(header.statusCodeTextLength);
+    entry->headers.resize(header.headersLength);
+    entry->content.resize((size_t)header.contentLength);
+    if (!read(storedUrl.data(), storedUrl.size() * sizeof(WCHAR)))
+    {
+        return discard();
+    }
+    if (storedUrl != url)
+    {
+        return nullptr;
+    }
+    if (!read(entry->statusCodeText.data(), entry->statusCodeText.size() * sizeof(WCHAR)) ||
+        !read(entry->headers.data(), entry->headers.size() * sizeof(WCHAR)) ||
+        !read(entry->content.data(), entry->content.size()))
+    {
+        return discard();
+    }
+    ParseValidators(*entry);
+    // 最終更新時刻を最終使用時刻として使う
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    SetFileTime(file.get(), nullptr, nullptr, &now);
+    this->diskLRU.splice(this->diskLRU.begin(), this->diskLRU, item->second.lru);
+    return entry;
+}
+
+void ProxyCache::StoreDisk(const std::wstring& url, const ProxyCacheEntry& entry)
+{
+    if (this->directory.empty())
+    {
+        return;
+    }
+    auto size = sizeof(DiskHeader) + (url.size() + entry.statusCodeText.size() + entry.headers.size()) * sizeof(WCHAR) + entry.content.size();
+    if (size > this->diskMaxSize / 4)
+    {
+        this->RemoveDisk(url);
+        return;
+    }
+    auto name = DiskFileName(url);
+    auto path = this->directory / name;
+    auto tempPath = path;
+    tempPath.replace_extension(L".tmp");
+    std::lock_guard<std::mutex> lock(this->diskMutex);
+    {
+        wil::unique_hfile file(CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+        if (!file)
+        {
+            return;
+        }
+        auto write = [&](const void* buffer, size_t size) -> bool {
+            DWORD written;
+            return size <= MAXDWORD && WriteFile(file.get(), buffer, (DWORD)size, &written, nullptr) && written == size;
+        };
+        DiskHeader header = {};
+        memcpy(header.magic, diskMagic, sizeof(diskMagic));
+        header.statusCode = entry.statusCode;
+        header.responseTime = entry.responseTime;
+        header.freshUntil = entry.freshUntil;
+        header.urlLength = (uint32_t)url.size();
+        header.statusCodeTextLength = (uint32_t)entry.statusCodeText.size();
+        header.headersLength = (uint32_t)entry.headers.size();
+        header.contentLength = entry.content.size();
+        if (!write(&header, sizeof(header)) ||
+            !write(url.data(), url.size() * sizeof(WCHAR)) ||
+            !write(entry.statusCodeText.data(), entry.statusCodeText.size() * sizeof(WCHAR)) ||
+            !write(entry.headers.data(), entry.headers.size() * sizeof(WCHAR)) ||
+            !write(entry.content.data(), entry.content.size()))
+        {
+            file.reset();
+            DeleteFileW(tempPath.c_str());
+            return;
+        }
+    }
+    if (!MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        DeleteFileW(tempPath.c_str());
+        return;
+    }
+    auto item = this->diskItems.find(name);
+    if (item != this->diskItems.end())
+    {
+        this->diskSize -= item->second.size;
+        item->second.size = size;
+        this->diskLRU.splice(this->diskLRU.begin(), this->diskLRU, item->second.lru);
+    }
+    else
+    {
+        this->diskLRU.push_front(name);
+        this->diskItems.emplace(name, DiskItem{ size, this->diskLRU.begin() });
+    }
+    this->diskSize += size;
+    this->EvictDisk();
+}
+
+void ProxyCache::RemoveDisk(const std::wstring& url)
+{
+    if (this->directory.empty())
+    {
+        return;
+    }
+    auto name = DiskFileName(url);
+    std::lock_guard<std::mutex> lock(this->diskMutex);
+    auto item = this->diskItems.find(name);
+    if (item == this->diskItems.end())
+    {
+        return;
+    }
+    DeleteFileW((this->directory / name).c_str());
+    this->diskSize -= item->second.size;
+    this->diskLRU.erase(item->second.lru);
+    this->diskItems.erase(item);
+}
+
+void ProxyCache::EvictDisk()
+{
+    while (this->diskSize > this->diskMaxSize && !this->diskLRU.empty())
+    {
+        auto& name = this->diskLRU.back();
+        DeleteFileW((this->directory / name).c_str());
+        auto it = this->diskItems.find(name);
+        this->diskSize -= it->second.size;
+        this->diskItems.erase(it);
+        this->diskLRU.pop_back();
+    }
+}
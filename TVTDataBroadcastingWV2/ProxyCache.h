@@ -0,0 +1,156 @@
+﻿#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// リクエストヘッダから決まるキャッシュの使い方 大きい方が優先される
+enum class ProxyCacheMode
+{
+    // 保持している応答を使い、受け取った応答を保存する
+    Use,
+    // 保持している応答は使わないが受け取った応答は保存する (Cache-Control: no-cacheなど)
+    Refresh,
+    // キャッシュを使わない (Cache-Control: no-store, ページ自身による条件付きリクエスト)
+    Bypass,
+};
+
+// 通信コンテンツのGETの応答を保持する
+struct ProxyCacheEntry
+{
+    DWORD statusCode = 0;
+    std::wstring statusCodeText;
+    // WINHTTP_QUERY_RAW_HEADERS_CRLFの形式 (先頭はステータス行) 呼び出し側が書き換えたもの
+    std::wstring headers;
+    std::vector<BYTE> content;
+    // 応答を受け取った時刻 (UNIX時間の秒)
+    int64_t responseTime = 0;
+    // この時刻までは再検証せずに使える
+    int64_t freshUntil = 0;
+    // Cache-Control: no-cacheなど 毎回再検証が必要
+    bool mustRevalidate = false;
+    std::wstring etag;
+    std::wstring lastModified;
+    // 本来は保存しない4xx/5xxの応答をnegativeLifetimeの間だけ保持したもの メモリにのみ置き、期限が切れれば再検証せずに捨てる
+    bool negative = false;
+
+    size_t Size() const;
+    bool IsFresh(int64_t now) const
+    {
+        return !this->mustRevalidate && now < this->freshUntil;
+    }
+    bool HasValidator() const
+    {
+        return !this->etag.empty() || !this->lastModified.empty();
+    }
+};
+
+// ProxyPipelineが使うキャッシュ ProxyCacheが実装する
+// ProxyPipelineをLinuxでビルドするときはWindowsに依存するProxyCacheの代わりに別の実装を渡すか使わない
+class ProxyResponseCache
+{
+public:
+    using Entry = std::shared_ptr<const ProxyCacheEntry>;
+    virtual ~ProxyResponseCache() = default;
+    // 現在時刻 (UNIX時間の秒)
+    virtual int64_t Now() = 0;
+    // ページから渡されたリクエストヘッダ1つについてキャッシュの使い方を返す
+    virtual ProxyCacheMode RequestHeaderMode(LPCWSTR name, LPCWSTR value) = 0;
+    // 保持している応答を返す 新鮮でなければ呼び出し側でETag, Last-Modifiedを使って再検証する
+    virtual Entry Lookup(const std::wstring& url, int64_t now) = 0;
+    // 保存できない応答であればnullptr
+    // 保存した場合contentはエントリに引き取られて空になる エントリのcontentをそのままページに返せばよい
+    virtual Entry Store(const std::wstring& url, DWORD statusCode, LPCWSTR statusCodeText, LPCWSTR headers, std::vector<BYTE>& content, int64_t requestTime) = 0;
+    // 304を受け取ったときに保持していた応答のヘッダと期限を更新する
+    virtual Entry Revalidate(const std::wstring& url, const Entry& stale, LPCWSTR headers, int64_t requestTime) = 0;
+    // POSTなどで保持している応答を捨てる
+    virtual void Invalidate(const std::wstring& url) = 0;
+    // リクエストヘッダによってキャッシュを使わなかった
+    virtual void CountBypass() = 0;
+    // これより大きい応答は保存されない
+    virtual size_t MaxEntrySize() const = 0;
+};
+
+// Cache-Control, Expires, ETag, Last-Modifiedに従うメモリとディスクのLRUキャッシュ
+// ブラウザから見ればプライベートキャッシュなのでprivateな応答も保持する
+// どのスレッドからも呼び出せる
+class ProxyCache : public ProxyResponseCache
+{
+public:
+    struct Statistics
+    {
+        // 再検証せずに返した回数
+        uint64_t hits = 0;
+        // 期限切れの応答を再検証して304が返ってきた回数
+        uint64_t revalidated = 0;
+        // 保持していなかったか期限切れだった回数から304が返ってきた回数を引いたもの
+        uint64_t misses = 0;
+        // リクエストヘッダによってキャッシュを使わなかった回数
+        uint64_t bypassed = 0;
+        // hitsのうち4xx/5xxの応答を返した回数
+        uint64_t negativeHits = 0;
+        size_t memorySize = 0;
+        size_t memoryEntries = 0;
+        size_t diskSize = 0;
+        size_t diskEntries = 0;
+    };
+private:
+    struct MemoryItem
+    {
+        Entry entry;
+        std::list<std::wstring>::iterator lru;
+    };
+    struct DiskItem
+    {
+        size_t size;
+        std::list<std::wstring>::iterator lru;
+    };
+    std::mutex memoryMutex;
+    // 先頭が最近使われたもの
+    std::list<std::wstring> memoryLRU;
+    std::unordered_map<std::wstring, MemoryItem> memoryItems;
+    size_t memorySize = 0;
+    size_t memoryMaxSize;
+    // ディスクの読み書きはmemoryMutexを持たずに行う
+    std::mutex diskMutex;
+    std::filesystem::path directory;
+    // ファイル名のLRU
+    std::list<std::wstring> diskLRU;
+    std::unordered_map<std::wstring, DiskItem> diskItems;
+    size_t diskSize = 0;
+    size_t diskMaxSize;
+    int64_t negativeLifetime;
+    std::mutex statisticsMutex;
+    Statistics statistics;
+
+    void StoreMemory(const std::wstring& url, const Entry& entry);
+    void RemoveMemory(const std::wstring& url);
+    void EvictMemory();
+    Entry LoadDisk(const std::wstring& url);
+    void StoreDisk(const std::wstring& url, const ProxyCacheEntry& entry);
+    void RemoveDisk(const std::wstring& url);
+    void EvictDisk();
+    static std::wstring DiskFileName(const std::wstring& url);
+    void Count(uint64_t Statistics::* counter);
+public:
+    // directoryが空かdiskMaxSizeが0であればディスクには保存しない
+    // 上流が落ちているときにページの再試行がそのまま上流に届かないよう、4xx/5xxの応答はnegativeLifetimeSeconds秒の間返す (0であればしない)
+    ProxyCache(size_t memoryMaxSize, const std::wstring& directory, size_t diskMaxSize, int64_t negativeLifetimeSeconds);
+    ProxyCache(const ProxyCache&) = delete;
+    ProxyCache& operator=(const ProxyCache&) = delete;
+    int64_t Now() override;
+    ProxyCacheMode RequestHeaderMode(LPCWSTR name, LPCWSTR value) override;
+    // 新鮮なものを返した場合hitsを数え、それ以外はmissesを数える
+    Entry Lookup(const std::wstring& url, int64_t now) override;
+    Entry Store(const std::wstring& url, DWORD statusCode, LPCWSTR statusCodeText, LPCWSTR headers, std::vector<BYTE>& content, int64_t requestTime) override;
+    // missesからrevalidatedに数え直す
+    Entry Revalidate(const std::wstring& url, const Entry& stale, LPCWSTR headers, int64_t requestTime) override;
+    void Invalidate(const std::wstring& url) override;
+    void CountBypass() override;
+    size_t MaxEntrySize() const override;
+    Statistics GetStatistics();
+};
@@ -0,0 +1,121 @@
+﻿#pragma once
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// 上流のホストごとに続けて失敗した回数を数え、しきい値に達したホストへのリクエストはしばらくの間すぐに失敗させる
+// 上流が落ちているとページの再試行のたびにWinHTTPのタイムアウトまで待たされ、リクエストが溜まっていくのを防ぐ
+// 期間が過ぎれば1つだけ通して試し、成功すれば元に戻る
+// LinuxでもPosixProxyTransportと一緒に使えるようにこのヘッダだけで完結させる
+class ProxyCircuitBreaker
+{
+public:
+    struct Statistics
+    {
+        // しきい値に達したホストの延べ数
+        uint64_t opened = 0;
+        // すぐに失敗させたリクエストの数
+        uint64_t rejected = 0;
+        // 現在止めているホストの数
+        size_t open = 0;
+    };
+private:
+    struct Host
+    {
+        size_t failures = 0;
+        uint64_t openUntil = 0;
+    };
+    std::mutex mutex;
+    // 失敗しているホストのみ 成功すれば取り除く
+    std::unordered_map<std::wstring, Host> hosts;
+    size_t failureThreshold;
+    uint64_t coolDown;
+    Statistics statistics;
+public:
+    // failureThresholdが0であれば何もしない 時刻は単調増加するミリ秒
+    ProxyCircuitBreaker(size_t failureThreshold, uint64_t coolDownMilliseconds) : failureThreshold(failureThreshold), coolDown(coolDownMilliseconds)
+    {
+    }
+    ProxyCircuitBreaker(const ProxyCircuitBreaker&) = delete;
+    ProxyCircuitBreaker& operator=(const ProxyCircuitBreaker&) = delete;
+
+    // falseであれば上流に送らずに失敗させる
+    bool Allow(const std::wstring& host, uint64_t now)
+    {
+        if (!this->failureThreshold)
+        {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto it = this->hosts.find(host);
+        if (it == this->hosts.end() || it->second.failures < this->failureThreshold)
+        {
+            return true;
+        }
+        if (now < it->second.openUntil)
+        {
+            this->statistics.rejected++;
+            return false;
+        }
+        // 試しに通したリクエストの結果が出るまでは次の期間まで止めておく
+        it->second.openUntil = now + this->coolDown;
+        return true;
+    }
+
+    // Allowと違い期間が過ぎていても試しに通す分を使わない リクエストを受け付けた時点で順番を待たせずに失敗させるために使う
+    // trueであればすぐに失敗させたものとして数える
+    bool IsOpen(const std::wstring& host, uint64_t now)
+    {
+        if (!this->failureThreshold)
+        {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto it = this->hosts.find(host);
+        if (it == this->hosts.end() || it->second.failures < this->failureThreshold || now >= it->second.openUntil)
+        {
+            return false;
+        }
+        this->statistics.rejected++;
+        return true;
+    }
+
+    // 応答を受け取ればsucceeded 接続できないなど応答がなかったか5xxであれば失敗 取り消したものは数えない
+    void Record(const std::wstring& host, bool succeeded, uint64_t now)
+    {
+        if (!this->failureThreshold)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (succeeded)
+        {
+            this->hosts.erase(host);
+            return;
+        }
+        auto& entry = this->hosts[host];
+        if (++entry.failures == this->failureThreshold)
+        {
+            this->statistics.opened++;
+        }
+        if (entry.failures >= this->failureThreshold)
+        {
+            entry.openUntil = now + this->coolDown;
+        }
+    }
+
+    Statistics GetStatistics(uint64_t now)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto result = this->statistics;
+        for (auto&& [name, entry] : this->hosts)
+        {
+            if (entry.failures >= this->failureThreshold && now < entry.openUntil)
+            {
+                result.open++;
+            }
+        }
+        return result;
+    }
+};
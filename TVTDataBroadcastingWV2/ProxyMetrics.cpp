@@ -0,0 +1,108 @@
+﻿#include "pch.h"
+#include "ProxyMetrics.h"
+#include <winhttp.h>
+
+std::string wstrToUTF8String(const wchar_t* ws);
+
+void ProxyMetrics::Record(const std::wstring& host, const std::function<void(Host& host)>& update)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    update(this->hosts[host]);
+}
+
+ULONGLONG ProxyMetrics::Now()
+{
+    // GetTickCount64は分解能が粗いので使わない
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return counter.QuadPart * 1000 / frequency.QuadPart;
+}
+
+std::wstring ProxyMetrics::FailureReason(DWORD error)
+{
+    switch (error)
+    {
+    case ERROR_WINHTTP_TIMEOUT:
+        return L"timeout";
+    case ERROR_WINHTTP_NAME_NOT_RESOLVED:
+        return L"name-not-resolved";
+    case ERROR_WINHTTP_CANNOT_CONNECT:
+        return L"cannot-connect";
+    case ERROR_WINHTTP_CONNECTION_ERROR:
+        return L"connection-error";
+    case ERROR_WINHTTP_SECURE_FAILURE:
+        return L"secure-failure";
+    case ERROR_WINHTTP_INVALID_SERVER_RESPONSE:
+        return L"invalid-server-response";
+    case ERROR_WINHTTP_OPERATION_CANCELLED:
+        return L"operation-cancelled";
+    default:
+        return L"error-" + std::to_wstring(error);
+    }
+}
+
+std::vector<std::wstring> ProxyMetrics::Format()
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    std::vector<std::wstring> lines;
+    for (auto&& [name, host] : this->hosts)
+    {
+        std::wstring line = L"ProxyHost " + name + L": status";
+        for (auto&& [statusCode, count] : host.statusCodes)
+        {
+            line += L" " + std::to_wstring(statusCode) + L":" + std::to_wstring(count);
+        }
+        line += L", failures";
+        for (auto&& [reason, count] : host.failures)
+        {
+            line += L" " + reason + L":" + std::to_wstring(count);
+        }
+        lines.push_back(std::move(line));
+        WCHAR buf[200];
+        swprintf_s(buf, L"  compression: responses=%llu, %llu -> %llu bytes (ratio %.2f)", host.decodedResponses, host.encodedBytes, host.decodedBytes, host.decodedBytes ? (double)host.encodedBytes / host.decodedBytes : 1.0);
+        lines.push_back(buf);
+        lines.push_back(L"  queue ms: " + host.queueMilliseconds.Format());
+        lines.push_back(L"  connect ms: " + host.connectMilliseconds.Format());
+        lines.push_back(L"  first byte ms: " + host.firstByteMilliseconds.Format());
+        lines.push_back(L"  total ms: " + host.totalMilliseconds.Format());
+        lines.push_back(L"  delivery ms: " + host.deliveryMilliseconds.Format());
+        lines.push_back(L"  response bytes: " + host.responseBytes.Format());
+    }
+    return lines;
+}
+
+nlohmann::json ProxyMetrics::ToJson()
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto result = nlohmann::json::object();
+    for (auto&& [name, host] : this->hosts)
+    {
+        auto statusCodes = nlohmann::json::object();
+        for (auto&& [statusCode, count] : host.statusCodes)
+        {
+            statusCodes[std::to_string(statusCode)] = count;
+        }
+        auto failures = nlohmann::json::object();
+        for (auto&& [reason, count] : host.failures)
+        {
+            failures[wstrToUTF8String(reason.c_str())] = count;
+        }
+        result[wstrToUTF8String(name.c_str())] = {
+            { "queueMilliseconds", host.queueMilliseconds.ToJson() },
+            { "connectMilliseconds", host.connectMilliseconds.ToJson() },
+            { "firstByteMilliseconds", host.firstByteMilliseconds.ToJson() },
+            { "totalMilliseconds", host.totalMilliseconds.ToJson() },
+            { "deliveryMilliseconds", host.deliveryMilliseconds.ToJson() },
+            { "responseBytes", host.responseBytes.ToJson() },
+            { "statusCodes", statusCodes },
+            { "failures", failures },
+            { "compression", {
+                { "decodedResponses", host.decodedResponses },
+                { "encodedBytes", host.encodedBytes },
+                { "decodedBytes", host.decodedBytes },
+            } },
+        };
+    }
+    return result;
+}
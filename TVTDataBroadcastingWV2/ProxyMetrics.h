@@ -0,0 +1,46 @@
+﻿#pragma once
+#include <functional>
+#include <map>
+#include <vector>
+#include "Histogram.h"
+
+// 通信コンテンツのリクエストの所要時間などを上流のホストごとに数える
+// 上流が遅いのかプラグイン内部で待たされているのかを見分けられるように区間ごとに分ける
+// どのスレッドからも呼び出せる
+class ProxyMetrics
+{
+public:
+    struct Host
+    {
+        // スケジューラで開始を待った時間
+        Log2Histogram queueMilliseconds;
+        // 名前解決と接続 接続を使いまわした場合は数えない
+        Log2Histogram connectMilliseconds;
+        // 送信を始めてから応答ヘッダを受け取るまで
+        Log2Histogram firstByteMilliseconds;
+        // 送信を始めてから受信し終えるまで
+        Log2Histogram totalMilliseconds;
+        // 応答ヘッダを受け取ってからページに返すまで
+        Log2Histogram deliveryMilliseconds;
+        Log2Histogram responseBytes;
+        std::map<DWORD, uint64_t> statusCodes;
+        // 失敗の理由ごとの回数
+        std::map<std::wstring, uint64_t> failures;
+        // gzip, deflateを展開した応答の数と、そのうちContent-Lengthが分かるものの圧縮された大きさと展開した大きさ
+        uint64_t decodedResponses = 0;
+        uint64_t encodedBytes = 0;
+        uint64_t decodedBytes = 0;
+    };
+private:
+    std::mutex mutex;
+    // キーはホスト名:ポート
+    std::map<std::wstring, Host> hosts;
+public:
+    void Record(const std::wstring& host, const std::function<void(Host& host)>& update);
+    static ULONGLONG Now();
+    // WinHTTPのエラーコードを失敗の理由にする
+    static std::wstring FailureReason(DWORD error);
+    // ホストごとに数行の形式
+    std::vector<std::wstring> Format();
+    nlohmann::json ToJson();
+};
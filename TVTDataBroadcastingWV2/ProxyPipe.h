@@ -0,0 +1,179 @@
+﻿#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+enum class ProxyPipeWriteResult
+{
+    Continue,
+    // バッファが一杯なので受信を止める 読み出し側が読めばresumeが呼ばれる
+    Paused,
+    // 読み出し側が閉じたので受信を中断する
+    ReaderClosed,
+};
+
+// 受信した内容をページに読ませるための大きさに上限のあるバッファ
+// 同時に届いた同じリクエストに返すため複数の読み出し側がそれぞれの位置から読める
+// 書き込み側(ProxyRequestなど)は最も遅い読み出し側の未読がcapacityに達したら受信を止め、半分まで読まれたらresumeで再開する
+// LinuxでもProxyPipelineと一緒に使えるようにこのヘッダだけで完結させる
+class ProxyPipe
+{
+    struct Reader
+    {
+        // 全体の先頭からの位置
+        uint64_t position = 0;
+        bool closed = false;
+    };
+    std::mutex mutex;
+    std::condition_variable readable;
+    // bufferの先頭は全体の先頭からbaseの位置
+    std::vector<uint8_t> buffer;
+    uint64_t base = 0;
+    std::vector<Reader> readers;
+    size_t capacity;
+    bool writerClosed = false;
+    bool failed = false;
+    std::function<void()> resume;
+
+    // 閉じていない読み出し側のうち最も遅い位置 全て閉じていればnullopt
+    std::optional<uint64_t> SlowestPosition() const
+    {
+        std::optional<uint64_t> slowest;
+        for (auto&& reader : this->readers)
+        {
+            if (!reader.closed && (!slowest || reader.position < *slowest))
+            {
+                slowest = reader.position;
+            }
+        }
+        return slowest;
+    }
+
+    void Trim()
+    {
+        // 全員が読み終えた部分が半分を超えたら詰める
+        auto slowest = this->SlowestPosition().value_or(this->base + this->buffer.size());
+        auto consumed = (size_t)(slowest - this->base);
+        if (consumed == this->buffer.size())
+        {
+            this->buffer.clear();
+            this->base = slowest;
+        }
+        else if (consumed > this->buffer.size() / 2)
+        {
+            this->buffer.erase(this->buffer.begin(), this->buffer.begin() + consumed);
+            this->base = slowest;
+        }
+    }
+
+    void TakeResume(std::unique_lock<std::mutex>& lock)
+    {
+        auto resume = std::exchange(this->resume, nullptr);
+        lock.unlock();
+        if (resume)
+        {
+            resume();
+        }
+    }
+public:
+    explicit ProxyPipe(size_t capacity) : capacity(capacity)
+    {
+    }
+    ProxyPipe(const ProxyPipe&) = delete;
+    ProxyPipe& operator=(const ProxyPipe&) = delete;
+
+    // 最初のWriteより前に呼ぶこと
+    size_t AddReader()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->readers.push_back({ this->base, false });
+        return this->readers.size() - 1;
+    }
+
+    // Pausedを返した場合resumeは別のスレッドからすぐに呼ばれることがあるので呼び出し側は何もせずに戻ること
+    ProxyPipeWriteResult Write(const uint8_t* data, size_t size, std::function<void()> resume)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto slowest = this->SlowestPosition();
+        if (!slowest)
+        {
+            return ProxyPipeWriteResult::ReaderClosed;
+        }
+        this->Trim();
+        this->buffer.insert(this->buffer.end(), data, data + size);
+        this->readable.notify_all();
+        if (this->base + this->buffer.size() - *slowest < this->capacity)
+        {
+            return ProxyPipeWriteResult::Continue;
+        }
+        this->resume = std::move(resume);
+        return ProxyPipeWriteResult::Paused;
+    }
+
+    // 全て書き込んだ
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->writerClosed = true;
+        this->readable.notify_all();
+    }
+
+    // 途中で失敗した 読み出し側はエラーになる
+    void Fail()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->writerClosed = true;
+        this->failed = true;
+        this->readable.notify_all();
+    }
+
+    // 読み出し側が不要になった 全て閉じれば止まっている受信はresumeで再開して中断させる
+    void CloseReader(size_t reader)
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->readers[reader].closed = true;
+        auto slowest = this->SlowestPosition();
+        this->Trim();
+        // 最も遅い読み出し側が閉じた場合も再開できることがある
+        if (!slowest || this->base + this->buffer.size() - *slowest <= this->capacity / 2)
+        {
+            this->TakeResume(lock);
+        }
+    }
+
+    bool IsReaderClosed()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        return !this->SlowestPosition();
+    }
+
+    // データが来るまで待つ 終端であれば0を返す 失敗していればfalse
+    bool Read(size_t reader, uint8_t* data, size_t size, size_t& read)
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->readable.wait(lock, [&] {
+            return this->readers[reader].position < this->base + this->buffer.size() || this->writerClosed;
+        });
+        auto position = this->readers[reader].position;
+        read = (size_t)std::min<uint64_t>(size, this->base + this->buffer.size() - position);
+        memcpy(data, this->buffer.data() + (position - this->base), read);
+        this->readers[reader].position += read;
+        if (!read && this->failed)
+        {
+            return false;
+        }
+        auto slowest = this->SlowestPosition();
+        if (this->resume && this->base + this->buffer.size() - *slowest <= this->capacity / 2)
+        {
+            this->Trim();
+            this->TakeResume(lock);
+        }
+        return true;
+    }
+};
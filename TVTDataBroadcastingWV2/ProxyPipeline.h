@@ -0,0 +1,389 @@
+﻿#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "ProxyCache.h"
+#include "ProxyCircuitBreaker.h"
+#include "ProxyPipe.h"
+#include "ProxyPolicy.h"
+#include "ProxyScheduler.h"
+#include "ProxyTransport.h"
+
+// ページからの通信コンテンツのリクエストを上流に出して応答を返すまでの処理
+// キャッシュ、同じGETのまとめ、ヘッダの書き換え、スケジューラとサーキットブレーカーを通してProxyTransportに送る
+// WebView2には依存せず、LinuxでもPosixProxyTransportと組み合わせてスタブサーバーに対して負荷試験できるようにこのヘッダだけで完結させる
+
+// リクエストを出したページ側 RespondかRespondStreamingかFailのいずれかが1回だけ別スレッドから呼ばれる
+class ProxyResponder
+{
+public:
+    virtual ~ProxyResponder() = default;
+    // 受信済みの内容を返す 内容はownerが所有し、まとめたリクエストやキャッシュと共有する
+    // hostは上流から受け取った場合のホスト名:ポート キャッシュから返す場合は空
+    virtual void Respond(uint32_t statusCode, const std::wstring& statusCodeText, const std::wstring& headers, std::shared_ptr<const void> owner, const uint8_t* content, size_t contentSize, const std::wstring& host) = 0;
+    // 内容はpipeのreaderから届いた分を読み出す 返せなければreaderを閉じること contentLengthが分からなければ0
+    virtual void RespondStreaming(uint32_t statusCode, const std::wstring& statusCodeText, const std::wstring& headers, std::shared_ptr<ProxyPipe> pipe, size_t reader, uint64_t contentLength, const std::wstring& host) = 0;
+    // 上流が失敗したか取り消された
+    virtual void Fail() = 0;
+};
+
+struct ProxyPipelineOptions
+{
+    ProxyHeaderRules requestHeaderRules;
+    ProxyHeaderRules responseHeaderRules;
+    // 0であれば全て受信してからページに返す
+    size_t streamBufferSize = 0;
+    // 0であれば制限しない
+    size_t maxRequestsPerHost = 0;
+    size_t maxRequests = 0;
+    // 0であれば止めない
+    size_t circuitBreakerFailures = 0;
+    uint64_t circuitBreakerCoolDownMilliseconds = 0;
+    // リクエストを開始するときにスケジューラで待った時間を知らせる
+    std::function<void(const std::wstring& host, uint64_t queueMilliseconds)> recordStart;
+    // サーキットブレーカーが止めているホストへのリクエストをすぐに失敗させたことを知らせる
+    std::function<void(const std::wstring& host)> recordRejected;
+};
+
+// どのスレッドからも呼び出せる 応答のコールバックは自身への参照を持つので、破棄する前にCancelAllを呼ぶこと
+class ProxyPipeline : public std::enable_shared_from_this<ProxyPipeline>
+{
+public:
+    struct Statistics
+    {
+        // 上流に出ている同じGETの応答を待たせた数
+        uint64_t coalesced = 0;
+        size_t inFlight = 0;
+    };
+private:
+    // 同時に届いた同じGETをまとめて1つのリクエストにする 応答はwaitersの全てに返す
+    struct Flight
+    {
+        std::vector<std::shared_ptr<ProxyResponder>> waiters;
+    };
+    std::shared_ptr<ProxyTransport> transport;
+    std::shared_ptr<ProxyResponseCache> cache;
+    std::shared_ptr<ProxyScheduler> scheduler;
+    std::shared_ptr<ProxyCircuitBreaker> breaker;
+    const ProxyPipelineOptions options;
+    // キーはメソッド, URL, 転送するヘッダ 応答のヘッダを受け取るか失敗するまで登録されている
+    std::mutex flightsMutex;
+    std::unordered_map<std::wstring, std::shared_ptr<Flight>> flights;
+    uint64_t coalesced = 0;
+
+    std::vector<std::shared_ptr<ProxyResponder>> TakeWaiters(const std::wstring& key, const std::shared_ptr<Flight>& flight)
+    {
+        // 取り出した後に届いた同じリクエストは新しく上流に出す
+        std::lock_guard<std::mutex> lock(this->flightsMutex);
+        auto it = key.empty() ? this->flights.end() : this->flights.find(key);
+        if (it != this->flights.end() && it->second == flight)
+        {
+            this->flights.erase(it);
+        }
+        return std::move(flight->waiters);
+    }
+
+    static void RespondCached(ProxyResponder& responder, const ProxyResponseCache::Entry& entry)
+    {
+        responder.Respond(entry->statusCode, entry->statusCodeText, entry->headers, entry, entry->content.data(), entry->content.size(), std::wstring());
+    }
+
+    struct Job
+    {
+        std::shared_ptr<Flight> flight;
+        std::wstring flightKey;
+        std::shared_ptr<ProxyResponseCache> storeCache;
+        std::wstring url;
+        std::wstring method;
+        std::vector<uint8_t> content;
+        // 枠が空くまで待たされることがあるのでリクエストの内容は全て持っておく
+        std::vector<std::pair<std::wstring, std::wstring>> headers;
+        ProxyResponseCache::Entry stale;
+        std::wstring host;
+        uint64_t enqueueTime;
+    };
+
+    void Fail(const std::shared_ptr<Job>& job)
+    {
+        for (auto&& waiter : this->TakeWaiters(job->flightKey, job->flight))
+        {
+            waiter->Fail();
+        }
+    }
+
+    void Start(const std::shared_ptr<Job>& job, std::shared_ptr<ProxySchedulerSlot> slot)
+    {
+        auto startTime = Now();
+        // 待っている間に止められた場合と、期間が過ぎて試しに1つだけ通す場合はここで決まる
+        if (this->breaker && !this->breaker->Allow(job->host, startTime))
+        {
+            if (this->options.recordRejected)
+            {
+                this->options.recordRejected(job->host);
+            }
+            this->Fail(job);
+            return;
+        }
+        if (this->options.recordStart)
+        {
+            this->options.recordStart(job->host, startTime - job->enqueueTime);
+        }
+        auto self = this->shared_from_this();
+        // 応答がなかったことを数える 取り消した場合を除くため失敗を通知する時点でまだ枠を持っているか確かめる
+        std::weak_ptr<ProxySchedulerSlot> weakSlot = slot;
+        auto errorCallback = [self, job, weakSlot]() -> void
+        {
+            auto slot = weakSlot.lock();
+            if (self->breaker && (!slot || !slot->IsCancelled()))
+            {
+                self->breaker->Record(job->host, false, Now());
+            }
+            self->Fail(job);
+        };
+        std::vector<std::pair<const wchar_t*, const wchar_t*>> headersPtr;
+        for (auto&& [name, value] : job->headers)
+        {
+            headersPtr.push_back({ name.c_str(), value.c_str() });
+        }
+        auto requestTime = job->storeCache ? job->storeCache->Now() : 0;
+        bool started;
+        if (this->options.streamBufferSize)
+        {
+            // ヘッダを受け取った時点でページに返し、内容は届いた分から読ませる キャッシュには全て受信してから保存する
+            started = this->transport->RequestStreamingAsync(job->url.c_str(), job->method.c_str(), std::move(job->content), headersPtr, this->options.streamBufferSize, job->storeCache ? job->storeCache->MaxEntrySize() : 0, std::move(slot), errorCallback,
+                [self, job, requestTime](uint32_t statusCode, const wchar_t* statusCodeText, const wchar_t* headers, uint64_t contentLength, std::shared_ptr<ProxyPipe> pipe) -> bool
+            {
+                if (self->breaker)
+                {
+                    self->breaker->Record(job->host, statusCode < 500, Now());
+                }
+                auto waiters = self->TakeWaiters(job->flightKey, job->flight);
+                auto rewrittenHeaders = RewriteResponseHeaders(headers, self->options.responseHeaderRules);
+                if (job->storeCache && statusCode == 304 && job->stale)
+                {
+                    auto entry = job->storeCache->Revalidate(job->url, job->stale, rewrittenHeaders.c_str(), requestTime);
+                    for (auto&& waiter : waiters)
+                    {
+                        RespondCached(*waiter, entry);
+                    }
+                    return false;
+                }
+                // 読み出しが始まる前に全員分の読み出し位置を作る
+                std::vector<size_t> readers;
+                for (size_t i = 0; i < waiters.size(); i++)
+                {
+                    readers.push_back(pipe->AddReader());
+                }
+                std::wstring text(statusCodeText);
+                for (size_t i = 0; i < waiters.size(); i++)
+                {
+                    waiters[i]->RespondStreaming(statusCode, text, rewrittenHeaders, pipe, readers[i], contentLength, job->host);
+                }
+                return true;
+            }, job->storeCache ? ProxyTransport::ResponseCallback([self, job, requestTime](uint32_t statusCode, const wchar_t* statusCodeText, const wchar_t* headers, std::vector<uint8_t>& content) -> void
+            {
+                job->storeCache->Store(job->url, statusCode, statusCodeText, RewriteResponseHeaders(headers, self->options.responseHeaderRules).c_str(), content, requestTime);
+            }) : nullptr);
+        }
+        else
+        {
+            started = this->transport->RequestAsync(job->url.c_str(), job->method.c_str(), std::move(job->content), headersPtr, std::move(slot), errorCallback,
+                [self, job, requestTime](uint32_t statusCode, const wchar_t* statusCodeText, const wchar_t* headers, std::vector<uint8_t>& content) -> void
+            {
+                if (self->breaker)
+                {
+                    self->breaker->Record(job->host, statusCode < 500, Now());
+                }
+                auto waiters = self->TakeWaiters(job->flightKey, job->flight);
+                auto rewrittenHeaders = RewriteResponseHeaders(headers, self->options.responseHeaderRules);
+                if (job->storeCache && statusCode == 304 && job->stale)
+                {
+                    auto entry = job->storeCache->Revalidate(job->url, job->stale, rewrittenHeaders.c_str(), requestTime);
+                    for (auto&& waiter : waiters)
+                    {
+                        RespondCached(*waiter, entry);
+                    }
+                    return;
+                }
+                // 受信した内容はキャッシュかこの応答が引き取り、まとめたリクエスト全員で共有する
+                ProxyResponseCache::Entry entry;
+                if (job->storeCache)
+                {
+                    entry = job->storeCache->Store(job->url, statusCode, statusCodeText, rewrittenHeaders.c_str(), content, requestTime);
+                }
+                std::shared_ptr<const void> owner = entry;
+                const uint8_t* body = entry ? entry->content.data() : nullptr;
+                size_t bodySize = entry ? entry->content.size() : 0;
+                if (!entry)
+                {
+                    auto adopted = std::make_shared<const std::vector<uint8_t>>(std::move(content));
+                    body = adopted->data();
+                    bodySize = adopted->size();
+                    owner = std::move(adopted);
+                }
+                std::wstring text(statusCodeText);
+                for (auto&& waiter : waiters)
+                {
+                    waiter->Respond(statusCode, text, rewrittenHeaders, owner, body, bodySize, job->host);
+                }
+            });
+        }
+        if (!started)
+        {
+            this->Fail(job);
+        }
+    }
+public:
+    // cacheはnullptrでもよい
+    ProxyPipeline(std::shared_ptr<ProxyTransport> transport, std::shared_ptr<ProxyResponseCache> cache, ProxyPipelineOptions options)
+        : transport(std::move(transport)), cache(std::move(cache)), options(std::move(options))
+    {
+        this->scheduler = std::make_shared<ProxyScheduler>(this->options.maxRequestsPerHost, this->options.maxRequests);
+        this->breaker = std::make_shared<ProxyCircuitBreaker>(this->options.circuitBreakerFailures, this->options.circuitBreakerCoolDownMilliseconds);
+    }
+    ProxyPipeline(const ProxyPipeline&) = delete;
+    ProxyPipeline& operator=(const ProxyPipeline&) = delete;
+
+    // スケジューラとサーキットブレーカーの時刻 単調増加するミリ秒
+    static uint64_t Now()
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // headersはページから渡されたもの全て IsForwardedRequestHeaderで選んでから送る
+    // priorityはGETの場合 それ以外のメソッドは視聴者応答などのPOSTとして表示を妨げないよう最後にする
+    void Request(const std::wstring& url, const std::wstring& method, std::vector<uint8_t> content, const std::vector<std::pair<std::wstring, std::wstring>>& headers, ProxyPriority priority, std::shared_ptr<ProxyResponder> responder)
+    {
+        auto isGet = ProxyEqualsIgnoreCase(method, L"GET");
+        auto cacheMode = isGet ? ProxyCacheMode::Use : ProxyCacheMode::Bypass;
+        auto job = std::make_shared<Job>();
+        job->flightKey = method + L" " + url + L"\n";
+        std::vector<std::pair<const wchar_t*, const wchar_t*>> headersPtr
+        {
+            { L"Pragma", L"no-cache" },
+            { L"Accept-Language", L"ja" },
+        };
+        for (auto&& [name, value] : headers)
+        {
+            if (IsForwardedRequestHeader(name))
+            {
+                if (this->cache)
+                {
+                    cacheMode = std::max(cacheMode, this->cache->RequestHeaderMode(name.c_str(), value.c_str()));
+                }
+                job->flightKey += name;
+                job->flightKey += L":";
+                job->flightKey += value;
+                job->flightKey += L"\n";
+                headersPtr.push_back({ name.c_str(), value.c_str() });
+            }
+        }
+        RewriteRequestHeaders(headersPtr, this->options.requestHeaderRules);
+        // 期限内のものはそのまま返し、期限切れのものはETag, Last-Modifiedで再検証する
+        if (this->cache)
+        {
+            if (!isGet)
+            {
+                this->cache->Invalidate(url);
+            }
+            else if (cacheMode == ProxyCacheMode::Use)
+            {
+                auto now = this->cache->Now();
+                auto entry = this->cache->Lookup(url, now);
+                if (entry && entry->IsFresh(now))
+                {
+                    RespondCached(*responder, entry);
+                    return;
+                }
+                job->stale = std::move(entry);
+                if (job->stale && !job->stale->etag.empty())
+                {
+                    headersPtr.push_back({ L"If-None-Match", job->stale->etag.c_str() });
+                }
+                if (job->stale && !job->stale->lastModified.empty())
+                {
+                    headersPtr.push_back({ L"If-Modified-Since", job->stale->lastModified.c_str() });
+                }
+            }
+            else
+            {
+                this->cache->CountBypass();
+            }
+        }
+        ProxyUrl components;
+        job->host = CrackProxyUrl(url.c_str(), components) ? components.hostName + L":" + std::to_wstring(components.port) : std::wstring();
+        // 止めているホストへのリクエストは枠を待たせずにすぐ失敗させる
+        if (this->breaker && this->breaker->IsOpen(job->host, Now()))
+        {
+            if (this->options.recordRejected)
+            {
+                this->options.recordRejected(job->host);
+            }
+            responder->Fail();
+            return;
+        }
+        job->flight = std::make_shared<Flight>();
+        job->flight->waiters.push_back(responder);
+        if (isGet)
+        {
+            std::lock_guard<std::mutex> lock(this->flightsMutex);
+            auto it = this->flights.find(job->flightKey);
+            if (it != this->flights.end())
+            {
+                // 同じリクエストが上流に出ているのでその応答を待つ
+                it->second->waiters.push_back(responder);
+                this->coalesced++;
+                return;
+            }
+            this->flights.emplace(job->flightKey, job->flight);
+        }
+        else
+        {
+            job->flightKey.clear();
+        }
+        job->storeCache = cacheMode != ProxyCacheMode::Bypass ? this->cache : nullptr;
+        job->url = url;
+        job->method = method;
+        job->content = std::move(content);
+        job->headers.assign(headersPtr.begin(), headersPtr.end());
+        job->enqueueTime = Now();
+        auto self = this->shared_from_this();
+        this->scheduler->Enqueue(job->host, isGet ? priority : ProxyPriority::Post, [self, job](std::shared_ptr<ProxySchedulerSlot> slot) -> void
+        {
+            self->Start(job, std::move(slot));
+        }, [self, job]() -> void
+        {
+            self->Fail(job);
+        });
+    }
+
+    // 待っているリクエストを全て取り消し、実行中のリクエストはtransportに中断させる
+    void CancelAll()
+    {
+        this->scheduler->CancelAll();
+        this->transport->CancelAll();
+    }
+
+    Statistics GetStatistics()
+    {
+        std::lock_guard<std::mutex> lock(this->flightsMutex);
+        return { this->coalesced, this->flights.size() };
+    }
+
+    ProxyScheduler::Statistics GetSchedulerStatistics()
+    {
+        return this->scheduler->GetStatistics();
+    }
+
+    ProxyCircuitBreaker::Statistics GetCircuitBreakerStatistics()
+    {
+        return this->breaker->GetStatistics(Now());
+    }
+};
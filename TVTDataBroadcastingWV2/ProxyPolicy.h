@@ -0,0 +1,478 @@
+﻿#pragma once
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// 通信コンテンツのプロキシの振る舞いのうちHTTPの実装に依存しない部分
+// LinuxでもPosixProxyTransportと一緒にビルドできるようにこのヘッダだけで完結させてWindowsの型にも依存しない
+
+struct ProxyUrl
+{
+    bool secure = false;
+    std::wstring hostName;
+    uint16_t port = 0;
+    // クエリを含む フラグメントは含まない
+    std::wstring path;
+};
+
+inline bool ProxyEqualsIgnoreCase(std::wstring_view a, std::wstring_view b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        auto x = a[i] >= L'A' && a[i] <= L'Z' ? a[i] - L'A' + L'a' : a[i];
+        auto y = b[i] >= L'A' && b[i] <= L'Z' ? b[i] - L'A' + L'a' : b[i];
+        if (x != y)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool ProxyStartsWithIgnoreCase(std::wstring_view s, std::wstring_view prefix)
+{
+    return s.size() >= prefix.size() && ProxyEqualsIgnoreCase(s.substr(0, prefix.size()), prefix);
+}
+
+// http://かhttps://で始まるURLを分解する
+inline bool CrackProxyUrl(std::wstring_view url, ProxyUrl& result)
+{
+    result = {};
+    if (ProxyStartsWithIgnoreCase(url, L"https://"))
+    {
+        result.secure = true;
+        url.remove_prefix(8);
+    }
+    else if (ProxyStartsWithIgnoreCase(url, L"http://"))
+    {
+        url.remove_prefix(7);
+    }
+    else
+    {
+        return false;
+    }
+    auto authorityEnd = url.find_first_of(L"/?#");
+    auto authority = url.substr(0, authorityEnd);
+    url.remove_prefix(authorityEnd == std::wstring_view::npos ? url.size() : authorityEnd);
+    auto at = authority.rfind(L'@');
+    if (at != std::wstring_view::npos)
+    {
+        authority.remove_prefix(at + 1);
+    }
+    std::wstring_view port;
+    if (!authority.empty() && authority.front() == L'[')
+    {
+        // IPv6
+        auto close = authority.find(L']');
+        if (close == std::wstring_view::npos)
+        {
+            return false;
+        }
+        result.hostName = authority.substr(1, close - 1);
+        auto rest = authority.substr(close + 1);
+        if (!rest.empty())
+        {
+            if (rest.front() != L':')
+            {
+                return false;
+            }
+            port = rest.substr(1);
+        }
+    }
+    else
+    {
+        auto colon = authority.find(L':');
+        result.hostName = authority.substr(0, colon);
+        if (colon != std::wstring_view::npos)
+        {
+            port = authority.substr(colon + 1);
+        }
+    }
+    if (result.hostName.empty())
+    {
+        return false;
+    }
+    if (port.empty())
+    {
+        result.port = result.secure ? 443 : 80;
+    }
+    else
+    {
+        uint32_t value = 0;
+        for (auto c : port)
+        {
+            if (c < L'0' || c > L'9' || (value = value * 10 + (c - L'0')) > 65535)
+            {
+                return false;
+            }
+        }
+        result.port = (uint16_t)value;
+    }
+    auto fragment = url.find(L'#');
+    result.path = url.substr(0, fragment);
+    if (result.path.empty() || result.path.front() != L'/')
+    {
+        result.path.insert(0, L"/");
+    }
+    return true;
+}
+
+// ページからのリクエストヘッダのうち上流に転送するもの
+inline bool IsForwardedRequestHeader(std::wstring_view name)
+{
+    return ProxyEqualsIgnoreCase(name, L"if-modified-since") || ProxyEqualsIgnoreCase(name, L"cache-control") || ProxyEqualsIgnoreCase(name, L"content-type");
+}
+
+// 転送時に復号できるContent-Encoding WinHTTPが展開できるもののみでbrは含まない
+inline bool IsDecodedContentEncoding(std::wstring_view encoding)
+{
+    return ProxyEqualsIgnoreCase(encoding, L"gzip") || ProxyEqualsIgnoreCase(encoding, L"x-gzip") || ProxyEqualsIgnoreCase(encoding, L"deflate");
+}
+
+// 上流に送るヘッダ行 CRLFが含まれている不正なヘッダはnullopt
+// CRLFの直後に空白かタブがあればヘッダの区切りではなくトークンの区切りとして扱われるためこの処理は正しくない
+// ただし含めたリクエストを送る処理はないしfetchに含めることもできないし問題ない
+inline std::optional<std::wstring> FormatRequestHeader(std::wstring_view name, std::wstring_view value)
+{
+    auto header = std::wstring(name) + L": " + std::wstring(value);
+    if (header.find(L'\r') != std::wstring::npos || header.find(L'\n') != std::wstring::npos)
+    {
+        return std::nullopt;
+    }
+    return header;
+}
+
+enum class ProxyHeaderAction
+{
+    // 同じ名前のヘッダを全て取り除く
+    Drop,
+    // 最初の1つの値を置き換えて残りは取り除く なければ追加する
+    Replace,
+    // 既にあっても追加する
+    Add,
+};
+
+struct ProxyHeaderRule
+{
+    ProxyHeaderAction action;
+    std::wstring name;
+    std::wstring value;
+};
+
+// 上から順に評価し、ヘッダ1つにはDropかReplaceのうち最初に一致したものだけを適用する
+using ProxyHeaderRules = std::vector<ProxyHeaderRule>;
+
+// 復号した応答から取り除くヘッダ ページには展開後の内容を渡すので圧縮されたときの長さと符号化は残せない
+inline const ProxyHeaderRules& ProxyDecodedResponseHeaderRules()
+{
+    static const ProxyHeaderRules rules
+    {
+        { ProxyHeaderAction::Drop, L"Content-Encoding", L"" },
+        { ProxyHeaderAction::Drop, L"Content-Length", L"" },
+    };
+    return rules;
+}
+
+inline std::wstring_view ProxyTrimHeader(std::wstring_view s)
+{
+    while (!s.empty() && (s.front() == L' ' || s.front() == L'\t'))
+    {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == L' ' || s.back() == L'\t' || s.back() == L'\r'))
+    {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+// iniに書く形式 "-Name|=Name: value|+Name: value" (-がDrop、=がReplace、+がAdd)
+// 読めない項目があればfalseを返すが読めたものはrulesに追加される
+inline bool ParseProxyHeaderRules(std::wstring_view spec, ProxyHeaderRules& rules)
+{
+    bool ok = true;
+    while (!spec.empty())
+    {
+        auto end = spec.find(L'|');
+        auto item = ProxyTrimHeader(spec.substr(0, end));
+        spec.remove_prefix(end == std::wstring_view::npos ? spec.size() : end + 1);
+        if (item.empty())
+        {
+            continue;
+        }
+        ProxyHeaderRule rule;
+        switch (item.front())
+        {
+        case L'-':
+            rule.action = ProxyHeaderAction::Drop;
+            break;
+        case L'=':
+            rule.action = ProxyHeaderAction::Replace;
+            break;
+        case L'+':
+            rule.action = ProxyHeaderAction::Add;
+            break;
+        default:
+            ok = false;
+            continue;
+        }
+        item.remove_prefix(1);
+        auto colon = item.find(L':');
+        rule.name = ProxyTrimHeader(item.substr(0, colon));
+        if (colon != std::wstring_view::npos)
+        {
+            rule.value = ProxyTrimHeader(item.substr(colon + 1));
+        }
+        // 値にCRLFは含められないので名前が空かDrop以外で値がなければ不正
+        if (rule.name.empty() || (rule.action != ProxyHeaderAction::Drop && colon == std::wstring_view::npos))
+        {
+            ok = false;
+            continue;
+        }
+        rules.push_back(std::move(rule));
+    }
+    return ok;
+}
+
+// nameに一致するDropかReplaceのルール
+inline const ProxyHeaderRule* FindProxyHeaderRule(const ProxyHeaderRules& rules, std::wstring_view name, size_t& index)
+{
+    for (index = 0; index < rules.size(); index++)
+    {
+        if (rules[index].action != ProxyHeaderAction::Add && ProxyEqualsIgnoreCase(rules[index].name, name))
+        {
+            return &rules[index];
+        }
+    }
+    return nullptr;
+}
+
+// 上流からの応答ヘッダ(WINHTTP_QUERY_RAW_HEADERS_CRLFの形式)をルールに従って1回の走査で書き換える
+// ステータス行はそのまま残し、ヘッダの終端のCRだけの行は取り除く 結果は行ごとに\nで終わる
+inline std::wstring RewriteResponseHeaders(std::wstring_view headers, const ProxyHeaderRules& rules)
+{
+    std::wstring result;
+    size_t extra = 0;
+    for (auto&& rule : rules)
+    {
+        extra += rule.name.size() + rule.value.size() + 4;
+    }
+    result.reserve(headers.size() + extra);
+    // Replaceを適用したかどうか ルールは多くないのでビットで持つ
+    std::vector<bool> replaced(rules.size());
+    bool statusLine = true;
+    while (!headers.empty())
+    {
+        auto end = headers.find(L'\n');
+        auto line = headers.substr(0, end);
+        headers.remove_prefix(end == std::wstring_view::npos ? headers.size() : end + 1);
+        if (line.empty() || line == L"\r")
+        {
+            continue;
+        }
+        auto colon = line.find(L':');
+        if (!std::exchange(statusLine, false) && colon != std::wstring_view::npos)
+        {
+            size_t index;
+            auto rule = FindProxyHeaderRule(rules, ProxyTrimHeader(line.substr(0, colon)), index);
+            if (rule && (rule->action == ProxyHeaderAction::Drop || replaced[index]))
+            {
+                continue;
+            }
+            if (rule)
+            {
+                replaced[index] = true;
+                result.append(rule->name).append(L": ").append(rule->value).append(L"\r\n");
+                continue;
+            }
+        }
+        result.append(line);
+        result.append(L"\n");
+    }
+    for (size_t i = 0; i < rules.size(); i++)
+    {
+        // 同じ名前の前のルールに隠れたReplaceは使わない
+        size_t first;
+        if (rules[i].action == ProxyHeaderAction::Add || (rules[i].action == ProxyHeaderAction::Replace && !replaced[i] && FindProxyHeaderRule(rules, rules[i].name, first) == &rules[i]))
+        {
+            result.append(rules[i].name).append(L": ").append(rules[i].value).append(L"\r\n");
+        }
+    }
+    return result;
+}
+
+// 上流に送るリクエストヘッダをルールに従って書き換える 追加したヘッダはrulesの文字列を指す
+inline void RewriteRequestHeaders(std::vector<std::pair<const wchar_t*, const wchar_t*>>& headers, const ProxyHeaderRules& rules)
+{
+    if (rules.empty())
+    {
+        return;
+    }
+    std::vector<bool> replaced(rules.size());
+    size_t kept = 0;
+    for (auto&& header : headers)
+    {
+        size_t index;
+        auto rule = FindProxyHeaderRule(rules, header.first, index);
+        if (rule && (rule->action == ProxyHeaderAction::Drop || replaced[index]))
+        {
+            continue;
+        }
+        if (rule)
+        {
+            replaced[index] = true;
+            headers[kept++] = { rule->name.c_str(), rule->value.c_str() };
+            continue;
+        }
+        headers[kept++] = header;
+    }
+    headers.resize(kept);
+    for (size_t i = 0; i < rules.size(); i++)
+    {
+        // 同じ名前の前のルールに隠れたReplaceは使わない
+        size_t first;
+        if (rules[i].action == ProxyHeaderAction::Add || (rules[i].action == ProxyHeaderAction::Replace && !replaced[i] && FindProxyHeaderRule(rules, rules[i].name, first) == &rules[i]))
+        {
+            headers.push_back({ rules[i].name.c_str(), rules[i].value.c_str() });
+        }
+    }
+}
+
+// 上流からの応答の先頭
+struct ProxyResponseHead
+{
+    uint32_t statusCode = 0;
+    std::wstring statusText;
+    // WINHTTP_QUERY_RAW_HEADERS_CRLFと同じくステータス行から始まりCRLFで区切られ空行で終わる
+    std::wstring headers;
+};
+
+// 先頭の空行までを解析する ヘッダはISO-8859-1として扱う
+inline bool ParseResponseHead(std::string_view head, ProxyResponseHead& result)
+{
+    result = {};
+    auto lineEnd = head.find("\r\n");
+    auto statusLine = head.substr(0, lineEnd);
+    // HTTP/1.1 200 OK
+    if (statusLine.substr(0, 5) != "HTTP/")
+    {
+        return false;
+    }
+    auto codeStart = statusLine.find(' ');
+    if (codeStart == std::string_view::npos || statusLine.size() < codeStart + 4)
+    {
+        return false;
+    }
+    for (size_t i = codeStart + 1; i < codeStart + 4; i++)
+    {
+        if (statusLine[i] < '0' || statusLine[i] > '9')
+        {
+            return false;
+        }
+        result.statusCode = result.statusCode * 10 + (statusLine[i] - '0');
+    }
+    if (statusLine.size() > codeStart + 5)
+    {
+        for (auto c : statusLine.substr(codeStart + 5))
+        {
+            result.statusText.push_back((wchar_t)(unsigned char)c);
+        }
+    }
+    while (!head.empty())
+    {
+        auto end = head.find("\r\n");
+        auto line = head.substr(0, end);
+        head.remove_prefix(end == std::string_view::npos ? head.size() : end + 2);
+        if (line.empty())
+        {
+            break;
+        }
+        for (auto c : line)
+        {
+            result.headers.push_back((wchar_t)(unsigned char)c);
+        }
+        result.headers.append(L"\r\n");
+    }
+    result.headers.append(L"\r\n");
+    return true;
+}
+
+// ソケットに書き込むためにUTF-8にする (wchar_tがUTF-16でもUTF-32でもよい)
+inline std::string ProxyWideToUTF8(std::wstring_view s)
+{
+    std::string result;
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        uint32_t c = (uint32_t)s[i];
+        if (sizeof(wchar_t) == 2 && c >= 0xd800 && c < 0xdc00 && i + 1 < s.size() && (uint32_t)s[i + 1] >= 0xdc00 && (uint32_t)s[i + 1] < 0xe000)
+        {
+            c = 0x10000 + ((c - 0xd800) << 10) + ((uint32_t)s[++i] - 0xdc00);
+        }
+        if (c < 0x80)
+        {
+            result.push_back((char)c);
+        }
+        else if (c < 0x800)
+        {
+            result.push_back((char)(0xc0 | (c >> 6)));
+            result.push_back((char)(0x80 | (c & 0x3f)));
+        }
+        else if (c < 0x10000)
+        {
+            result.push_back((char)(0xe0 | (c >> 12)));
+            result.push_back((char)(0x80 | ((c >> 6) & 0x3f)));
+            result.push_back((char)(0x80 | (c & 0x3f)));
+        }
+        else
+        {
+            result.push_back((char)(0xf0 | (c >> 18)));
+            result.push_back((char)(0x80 | ((c >> 12) & 0x3f)));
+            result.push_back((char)(0x80 | ((c >> 6) & 0x3f)));
+            result.push_back((char)(0x80 | (c & 0x3f)));
+        }
+    }
+    return result;
+}
+
+// ProxyWideToUTF8の逆 不正なバイト列はU+FFFDにする
+inline std::wstring ProxyUTF8ToWide(std::string_view s)
+{
+    std::wstring result;
+    for (size_t i = 0; i < s.size();)
+    {
+        auto b = (uint8_t)s[i];
+        size_t length = b < 0x80 ? 1 : (b & 0xe0) == 0xc0 ? 2 : (b & 0xf0) == 0xe0 ? 3 : (b & 0xf8) == 0xf0 ? 4 : 0;
+        uint32_t c = length == 1 ? b : length == 2 ? b & 0x1f : length == 3 ? b & 0x0f : b & 0x07;
+        bool valid = length && i + length <= s.size();
+        for (size_t j = 1; valid && j < length; j++)
+        {
+            auto continuation = (uint8_t)s[i + j];
+            valid = (continuation & 0xc0) == 0x80;
+            c = (c << 6) | (continuation & 0x3f);
+        }
+        if (!valid || c > 0x10ffff || (c >= 0xd800 && c < 0xe000))
+        {
+            result.push_back((wchar_t)0xfffd);
+            i++;
+            continue;
+        }
+        i += length;
+        if (sizeof(wchar_t) == 2 && c >= 0x10000)
+        {
+            result.push_back((wchar_t)(0xd800 + ((c - 0x10000) >> 10)));
+            result.push_back((wchar_t)(0xdc00 + ((c - 0x10000) & 0x3ff)));
+        }
+        else
+        {
+            result.push_back((wchar_t)c);
+        }
+    }
+    return result;
+}
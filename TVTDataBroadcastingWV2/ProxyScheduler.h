@@ -0,0 +1,214 @@
+﻿#pragma once
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// 通信コンテンツのリクエストをホストごとと全体の同時実行数の上限に従って順に開始する
+// LinuxでもPosixProxyTransportと一緒に使えるようにこのヘッダだけで完結させる
+
+// 小さいほど優先される 同じ優先度の中では届いた順
+enum class ProxyPriority
+{
+    // ページ、スクリプト、fetchやXHRによるデータのGET
+    Document,
+    // 画像や音声などのGET
+    Resource,
+    // 視聴者応答などのPOST 表示を妨げないよう最後にする
+    Post,
+    Count,
+};
+
+class ProxyScheduler;
+
+// 開始したリクエストが同時実行数の枠を1つ使っていることを表す
+// リクエストの実装が破棄されるまで保持し、最後の参照がなくなれば枠を返して次のリクエストを開始する
+class ProxySchedulerSlot
+{
+    friend class ProxyScheduler;
+    std::shared_ptr<ProxyScheduler> scheduler;
+    std::wstring host;
+    std::shared_ptr<const std::atomic<bool>> cancelled;
+public:
+    ProxySchedulerSlot(std::shared_ptr<ProxyScheduler> scheduler, std::wstring host, std::shared_ptr<const std::atomic<bool>> cancelled)
+        : scheduler(std::move(scheduler)), host(std::move(host)), cancelled(std::move(cancelled))
+    {
+    }
+    ProxySchedulerSlot(const ProxySchedulerSlot&) = delete;
+    ProxySchedulerSlot& operator=(const ProxySchedulerSlot&) = delete;
+    inline ~ProxySchedulerSlot();
+    // CancelAllが呼ばれた リクエストは次の区切りで中断すること
+    bool IsCancelled() const
+    {
+        return *this->cancelled;
+    }
+};
+
+class ProxyScheduler : public std::enable_shared_from_this<ProxyScheduler>
+{
+public:
+    // 枠を受け取ってリクエストを開始する 開始できなければ枠を捨てて戻ればよい
+    using StartFunction = std::function<void(std::shared_ptr<ProxySchedulerSlot> slot)>;
+    // 開始する前にCancelAllで取り消された
+    using CancelFunction = std::function<void()>;
+    struct Statistics
+    {
+        uint64_t started = 0;
+        // 上限に達していたため待たされた数
+        uint64_t delayed = 0;
+        // 開始前に取り消した数と実行中に中断を求めた数
+        uint64_t cancelledWaiting = 0;
+        uint64_t cancelledRunning = 0;
+        size_t running = 0;
+        size_t waiting = 0;
+    };
+private:
+    struct Job
+    {
+        std::wstring host;
+        StartFunction start;
+        CancelFunction cancel;
+    };
+    std::mutex mutex;
+    std::deque<Job> waiting[(size_t)ProxyPriority::Count];
+    std::unordered_map<std::wstring, size_t> runningPerHost;
+    size_t running = 0;
+    size_t maxPerHost;
+    size_t maxTotal;
+    // CancelAllのたびに新しくする
+    std::shared_ptr<std::atomic<bool>> cancelled = std::make_shared<std::atomic<bool>>(false);
+    Statistics statistics;
+
+    bool HasRoom(const std::wstring& host)
+    {
+        if (this->running >= this->maxTotal)
+        {
+            return false;
+        }
+        auto it = this->runningPerHost.find(host);
+        return it == this->runningPerHost.end() || it->second < this->maxPerHost;
+    }
+
+    std::shared_ptr<ProxySchedulerSlot> Acquire(const std::wstring& host)
+    {
+        this->running++;
+        this->runningPerHost[host]++;
+        this->statistics.started++;
+        return std::make_shared<ProxySchedulerSlot>(this->shared_from_this(), host, this->cancelled);
+    }
+
+    // 開始できるものを優先度順に取り出す
+    std::vector<std::pair<StartFunction, std::shared_ptr<ProxySchedulerSlot>>> TakeRunnable()
+    {
+        std::vector<std::pair<StartFunction, std::shared_ptr<ProxySchedulerSlot>>> runnable;
+        for (auto&& queue : this->waiting)
+        {
+            for (auto it = queue.begin(); it != queue.end() && this->running < this->maxTotal;)
+            {
+                if (!this->HasRoom(it->host))
+                {
+                    ++it;
+                    continue;
+                }
+                runnable.push_back({ std::move(it->start), this->Acquire(it->host) });
+                it = queue.erase(it);
+            }
+        }
+        return runnable;
+    }
+
+    void Release(const std::wstring& host)
+    {
+        std::vector<std::pair<StartFunction, std::shared_ptr<ProxySchedulerSlot>>> runnable;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->running--;
+            auto it = this->runningPerHost.find(host);
+            if (it != this->runningPerHost.end() && --it->second == 0)
+            {
+                this->runningPerHost.erase(it);
+            }
+            runnable = this->TakeRunnable();
+        }
+        for (auto&& [start, slot] : runnable)
+        {
+            start(std::move(slot));
+        }
+    }
+    friend class ProxySchedulerSlot;
+public:
+    // maxPerHost, maxTotalが0であれば制限しない
+    ProxyScheduler(size_t maxPerHost, size_t maxTotal) : maxPerHost(maxPerHost ? maxPerHost : SIZE_MAX), maxTotal(maxTotal ? maxTotal : SIZE_MAX)
+    {
+    }
+    ProxyScheduler(const ProxyScheduler&) = delete;
+    ProxyScheduler& operator=(const ProxyScheduler&) = delete;
+
+    // 枠が空いていればこの場でstartを呼び、なければ空いたときにリクエストを終えたスレッドから呼ぶ
+    void Enqueue(const std::wstring& host, ProxyPriority priority, StartFunction start, CancelFunction cancel)
+    {
+        std::shared_ptr<ProxySchedulerSlot> slot;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (!this->HasRoom(host))
+            {
+                this->statistics.delayed++;
+                this->waiting[(size_t)priority].push_back({ host, std::move(start), std::move(cancel) });
+                return;
+            }
+            slot = this->Acquire(host);
+        }
+        start(std::move(slot));
+    }
+
+    // 待っているリクエストを全て取り消し、実行中のリクエストには中断を求める
+    void CancelAll()
+    {
+        std::vector<CancelFunction> cancels;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->statistics.cancelledRunning += this->running;
+            this->cancelled->store(true);
+            this->cancelled = std::make_shared<std::atomic<bool>>(false);
+            for (auto&& queue : this->waiting)
+            {
+                for (auto&& job : queue)
+                {
+                    cancels.push_back(std::move(job.cancel));
+                }
+                queue.clear();
+            }
+            this->statistics.cancelledWaiting += cancels.size();
+        }
+        for (auto&& cancel : cancels)
+        {
+            if (cancel)
+            {
+                cancel();
+            }
+        }
+    }
+
+    Statistics GetStatistics()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto result = this->statistics;
+        result.running = this->running;
+        for (auto&& queue : this->waiting)
+        {
+            result.waiting += queue.size();
+        }
+        return result;
+    }
+};
+
+inline ProxySchedulerSlot::~ProxySchedulerSlot()
+{
+    this->scheduler->Release(this->host);
+}
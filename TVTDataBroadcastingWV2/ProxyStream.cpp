@@ -0,0 +1,242 @@
+﻿#include "pch.h"
+#include "ProxyStream.h"
+
+ProxyPipeStream::ProxyPipeStream(std::shared_ptr<ProxyPipe> pipe, size_t reader, ULONGLONG contentLength) : pipe(std::move(pipe)), reader(reader), contentLength(contentLength)
+{
+}
+
+ProxyPipeStream::~ProxyPipeStream()
+{
+    this->pipe->CloseReader(this->reader);
+}
+
+STDMETHODIMP ProxyPipeStream::Read(void* pv, ULONG cb, ULONG* pcbRead)
+{
+    if (!pv)
+    {
+        return STG_E_INVALIDPOINTER;
+    }
+    size_t read = 0;
+    // cbに満たなくても届いている分だけ返す
+    if (!this->pipe->Read(this->reader, (BYTE*)pv, cb, read))
+    {
+        if (pcbRead)
+        {
+            *pcbRead = 0;
+        }
+        return STG_E_READFAULT;
+    }
+    this->position += read;
+    if (pcbRead)
+    {
+        *pcbRead = (ULONG)read;
+    }
+    return read == 0 && cb != 0 ? S_FALSE : S_OK;
+}
+
+STDMETHODIMP ProxyPipeStream::Write(const void* pv, ULONG cb, ULONG* pcbWritten)
+{
+    return STG_E_ACCESSDENIED;
+}
+
+STDMETHODIMP ProxyPipeStream::Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition)
+{
+    if (dwOrigin != STREAM_SEEK_CUR || dlibMove.QuadPart != 0)
+    {
+        return STG_E_INVALIDFUNCTION;
+    }
+    if (plibNewPosition)
+    {
+        plibNewPosition->QuadPart = this->position;
+    }
+    return S_OK;
+}
+
+STDMETHODIMP ProxyPipeStream::SetSize(ULARGE_INTEGER libNewSize)
+{
+    return STG_E_INVALIDFUNCTION;
+}
+
+STDMETHODIMP ProxyPipeStream::CopyTo(IStream* pstm, ULARGE_INTEGER cb, ULARGE_INTEGER* pcbRead, ULARGE_INTEGER* pcbWritten)
+{
+    return E_NOTIMPL;
+}
+
+STDMETHODIMP ProxyPipeStream::Commit(DWORD grfCommitFlags)
+{
+    return S_OK;
+}
+
+STDMETHODIMP ProxyPipeStream::Revert()
+{
+    return STG_E_INVALIDFUNCTION;
+}
+
+STDMETHODIMP ProxyPipeStream::LockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType)
+{
+    return STG_E_INVALIDFUNCTION;
+}
+
+STDMETHODIMP ProxyPipeStream::UnlockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType)
+{
+    return STG_E_INVALIDFUNCTION;
+}
+
+STDMETHODIMP ProxyPipeStream::Stat(STATSTG* pstatstg, DWORD grfStatFlag)
+{
+    if (!pstatstg)
+    {
+        return STG_E_INVALIDPOINTER;
+    }
+    *pstatstg = {};
+    pstatstg->type = STGTY_STREAM;
+    pstatstg->cbSize.QuadPart = this->contentLength;
+    pstatstg->grfMode = STGM_READ;
+    return S_OK;
+}
+
+STDMETHODIMP ProxyPipeStream::Clone(IStream** ppstm)
+{
+    return E_NOTIMPL;
+}
+
+ProxyBufferStream::ProxyBufferStream(std::shared_ptr<const void> owner, const BYTE* data, size_t size) : owner(std::move(owner)), data(data), size(size)
+{
+}
+
+ProxyBufferStream::ProxyBufferStream(std::vector<BYTE>&& content)
+{
+    auto adopted = std::make_shared<const std::vector<BYTE>>(std::move(content));
+    this->data = adopted->data();
+    this->size = adopted->size();
+    this->owner = std::move(adopted);
+}
+
+STDMETHODIMP ProxyBufferStream::Read(void* pv, ULONG cb, ULONG* pcbRead)
+{
+    if (!pv)
+    {
+        return STG_E_INVALIDPOINTER;
+    }
+    auto read = (ULONG)std::min<ULONGLONG>(cb, this->position < this->size ? this->size - this->position : 0);
+    if (read)
+    {
+        memcpy(pv, this->data + this->position, read);
+        this->position += read;
+    }
+    if (pcbRead)
+    {
+        *pcbRead = read;
+    }
+    return read < cb ? S_FALSE : S_OK;
+}
+
+STDMETHODIMP ProxyBufferStream::Write(const void* pv, ULONG cb, ULONG* pcbWritten)
+{
+    return STG_E_ACCESSDENIED;
+}
+
+STDMETHODIMP ProxyBufferStream::Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition)
+{
+    LONGLONG origin;
+    switch (dwOrigin)
+    {
+    case STREAM_SEEK_SET:
+        origin = 0;
+        break;
+    case STREAM_SEEK_CUR:
+        origin = (LONGLONG)this->position;
+        break;
+    case STREAM_SEEK_END:
+        origin = (LONGLONG)this->size;
+        break;
+    default:
+        return STG_E_INVALIDFUNCTION;
+    }
+    if (origin + dlibMove.QuadPart < 0)
+    {
+        return STG_E_INVALIDFUNCTION;
+    }
+    // 末尾より後ろに移動した場合は読んでも0バイト
+    this->position = (ULONGLONG)(origin + dlibMove.QuadPart);
+    if (plibNewPosition)
+    {
+        plibNewPosition->QuadPart = this->position;
+    }
+    return S_OK;
+}
+
+STDMETHODIMP ProxyBufferStream::SetSize(ULARGE_INTEGER libNewSize)
+{
+    return STG_E_ACCESSDENIED;
+}
+
+STDMETHODIMP ProxyBufferStream::CopyTo(IStream* pstm, ULARGE_INTEGER cb, ULARGE_INTEGER* pcbRead, ULARGE_INTEGER* pcbWritten)
+{
+    if (!pstm)
+    {
+        return STG_E_INVALIDPOINTER;
+    }
+    auto size = (ULONG)std::min<ULONGLONG>({ cb.QuadPart, this->position < this->size ? this->size - this->position : 0, ULONG_MAX });
+    ULONG written = 0;
+    auto hr = pstm->Write(this->data + this->position, size, &written);
+    this->position += size;
+    if (pcbRead)
+    {
+        pcbRead->QuadPart = size;
+    }
+    if (pcbWritten)
+    {
+        pcbWritten->QuadPart = written;
+    }
+    return hr;
+}
+
+STDMETHODIMP ProxyBufferStream::Commit(DWORD grfCommitFlags)
+{
+    return S_OK;
+}
+
+STDMETHODIMP ProxyBufferStream::Revert()
+{
+    return STG_E_INVALIDFUNCTION;
+}
+
+STDMETHODIMP ProxyBufferStream::LockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType)
+{
+    return STG_E_INVALIDFUNCTION;
+}
+
+STDMETHODIMP ProxyBufferStream::UnlockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType)
+{
+    return STG_E_INVALIDFUNCTION;
+}
+
+STDMETHODIMP ProxyBufferStream::Stat(STATSTG* pstatstg, DWORD grfStatFlag)
+{
+    if (!pstatstg)
+    {
+        return STG_E_INVALIDPOINTER;
+    }
+    *pstatstg = {};
+    pstatstg->type = STGTY_STREAM;
+    pstatstg->cbSize.QuadPart = this->size;
+    pstatstg->grfMode = STGM_READ;
+    return S_OK;
+}
+
+STDMETHODIMP ProxyBufferStream::Clone(IStream** ppstm)
+{
+    if (!ppstm)
+    {
+        return STG_E_INVALIDPOINTER;
+    }
+    auto clone = Microsoft::WRL::Make<ProxyBufferStream>(this->owner, this->data, this->size);
+    if (!clone)
+    {
+        return E_OUTOFMEMORY;
+    }
+    clone->position = this->position;
+    *ppstm = clone.Detach();
+    return S_OK;
+}
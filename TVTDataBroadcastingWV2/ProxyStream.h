@@ -0,0 +1,58 @@
+﻿#pragma once
+#include <memory>
+#include <wrl/ftm.h>
+#include "ProxyPipe.h"
+
+// ProxyPipeを読み出すIStream
+// WebView2はレスポンスの内容をバックグラウンドのスレッドから読むのでReadでブロックしてよい
+class ProxyPipeStream : public Microsoft::WRL::RuntimeClass<Microsoft::WRL::RuntimeClassFlags<Microsoft::WRL::ClassicCom>, IStream, Microsoft::WRL::FtmBase>
+{
+    std::shared_ptr<ProxyPipe> pipe;
+    size_t reader;
+    // Content-Lengthがなければ0
+    ULONGLONG contentLength;
+    ULONGLONG position = 0;
+public:
+    ProxyPipeStream(std::shared_ptr<ProxyPipe> pipe, size_t reader, ULONGLONG contentLength);
+    ~ProxyPipeStream();
+    // ISequentialStream
+    STDMETHODIMP Read(void* pv, ULONG cb, ULONG* pcbRead) override;
+    STDMETHODIMP Write(const void* pv, ULONG cb, ULONG* pcbWritten) override;
+    // IStream 先頭から順に読む以外には対応しない (現在位置の取得のみ可能)
+    STDMETHODIMP Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition) override;
+    STDMETHODIMP SetSize(ULARGE_INTEGER libNewSize) override;
+    STDMETHODIMP CopyTo(IStream* pstm, ULARGE_INTEGER cb, ULARGE_INTEGER* pcbRead, ULARGE_INTEGER* pcbWritten) override;
+    STDMETHODIMP Commit(DWORD grfCommitFlags) override;
+    STDMETHODIMP Revert() override;
+    STDMETHODIMP LockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType) override;
+    STDMETHODIMP UnlockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType) override;
+    STDMETHODIMP Stat(STATSTG* pstatstg, DWORD grfStatFlag) override;
+    STDMETHODIMP Clone(IStream** ppstm) override;
+};
+
+// 受信済みの内容を読み出すIStream
+// 内容はownerが所有するのでコピーせずにWebView2に渡せる 同じ内容を複数のストリームで共有してよい
+class ProxyBufferStream : public Microsoft::WRL::RuntimeClass<Microsoft::WRL::RuntimeClassFlags<Microsoft::WRL::ClassicCom>, IStream, Microsoft::WRL::FtmBase>
+{
+    std::shared_ptr<const void> owner;
+    const BYTE* data;
+    size_t size;
+    ULONGLONG position = 0;
+public:
+    ProxyBufferStream(std::shared_ptr<const void> owner, const BYTE* data, size_t size);
+    // contentを引き取る
+    explicit ProxyBufferStream(std::vector<BYTE>&& content);
+    // ISequentialStream
+    STDMETHODIMP Read(void* pv, ULONG cb, ULONG* pcbRead) override;
+    STDMETHODIMP Write(const void* pv, ULONG cb, ULONG* pcbWritten) override;
+    // IStream 読み出し専用
+    STDMETHODIMP Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition) override;
+    STDMETHODIMP SetSize(ULARGE_INTEGER libNewSize) override;
+    STDMETHODIMP CopyTo(IStream* pstm, ULARGE_INTEGER cb, ULARGE_INTEGER* pcbRead, ULARGE_INTEGER* pcbWritten) override;
+    STDMETHODIMP Commit(DWORD grfCommitFlags) override;
+    STDMETHODIMP Revert() override;
+    STDMETHODIMP LockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType) override;
+    STDMETHODIMP UnlockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType) override;
+    STDMETHODIMP Stat(STATSTG* pstatstg, DWORD grfStatFlag) override;
+    STDMETHODIMP Clone(IStream** ppstm) override;
+};
@@ -0,0 +1,75 @@
+﻿#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "ProxyPipe.h"
+#include "ProxyPolicy.h"
+#include "ProxyScheduler.h"
+
+// 上流へのHTTPリクエストを行う実装
+// WindowsではWinHTTPを使うProxySession、それ以外ではPOSIXのソケットを使うPosixProxyTransport
+class ProxyTransport
+{
+public:
+    using ErrorCallback = std::function<void()>;
+    // contentは呼び出し側がmoveして引き取ってよい
+    using ResponseCallback = std::function<void(uint32_t statusCode, const wchar_t* statusCodeText, const wchar_t* headers, std::vector<uint8_t>& content)>;
+    // falseを返した場合内容は受信せずに終了する contentLengthが分からなければ0
+    using StreamCallback = std::function<bool(uint32_t statusCode, const wchar_t* statusCodeText, const wchar_t* headers, uint64_t contentLength, std::shared_ptr<ProxyPipe> pipe)>;
+    virtual ~ProxyTransport() = default;
+    // 非同期HTTPリクエストを行う 完了すると別スレッドでcallbackが、失敗すればerrorCallbackが呼ばれる
+    // headersはFormatRequestHeaderを通して送られる falseを返した場合どちらも呼ばれない
+    // slotは終わるまで保持され、取り消されていれば途中でerrorCallbackを呼んで中断する (nullptrでもよい)
+    virtual bool RequestAsync
+    (
+        const wchar_t* url,
+        const wchar_t* verb,
+        std::vector<uint8_t> payload,
+        const std::vector<std::pair<const wchar_t*, const wchar_t*>>& headers,
+        std::shared_ptr<ProxySchedulerSlot> slot,
+        ErrorCallback errorCallback,
+        ResponseCallback callback
+    ) = 0;
+    // ヘッダを受け取った時点でstreamCallbackが呼ばれ、内容は届いた分からpipeで読み出せる
+    // pipeにpipeCapacity以上溜まれば読み出されるまで受信を止める
+    // callbackがあれば内容がmaxBufferedSize以下だった場合に限り全て受信した後に呼ばれる
+    // 既定の実装はRequestAsyncで全て受信してからまとめてpipeに書き込む
+    virtual bool RequestStreamingAsync
+    (
+        const wchar_t* url,
+        const wchar_t* verb,
+        std::vector<uint8_t> payload,
+        const std::vector<std::pair<const wchar_t*, const wchar_t*>>& headers,
+        size_t pipeCapacity,
+        size_t maxBufferedSize,
+        std::shared_ptr<ProxySchedulerSlot> slot,
+        ErrorCallback errorCallback,
+        StreamCallback streamCallback,
+        ResponseCallback callback
+    )
+    {
+        return this->RequestAsync(url, verb, std::move(payload), headers, std::move(slot), std::move(errorCallback),
+            [pipeCapacity, maxBufferedSize, streamCallback = std::move(streamCallback), callback = std::move(callback)](uint32_t statusCode, const wchar_t* statusCodeText, const wchar_t* headers, std::vector<uint8_t>& content) -> void
+        {
+            auto pipe = std::make_shared<ProxyPipe>(pipeCapacity);
+            if (!streamCallback(statusCode, statusCodeText, headers, content.size(), pipe))
+            {
+                return;
+            }
+            // 読み出し側は既に揃っているので一杯になっても止めずに全て書き込む
+            pipe->Write(content.data(), content.size(), nullptr);
+            pipe->Close();
+            if (callback && content.size() <= maxBufferedSize)
+            {
+                callback(statusCode, statusCodeText, headers, content);
+            }
+        });
+    }
+    // 実行中のリクエストを受信の途中でも中断する 中断したリクエストはerrorCallbackかpipeの失敗で終わる
+    // 既定の実装は何もせず、取り消されたslotを次に確かめた時点で中断する
+    virtual void CancelAll()
+    {
+    }
+};
@@ -0,0 +1,339 @@
+﻿#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#endif
+
+// 共有メモリ上のリングバッファ
+// プロセス間で使えるようにWindowsに依存しない部分はこのヘッダだけで完結させる (LinuxではPOSIX共有メモリを使う)
+// 先頭にSharedMemoryRingHeader、続いてcapacityバイトのデータ領域が並ぶ
+// データ領域にはフレーム([SharedMemoryRingFrameHeader][データ]を8バイト境界に揃えたもの)が連続して書き込まれる
+// 書き込み側はwriteCursorを、読み込み側はreadCursorを進める。どちらも単調増加でcapacityで割った余りが位置になる
+
+constexpr uint32_t sharedMemoryRingMagic = 0x52574254; // "TBWR"
+constexpr uint32_t sharedMemoryRingVersion = 1;
+
+struct SharedMemoryRingHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    // 書き込み側が書き終えた位置
+    std::atomic<uint64_t> writeCursor;
+    // 読み込み側が読み終えた位置
+    std::atomic<uint64_t> readCursor;
+    // 空きがなく書き込めなかったフレーム数
+    std::atomic<uint64_t> droppedFrames;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory requires lock-free 64-bit atomics");
+
+enum SharedMemoryRingFrameType : uint32_t
+{
+    // TSパケットの列
+    SHARED_MEMORY_RING_FRAME_PACKETS = 0,
+    // PCRの不連続などで組み立て途中のデータを破棄する
+    SHARED_MEMORY_RING_FRAME_RESET = 1,
+    // データ領域の末尾の余り 読み飛ばして先頭から読む
+    SHARED_MEMORY_RING_FRAME_PADDING = 2,
+};
+
+struct SharedMemoryRingFrameHeader
+{
+    uint32_t size;
+    uint32_t type;
+};
+
+constexpr uint64_t SharedMemoryRingAlign(uint64_t size)
+{
+    return (size + 7) & ~(uint64_t)7;
+}
+
+// 共有メモリの確保と割り当て
+class SharedMemoryRing
+{
+#ifdef _WIN32
+    HANDLE hMapping = nullptr;
+#else
+    int fd = -1;
+    std::string unlinkName;
+#endif
+    void* view = nullptr;
+    size_t viewSize = 0;
+
+    bool Map(size_t size)
+    {
+#ifdef _WIN32
+        this->view = MapViewOfFile(this->hMapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, size);
+#else
+        auto view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+        this->view = view == MAP_FAILED ? nullptr : view;
+#endif
+        this->viewSize = this->view ? size : 0;
+        return this->view != nullptr;
+    }
+public:
+#ifdef _WIN32
+    using Name = const wchar_t*;
+#else
+    // "/name"の形式
+    using Name = const char*;
+#endif
+
+    SharedMemoryRing() = default;
+    SharedMemoryRing(const SharedMemoryRing&) = delete;
+    SharedMemoryRing& operator=(const SharedMemoryRing&) = delete;
+
+    ~SharedMemoryRing()
+    {
+        this->Close();
+    }
+
+    // 書き込み側として作成する capacityは8の倍数に切り上げられる
+    bool Create(Name name, size_t capacity)
+    {
+        this->Close();
+        capacity = (size_t)SharedMemoryRingAlign(capacity);
+        auto size = sizeof(SharedMemoryRingHeader) + capacity;
+#ifdef _WIN32
+        this->hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, name);
+        if (!this->hMapping)
+        {
+            return false;
+        }
+#else
+        this->fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (this->fd < 0)
+        {
+            return false;
+        }
+        this->unlinkName = name;
+        if (ftruncate(this->fd, (off_t)size) != 0)
+        {
+            this->Close();
+            return false;
+        }
+#endif
+        if (!this->Map(size))
+        {
+            this->Close();
+            return false;
+        }
+        auto header = this->Header();
+        header->magic = 0;
+        header->version = sharedMemoryRingVersion;
+        header->capacity = capacity;
+        header->writeCursor.store(0, std::memory_order_relaxed);
+        header->readCursor.store(0, std::memory_order_relaxed);
+        header->droppedFrames.store(0, std::memory_order_relaxed);
+        // magicが書かれるまで読み込み側は初期化中とみなす
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = sharedMemoryRingMagic;
+        return true;
+    }
+
+    // 読み込み側として既存のものを開く
+    bool Open(Name name)
+    {
+        this->Close();
+#ifdef _WIN32
+        this->hMapping = OpenFileMappingW(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, name);
+        if (!this->hMapping)
+        {
+            return false;
+        }
+        // 大きさはヘッダを読むまでわからないのでいったん全体を割り当てる
+        if (!this->Map(0))
+        {
+            this->Close();
+            return false;
+        }
+        MEMORY_BASIC_INFORMATION info;
+        if (!VirtualQuery(this->view, &info, sizeof(info)) || info.RegionSize < sizeof(SharedMemoryRingHeader))
+        {
+            this->Close();
+            return false;
+        }
+        this->viewSize = info.RegionSize;
+#else
+        this->fd = shm_open(name, O_RDWR, 0);
+        if (this->fd < 0)
+        {
+            return false;
+        }
+        struct stat st;
+        if (fstat(this->fd, &st) != 0 || (size_t)st.st_size < sizeof(SharedMemoryRingHeader) || !this->Map((size_t)st.st_size))
+        {
+            this->Close();
+            return false;
+        }
+#endif
+        auto header = this->Header();
+        if (header->magic != sharedMemoryRingMagic || header->version != sharedMemoryRingVersion || sizeof(SharedMemoryRingHeader) + header->capacity > this->viewSize)
+        {
+            this->Close();
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+
+    void Close()
+    {
+#ifdef _WIN32
+        if (this->view)
+        {
+            UnmapViewOfFile(this->view);
+        }
+        if (this->hMapping)
+        {
+            CloseHandle(this->hMapping);
+            this->hMapping = nullptr;
+        }
+#else
+        if (this->view)
+        {
+            munmap(this->view, this->viewSize);
+        }
+        if (this->fd >= 0)
+        {
+            close(this->fd);
+            this->fd = -1;
+        }
+        // 作成した側が閉じたら名前を消す (割り当て済みの読み込み側はそのまま読める)
+        if (!this->unlinkName.empty())
+        {
+            shm_unlink(this->unlinkName.c_str());
+            this->unlinkName.clear();
+        }
+#endif
+        this->view = nullptr;
+        this->viewSize = 0;
+    }
+
+    bool IsOpen() const
+    {
+        return this->view != nullptr;
+    }
+
+    SharedMemoryRingHeader* Header() const
+    {
+        return static_cast<SharedMemoryRingHeader*>(this->view);
+    }
+
+    uint8_t* Data() const
+    {
+        return static_cast<uint8_t*>(this->view) + sizeof(SharedMemoryRingHeader);
+    }
+};
+
+// 書き込み側 1つのスレッドからのみ使う
+class SharedMemoryRingWriter
+{
+    SharedMemoryRing& ring;
+public:
+    explicit SharedMemoryRingWriter(SharedMemoryRing& ring) : ring(ring)
+    {
+    }
+
+    // 空きが足りなければ書き込まずにfalseを返す (読み込み側が追い付くまで待たない)
+    bool Write(SharedMemoryRingFrameType type, const void* data, size_t size)
+    {
+        auto header = this->ring.Header();
+        auto capacity = header->capacity;
+        auto frameSize = SharedMemoryRingAlign(sizeof(SharedMemoryRingFrameHeader) + size);
+        if (frameSize > capacity || size > UINT32_MAX)
+        {
+            header->droppedFrames.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        auto write = header->writeCursor.load(std::memory_order_relaxed);
+        auto read = header->readCursor.load(std::memory_order_acquire);
+        auto offset = write % capacity;
+        // 末尾に収まらなければ余りを埋めて先頭から書く
+        auto padding = capacity - offset < frameSize ? capacity - offset : 0;
+        if (write + padding + frameSize - read > capacity)
+        {
+            header->droppedFrames.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        auto buffer = this->ring.Data();
+        if (padding)
+        {
+            // 全て8バイト境界なので余りにも必ずフレームヘッダが収まる
+            SharedMemoryRingFrameHeader paddingHeader = { (uint32_t)(padding - sizeof(SharedMemoryRingFrameHeader)), SHARED_MEMORY_RING_FRAME_PADDING };
+            memcpy(buffer + offset, &paddingHeader, sizeof(paddingHeader));
+            offset = 0;
+        }
+        SharedMemoryRingFrameHeader frameHeader = { (uint32_t)size, (uint32_t)type };
+        memcpy(buffer + offset, &frameHeader, sizeof(frameHeader));
+        if (size)
+        {
+            memcpy(buffer + offset + sizeof(frameHeader), data, size);
+        }
+        header->writeCursor.store(write + padding + frameSize, std::memory_order_release);
+        return true;
+    }
+};
+
+// 読み込み側の参照実装 1つのスレッドからのみ使う
+// Peekで得たデータはAdvanceを呼ぶまで書き換えられない
+class SharedMemoryRingReader
+{
+    SharedMemoryRing& ring;
+    uint64_t pendingAdvance = 0;
+public:
+    explicit SharedMemoryRingReader(SharedMemoryRing& ring) : ring(ring)
+    {
+    }
+
+    // 次のフレームがあればtrue
+    bool Peek(SharedMemoryRingFrameType& type, const uint8_t*& data, size_t& size)
+    {
+        auto header = this->ring.Header();
+        auto capacity = header->capacity;
+        auto read = header->readCursor.load(std::memory_order_relaxed);
+        while (true)
+        {
+            auto write = header->writeCursor.load(std::memory_order_acquire);
+            if (read == write)
+            {
+                return false;
+            }
+            auto offset = read % capacity;
+            SharedMemoryRingFrameHeader frameHeader;
+            memcpy(&frameHeader, this->ring.Data() + offset, sizeof(frameHeader));
+            auto frameSize = SharedMemoryRingAlign(sizeof(frameHeader) + frameHeader.size);
+            if (frameHeader.type == SHARED_MEMORY_RING_FRAME_PADDING)
+            {
+                read += frameSize;
+                header->readCursor.store(read, std::memory_order_release);
+                continue;
+            }
+            type = (SharedMemoryRingFrameType)frameHeader.type;
+            data = this->ring.Data() + offset + sizeof(frameHeader);
+            size = frameHeader.size;
+            this->pendingAdvance = frameSize;
+            return true;
+        }
+    }
+
+    // Peekしたフレームを読み終えて領域を書き込み側に返す
+    void Advance()
+    {
+        auto header = this->ring.Header();
+        header->readCursor.fetch_add(std::exchange(this->pendingAdvance, 0), std::memory_order_release);
+    }
+};
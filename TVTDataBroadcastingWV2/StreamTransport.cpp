@@ -0,0 +1,152 @@
+﻿#include "pch.h"
+#include "StreamTransport.h"
+#include "base64.h"
+
+JsonStreamTransport::JsonStreamTransport(wil::com_ptr<ICoreWebView2>& webView) : webView(webView)
+{
+}
+
+void JsonStreamTransport::SetBinaryFraming(bool binaryFraming)
+{
+    this->binaryFraming = binaryFraming;
+}
+
+// framesが指定されていればフレームの後にそのまま続ける
+bool JsonStreamTransport::PostBinaryFrame(BinaryFrameType type, const BYTE* payload, size_t payloadSize, const BYTE* frames, size_t framesSize)
+{
+    WCHAR head[] = LR"({"type":"streamBinary","data":")";
+    WCHAR tail[] = LR"("})";
+    size_t size = _countof(head) - 1 + PackedUtf16Length(binaryFrameHeaderSize + payloadSize + framesSize) + _countof(tail) + 1;
+    if (this->jsonBuffer.size() < size)
+    {
+        this->jsonBuffer.resize(size);
+    }
+    auto buf = this->jsonBuffer.data();
+    wcscpy_s(buf, size, head);
+    // Base64と違い一旦フレームを組み立てずにヘッダとペイロードを続けて詰める
+    static_assert(sizeof(WCHAR) == sizeof(uint16_t));
+    BYTE header[binaryFrameHeaderSize];
+    WriteBinaryFrameHeader(header, type, 0, (uint32_t)payloadSize);
+    Utf16Packer packer(reinterpret_cast<uint16_t*>(buf + wcslen(head)));
+    packer.Write(header, sizeof(header));
+    packer.Write(payload, payloadSize);
+    if (framesSize)
+    {
+        packer.Write(frames, framesSize);
+    }
+    auto pos = reinterpret_cast<WCHAR*>(packer.Finish()) - buf;
+    wcscpy_s(buf + pos, size - pos, tail);
+    return SUCCEEDED(this->webView->PostWebMessageAsJson(buf));
+}
+
+bool JsonStreamTransport::PostPackets(const BYTE* packets, size_t packetBlockSize, size_t blockCount, const BYTE* frames, size_t framesSize)
+{
+    if (!this->webView)
+    {
+        return false;
+    }
+    if (this->binaryFraming)
+    {
+        return this->PostBinaryFrame(BINARY_FRAME_PACKETS, packets, packetBlockSize, frames, framesSize);
+    }
+    WCHAR head[] = LR"({"type":"streamBase64","data":")";
+    WCHAR tail[] = LR"("})";
+    size_t size = _countof(head) - 1 + Base64EncodedLength(packetBlockSize) + _countof(tail) + 1;
+    if (this->jsonBuffer.size() < size)
+    {
+        this->jsonBuffer.resize(size);
+    }
+    auto buf = this->jsonBuffer.data();
+    wcscpy_s(buf, size, head);
+    size_t pos = 0;
+    pos += wcslen(head);
+    pos += EncodeBase64(packets, packetBlockSize, buf + pos);
+    wcscpy_s(buf + pos, size - pos, tail);
+    return SUCCEEDED(this->webView->PostWebMessageAsJson(buf));
+}
+
+void JsonStreamTransport::PostReset()
+{
+    if (!this->webView)
+    {
+        return;
+    }
+    if (this->binaryFraming)
+    {
+        static const char reset[] = R"({"type":"streamReset"})";
+        this->PostBinaryFrame(BINARY_FRAME_CONTROL, (const BYTE*)reset, sizeof(reset) - 1);
+        return;
+    }
+    this->webView->PostWebMessageAsJson(LR"({"type":"streamReset"})");
+}
+
+bool SharedMemoryStreamTransport::Create(LPCWSTR name, size_t capacity)
+{
+    this->writer.reset();
+    if (!this->ring.Create(name, capacity))
+    {
+        return false;
+    }
+    this->writer.emplace(this->ring);
+    return true;
+}
+
+uint64_t SharedMemoryStreamTransport::GetDroppedFrames() const
+{
+    if (!this->ring.IsOpen())
+    {
+        return 0;
+    }
+    return this->ring.Header()->droppedFrames.load(std::memory_order_relaxed);
+}
+
+bool SharedMemoryStreamTransport::PostPackets(const BYTE* packets, size_t size, size_t blockCount, const BYTE* frames, size_t framesSize)
+{
+    if (!this->writer)
+    {
+        return false;
+    }
+    return this->writer->Write(SHARED_MEMORY_RING_FRAME_PACKETS, packets, size);
+}
+
+void SharedMemoryStreamTransport::PostReset()
+{
+    if (this->writer)
+    {
+        this->writer->Write(SHARED_MEMORY_RING_FRAME_RESET, nullptr, 0);
+    }
+}
+
+bool WebSocketStreamTransport::Start(unsigned short port, size_t maxClientQueueSize)
+{
+    return this->server.Start(port, maxClientQueueSize);
+}
+
+WebSocketServer::Statistics WebSocketStreamTransport::GetStatistics()
+{
+    return this->server.GetStatistics();
+}
+
+bool WebSocketStreamTransport::PostPackets(const BYTE* packets, size_t size, size_t blockCount, const BYTE* frames, size_t framesSize)
+{
+    this->server.BroadcastBinary(WebSocketChannel::Stream, packets, size);
+    if (framesSize && this->server.HasClients(WebSocketChannel::Decoded))
+    {
+        BinaryFrameReader reader(frames, framesSize);
+        BinaryFrameView frame;
+        while (reader.Next(frame))
+        {
+            if (FormatResponseMessage(frame, this->message))
+            {
+                this->server.BroadcastText(WebSocketChannel::Decoded, this->message.data(), this->message.size());
+            }
+        }
+    }
+    return true;
+}
+
+void WebSocketStreamTransport::PostReset()
+{
+    static const char reset[] = R"({"type":"streamReset"})";
+    this->server.BroadcastText(WebSocketChannel::Stream, reset, sizeof(reset) - 1);
+}
@@ -0,0 +1,63 @@
+﻿#pragma once
+#include <optional>
+#include "SharedMemoryRing.h"
+#include "BinaryFrame.h"
+#include "WebSocketServer.h"
+
+// 受信したTSをページなどの消費側に届ける経路
+// メインスレッドからのみ呼び出す
+class StreamTransport
+{
+public:
+    virtual ~StreamTransport() = default;
+    // TSパケットの列を送る blockCountはまとめたPacketBlockの数
+    // framesはTSDecoderで解析したBinaryFrame.hのフレームの列で、解析を有効にしたページにのみ渡される
+    virtual bool PostPackets(const BYTE* packets, size_t size, size_t blockCount, const BYTE* frames, size_t framesSize) = 0;
+    // PCRの不連続などで組み立て途中のセクションやPESを破棄させる
+    virtual void PostReset() = 0;
+};
+
+// PostWebMessageAsJsonでページに送る
+// ページが対応していればBinaryFrame.hの形式で{"type":"streamBinary"}メッセージとして、
+// そうでなければBase64で{"type":"streamBase64"}メッセージとして送る
+class JsonStreamTransport : public StreamTransport
+{
+    wil::com_ptr<ICoreWebView2>& webView;
+    std::vector<WCHAR> jsonBuffer;
+    bool binaryFraming = false;
+    bool PostBinaryFrame(BinaryFrameType type, const BYTE* payload, size_t size, const BYTE* frames = nullptr, size_t framesSize = 0);
+public:
+    JsonStreamTransport(wil::com_ptr<ICoreWebView2>& webView);
+    // ページの読み込み時に通知された対応形式から設定する
+    void SetBinaryFraming(bool binaryFraming);
+    bool PostPackets(const BYTE* packets, size_t size, size_t blockCount, const BYTE* frames, size_t framesSize) override;
+    void PostReset() override;
+};
+
+// 共有メモリのリングバッファにフレームとして書き込む
+// 消費側が追い付いていなければ捨てられる
+class SharedMemoryStreamTransport : public StreamTransport
+{
+    SharedMemoryRing ring;
+    std::optional<SharedMemoryRingWriter> writer;
+public:
+    bool Create(LPCWSTR name, size_t capacity);
+    uint64_t GetDroppedFrames() const;
+    bool PostPackets(const BYTE* packets, size_t size, size_t blockCount, const BYTE* frames, size_t framesSize) override;
+    void PostReset() override;
+};
+
+// ループバックのWebSocketサーバに接続している全てのクライアントに送る
+// "/"のクライアントにはTSはバイナリフレーム、streamResetはページと同じJSONのテキストフレームで送る
+// "/decoded"のクライアントにはTSDecoderで解析したフレームをResponseMessageのJSONのテキストフレームにして送る
+// 解析はTSスレッドで、JSONへの変換もクライアントの数によらず1回だけ行う
+class WebSocketStreamTransport : public StreamTransport
+{
+    WebSocketServer server;
+    std::string message;
+public:
+    bool Start(unsigned short port, size_t maxClientQueueSize);
+    WebSocketServer::Statistics GetStatistics();
+    bool PostPackets(const BYTE* packets, size_t size, size_t blockCount, const BYTE* frames, size_t framesSize) override;
+    void PostReset() override;
+};
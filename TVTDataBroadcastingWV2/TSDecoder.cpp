@@ -0,0 +1,212 @@
+﻿#include "pch.h"
+#include "TSDecoder.h"
+
+namespace
+{
+    constexpr size_t packetSize = 188;
+
+    // オプションのPESヘッダを持たないstream_id
+    bool HasPESHeader(uint8_t streamId)
+    {
+        switch (streamId)
+        {
+        case 0xbc: // program_stream_map
+        case 0xbe: // padding_stream
+        case 0xbf: // private_stream_2
+        case 0xf0: // ECM
+        case 0xf1: // EMM
+        case 0xf2: // DSMCC_stream
+        case 0xf8: // ITU-T Rec. H.222.1 type E
+        case 0xff: // program_stream_directory
+            return false;
+        default:
+            return true;
+        }
+    }
+
+    int BCDToInt(uint8_t bcd)
+    {
+        return (bcd >> 4) * 10 + (bcd & 15);
+    }
+}
+
+void TSDecoder::SetPESPIDs(const std::unordered_set<uint16_t>& pids)
+{
+    this->pesAssemblies.clear();
+    for (auto pid : pids)
+    {
+        this->pesAssemblies.emplace(pid, PESAssembly());
+    }
+}
+
+void TSDecoder::Reset()
+{
+    for (auto&& [pid, assembly] : this->pesAssemblies)
+    {
+        assembly.buffer.clear();
+        assembly.continuityCounter = -1;
+        assembly.assembling = false;
+    }
+}
+
+void TSDecoder::DecodePacket(const uint8_t* packet, std::vector<uint8_t>& frames)
+{
+    bool transportErrorIndicator = !!(packet[1] & 0x80);
+    if (transportErrorIndicator)
+    {
+        return;
+    }
+    bool payloadUnitStartIndicator = !!(packet[1] & 0x40);
+    uint16_t pid = ((packet[1] << 8) | packet[2]) & 0x1fff;
+    int adaptationFieldControl = (packet[3] >> 4) & 0x03;
+    int continuityCounter = packet[3] & 0x0f;
+    if (!(adaptationFieldControl & 1))
+    {
+        return;
+    }
+    size_t payloadOffset = 4;
+    if (adaptationFieldControl & 2)
+    {
+        payloadOffset += 1 + packet[4];
+        if (payloadOffset >= packetSize)
+        {
+            return;
+        }
+    }
+    auto payload = packet + payloadOffset;
+    auto payloadSize = packetSize - payloadOffset;
+    if (pid == timePID)
+    {
+        // TDT/TOTは1パケットに収まるので分割されたものは扱わない
+        if (payloadUnitStartIndicator && payload[0] + 1u < payloadSize)
+        {
+            this->DecodeTimeSection(payload + 1 + payload[0], payloadSize - 1 - payload[0], frames);
+        }
+        return;
+    }
+    auto it = this->pesAssemblies.find(pid);
+    if (it == this->pesAssemblies.end())
+    {
+        return;
+    }
+    auto&& assembly = it->second;
+    if (payloadUnitStartIndicator)
+    {
+        // PES_packet_lengthが0の場合は次の開始まで終わりがわからない
+        if (assembly.assembling)
+        {
+            this->FlushPES(assembly, frames);
+        }
+        assembly.buffer.assign(payload, payload + payloadSize);
+        assembly.assembling = true;
+    }
+    else if (assembly.assembling)
+    {
+        if (assembly.continuityCounter < 0 || ((assembly.continuityCounter + 1) & 0x0f) != continuityCounter)
+        {
+            // 取りこぼしたので次の開始まで待つ
+            assembly.assembling = false;
+            assembly.buffer.clear();
+            assembly.continuityCounter = continuityCounter;
+            return;
+        }
+        assembly.buffer.insert(assembly.buffer.end(), payload, payload + payloadSize);
+    }
+    assembly.continuityCounter = continuityCounter;
+    if (assembly.assembling && assembly.buffer.size() >= 6)
+    {
+        size_t pesPacketLength = (assembly.buffer[4] << 8) | assembly.buffer[5];
+        if (pesPacketLength && assembly.buffer.size() >= 6 + pesPacketLength)
+        {
+            assembly.buffer.resize(6 + pesPacketLength);
+            this->FlushPES(assembly, frames);
+        }
+    }
+}
+
+void TSDecoder::FlushPES(PESAssembly& assembly, std::vector<uint8_t>& frames)
+{
+    auto&& buffer = assembly.buffer;
+    assembly.assembling = false;
+    if (buffer.size() < 6 || buffer[0] != 0 || buffer[1] != 0 || buffer[2] != 1)
+    {
+        buffer.clear();
+        return;
+    }
+    auto streamId = buffer[3];
+    size_t dataOffset = 6;
+    uint8_t flags = 0;
+    uint64_t pts = 0;
+    if (HasPESHeader(streamId))
+    {
+        if (buffer.size() < 9)
+        {
+            buffer.clear();
+            return;
+        }
+        auto ptsDtsFlags = buffer[7] >> 6;
+        auto headerDataLength = buffer[8];
+        dataOffset = 9 + headerDataLength;
+        if ((ptsDtsFlags & 2) && headerDataLength >= 5 && buffer.size() >= 14)
+        {
+            auto p = buffer.data() + 9;
+            pts = ((uint64_t)(p[0] & 0x0e) << 29) | ((uint64_t)p[1] << 22) | ((uint64_t)(p[2] & 0xfe) << 14) | ((uint64_t)p[3] << 7) | (p[4] >> 1);
+            flags |= binaryFramePESFlagPTS;
+        }
+        if (dataOffset > buffer.size())
+        {
+            buffer.clear();
+            return;
+        }
+    }
+    auto dataSize = buffer.size() - dataOffset;
+    auto frame = AppendBinaryFrame(frames, BINARY_FRAME_PES, binaryFramePESHeaderSize + dataSize);
+    frame[0] = streamId;
+    frame[1] = flags;
+    for (int i = 0; i < 8; i++)
+    {
+        frame[2 + i] = (uint8_t)(pts >> (i * 8));
+    }
+    memcpy(frame + binaryFramePESHeaderSize, buffer.data() + dataOffset, dataSize);
+    buffer.clear();
+}
+
+void TSDecoder::DecodeTimeSection(const uint8_t* section, size_t size, std::vector<uint8_t>& frames)
+{
+    // table_id(8) section_syntax_indicator(1) reserved(3) section_length(12) JST_time(40)
+    if (size < 8 || (section[0] != 0x70 && section[0] != 0x73))
+    {
+        return;
+    }
+    auto p = section + 3;
+    int mjd = (p[0] << 8) | p[1];
+    int hour = BCDToInt(p[2]);
+    int minute = BCDToInt(p[3]);
+    int second = BCDToInt(p[4]);
+    if (hour >= 24 || minute >= 60 || second >= 60)
+    {
+        return;
+    }
+    // MJD 40587が1970-01-01 JSTはUTC+9
+    int64_t timeUnixMillis = ((int64_t)(mjd - 40587) * 86400 + hour * 3600 + minute * 60 + second - 9 * 3600) * 1000;
+    char json[80];
+    auto length = snprintf(json, sizeof(json), R"({"type":"currentTime","timeUnixMillis":%lld})", (long long)timeUnixMillis);
+    if (length > 0)
+    {
+        AppendBinaryFrame(frames, BINARY_FRAME_RESPONSE, json, (size_t)length);
+    }
+}
+
+void TSDecoder::DecodePCR(const uint8_t* packet, std::vector<uint8_t>& frames)
+{
+    auto p = packet + 6;
+    uint64_t pcrBase = ((uint64_t)p[0] << 25) | ((uint64_t)p[1] << 17) | ((uint64_t)p[2] << 9) | ((uint64_t)p[3] << 1) | (p[4] >> 7);
+    uint16_t pcrExtension = (uint16_t)(((p[4] & 1) << 8) | p[5]);
+    auto frame = AppendBinaryFrame(frames, BINARY_FRAME_TIMESTAMP, 10);
+    for (int i = 0; i < 8; i++)
+    {
+        frame[i] = (uint8_t)(pcrBase >> (i * 8));
+    }
+    frame[8] = (uint8_t)pcrExtension;
+    frame[9] = (uint8_t)(pcrExtension >> 8);
+}
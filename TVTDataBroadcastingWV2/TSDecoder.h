@@ -0,0 +1,36 @@
+﻿#pragma once
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "BinaryFrame.h"
+
+// ページのdecodeTSの代わりにパケットごとの処理が重いものを解析してBinaryFrame.hのフレームにする
+// 字幕などのPESの組み立て、PCR、TDT/TOTの現在時刻を扱う
+// TSスレッドでのみ使う
+class TSDecoder
+{
+    struct PESAssembly
+    {
+        std::vector<uint8_t> buffer;
+        int continuityCounter = -1;
+        bool assembling = false;
+    };
+    std::unordered_map<uint16_t, PESAssembly> pesAssemblies;
+    void FlushPES(PESAssembly& assembly, std::vector<uint8_t>& frames);
+    void DecodeTimeSection(const uint8_t* section, size_t size, std::vector<uint8_t>& frames);
+public:
+    static constexpr uint16_t timePID = 0x0014;
+
+    // 組み立てるPESのPIDを設定する 途中のものは捨てる
+    void SetPESPIDs(const std::unordered_set<uint16_t>& pids);
+    bool IsPESPID(uint16_t pid) const
+    {
+        return this->pesAssemblies.count(pid) != 0;
+    }
+    // PESのPIDとTDT/TOTのパケットを解析してフレームをframesに加える
+    void DecodePacket(const uint8_t* packet, std::vector<uint8_t>& frames);
+    // アダプテーションフィールドのPCRからフレームを加える
+    void DecodePCR(const uint8_t* packet, std::vector<uint8_t>& frames);
+    // PCRの不連続などで組み立て途中のものを捨てる
+    void Reset();
+};
@@ -4,13 +4,22 @@
 #include "thirdparty/TVTestPlugin.h"
 #include "resource.h"
 #include <queue>
+#include <deque>
 #include <optional>
 #include <wil/stl.h>
 #include <wil/win32_helpers.h>
 #include "NVRAMSettingsDialog.h"
 #include "proxy.h"
+#include "ProxyCache.h"
+#include "ProxyArchive.h"
+#include "ProxyPipeline.h"
 #include "InputDialog.h"
 #include "OneSeg.h"
+#include "StreamTransport.h"
+#include "TSDecoder.h"
+#include "JsonWriter.h"
+#include "JsonReader.h"
+#include "Histogram.h"
 #include <shellapi.h>
 
 using namespace Microsoft::WRL;
@@ -36,11 +45,17 @@ struct DeferralResponse
     DWORD statusCode;
     std::wstring statusCodeText;
     std::wstring headers;
-    std::vector<BYTE> content;
+    // 受信済みの内容はProxyBufferStream、ストリーミングする場合はProxyPipeStream
+    wil::com_ptr<IStream> stream;
+    // 上流から受信した応答であればページに返すまでの時間をこのホストのdeliveryMillisecondsに数える
+    std::wstring metricsHost;
+    ULONGLONG postedTime = 0;
 };
 
 #define IDT_SHOW_EVR_WINDOW 1
 #define IDT_RESIZE 2
+#define IDT_COALESCE 3
+#define IDT_REPLAY 4
 
 struct UsedKey
 {
@@ -58,22 +73,94 @@ struct Status
     bool loading = false;
 };
 
+static bool DecodeVideoChanged(const JsonMessageReader& reader, RECT& rect, bool& invisible)
+{
+    double left, right, top, bottom;
+    if (!reader.GetNumber(L"left", left) || !reader.GetNumber(L"right", right) || !reader.GetNumber(L"top", top) || !reader.GetNumber(L"bottom", bottom) || !reader.GetBool(L"invisible", invisible))
+    {
+        return false;
+    }
+    rect.left = (int)std::floor(left);
+    rect.right = (int)std::ceil(right);
+    rect.top = (int)std::floor(top);
+    rect.bottom = (int)std::ceil(bottom);
+    return true;
+}
+
+static bool DecodeStatus(const JsonMessageReader& reader, Status& status)
+{
+    return reader.GetString(L"url", status.url) && reader.GetBool(L"receiving", status.receiving) && reader.GetBool(L"loading", status.loading);
+}
+
+// ページから短い間隔で届くメッセージをまとめて反映するもの
+enum CoalescedUpdate
+{
+    COALESCED_UPDATE_VIDEO = 1,
+    COALESCED_UPDATE_STATUS = 2,
+};
+
+struct PacketBlock
+{
+    std::vector<BYTE> packets;
+    // ブロックを区切った時点のPCR (45kHz)
+    DWORD pcr = 0;
+    // trueであればこのブロックの直前でPCRが不連続になっている
+    bool discontinuity = false;
+    // TSDecoderで解析したもの (BinaryFrame.hのフレームの列)
+    std::vector<BYTE> frames;
+
+    // 送るデータの大きさ キューやバッチの大きさはフレームも含めて数える
+    size_t size() const
+    {
+        return this->packets.size() + this->frames.size();
+    }
+};
+
+struct PacketQueueStatistics
+{
+    // キューに入っているバイト数
+    size_t size = 0;
+    // キューに入っていたバイト数の最大値
+    size_t peakSize = 0;
+    // 溢れて捨てられたバイト数とブロック数
+    uint64_t droppedSize = 0;
+    uint64_t droppedBlocks = 0;
+};
+
 struct PacketQueue
 {
 private:
     std::mutex queueMutex;
     std::vector<BYTE> currentBlock;
-    std::queue<std::vector<BYTE>> queue;
+    std::queue<PacketBlock> queue;
+    PacketQueueStatistics statistics;
+    size_t maxQueueSize = 4 * 1024 * 1024;
+    DWORD maxQueueDuration = 45 * 10000;
     std::atomic<bool> invalidate;
     std::unordered_set<WORD> pidsToExclude;
     std::unordered_map<WORD, int> pcrPIDCandidates;
     int pcrPID = -1;
+    bool hasPCR = false;
     DWORD pcr = 0;
     DWORD lastBlockPCR = 0;
+    // 次にキューに加えるブロックに不連続を記録する
+    bool pendingDiscontinuity = false;
+    // ページの代わりに解析するか (メインスレッドから設定されTSスレッドで反映する)
+    bool nativeDecoding = false;
+    // 解析したパケットもTSに残すか
+    bool keepDecodedPackets = false;
+    std::unordered_set<uint16_t> decodedPIDs;
+    bool decoderConfigChanged = false;
+    // 以下はTSスレッドのみ
+    bool decoding = false;
+    bool keepingDecodedPackets = false;
+    TSDecoder decoder;
+    std::vector<BYTE> currentFrames;
 public:
     static constexpr size_t packetSize = 188;
     static constexpr size_t packetBlockSize = packetSize * 500;
-    static constexpr size_t maxQueueLength = 100;
+    // PCRは最大でも100ミリ秒間隔で送られるので1秒以上飛んだ場合はシークなどによる不連続とみなす
+    static constexpr DWORD maxPCRInterval = 45 * 1000;
 
     PacketQueue()
     {
@@ -86,6 +173,10 @@ public:
         if (this->invalidate.exchange(false))
         {
             this->currentBlock.clear();
+            this->currentFrames.clear();
+            this->decoder.Reset();
+            this->hasPCR = false;
+            this->pendingDiscontinuity = false;
         }
         // 8-bit sync byte
         // 1-bit TEI
@@ -115,13 +206,37 @@ public:
                     if ((this->pcrPID < 0 && it->second >= 3) || it->second >= 5)
                     {
                         this->pcrPID = pid;
+                        // 別のPIDのPCRとは比較できない
+                        this->hasPCR = false;
                     }
                 }
                 if (pid == this->pcrPID)
                 {
                     // PCRを取得する。時計演算の便利のため下位1bitは捨てる
                     this->pcrPIDCandidates.clear();
-                    this->pcr = (static_cast<DWORD>(packet[6]) << 24) | (packet[7] << 16) | (packet[8] << 8) | packet[9];
+                    DWORD pcr = (static_cast<DWORD>(packet[6]) << 24) | (packet[7] << 16) | (packet[8] << 8) | packet[9];
+                    bool discontinuityIndicator = !!(packet[5] & 0x80);
+                    // discontinuity_indicatorが立っているか、PCRが巻き戻ったか大きく飛んだ場合
+                    // ファイル再生時のシークなどで古いブロックや組み立て途中のデータが残らないように全て捨てる
+                    if (this->hasPCR && (discontinuityIndicator || static_cast<int32_t>(pcr - this->pcr) < 0 || pcr - this->pcr >= maxPCRInterval))
+                    {
+                        this->currentBlock.clear();
+                        this->currentFrames.clear();
+                        this->decoder.Reset();
+                        {
+                            std::lock_guard<std::mutex> lock(this->queueMutex);
+                            std::queue<PacketBlock>().swap(this->queue);
+                            this->statistics.size = 0;
+                        }
+                        this->pendingDiscontinuity = true;
+                        this->lastBlockPCR = pcr;
+                    }
+                    this->pcr = pcr;
+                    this->hasPCR = true;
+                    if (this->decoding)
+                    {
+                        this->decoder.DecodePCR(packet, this->currentFrames);
+                    }
                 }
             }
         }
@@ -131,14 +246,28 @@ public:
             // std::mutexの内部はSRWLock等なので頻繁に呼んでも別に気にしなくてよい
             std::lock_guard<std::mutex> lock(this->queueMutex);
             acceptPacket = this->pidsToExclude.count(pid) == 0;
+            if (this->decoderConfigChanged)
+            {
+                this->decoderConfigChanged = false;
+                this->decoding = this->nativeDecoding;
+                this->keepingDecodedPackets = this->keepDecodedPackets;
+                this->decoder.SetPESPIDs(this->decoding ? this->decodedPIDs : std::unordered_set<uint16_t>());
+            }
+        }
+        if (this->decoding && (pid == TSDecoder::timePID || this->decoder.IsPESPID(pid)))
+        {
+            this->decoder.DecodePacket(packet, this->currentFrames);
+            // 元のTSが必要なければ解析したものだけを送る
+            acceptPacket &= this->keepingDecodedPackets;
         }
         if (acceptPacket)
         {
             this->currentBlock.insert(this->currentBlock.end(), packet, packet + this->packetSize);
         }
-        else if (pcrFlag)
+        else if (pcrFlag && (!this->decoding || this->keepingDecodedPackets))
         {
             // 除外されているPIDにPCRが含まれていればPCRのみをキューに加える
+            // 解析したものだけを送る場合はPCRをフレームとして送るので不要
             BYTE pcr_packet[packetSize] = {};
             pcr_packet[0] = 0x47;
             // adaptation_field_control=0b10なのでCIは加算されない、0固定で間に合わせる
@@ -153,22 +282,33 @@ public:
         }
 
         // PCRが100ミリ秒以上進めばキューに加える
-        // キューには100*maxQueueLengthミリ秒分ほど貯められる
-        if (this->currentBlock.size() >= this->packetBlockSize ||
-            (!this->currentBlock.empty() && (this->pcr - this->lastBlockPCR) >= 45 * 100))
+        // キューにはmaxQueueSizeバイトかつPCRでmaxQueueDuration分まで貯められる
+        if (this->currentBlock.size() + this->currentFrames.size() >= this->packetBlockSize ||
+            ((!this->currentBlock.empty() || !this->currentFrames.empty()) && (this->pcr - this->lastBlockPCR) >= 45 * 100))
         {
             {
                 std::lock_guard<std::mutex> lock(this->queueMutex);
-                this->queue.push(std::move(this->currentBlock));
-                if (this->queue.size() > this->maxQueueLength)
+                this->statistics.size += this->currentBlock.size() + this->currentFrames.size();
+                this->queue.push({ std::move(this->currentBlock), this->pcr, std::exchange(this->pendingDiscontinuity, false), std::move(this->currentFrames) });
+                while (this->queue.size() > 1 &&
+                    (this->statistics.size > this->maxQueueSize || this->queue.back().pcr - this->queue.front().pcr > this->maxQueueDuration))
                 {
                     // 古いものを中身再利用して捨てる
-                    this->currentBlock.swap(this->queue.front());
+                    auto discontinuity = this->queue.front().discontinuity;
+                    auto droppedSize = this->queue.front().size();
+                    this->statistics.size -= droppedSize;
+                    this->statistics.droppedSize += droppedSize;
+                    this->statistics.droppedBlocks++;
+                    this->currentBlock.swap(this->queue.front().packets);
                     this->queue.pop();
+                    // 捨てたブロックの不連続は次のブロックに引き継ぐ
+                    this->queue.front().discontinuity |= discontinuity;
                 }
+                this->statistics.peakSize = std::max(this->statistics.peakSize, this->statistics.size);
             }
             this->currentBlock.clear();
             this->currentBlock.reserve(this->packetBlockSize);
+            this->currentFrames.clear();
             this->lastBlockPCR = this->pcr;
             return true;
         }
@@ -179,12 +319,13 @@ public:
     void clear()
     {
         std::lock_guard<std::mutex> lock(this->queueMutex);
-        std::queue<std::vector<BYTE>>().swap(this->queue);
+        std::queue<PacketBlock>().swap(this->queue);
+        this->statistics.size = 0;
         this->invalidate = true;
     }
 
     // どのスレッドからも呼び出せる
-    std::optional<std::vector<BYTE>> pop()
+    std::optional<PacketBlock> pop()
     {
         std::lock_guard<std::mutex> lock(this->queueMutex);
         if (this->queue.empty())
@@ -193,15 +334,71 @@ public:
         }
         auto r = std::move(this->queue.front());
         this->queue.pop();
+        this->statistics.size -= r.size();
+        return r;
+    }
+
+    // 先頭のブロックをpredicateが受け入れた場合のみ取り出す
+    template<class Predicate>
+    std::optional<PacketBlock> popIf(Predicate predicate)
+    {
+        std::lock_guard<std::mutex> lock(this->queueMutex);
+        if (this->queue.empty() || !predicate(static_cast<const PacketBlock&>(this->queue.front())))
+        {
+            return std::nullopt;
+        }
+        auto r = std::move(this->queue.front());
+        this->queue.pop();
+        this->statistics.size -= r.size();
         return r;
     }
 
+    // どのスレッドからも呼び出せる
+    void setLimits(size_t maxSize, DWORD maxDuration)
+    {
+        std::lock_guard<std::mutex> lock(this->queueMutex);
+        this->maxQueueSize = maxSize;
+        this->maxQueueDuration = maxDuration;
+    }
+
+    // どのスレッドからも呼び出せる
+    PacketQueueStatistics getStatistics()
+    {
+        std::lock_guard<std::mutex> lock(this->queueMutex);
+        return this->statistics;
+    }
+
     // どのスレッドからも呼び出せる
     void setPIDsToExclude(std::unordered_set<WORD> pids)
     {
         std::lock_guard<std::mutex> lock(this->queueMutex);
         this->pidsToExclude.swap(pids);
     }
+
+    // どのスレッドからも呼び出せる
+    // 有効であれば字幕などのPES、PCR、TDT/TOTはTSDecoderで解析したフレームをブロックに加える
+    // keepPacketsでなければ解析したパケットはブロックに加えない
+    void setNativeDecoding(bool enable, bool keepPackets)
+    {
+        std::lock_guard<std::mutex> lock(this->queueMutex);
+        if (this->nativeDecoding != enable || this->keepDecodedPackets != keepPackets)
+        {
+            this->nativeDecoding = enable;
+            this->keepDecodedPackets = keepPackets;
+            this->decoderConfigChanged = true;
+        }
+    }
+
+    // どのスレッドからも呼び出せる
+    void setDecodedPIDs(std::unordered_set<uint16_t> pids)
+    {
+        std::lock_guard<std::mutex> lock(this->queueMutex);
+        if (this->decodedPIDs != pids)
+        {
+            this->decodedPIDs.swap(pids);
+            this->decoderConfigChanged = true;
+        }
+    }
 };
 
 struct Audio
@@ -289,8 +486,53 @@ class CDataBroadcastingWV2 : public TVTest::CTVTestPlugin, TVTest::CTVTestEventH
     std::wstring webView2Directory;
 
     std::atomic<bool> webViewLoaded;
+    // 遷移中はページにストリームを送らない
+    bool webViewNavigating = false;
+    // ページが遷移せずにサービスを切り替えられるか
+    bool pageSupportsServiceChanged = false;
+    // ページが解析済みのフレーム(decoded1)を受け取れるか
+    bool pageDecodedFrames = false;
+    // 遷移せずに切り替えを要求したURL (ページ側でURLが書き換えられるまではget_Sourceが古いまま)
+    std::wstring pendingServiceUrl;
     PacketQueue packetQueue;
-    std::vector<WCHAR> packetsToJsonBuf;
+    // ページへの送信経路
+    std::unique_ptr<JsonStreamTransport> pageTransport;
+    // iniのStreamSharedMemoryNameが指定されていれば他のプロセス向けに共有メモリにも書き込む
+    std::unique_ptr<SharedMemoryStreamTransport> sharedMemoryTransport;
+    // iniのWebSocketServerPortが指定されていればローカルのWebSocketクライアントにも配る
+    std::unique_ptr<WebSocketStreamTransport> webSocketTransport;
+    // ページ以外の送信先 (上の2つのうち有効なもの)
+    std::vector<StreamTransport*> externalTransports;
+    // キューに溜まっているブロックを一つのメッセージにまとめる上限 (0であればまとめない)
+    size_t streamBatchMaxSize = 0;
+    DWORD streamBatchMaxDuration = 0;
+    std::vector<PacketBlock> batchBlocks;
+    std::vector<BYTE> batchPackets;
+    std::vector<BYTE> batchFrames;
+    // streamBase64メッセージごとのTSのバイト数とブロック数
+    Log2Histogram streamMessageBytes;
+    Log2Histogram streamMessageBlocks;
+    // ページに送るメッセージの書き出し用 (メインスレッドのみ)
+    JsonMessageWriter messageWriter;
+    // statusメッセージの読み込み先 読めたらstatusと入れ替える
+    Status receivedStatus;
+    // videoChangedやstatusは状態だけ更新しておき再描画などはこの間隔(ミリ秒)に1回だけ行う (0であれば毎回行う)
+    UINT messageCoalesceInterval = 16;
+    bool coalesceTimerActive = false;
+    int pendingUpdates = 0;
+    // 反映する前に次のメッセージで上書きされた数
+    uint64_t suppressedVideoUpdates = 0;
+    uint64_t suppressedStatusUpdates = 0;
+    // 再読み込み時にすぐ表示できるようにページに送ったブロックを現在のサービスの分だけ保持しておく
+    std::deque<PacketBlock> replayBuffer;
+    size_t replayBufferSize = 0;
+    DWORD replayBufferDuration = 0;
+    size_t replayBufferMaxSize = 0;
+    // 再送は1回のタイマーでこの大きさまでにしてUIスレッドを長く止めないようにする
+    size_t replayTickMaxSize = 0;
+    // 次に再送するreplayBufferの位置 再送中は受信したブロックを送らずにキューに残す
+    size_t replayPosition = 0;
+    bool replayTimerActive = false;
 
     HWND hRemoteWnd = nullptr;
     HWND hPanelWnd = nullptr;
@@ -323,7 +565,40 @@ class CDataBroadcastingWV2 : public TVTest::CTVTestPlugin, TVTest::CTVTestEventH
     UsedKey usedKey;
     // iniのEnableNetworkが1であればProxySessionが初期化されenableNetworkもtrueになる
     // ただしenableNetworkの方は実行時にボタンで切り替えられる
-    std::unique_ptr<ProxySession> proxySession;
+    std::shared_ptr<ProxySession> proxySession;
+    // 通信中に無効にされても完了時のコールバックで使えるように共有する
+    std::shared_ptr<ProxyCache> proxyCache;
+    // キャッシュ、まとめ、ヘッダの書き換え、スケジューリングを行いproxySessionかproxyArchiveTransportに送る
+    std::shared_ptr<ProxyPipeline> proxyPipeline;
+    // 0であれば止めない
+    size_t proxyCircuitBreakerFailures = 0;
+    DWORD proxyCircuitBreakerCoolDown = 0;
+    // 0であれば4xx/5xxの応答を保持しない
+    int64_t proxyNegativeCacheLifetime = 0;
+    // ProxyRecordFileかProxyReplayFileが指定されていればproxySessionの代わりにこれを通す
+    // 記録と再生で同じ結果になるようにキャッシュとストリーミングは使わない
+    std::shared_ptr<ProxyTransport> proxyArchiveTransport;
+    std::wstring proxyRecordFile;
+    std::wstring proxyReplayFile;
+    // 記録した所要時間に対する再生の速さ(%) 0であれば待たない
+    unsigned proxyReplaySpeed = 100;
+    // 0であれば制限しない
+    size_t proxyMaxRequestsPerHost = 0;
+    size_t proxyMaxRequests = 0;
+    // 0であれば無制限
+    DWORD proxyConnectTimeout = 0;
+    DWORD proxyReceiveTimeout = 0;
+    size_t proxyCacheMemoryMaxSize = 0;
+    size_t proxyCacheDiskMaxSize = 0;
+    // 0であれば全て受信してからページに返す
+    size_t proxyStreamBufferSize = 0;
+    // サーバーごとの接続数の上限 0であればWinHTTPの既定のまま
+    DWORD proxyMaxConnectionsPerServer = 0;
+    // gzip, deflateで圧縮された応答を受け取り展開してからページに返す
+    bool proxyDecompression = true;
+    // Initializeでのみ書き換え、有効にするときにproxyPipelineに写す
+    ProxyHeaderRules proxyRequestHeaderRules;
+    ProxyHeaderRules proxyResponseHeaderRules;
     bool enableNetwork = true;
     std::unique_ptr<InputDialog> inputDialog;
     Audio mainAudio;
@@ -351,12 +626,27 @@ class CDataBroadcastingWV2 : public TVTest::CTVTestPlugin, TVTest::CTVTestEventH
     HWND GetFullscreenWindow();
     void RestoreVideoWindow();
     void ResizeVideoWindow();
+    bool HandleFrequentWebMessage(LPCWSTR json);
+    void RequestCoalescedUpdate(CoalescedUpdate update);
+    void ApplyCoalescedUpdates(int updates);
     void Tune();
     void InitWebView2();
     bool caption = false;
     void SetCaptionState(bool enable);
     void UpdateCaptionState(bool showIndicator);
     void UpdateVolume();
+    void PostPacketBlock(const BYTE* packets, size_t size, const BYTE* frames, size_t framesSize, size_t blockCount, bool replay);
+    bool CanAppendToBatch(const PacketBlock& first, size_t batchSize, const PacketBlock& next) const;
+    template<class Iterator>
+    void PostPacketBlocks(Iterator begin, Iterator end, bool replay);
+    void AppendReplayBuffer(PacketBlock block);
+    void ClearReplayBuffer();
+    void Replay();
+    bool ReplayNext();
+    void StopReplay();
+    void ShowStatistics();
+    void UpdateNativeDecoding();
+    class ProxyDeferralResponder;
     std::wstring GetIniItem(const wchar_t* key, const wchar_t* def);
     INT GetIniItem(const wchar_t* key, INT def);
     bool SetIniItem(const wchar_t* key, const wchar_t* data);
@@ -502,12 +792,29 @@ bool CDataBroadcastingWV2::OnServiceUpdate()
     }
     // 動画、音声のPESは不要なので削っておく
     this->packetQueue.setPIDsToExclude(std::move(pesPIDList));
+    // 字幕のPESはページが対応していればこちらで組み立てる
+    std::unordered_set<uint16_t> captionPIDList;
+    TVTest::ElementaryStreamInfoList captionESList = {};
+    if (this->m_pApp->GetElementaryStreamInfoList(&captionESList, TVTest::ES_MEDIA_CAPTION, this->currentService.ServiceID))
+    {
+        for (auto i = 0; i < captionESList.ESCount; i++)
+        {
+            captionPIDList.insert(captionESList.ESList[i].PID);
+        }
+        this->m_pApp->MemoryFree(captionESList.ESList);
+    }
+    if (this->currentService.SubtitlePID)
+    {
+        captionPIDList.insert(this->currentService.SubtitlePID);
+    }
+    this->packetQueue.setDecodedPIDs(std::move(captionPIDList));
 
     if (this->currentChannel.NetworkID != lastNetworkID ||
         this->currentService.ServiceID != lastServiceID)
     {
         this->currentServiceIsOneSeg = false;
         this->packetQueue.clear();
+        this->ClearReplayBuffer();
     }
     Tune();
     return true;
@@ -613,6 +920,7 @@ bool CDataBroadcastingWV2::Initialize()
     m_pApp->RegisterCommand(IDC_TOGGLE_CAPTION, L"ToggleCaption", L"字幕表示/非表示切替");
     m_pApp->RegisterCommand(IDC_SHOW_REMOTE_CONTROL, L"ShowRemoteControl", L"リモコン表示");
     m_pApp->RegisterCommand(IDC_TASKMANAGER, L"TaskManager", L"タスクマネージャー");
+    m_pApp->RegisterCommand(IDC_SHOW_STATISTICS, L"ShowStatistics", L"統計情報をログに出力");
     m_pApp->RegisterPluginIconFromResource(g_hinstDLL, MAKEINTRESOURCEW(IDB_PLUGIN));
     TVTest::PanelItemInfo panel = {};
     panel.Size = sizeof(panel);
@@ -636,6 +944,78 @@ bool CDataBroadcastingWV2::Initialize()
     m_pApp->RegisterStatusItem(&statusItemInfo);
     this->useTVTestVolume = this->GetIniItem(L"UseTVTestVolume", true);
     this->useTVTestChannelCommand = this->GetIniItem(L"UseTVTestChannelCommand", true);
+    // 0であれば再読み込み時の再送を行わない
+    this->replayBufferDuration = (DWORD)std::max(this->GetIniItem(L"ReplayBufferSeconds", 120), 0) * 45000;
+    this->replayBufferMaxSize = (size_t)std::max(this->GetIniItem(L"ReplayBufferMaxMegabytes", 64), 0) * 1024 * 1024;
+    this->replayTickMaxSize = (size_t)std::max(this->GetIniItem(L"ReplayTickKilobytes", 1024), 1) * 1024;
+    // ページへの送信が滞ったときに貯めておく量
+    this->packetQueue.setLimits(
+        (size_t)std::max(this->GetIniItem(L"PacketQueueMaxKilobytes", 4096), 1) * 1024,
+        (DWORD)std::max(this->GetIniItem(L"PacketQueueMaxMilliseconds", 10000), 100) * 45
+    );
+    // 送信が滞ってキューに溜まったブロックをまとめて送る量 0であれば1ブロックずつ送る
+    this->streamBatchMaxSize = (size_t)std::max(this->GetIniItem(L"StreamBatchMaxKilobytes", 1024), 0) * 1024;
+    this->streamBatchMaxDuration = (DWORD)std::max(this->GetIniItem(L"StreamBatchMaxMilliseconds", 500), 0) * 45;
+    this->messageCoalesceInterval = (UINT)std::max(this->GetIniItem(L"MessageCoalesceMilliseconds", 16), 0);
+    // 通信コンテンツのキャッシュ メモリが0であればキャッシュしない
+    this->proxyCacheMemoryMaxSize = (size_t)std::max(this->GetIniItem(L"ProxyCacheMemoryKilobytes", 16384), 0) * 1024;
+    this->proxyCacheDiskMaxSize = (size_t)std::max(this->GetIniItem(L"ProxyCacheDiskMegabytes", 64), 0) * 1024 * 1024;
+    this->proxyStreamBufferSize = (size_t)std::max(this->GetIniItem(L"ProxyStreamBufferKilobytes", 256), 0) * 1024;
+    this->proxyMaxConnectionsPerServer = (DWORD)std::max(this->GetIniItem(L"ProxyMaxConnectionsPerServer", 6), 0);
+    this->proxyDecompression = this->GetIniItem(L"ProxyDecompression", true);
+    this->proxyMaxRequestsPerHost = (size_t)std::max(this->GetIniItem(L"ProxyMaxRequestsPerHost", 6), 0);
+    this->proxyMaxRequests = (size_t)std::max(this->GetIniItem(L"ProxyMaxRequests", 16), 0);
+    this->proxyConnectTimeout = (DWORD)std::max(this->GetIniItem(L"ProxyConnectTimeoutSeconds", 10), 0) * 1000;
+    this->proxyReceiveTimeout = (DWORD)std::max(this->GetIniItem(L"ProxyReceiveTimeoutSeconds", 30), 0) * 1000;
+    this->proxyCircuitBreakerFailures = (size_t)std::max(this->GetIniItem(L"ProxyCircuitBreakerFailures", 5), 0);
+    this->proxyCircuitBreakerCoolDown = (DWORD)std::max(this->GetIniItem(L"ProxyCircuitBreakerSeconds", 15), 0) * 1000;
+    this->proxyNegativeCacheLifetime = std::max(this->GetIniItem(L"ProxyNegativeCacheSeconds", 5), 0);
+    this->proxyRecordFile = this->GetIniItem(L"ProxyRecordFile", L"");
+    this->proxyReplayFile = this->GetIniItem(L"ProxyReplayFile", L"");
+    this->proxyReplaySpeed = (unsigned)std::max(this->GetIniItem(L"ProxyReplaySpeedPercent", 100), 0);
+    this->proxyRequestHeaderRules.clear();
+    if (!ParseProxyHeaderRules(this->GetIniItem(L"ProxyRequestHeaders", L""), this->proxyRequestHeaderRules))
+    {
+        this->m_pApp->AddLog(L"ProxyRequestHeadersに読めない項目があります。", TVTest::LOG_TYPE_WARNING);
+    }
+    // ページからはこのオリジンでしか読めないので利用者のルールより優先する
+    this->proxyResponseHeaderRules = { { ProxyHeaderAction::Replace, L"Access-Control-Allow-Origin", L"https://tvtdatabroadcastingwv2.invalid" } };
+    if (!ParseProxyHeaderRules(this->GetIniItem(L"ProxyResponseHeaders", L""), this->proxyResponseHeaderRules))
+    {
+        this->m_pApp->AddLog(L"ProxyResponseHeadersに読めない項目があります。", TVTest::LOG_TYPE_WARNING);
+    }
+    this->pageTransport = std::make_unique<JsonStreamTransport>(this->webView);
+    auto sharedMemoryName = this->GetIniItem(L"StreamSharedMemoryName", L"");
+    if (!sharedMemoryName.empty())
+    {
+        auto transport = std::make_unique<SharedMemoryStreamTransport>();
+        if (transport->Create(sharedMemoryName.c_str(), (size_t)std::max(this->GetIniItem(L"StreamSharedMemoryKilobytes", 8192), 64) * 1024))
+        {
+            this->sharedMemoryTransport = std::move(transport);
+            this->externalTransports.push_back(this->sharedMemoryTransport.get());
+        }
+        else
+        {
+            auto msg = L"共有メモリ" + sharedMemoryName + L"を作成できませんでした。";
+            this->m_pApp->AddLog(msg.c_str(), TVTest::LOG_TYPE_ERROR);
+        }
+    }
+    auto webSocketPort = this->GetIniItem(L"WebSocketServerPort", 0);
+    if (webSocketPort > 0 && webSocketPort <= 0xffff)
+    {
+        auto transport = std::make_unique<WebSocketStreamTransport>();
+        if (transport->Start((unsigned short)webSocketPort, (size_t)std::max(this->GetIniItem(L"WebSocketClientQueueKilobytes", 8192), 64) * 1024))
+        {
+            this->webSocketTransport = std::move(transport);
+            this->externalTransports.push_back(this->webSocketTransport.get());
+        }
+        else
+        {
+            auto msg = L"WebSocketサーバをポート" + std::to_wstring(webSocketPort) + L"で開始できませんでした。";
+            this->m_pApp->AddLog(msg.c_str(), TVTest::LOG_TYPE_ERROR);
+        }
+    }
+    this->UpdateNativeDecoding();
     if (this->GetIniItem(L"AutoEnable", 0))
     {
         // Initialize()でプラグインを有効にするかPLUGIN_FLAG_ENABLEDEFAULTだとサイドパネルのプラグインボタンが押された状態にならないので遅延する
@@ -648,6 +1028,9 @@ bool CDataBroadcastingWV2::Initialize()
 bool CDataBroadcastingWV2::Finalize()
 {
     this->Disable(true);
+    this->externalTransports.clear();
+    this->webSocketTransport.reset();
+    this->sharedMemoryTransport.reset();
     return true;
 }
 
@@ -670,6 +1053,30 @@ LRESULT CALLBACK CDataBroadcastingWV2::MessageWndProc(HWND hWnd, UINT uMsg, WPAR
             KillTimer(hWnd, wParam);
             break;
         }
+        case IDT_COALESCE:
+        {
+            if (pThis->pendingUpdates)
+            {
+                pThis->ApplyCoalescedUpdates(std::exchange(pThis->pendingUpdates, 0));
+            }
+            else
+            {
+                // 間隔の間に何も届かなければ止めて次は即座に反映する
+                KillTimer(hWnd, wParam);
+                pThis->coalesceTimerActive = false;
+            }
+            break;
+        }
+        case IDT_REPLAY:
+        {
+            if (!pThis->webView || !pThis->webViewLoaded || pThis->webViewNavigating || pThis->ReplayNext())
+            {
+                pThis->StopReplay();
+                // 再送中に溜まった分を送る
+                PostMessageW(hWnd, WM_APP_PACKET, 0, 0);
+            }
+            break;
+        }
         case IDT_RESIZE:
         {
             if (pThis->webViewController && !pThis->oneSegWindowIsShown)
@@ -739,50 +1146,52 @@ LRESULT CALLBACK CDataBroadcastingWV2::MessageWndProc(HWND hWnd, UINT uMsg, WPAR
     }
     case WM_APP_PACKET:
     {
-        if (!pThis->webView || !pThis->webViewLoaded)
+        if (!pThis->webView || !pThis->webViewLoaded || pThis->webViewNavigating)
         {
             // キューを消費しない
             break;
         }
-        // スレッドが失速して回復したときなどに応答を維持するためメッセージごとの処理数を制限
-        for (int popCount = 0; popCount < 5; popCount++)
+        if (pThis->replayTimerActive)
+        {
+            // 再送が終わるまでは順番が入れ替わらないようにキューに残しておく
+            break;
+        }
+        // スレッドが失速して回復したときなどに応答を維持するためメッセージごとの送信数を制限
+        for (int postCount = 0; postCount < 5; postCount++)
         {
-            auto packets = pThis->packetQueue.pop();
-            if (!packets)
+            auto block = pThis->packetQueue.pop();
+            if (!block)
             {
                 break;
             }
-            WCHAR head[] = LR"({"type":"streamBase64","data":")";
-            WCHAR tail[] = LR"("})";
-            auto packetBlockSize = packets.value().size();
-            auto packetSize = pThis->packetQueue.packetSize;
-            size_t size = _countof(head) - 1 + (packetBlockSize + 2) / 3 * 4 /* Base64 */ + _countof(tail) + 1;
-            if (pThis->packetsToJsonBuf.size() < size)
+            if (block->discontinuity)
             {
-                pThis->packetsToJsonBuf.resize(size);
-            }
-            {
-                auto buf = pThis->packetsToJsonBuf.data();
-                wcscpy_s(buf, size, head);
-                size_t pos = 0;
-                pos += wcslen(head);
-                auto buffer = packets.value().data();
-                static const WCHAR base64[66] = L"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=";
-                for (size_t i = 0; i < packetBlockSize; i += 3)
+                // ページ側の組み立て途中のセクションやPESを破棄させる
+                pThis->pageTransport->PostReset();
+                for (auto transport : pThis->externalTransports)
                 {
-                    buf[pos] = base64[buffer[i] >> 2];
-                    pos += 1;
-                    buf[pos] = base64[((buffer[i] & 3) << 4) | (i + 1 < packetBlockSize ? buffer[i + 1] >> 4 : 0)];
-                    pos += 1;
-                    buf[pos] = base64[i + 1 < packetBlockSize ? ((buffer[i + 1] & 15) << 2) |
-                                                                (i + 2 < packetBlockSize ? buffer[i + 2] >> 6 : 0) : 64];
-                    pos += 1;
-                    buf[pos] = base64[i + 2 < packetBlockSize ? buffer[i + 2] & 63 : 64];
-                    pos += 1;
+                    transport->PostReset();
                 }
-                wcscpy_s(buf + pos, size - pos, tail);
-                auto hr = pThis->webView->PostWebMessageAsJson(buf);
+                // 不連続以前のものを再送しても意味がない
+                pThis->ClearReplayBuffer();
             }
+            // 溜まっている分は上限までまとめて送りメッセージごとの処理の負担を減らす
+            // キューが浅ければ1ブロックずつ送ることになるので遅延は増えない
+            auto&& batch = pThis->batchBlocks;
+            batch.clear();
+            size_t batchSize = block->size();
+            batch.push_back(std::move(block.value()));
+            while (auto next = pThis->packetQueue.popIf([pThis, &batch, &batchSize](const PacketBlock& next) { return pThis->CanAppendToBatch(batch.front(), batchSize, next); }))
+            {
+                batchSize += next->size();
+                batch.push_back(std::move(next.value()));
+            }
+            pThis->PostPacketBlocks(batch.begin(), batch.end(), false);
+            for (auto&& b : batch)
+            {
+                pThis->AppendReplayBuffer(std::move(b));
+            }
+            batch.clear();
         }
         break;
     }
@@ -797,51 +1206,28 @@ LRESULT CALLBACK CDataBroadcastingWV2::MessageWndProc(HWND hWnd, UINT uMsg, WPAR
             break;
         }
         wil::com_ptr<ICoreWebView2WebResourceResponse> webResponse;
-        wil::com_ptr<IStream> stm;
-        auto  hGlobal = GlobalAlloc(GMEM_MOVEABLE | GMEM_NODISCARD, response->content.size());
-        if (!hGlobal)
-        {
-            response->deferral->Complete();
-            break;
-        }
-        auto mem = GlobalLock(hGlobal);
-        memcpy(mem, response->content.data(), response->content.size());
-        GlobalUnlock(hGlobal);
-        if (FAILED(CreateStreamOnHGlobal(hGlobal, TRUE, stm.put())))
+        if (!response->stream)
         {
             response->deferral->Complete();
             break;
         }
-        std::wistringstream iss(response->headers);
-        std::wostringstream replacedHeader;
-        std::wstring header;
-        while (std::getline(iss, header))
-        {
-            if (!_wcsnicmp(header.c_str(), L"Access-Control-Allow-Origin", wcslen(L"Access-Control-Allow-Origin")))
-            {
-            }
-            else if (header != L"\r")
-            {
-                replacedHeader << header;
-                replacedHeader << L"\n";
-            }
-        }
-        hr = env->CreateWebResourceResponse(stm.get(), response->statusCode, response->statusCodeText.c_str(), replacedHeader.str().c_str(), webResponse.put());
+        // ヘッダは受信した時点でproxyResponseHeaderRulesに従って書き換えてある
+        hr = env->CreateWebResourceResponse(response->stream.get(), response->statusCode, response->statusCodeText.c_str(), response->headers.c_str(), webResponse.put());
         if (FAILED(hr))
         {
             response->deferral->Complete();
             break;
         }
-        wil::com_ptr<ICoreWebView2HttpResponseHeaders> responseHeaders;
-        hr = webResponse->get_Headers(responseHeaders.put());
-        if (FAILED(hr))
-        {
-            response->deferral->Complete();
-            break;
-        }
-        responseHeaders->AppendHeader(L"Access-Control-Allow-Origin", L"https://tvtdatabroadcastingwv2.invalid");
         response->args->put_Response(webResponse.get());
         response->deferral->Complete();
+        if (response->postedTime && pThis->proxySession)
+        {
+            auto delivery = ProxyMetrics::Now() - response->postedTime;
+            pThis->proxySession->GetMetrics()->Record(response->metricsHost, [delivery](ProxyMetrics::Host& hostMetrics)
+            {
+                hostMetrics.deliveryMilliseconds.Add(delivery);
+            });
+        }
         break;
     }
     case WM_APP_INPUT:
@@ -889,6 +1275,216 @@ LRESULT CALLBACK CDataBroadcastingWV2::MessageWndProc(HWND hWnd, UINT uMsg, WPAR
     return DefWindowProcW(hWnd, uMsg, wParam, lParam);
 }
 
+// replayであれば再読み込みしたページに向けた再送なのでページにのみ送る
+void CDataBroadcastingWV2::PostPacketBlock(const BYTE* packets, size_t packetBlockSize, const BYTE* frames, size_t framesSize, size_t blockCount, bool replay)
+{
+    if (!replay)
+    {
+        for (auto transport : this->externalTransports)
+        {
+            transport->PostPackets(packets, packetBlockSize, blockCount, frames, framesSize);
+        }
+    }
+    if (!this->externalTransports.empty())
+    {
+        // 元のTSを残したまま解析しているのでページでは解析したものを使わない
+        frames = nullptr;
+        framesSize = 0;
+    }
+    this->pageTransport->PostPackets(packets, packetBlockSize, blockCount, frames, framesSize);
+    this->streamMessageBytes.Add(packetBlockSize + framesSize);
+    this->streamMessageBlocks.Add(blockCount);
+}
+
+// まとめたメッセージはページ側で1回の処理として扱われるので含まれるPCRの幅が遅延になる
+bool CDataBroadcastingWV2::CanAppendToBatch(const PacketBlock& first, size_t batchSize, const PacketBlock& next) const
+{
+    // 不連続の前にはstreamResetを挟む必要があるのでまとめない
+    return !next.discontinuity &&
+        batchSize + next.size() <= this->streamBatchMaxSize &&
+        next.pcr - first.pcr <= this->streamBatchMaxDuration;
+}
+
+template<class Iterator>
+void CDataBroadcastingWV2::PostPacketBlocks(Iterator begin, Iterator end, bool replay)
+{
+    auto blockCount = (size_t)std::distance(begin, end);
+    if (blockCount == 1)
+    {
+        this->PostPacketBlock(begin->packets.data(), begin->packets.size(), begin->frames.data(), begin->frames.size(), 1, replay);
+        return;
+    }
+    // TSパケットの列なので連結すればそのまま1つのブロックとして扱える
+    // 解析したフレームも長さ付きで並んでいるだけなので連結できる
+    this->batchPackets.clear();
+    this->batchFrames.clear();
+    for (auto it = begin; it != end; it++)
+    {
+        this->batchPackets.insert(this->batchPackets.end(), it->packets.begin(), it->packets.end());
+        this->batchFrames.insert(this->batchFrames.end(), it->frames.begin(), it->frames.end());
+    }
+    this->PostPacketBlock(this->batchPackets.data(), this->batchPackets.size(), this->batchFrames.data(), this->batchFrames.size(), blockCount, replay);
+}
+
+void CDataBroadcastingWV2::AppendReplayBuffer(PacketBlock block)
+{
+    if (this->replayBufferDuration == 0 || this->replayBufferMaxSize == 0)
+    {
+        return;
+    }
+    this->replayBufferSize += block.size();
+    this->replayBuffer.push_back(std::move(block));
+    auto latestPCR = this->replayBuffer.back().pcr;
+    // 古いものから指定された時間と大きさに収まるまで捨てる
+    while (!this->replayBuffer.empty() &&
+        (this->replayBufferSize > this->replayBufferMaxSize || latestPCR - this->replayBuffer.front().pcr > this->replayBufferDuration))
+    {
+        this->replayBufferSize -= this->replayBuffer.front().size();
+        this->replayBuffer.pop_front();
+    }
+}
+
+void CDataBroadcastingWV2::ClearReplayBuffer()
+{
+    this->StopReplay();
+    this->replayBuffer.clear();
+    this->replayBufferSize = 0;
+}
+
+void CDataBroadcastingWV2::Replay()
+{
+    // 読み込み直後のページに直近のデータを流し込んでカルーセルの受信を待たずに表示できるようにする
+    // 全て一度に送るとbase64にした文字列の作成と送信でUIスレッドが止まるのでタイマーで少しずつ送る
+    this->StopReplay();
+    if (this->ReplayNext())
+    {
+        return;
+    }
+    this->replayTimerActive = !!SetTimer(this->hMessageWnd, IDT_REPLAY, USER_TIMER_MINIMUM, nullptr);
+    if (!this->replayTimerActive)
+    {
+        this->replayPosition = 0;
+    }
+}
+
+// replayTickMaxSizeまで送る 全て送り終わればtrue
+bool CDataBroadcastingWV2::ReplayNext()
+{
+    auto begin = this->replayBuffer.begin() + this->replayPosition;
+    size_t tickSize = 0;
+    while (begin != this->replayBuffer.end() && tickSize < this->replayTickMaxSize)
+    {
+        auto end = std::next(begin);
+        size_t batchSize = begin->size();
+        while (end != this->replayBuffer.end() && this->CanAppendToBatch(*begin, batchSize, *end))
+        {
+            batchSize += end->size();
+            end++;
+        }
+        this->PostPacketBlocks(begin, end, true);
+        tickSize += batchSize;
+        begin = end;
+    }
+    this->replayPosition = (size_t)(begin - this->replayBuffer.begin());
+    return begin == this->replayBuffer.end();
+}
+
+void CDataBroadcastingWV2::StopReplay()
+{
+    this->replayPosition = 0;
+    if (this->replayTimerActive)
+    {
+        KillTimer(this->hMessageWnd, IDT_REPLAY);
+        this->replayTimerActive = false;
+    }
+}
+
+void CDataBroadcastingWV2::ShowStatistics()
+{
+    auto queue = this->packetQueue.getStatistics();
+    WCHAR buf[512];
+    swprintf_s(buf, L"PacketQueue: current=%zu bytes, peak=%zu bytes, dropped=%llu bytes (%llu blocks)", queue.size, queue.peakSize, queue.droppedSize, queue.droppedBlocks);
+    this->m_pApp->AddLog(buf, TVTest::LOG_TYPE_INFORMATION);
+    swprintf_s(buf, L"ReplayBuffer: current=%zu bytes (%zu blocks), replaying=%zu blocks", this->replayBufferSize, this->replayBuffer.size(), this->replayTimerActive ? this->replayBuffer.size() - this->replayPosition : 0);
+    this->m_pApp->AddLog(buf, TVTest::LOG_TYPE_INFORMATION);
+    auto bytes = L"StreamMessage bytes: " + this->streamMessageBytes.Format();
+    this->m_pApp->AddLog(bytes.c_str(), TVTest::LOG_TYPE_INFORMATION);
+    auto blocks = L"StreamMessage blocks: " + this->streamMessageBlocks.Format();
+    this->m_pApp->AddLog(blocks.c_str(), TVTest::LOG_TYPE_INFORMATION);
+    swprintf_s(buf, L"CoalescedMessages: suppressed videoChanged=%llu, status=%llu", this->suppressedVideoUpdates, this->suppressedStatusUpdates);
+    this->m_pApp->AddLog(buf, TVTest::LOG_TYPE_INFORMATION);
+    if (this->proxySession && this->proxyPipeline)
+    {
+        auto requests = this->proxyPipeline->GetStatistics();
+        swprintf_s(buf, L"ProxyRequests: coalesced=%llu, in flight=%zu", requests.coalesced, requests.inFlight);
+        this->m_pApp->AddLog(buf, TVTest::LOG_TYPE_INFORMATION);
+        auto scheduler = this->proxyPipeline->GetSchedulerStatistics();
+        swprintf_s(buf, L"ProxyScheduler: started=%llu, delayed=%llu, cancelled waiting=%llu, cancelled running=%llu, running=%zu, waiting=%zu",
+            scheduler.started, scheduler.delayed, scheduler.cancelledWaiting, scheduler.cancelledRunning, scheduler.running, scheduler.waiting);
+        this->m_pApp->AddLog(buf, TVTest::LOG_TYPE_INFORMATION);
+        auto breaker = this->proxyPipeline->GetCircuitBreakerStatistics();
+        swprintf_s(buf, L"ProxyCircuitBreaker: opened=%llu, rejected=%llu, open hosts=%zu", breaker.opened, breaker.rejected, breaker.open);
+        this->m_pApp->AddLog(buf, TVTest::LOG_TYPE_INFORMATION);
+        auto body = this->proxySession->GetBodyStatistics();
+        swprintf_s(buf, L"ProxyBodies: responses=%llu, received=%llu bytes, copied=%llu bytes (%.2f per received byte)",
+            body->responses.load(), body->receivedBytes.load(), body->copiedBytes.load(), body->receivedBytes ? (double)body->copiedBytes / body->receivedBytes : 0.0);
+        this->m_pApp->AddLog(buf, TVTest::LOG_TYPE_INFORMATION);
+    }
+    if (auto replay = dynamic_cast<ProxyReplayTransport*>(this->proxyArchiveTransport.get()))
+    {
+        auto statistics = replay->GetStatistics();
+        swprintf_s(buf, L"ProxyReplay: exchanges=%zu, hits=%llu, misses=%llu", replay->Size(), statistics.hits, statistics.misses);
+        this->m_pApp->AddLog(buf, TVTest::LOG_TYPE_INFORMATION);
+    }
+    if (this->proxySession)
+    {
+        auto metrics = this->proxySession->GetMetrics();
+        for (auto&& line : metrics->Format())
+        {
+            this->m_pApp->AddLog(line.c_str(), TVTest::LOG_TYPE_INFORMATION);
+        }
+        // 集計用に同じものをJSONでも書き出す
+        auto path = (std::filesystem::path(this->baseDirectory) / L"ProxyStatistics.json").wstring();
+        auto json = metrics->ToJson().dump(2);
+        wil::unique_hfile file(CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+        DWORD written;
+        if (file && json.size() <= MAXDWORD && WriteFile(file.get(), json.data(), (DWORD)json.size(), &written, nullptr) && written == json.size())
+        {
+            this->m_pApp->AddLog((L"ProxyStatistics: " + path).c_str(), TVTest::LOG_TYPE_INFORMATION);
+        }
+        else
+        {
+            this->m_pApp->AddLog((path + L"に書き出せませんでした。").c_str(), TVTest::LOG_TYPE_WARNING);
+        }
+    }
+    if (this->proxyCache)
+    {
+        auto cache = this->proxyCache->GetStatistics();
+        auto lookups = cache.hits + cache.revalidated + cache.misses;
+        swprintf_s(buf, L"ProxyCache: hits=%llu (negative %llu), revalidated=%llu, misses=%llu (hit rate %.1f%%), bypassed=%llu, memory=%zu bytes (%zu entries), disk=%zu bytes (%zu entries)",
+            cache.hits, cache.negativeHits, cache.revalidated, cache.misses, lookups ? (cache.hits + cache.revalidated) * 100.0 / lookups : 0.0, cache.bypassed, cache.memorySize, cache.memoryEntries, cache.diskSize, cache.diskEntries);
+        this->m_pApp->AddLog(buf, TVTest::LOG_TYPE_INFORMATION);
+    }
+    if (this->sharedMemoryTransport)
+    {
+        swprintf_s(buf, L"SharedMemory: dropped=%llu frames", this->sharedMemoryTransport->GetDroppedFrames());
+        this->m_pApp->AddLog(buf, TVTest::LOG_TYPE_INFORMATION);
+    }
+    if (this->webSocketTransport)
+    {
+        auto webSocket = this->webSocketTransport->GetStatistics();
+        swprintf_s(buf, L"WebSocket: clients=%zu, dropped=%llu bytes (%llu overflows)", webSocket.clients, webSocket.droppedBytes, webSocket.overflows);
+        this->m_pApp->AddLog(buf, TVTest::LOG_TYPE_INFORMATION);
+    }
+}
+
+// ページ以外の送信先には元のTSが必要なので、その場合は解析したパケットもTSに残したままWebSocketの/decoded向けにのみ解析する
+void CDataBroadcastingWV2::UpdateNativeDecoding()
+{
+    bool keepPackets = !this->externalTransports.empty();
+    this->packetQueue.setNativeDecoding(this->webSocketTransport || (this->pageDecodedFrames && !keepPackets), keepPackets);
+}
+
 HWND CDataBroadcastingWV2::GetFullscreenWindow()
 {
     TVTest::HostInfo info;
@@ -1166,7 +1762,7 @@ void CDataBroadcastingWV2::InitWebView2()
                 {
                     proxyUrl = uri.get() + wcslen(post);
                 }
-                if (this->proxySession && proxyUrl && this->enableNetwork)
+                if (this->proxyPipeline && proxyUrl && this->enableNetwork)
                 {
                     return this->Proxy(args, proxyUrl);
                 }
@@ -1194,6 +1790,12 @@ void CDataBroadcastingWV2::InitWebView2()
                 wil::unique_cotaskmem_string message;
                 if (SUCCEEDED(args->get_WebMessageAsJson(message.put())))
                 {
+                    // 頻繁に届くメッセージはUTF-16のまま読んで処理する
+                    if (this->HandleFrequentWebMessage(message.get()))
+                    {
+                        return S_OK;
+                    }
+
                     auto messageUTF8 = wstrToUTF8String(message.get());
 
                     auto a = nlohmann::json::parse(messageUTF8);
@@ -1306,19 +1908,11 @@ void CDataBroadcastingWV2::InitWebView2()
                                 }
                                 if (value)
                                 {
-                                    nlohmann::json msg{ { "type", "changeInput" }, { "value", wstrToUTF8String(value.get()) } };
-                                    std::stringstream ss;
-                                    ss << msg;
-                                    auto wjson = utf8StrToWString(ss.str().c_str());
-                                    this->webView->PostWebMessageAsJson(wjson.c_str());
+                                    this->webView->PostWebMessageAsJson(this->messageWriter.Begin(L"changeInput").Add(L"value", value.get()).End());
                                 }
                                 else
                                 {
-                                    nlohmann::json msg{ { "type", "cancelInput" } };
-                                    std::stringstream ss;
-                                    ss << msg;
-                                    auto wjson = utf8StrToWString(ss.str().c_str());
-                                    this->webView->PostWebMessageAsJson(wjson.c_str());
+                                    this->webView->PostWebMessageAsJson(this->messageWriter.Begin(L"cancelInput").End());
                                 }
                             };
                             auto inputDialog = new InputDialog(
@@ -1389,6 +1983,25 @@ void CDataBroadcastingWV2::InitWebView2()
                             }
                         }
                     }
+                    else if (type == "capabilities")
+                    {
+                        auto&& serviceChanged = a["serviceChanged"];
+                        this->pageSupportsServiceChanged = serviceChanged.is_boolean() && serviceChanged.get<bool>();
+                        auto&& streamFormats = a["streamFormats"];
+                        bool binaryFraming = false;
+                        bool decodedFrames = false;
+                        if (streamFormats.is_array())
+                        {
+                            for (auto&& format : streamFormats)
+                            {
+                                binaryFraming |= format.is_string() && format.get<std::string>() == "binary1";
+                                decodedFrames |= format.is_string() && format.get<std::string>() == "decoded1";
+                            }
+                        }
+                        this->pageTransport->SetBinaryFraming(binaryFraming);
+                        this->pageDecodedFrames = binaryFraming && decodedFrames;
+                        this->UpdateNativeDecoding();
+                    }
                     else if (type == "startBrowser")
                     {
                         auto uri = a["uri"].get<std::string>();
@@ -1409,6 +2022,20 @@ void CDataBroadcastingWV2::InitWebView2()
                 return S_OK;
             }).Get(), &token);
 
+            this->webView->add_NavigationStarting(Callback<ICoreWebView2NavigationStartingEventHandler>(
+                [this](ICoreWebView2* sender, ICoreWebView2NavigationStartingEventArgs* args) -> HRESULT {
+                // 読み込み完了まではキューに溜めておく
+                this->webViewNavigating = true;
+                this->pageSupportsServiceChanged = false;
+                // 読み込まれたページが対応を通知してくるまではBase64で送る
+                this->pageTransport->SetBinaryFraming(false);
+                // WebSocketの/decodedのクライアントが使っていれば続ける
+                this->pageDecodedFrames = false;
+                this->UpdateNativeDecoding();
+                this->pendingServiceUrl.clear();
+                return S_OK;
+            }).Get(), &token);
+
             this->webView->add_NavigationCompleted(Callback<ICoreWebView2NavigationCompletedEventHandler>(
                 [this](ICoreWebView2* sender, ICoreWebView2NavigationCompletedEventArgs* args) -> HRESULT {
                 if (!this->webViewLoaded)
@@ -1425,6 +2052,9 @@ void CDataBroadcastingWV2::InitWebView2()
                 }
                 this->UpdateAudioStream();
                 this->webViewLoaded = true;
+                this->webViewNavigating = false;
+                this->Replay();
+                PostMessageW(this->hMessageWnd, WM_APP_PACKET, 0, 0);
                 if (this->oneSegWindowIsShown)
                 {
                     this->webView->PostWebMessageAsJson(LR"({"type":"launchOneSeg"})");
@@ -1454,6 +2084,62 @@ void CDataBroadcastingWV2::InitWebView2()
 }
 
 // cors無効コマンドライン引数を追加するなどでWebView2側に任せることも可能ではあるけど融通が利かないためWinHTTPを使う あとバージョン依存の問題があるらしい?
+// ProxyPipelineの応答をWM_APP_RESPONSEでメッセージウィンドウに送り、ページに返してdeferralを完了する
+class CDataBroadcastingWV2::ProxyDeferralResponder : public ProxyResponder
+{
+    CDataBroadcastingWV2* plugin;
+    wil::com_ptr<ICoreWebView2Deferral> deferral;
+    wil::com_ptr<ICoreWebView2WebResourceRequestedEventArgs> args;
+
+    void Post(uint32_t statusCode, const std::wstring& statusCodeText, const std::wstring& headers, wil::com_ptr<IStream> stream, const std::wstring& host)
+    {
+        auto response = new DeferralResponse
+        {
+            this->deferral,
+            this->args,
+            statusCode,
+            statusCodeText,
+            headers,
+            std::move(stream),
+            host,
+            host.empty() ? 0 : ProxyMetrics::Now(),
+        };
+        PostMessageW(this->plugin->hMessageWnd, WM_APP_RESPONSE, 0, (LPARAM)response);
+    }
+public:
+    ProxyDeferralResponder(CDataBroadcastingWV2* plugin, wil::com_ptr<ICoreWebView2Deferral> deferral, wil::com_ptr<ICoreWebView2WebResourceRequestedEventArgs> args)
+        : plugin(plugin), deferral(std::move(deferral)), args(std::move(args))
+    {
+    }
+
+    void Respond(uint32_t statusCode, const std::wstring& statusCodeText, const std::wstring& headers, std::shared_ptr<const void> owner, const uint8_t* content, size_t contentSize, const std::wstring& host) override
+    {
+        if (!this->plugin->hMessageWnd)
+        {
+            this->deferral->Complete();
+            return;
+        }
+        this->Post(statusCode, statusCodeText, headers, Make<ProxyBufferStream>(std::move(owner), content, contentSize).Get(), host);
+    }
+
+    void RespondStreaming(uint32_t statusCode, const std::wstring& statusCodeText, const std::wstring& headers, std::shared_ptr<ProxyPipe> pipe, size_t reader, uint64_t contentLength, const std::wstring& host) override
+    {
+        if (!this->plugin->hMessageWnd)
+        {
+            // 全員が閉じれば受信は中断される
+            pipe->CloseReader(reader);
+            this->deferral->Complete();
+            return;
+        }
+        this->Post(statusCode, statusCodeText, headers, Make<ProxyPipeStream>(std::move(pipe), reader, contentLength).Get(), host);
+    }
+
+    void Fail() override
+    {
+        this->deferral->Complete();
+    }
+};
+
 HRESULT CDataBroadcastingWV2::Proxy(ICoreWebView2WebResourceRequestedEventArgs* args, LPCWSTR proxyUrl)
 {
     wil::com_ptr<ICoreWebView2WebResourceRequest> request;
@@ -1497,24 +2183,16 @@ HRESULT CDataBroadcastingWV2::Proxy(ICoreWebView2WebResourceRequestedEventArgs*
     {
         return hr;
     }
+    // 転送するものはProxyPipelineが選ぶ
     BOOL hasCurrent = false;
-    std::vector<std::pair<wil::unique_cotaskmem_string, wil::unique_cotaskmem_string>> headersCo;
-    std::vector<std::pair<LPCWSTR, LPCWSTR>> headersPtr
-    {
-        { L"Pragma", L"no-cache" },
-        { L"Accept-Language", L"ja" },
-    };
+    std::vector<std::pair<std::wstring, std::wstring>> requestHeaders;
     while (SUCCEEDED(iterator->get_HasCurrentHeader(&hasCurrent)) && hasCurrent)
     {
         wil::unique_cotaskmem_string name;
         wil::unique_cotaskmem_string value;
         if (SUCCEEDED(iterator->GetCurrentHeader(name.put(), value.put())))
         {
-            if (!_wcsicmp(name.get(), L"if-modified-since") || !_wcsicmp(name.get(), L"cache-control") || !_wcsicmp(name.get(), L"content-type"))
-            {
-                headersPtr.push_back({ name.get(), value.get() });
-                headersCo.push_back({ std::move(name), std::move(value) });
-            }
+            requestHeaders.push_back({ name.get(), value.get() });
             BOOL hasNext;
             if (FAILED(iterator->MoveNext(&hasNext)))
             {
@@ -1522,36 +2200,17 @@ HRESULT CDataBroadcastingWV2::Proxy(ICoreWebView2WebResourceRequestedEventArgs*
             }
         }
     }
-    wil::com_ptr<ICoreWebView2Deferral> deferral;
-    args->GetDeferral(deferral.put());
-    if (!ProxyRequest::RequestAsync(*this->proxySession.get(), proxyUrl, method.get(), std::move(contentBuffer), headersPtr, [deferral]() -> void
-    {
-        // error
-        deferral->Complete();
-    }, [this, args = wil::com_ptr<ICoreWebView2WebResourceRequestedEventArgs>(args), deferral](DWORD statusCode, LPCWSTR statusCodeText, LPCWSTR headers, size_t contentLength, BYTE* content) -> void
+    // ページの表示に必要なものを先にする POSTはProxyPipelineが最後にする
+    auto priority = ProxyPriority::Document;
+    COREWEBVIEW2_WEB_RESOURCE_CONTEXT resourceContext;
+    if (SUCCEEDED(args->get_ResourceContext(&resourceContext)) && (resourceContext == COREWEBVIEW2_WEB_RESOURCE_CONTEXT_IMAGE || resourceContext == COREWEBVIEW2_WEB_RESOURCE_CONTEXT_MEDIA || resourceContext == COREWEBVIEW2_WEB_RESOURCE_CONTEXT_FONT))
     {
-        if (this->hMessageWnd)
-        {
-            auto response = new DeferralResponse
-            {
-                deferral,
-                args,
-                statusCode,
-                std::wstring(statusCodeText),
-                std::wstring(headers),
-                std::vector<BYTE>(content, content + contentLength),
-            };
-            PostMessageW(this->hMessageWnd, WM_APP_RESPONSE, 0, (LPARAM)response);
-        }
-        else
-        {
-            deferral->Complete();
-        }
-        return;
-    }))
-    {
-        deferral->Complete();
+        priority = ProxyPriority::Resource;
     }
+    wil::com_ptr<ICoreWebView2Deferral> deferral;
+    args->GetDeferral(deferral.put());
+    auto responder = std::make_shared<ProxyDeferralResponder>(this, std::move(deferral), wil::com_ptr<ICoreWebView2WebResourceRequestedEventArgs>(args));
+    this->proxyPipeline->Request(proxyUrl, method.get(), std::move(contentBuffer), requestHeaders, priority, std::move(responder));
     return S_OK;
 }
 
@@ -1594,6 +2253,98 @@ void CDataBroadcastingWV2::ResizeVideoWindow()
     }
 }
 
+// 処理できなかった場合はfalseを返すので呼び出し側でnlohmann::jsonで読みなおす
+bool CDataBroadcastingWV2::HandleFrequentWebMessage(LPCWSTR json)
+{
+    JsonMessageReader reader;
+    if (!reader.Parse(json))
+    {
+        return false;
+    }
+    auto type = reader.Type();
+    switch (JsonMessageTypeHash(type))
+    {
+    case JsonMessageTypeHash(L"videoChanged"):
+    {
+        RECT rect;
+        bool invisible;
+        if (type != L"videoChanged" || !DecodeVideoChanged(reader, rect, invisible))
+        {
+            return false;
+        }
+        this->invisible = invisible;
+        this->videoRect = rect;
+        this->RequestCoalescedUpdate(COALESCED_UPDATE_VIDEO);
+        return true;
+    }
+    case JsonMessageTypeHash(L"invisible"):
+    {
+        bool invisible;
+        if (type != L"invisible" || !reader.GetBool(L"invisible", invisible))
+        {
+            return false;
+        }
+        this->invisible = invisible;
+        this->RequestCoalescedUpdate(COALESCED_UPDATE_VIDEO);
+        return true;
+    }
+    case JsonMessageTypeHash(L"status"):
+    {
+        if (type != L"status" || !DecodeStatus(reader, this->receivedStatus))
+        {
+            return false;
+        }
+        // 文字列の領域を使いまわすため入れ替える
+        std::swap(this->status, this->receivedStatus);
+        this->RequestCoalescedUpdate(COALESCED_UPDATE_STATUS);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// 状態は更新済みなので反映だけを間引く
+// 間隔が空いていればすぐに反映し、その後の間隔の間に届いた分は最新のものだけをタイマーで反映する
+void CDataBroadcastingWV2::RequestCoalescedUpdate(CoalescedUpdate update)
+{
+    if (!this->messageCoalesceInterval || !this->hMessageWnd)
+    {
+        this->ApplyCoalescedUpdates(update);
+        return;
+    }
+    if (!this->coalesceTimerActive)
+    {
+        this->ApplyCoalescedUpdates(update);
+        this->coalesceTimerActive = !!SetTimer(this->hMessageWnd, IDT_COALESCE, this->messageCoalesceInterval, nullptr);
+        return;
+    }
+    if (this->pendingUpdates & update)
+    {
+        if (update == COALESCED_UPDATE_VIDEO)
+        {
+            this->suppressedVideoUpdates++;
+        }
+        else
+        {
+            this->suppressedStatusUpdates++;
+        }
+    }
+    this->pendingUpdates |= update;
+}
+
+void CDataBroadcastingWV2::ApplyCoalescedUpdates(int updates)
+{
+    if (updates & COALESCED_UPDATE_VIDEO)
+    {
+        this->ResizeVideoWindow();
+    }
+    if (updates & COALESCED_UPDATE_STATUS)
+    {
+        this->m_pApp->StatusItemNotify(1, TVTest::STATUS_ITEM_NOTIFY_REDRAW);
+    }
+}
+
 void CDataBroadcastingWV2::Disable(bool finalize)
 {
     this->RestoreMainAudio();
@@ -1618,8 +2369,16 @@ void CDataBroadcastingWV2::Disable(bool finalize)
         this->webViewController.reset();
     }
     this->webViewLoaded = false;
+    this->webViewNavigating = false;
 
     this->packetQueue.clear();
+    this->ClearReplayBuffer();
+    if (this->coalesceTimerActive)
+    {
+        KillTimer(this->hMessageWnd, IDT_COALESCE);
+        this->coalesceTimerActive = false;
+    }
+    this->pendingUpdates = 0;
 
     if (this->hMessageWnd)
     {
@@ -1628,7 +2387,15 @@ void CDataBroadcastingWV2::Disable(bool finalize)
         this->hMessageWnd = nullptr;
     }
 
+    // 実行中のリクエストはproxyPipelineとその先のproxySessionを終わるまで保持する
+    if (this->proxyPipeline)
+    {
+        this->proxyPipeline->CancelAll();
+        this->proxyPipeline = nullptr;
+    }
+    this->proxyArchiveTransport = nullptr;
     this->proxySession = nullptr;
+    this->proxyCache = nullptr;
 
     this->inputDialog = nullptr;
 
@@ -1695,7 +2462,63 @@ bool CDataBroadcastingWV2::OnPluginEnable(bool fEnable)
         this->EnablePanelButtons(true);
         if (this->GetIniItem(L"EnableNetwork", 0))
         {
-            this->proxySession = std::unique_ptr<ProxySession>(new ProxySession());
+            this->proxySession = std::make_shared<ProxySession>(this->proxyMaxConnectionsPerServer, this->proxyConnectTimeout, this->proxyReceiveTimeout, this->proxyDecompression);
+            // 相対パスはプラグインのディレクトリから
+            if (!this->proxyReplayFile.empty())
+            {
+                auto replayPath = std::filesystem::path(this->baseDirectory) / this->proxyReplayFile;
+                std::vector<ProxyExchange> exchanges;
+                if (ProxyReadArchive(replayPath, exchanges))
+                {
+                    this->proxyArchiveTransport = std::make_shared<ProxyReplayTransport>(std::move(exchanges), this->proxyReplaySpeed);
+                    this->m_pApp->AddLog((replayPath.wstring() + L"を再生します。").c_str(), TVTest::LOG_TYPE_INFORMATION);
+                }
+                else
+                {
+                    this->m_pApp->AddLog((replayPath.wstring() + L"を読み込めませんでした。").c_str(), TVTest::LOG_TYPE_WARNING);
+                }
+            }
+            else if (!this->proxyRecordFile.empty())
+            {
+                auto recordPath = std::filesystem::path(this->baseDirectory) / this->proxyRecordFile;
+                auto writer = std::make_shared<ProxyArchiveWriter>(recordPath);
+                if (writer->IsOpen())
+                {
+                    this->proxyArchiveTransport = std::make_shared<ProxyRecordingTransport>(this->proxySession, std::move(writer));
+                    this->m_pApp->AddLog((recordPath.wstring() + L"に記録します。").c_str(), TVTest::LOG_TYPE_INFORMATION);
+                }
+                else
+                {
+                    this->m_pApp->AddLog((recordPath.wstring() + L"に書き込めませんでした。").c_str(), TVTest::LOG_TYPE_WARNING);
+                }
+            }
+            if (this->proxyCacheMemoryMaxSize && !this->proxyArchiveTransport)
+            {
+                this->proxyCache = std::make_shared<ProxyCache>(this->proxyCacheMemoryMaxSize, (std::filesystem::path(this->baseDirectory) / L"ProxyCache").wstring(), this->proxyCacheDiskMaxSize, this->proxyNegativeCacheLifetime);
+            }
+            ProxyPipelineOptions options;
+            options.requestHeaderRules = this->proxyRequestHeaderRules;
+            options.responseHeaderRules = this->proxyResponseHeaderRules;
+            options.streamBufferSize = this->proxyArchiveTransport ? 0 : this->proxyStreamBufferSize;
+            options.maxRequestsPerHost = this->proxyMaxRequestsPerHost;
+            options.maxRequests = this->proxyMaxRequests;
+            options.circuitBreakerFailures = this->proxyCircuitBreakerFailures;
+            options.circuitBreakerCoolDownMilliseconds = this->proxyCircuitBreakerCoolDown;
+            options.recordStart = [metrics = this->proxySession->GetMetrics()](const std::wstring& host, uint64_t queueMilliseconds) -> void
+            {
+                metrics->Record(host, [queueMilliseconds](ProxyMetrics::Host& hostMetrics)
+                {
+                    hostMetrics.queueMilliseconds.Add(queueMilliseconds);
+                });
+            };
+            options.recordRejected = [metrics = this->proxySession->GetMetrics()](const std::wstring& host) -> void
+            {
+                metrics->Record(host, [](ProxyMetrics::Host& hostMetrics)
+                {
+                    hostMetrics.failures[L"circuit-open"]++;
+                });
+            };
+            this->proxyPipeline = std::make_shared<ProxyPipeline>(this->proxyArchiveTransport ? this->proxyArchiveTransport : this->proxySession, this->proxyCache, std::move(options));
         }
     }
     else
@@ -1718,11 +2541,26 @@ void CDataBroadcastingWV2::Tune()
             baseUrl += std::to_wstring(this->currentService.ServiceID);
             baseUrl += L"&networkId=";
             baseUrl += std::to_wstring(this->currentChannel.NetworkID);
-            if (_wcsicmp(source.get(), baseUrl.c_str()))
+            auto currentUrl = this->pendingServiceUrl.empty() ? source.get() : this->pendingServiceUrl.c_str();
+            if (_wcsicmp(currentUrl, baseUrl.c_str()))
             {
+                // 前のサービスのページのための通信は不要になる
+                if (this->proxyPipeline)
+                {
+                    this->proxyPipeline->CancelAll();
+                }
                 this->oneSegWindow = nullptr;
                 this->RestoreVideoWindow();
-                this->webView->Navigate(baseUrl.c_str());
+                if (this->pageSupportsServiceChanged && this->webViewLoaded && !this->webViewNavigating)
+                {
+                    // 読み込み済みのページでサービスを切り替えればweb-bmlやフォントなどを読み込み直さずに済む
+                    this->pendingServiceUrl = baseUrl;
+                    this->webView->PostWebMessageAsJson(this->messageWriter.Begin(L"serviceChanged").Add(L"serviceId", (int)this->currentService.ServiceID).Add(L"networkId", (int)this->currentChannel.NetworkID).End());
+                }
+                else
+                {
+                    this->webView->Navigate(baseUrl.c_str());
+                }
                 this->usedKey.basic = true;
                 this->usedKey.dataButton = true;
                 this->usedKey.numericTuning = false;
@@ -1788,11 +2626,7 @@ void CDataBroadcastingWV2::UpdateCaptionState(bool showIndicator)
     {
         return;
     }
-    nlohmann::json msg{ { "type", "caption" }, { "enable", this->caption }, { "showIndicator", showIndicator } };
-    std::stringstream ss;
-    ss << msg;
-    auto wjson = utf8StrToWString(ss.str().c_str());
-    this->webView->PostWebMessageAsJson(wjson.c_str());
+    this->webView->PostWebMessageAsJson(this->messageWriter.Begin(L"caption").Add(L"enable", this->caption).Add(L"showIndicator", showIndicator).End());
 }
 
 void CDataBroadcastingWV2::UpdateVolume()
@@ -1801,11 +2635,7 @@ void CDataBroadcastingWV2::UpdateVolume()
     {
         return;
     }
-    nlohmann::json msg{ { "type", "volume" }, { "value", this->useTVTestVolume ? this->currentVolume / (double)MAX_VOLUME : 1.0 } };
-    std::stringstream ss;
-    ss << msg;
-    auto wjson = utf8StrToWString(ss.str().c_str());
-    this->webView->PostWebMessageAsJson(wjson.c_str());
+    this->webView->PostWebMessageAsJson(this->messageWriter.Begin(L"volume").Add(L"value", this->useTVTestVolume ? this->currentVolume / (double)MAX_VOLUME : 1.0).End());
 }
 
 void CDataBroadcastingWV2::SetCaptionState(bool enable)
@@ -1848,11 +2678,7 @@ void CDataBroadcastingWV2::UpdateNetworkState()
     {
         return;
     }
-    nlohmann::json msg{ { "type", "enableNetwork" }, { "enable", this->enableNetwork } };
-    std::stringstream ss;
-    ss << msg;
-    auto wjson = utf8StrToWString(ss.str().c_str());
-    this->webView->PostWebMessageAsJson(wjson.c_str());
+    this->webView->PostWebMessageAsJson(this->messageWriter.Begin(L"enableNetwork").Add(L"enable", this->enableNetwork).End());
 }
 
 enum class UsedKeyType
@@ -1965,6 +2791,11 @@ bool CDataBroadcastingWV2::OnCommand(int ID)
             this->SetNetworkState(!this->enableNetwork);
             return true;
         }
+        case IDC_SHOW_STATISTICS:
+        {
+            this->ShowStatistics();
+            return true;
+        }
         case IDC_TOGGLE_CAPTION:
             this->SetCaptionState(!this->caption);
             return true;
@@ -2052,11 +2883,7 @@ bool CDataBroadcastingWV2::OnCommand(int ID)
             }
             if (post)
             {
-                nlohmann::json msg{ { "type", "key" }, { "keyCode", command->second.keyCode } };
-                std::stringstream ss;
-                ss << msg;
-                auto wjson = utf8StrToWString(ss.str().c_str());
-                this->webView->PostWebMessageAsJson(wjson.c_str());
+                this->webView->PostWebMessageAsJson(this->messageWriter.Begin(L"key").Add(L"keyCode", command->second.keyCode).End());
             }
             else if (command->second.commandName)
             {
@@ -2490,32 +3317,29 @@ void CDataBroadcastingWV2::UpdateAudioStream()
     {
         return;
     }
-    nlohmann::json msg{ { "type", "mainAudioStreamChanged" } };
+    if (!this->mainAudio.componentId.has_value() && !this->mainAudio.index.has_value())
+    {
+        return;
+    }
+    auto& msg = this->messageWriter.Begin(L"mainAudioStreamChanged");
     if (this->mainAudio.componentId.has_value())
     {
-        msg["componentId"] = this->mainAudio.componentId.value();
+        msg.Add(L"componentId", (int)this->mainAudio.componentId.value());
     }
-    else if (this->mainAudio.index.has_value())
+    else
     {
         auto index = this->mainAudio.index.value();
-        msg["index"] = index;
+        msg.Add(L"index", index);
         if (index >= 0 && _countof(this->currentService.AudioPID) > index && this->currentService.NumAudioPIDs > index)
         {
-            msg.push_back({ "pid", this->currentService.AudioPID[index] });
+            msg.Add(L"pid", (int)this->currentService.AudioPID[index]);
         }
     }
-    else
-    {
-        return;
-    }
     if (this->mainAudio.getChannelId().has_value())
     {
-        msg["channelId"] = this->mainAudio.getChannelId().value();
+        msg.Add(L"channelId", this->mainAudio.getChannelId().value());
     }
-    std::stringstream ss;
-    ss << msg;
-    auto wjson = utf8StrToWString(ss.str().c_str());
-    this->webView->PostWebMessageAsJson(wjson.c_str());
+    this->webView->PostWebMessageAsJson(msg.End());
 }
 
 // Index=1からサービスを変更したとしてもOnAudioStreamChangeは呼ばれない
@@ -0,0 +1,624 @@
+﻿#include "pch.h"
+#include "WebSocketServer.h"
+#include <ws2tcpip.h>
+#include <bcrypt.h>
+#include <climits>
+#include "base64.h"
+
+namespace
+{
+    // 送信が詰まっていなければ一度に読み書きする量
+    constexpr size_t receiveBufferSize = 4096;
+    // ハンドシェイクの要求の最大の大きさ
+    constexpr size_t maxRequestSize = 8192;
+    // クライアントからのフレーム(ping/closeのみを想定)の最大の大きさ
+    constexpr size_t maxReceivedFrameSize = 65536;
+    // WSAWaitForMultipleEventsで待てる数から待ち受け用と起床用を除いた分
+    constexpr size_t maxClients = WSA_MAXIMUM_WAIT_EVENTS - 2;
+
+    constexpr BYTE opcodeText = 0x1;
+    constexpr BYTE opcodeBinary = 0x2;
+    constexpr BYTE opcodeClose = 0x8;
+    constexpr BYTE opcodePing = 0x9;
+    constexpr BYTE opcodePong = 0xa;
+
+    std::string_view FindHeader(std::string_view request, std::string_view name)
+    {
+        size_t pos = request.find("\r\n");
+        while (pos != std::string_view::npos && pos + 2 < request.size())
+        {
+            pos += 2;
+            auto end = request.find("\r\n", pos);
+            auto line = request.substr(pos, end - pos);
+            if (line.size() > name.size() && line[name.size()] == ':' && !_strnicmp(line.data(), name.data(), name.size()))
+            {
+                auto value = line.substr(name.size() + 1);
+                while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+                {
+                    value.remove_prefix(1);
+                }
+                while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+                {
+                    value.remove_suffix(1);
+                }
+                return value;
+            }
+            pos = end;
+        }
+        return {};
+    }
+
+    // カンマ区切りのトークンの列にtokenが含まれるか (大文字小文字を区別しない)
+    bool HasToken(std::string_view value, std::string_view token)
+    {
+        while (!value.empty())
+        {
+            auto end = value.find(',');
+            auto item = value.substr(0, end);
+            value.remove_prefix(end == std::string_view::npos ? value.size() : end + 1);
+            while (!item.empty() && (item.front() == ' ' || item.front() == '\t'))
+            {
+                item.remove_prefix(1);
+            }
+            while (!item.empty() && (item.back() == ' ' || item.back() == '\t'))
+            {
+                item.remove_suffix(1);
+            }
+            if (item.size() == token.size() && !_strnicmp(item.data(), token.data(), token.size()))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 要求行のパスから配信内容を選ぶ クエリは無視する
+    bool ParseChannel(std::string_view request, WebSocketChannel& channel)
+    {
+        auto target = request.substr(4, request.find(' ', 4) - 4);
+        target = target.substr(0, target.find('?'));
+        if (target == "/")
+        {
+            channel = WebSocketChannel::Stream;
+            return true;
+        }
+        if (target == "/decoded")
+        {
+            channel = WebSocketChannel::Decoded;
+            return true;
+        }
+        return false;
+    }
+
+    // ブラウザで開かれた任意のページから接続されないようにOriginがあればローカルのもののみ許可する
+    bool IsAllowedOrigin(std::string_view origin)
+    {
+        if (origin.empty() || origin == "null" || origin.starts_with("file://"))
+        {
+            return true;
+        }
+        for (auto scheme : { std::string_view("http://"), std::string_view("https://") })
+        {
+            if (!origin.starts_with(scheme))
+            {
+                continue;
+            }
+            auto host = origin.substr(scheme.size());
+            for (auto local : { std::string_view("localhost"), std::string_view("127.0.0.1"), std::string_view("[::1]") })
+            {
+                if (host.starts_with(local) && (host.size() == local.size() || host[local.size()] == ':'))
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool ComputeAcceptKey(std::string_view key, std::string& accept)
+    {
+        static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        BCRYPT_ALG_HANDLE hAlg = nullptr;
+        if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&hAlg, BCRYPT_SHA1_ALGORITHM, nullptr, 0)))
+        {
+            return false;
+        }
+        BYTE hash[20];
+        BCRYPT_HASH_HANDLE hHash = nullptr;
+        bool success = BCRYPT_SUCCESS(BCryptCreateHash(hAlg, &hHash, nullptr, 0, nullptr, 0, 0));
+        if (success)
+        {
+            success = BCRYPT_SUCCESS(BCryptHashData(hHash, (PUCHAR)key.data(), (ULONG)key.size(), 0)) &&
+                BCRYPT_SUCCESS(BCryptHashData(hHash, (PUCHAR)guid, (ULONG)(sizeof(guid) - 1), 0)) &&
+                BCRYPT_SUCCESS(BCryptFinishHash(hHash, hash, sizeof(hash), 0));
+            BCryptDestroyHash(hHash);
+        }
+        BCryptCloseAlgorithmProvider(hAlg, 0);
+        if (!success)
+        {
+            return false;
+        }
+        WCHAR encoded[Base64EncodedLength(sizeof(hash)) + 1];
+        auto length = EncodeBase64(hash, sizeof(hash), encoded);
+        accept.assign(encoded, encoded + length);
+        return true;
+    }
+}
+
+WebSocketServer::WebSocketServer() : stopRequested(false)
+{
+    for (auto&& count : this->channelClientCounts)
+    {
+        count = 0;
+    }
+    static const char reset[] = R"({"type":"streamReset"})";
+    this->resetFrame = MakeFrame(opcodeText, (const BYTE*)reset, sizeof(reset) - 1);
+}
+
+WebSocketServer::~WebSocketServer()
+{
+    this->Stop();
+}
+
+WebSocketServer::Frame WebSocketServer::MakeFrame(BYTE opcode, const BYTE* data, size_t size)
+{
+    auto frame = std::make_shared<std::vector<BYTE>>();
+    frame->reserve(size + 10);
+    // FINを立てて分割しない サーバからはマスクしない
+    frame->push_back(0x80 | opcode);
+    if (size < 126)
+    {
+        frame->push_back((BYTE)size);
+    }
+    else if (size <= 0xffff)
+    {
+        frame->push_back(126);
+        frame->push_back((BYTE)(size >> 8));
+        frame->push_back((BYTE)size);
+    }
+    else
+    {
+        frame->push_back(127);
+        for (int shift = 56; shift >= 0; shift -= 8)
+        {
+            frame->push_back((BYTE)((uint64_t)size >> shift));
+        }
+    }
+    frame->insert(frame->end(), data, data + size);
+    return frame;
+}
+
+bool WebSocketServer::Start(unsigned short port, size_t maxClientQueueSize)
+{
+    this->Stop();
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData))
+    {
+        return false;
+    }
+    this->wsaStarted = true;
+    this->maxClientQueueSize = maxClientQueueSize;
+    this->listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (this->listenSocket == INVALID_SOCKET)
+    {
+        this->Stop();
+        return false;
+    }
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(this->listenSocket, (sockaddr*)&addr, sizeof(addr)) || listen(this->listenSocket, SOMAXCONN))
+    {
+        this->Stop();
+        return false;
+    }
+    this->listenEvent = WSACreateEvent();
+    this->wakeEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    if (this->listenEvent == WSA_INVALID_EVENT || !this->wakeEvent || WSAEventSelect(this->listenSocket, this->listenEvent, FD_ACCEPT))
+    {
+        this->Stop();
+        return false;
+    }
+    this->stopRequested = false;
+    this->thread = std::thread([this]() {
+        this->Run();
+    });
+    return true;
+}
+
+void WebSocketServer::Stop()
+{
+    if (this->thread.joinable())
+    {
+        this->stopRequested = true;
+        SetEvent(this->wakeEvent);
+        this->thread.join();
+    }
+    for (auto&& client : this->clients)
+    {
+        this->CloseClient(*client);
+    }
+    this->clients.clear();
+    for (auto&& count : this->channelClientCounts)
+    {
+        count = 0;
+    }
+    if (this->listenSocket != INVALID_SOCKET)
+    {
+        closesocket(this->listenSocket);
+        this->listenSocket = INVALID_SOCKET;
+    }
+    if (this->listenEvent != WSA_INVALID_EVENT)
+    {
+        WSACloseEvent(this->listenEvent);
+        this->listenEvent = WSA_INVALID_EVENT;
+    }
+    if (this->wakeEvent)
+    {
+        CloseHandle(this->wakeEvent);
+        this->wakeEvent = nullptr;
+    }
+    if (this->wsaStarted)
+    {
+        WSACleanup();
+        this->wsaStarted = false;
+    }
+}
+
+bool WebSocketServer::HasClients(WebSocketChannel channel) const
+{
+    return this->channelClientCounts[(size_t)channel] != 0;
+}
+
+void WebSocketServer::BroadcastBinary(WebSocketChannel channel, const BYTE* data, size_t size)
+{
+    if (!this->HasClients(channel))
+    {
+        return;
+    }
+    this->Broadcast(channel, MakeFrame(opcodeBinary, data, size));
+}
+
+void WebSocketServer::BroadcastText(WebSocketChannel channel, const char* utf8, size_t size)
+{
+    if (!this->HasClients(channel))
+    {
+        return;
+    }
+    this->Broadcast(channel, MakeFrame(opcodeText, (const BYTE*)utf8, size));
+}
+
+void WebSocketServer::Broadcast(WebSocketChannel channel, const Frame& frame)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        for (auto&& client : this->clients)
+        {
+            if (client->handshaken && !client->closing && client->channel == channel)
+            {
+                this->Enqueue(*client, frame);
+            }
+        }
+    }
+    SetEvent(this->wakeEvent);
+}
+
+// mutexを獲得した状態で呼ぶ
+void WebSocketServer::Enqueue(Client& client, const Frame& frame)
+{
+    if (client.queueSize + frame->size() > this->maxClientQueueSize && !client.queue.empty())
+    {
+        // 送信が追いつかないクライアントは途中まで送ったフレーム以外を捨てて組み立て途中のデータを破棄させる
+        auto keep = client.sentOffset ? 1 : 0;
+        while (client.queue.size() > (size_t)keep)
+        {
+            auto size = client.queue.back()->size();
+            client.queueSize -= size;
+            this->statistics.droppedBytes += size;
+            client.queue.pop_back();
+        }
+        this->statistics.overflows++;
+        client.queue.push_back(this->resetFrame);
+        client.queueSize += this->resetFrame->size();
+    }
+    client.queue.push_back(frame);
+    client.queueSize += frame->size();
+}
+
+WebSocketServer::Statistics WebSocketServer::GetStatistics()
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto statistics = this->statistics;
+    statistics.clients = this->clients.size();
+    return statistics;
+}
+
+void WebSocketServer::Run()
+{
+    std::vector<WSAEVENT> events;
+    while (!this->stopRequested)
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            events.clear();
+            events.push_back(this->wakeEvent);
+            events.push_back(this->listenEvent);
+            for (auto&& client : this->clients)
+            {
+                events.push_back(client->event);
+            }
+        }
+        if (WSAWaitForMultipleEvents((DWORD)events.size(), events.data(), FALSE, WSA_INFINITE, FALSE) == WSA_WAIT_FAILED)
+        {
+            break;
+        }
+        if (this->stopRequested)
+        {
+            break;
+        }
+        std::lock_guard<std::mutex> lock(this->mutex);
+        WSANETWORKEVENTS networkEvents;
+        if (!WSAEnumNetworkEvents(this->listenSocket, this->listenEvent, &networkEvents) && (networkEvents.lNetworkEvents & FD_ACCEPT))
+        {
+            this->Accept();
+        }
+        for (auto&& client : this->clients)
+        {
+            bool alive = true;
+            if (!WSAEnumNetworkEvents(client->socket, client->event, &networkEvents))
+            {
+                if (networkEvents.lNetworkEvents & FD_READ)
+                {
+                    alive = this->Receive(*client);
+                }
+                if (networkEvents.lNetworkEvents & FD_CLOSE)
+                {
+                    alive = false;
+                }
+            }
+            // FD_WRITEが来ていなくてもキューに追加されていれば送る
+            if (alive)
+            {
+                alive = this->Send(*client);
+            }
+            if (!alive)
+            {
+                this->CloseClient(*client);
+            }
+        }
+        std::erase_if(this->clients, [](const std::unique_ptr<Client>& client) {
+            return client->socket == INVALID_SOCKET;
+        });
+        size_t counts[(size_t)WebSocketChannel::Count] = {};
+        for (auto&& client : this->clients)
+        {
+            if (client->handshaken && !client->closing)
+            {
+                counts[(size_t)client->channel]++;
+            }
+        }
+        for (size_t i = 0; i < (size_t)WebSocketChannel::Count; i++)
+        {
+            this->channelClientCounts[i] = counts[i];
+        }
+    }
+}
+
+// mutexを獲得した状態で呼ぶ
+void WebSocketServer::Accept()
+{
+    while (true)
+    {
+        auto s = accept(this->listenSocket, nullptr, nullptr);
+        if (s == INVALID_SOCKET)
+        {
+            return;
+        }
+        if (this->clients.size() >= maxClients)
+        {
+            closesocket(s);
+            continue;
+        }
+        auto client = std::make_unique<Client>();
+        client->socket = s;
+        client->event = WSACreateEvent();
+        // WSAEventSelectでノンブロッキングになる
+        if (client->event == WSA_INVALID_EVENT || WSAEventSelect(s, client->event, FD_READ | FD_WRITE | FD_CLOSE))
+        {
+            this->CloseClient(*client);
+            continue;
+        }
+        BOOL noDelay = TRUE;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+        this->clients.push_back(std::move(client));
+    }
+}
+
+bool WebSocketServer::Receive(Client& client)
+{
+    BYTE buf[receiveBufferSize];
+    while (true)
+    {
+        auto result = recv(client.socket, (char*)buf, sizeof(buf), 0);
+        if (result == 0)
+        {
+            return false;
+        }
+        if (result == SOCKET_ERROR)
+        {
+            return WSAGetLastError() == WSAEWOULDBLOCK;
+        }
+        if (client.closing)
+        {
+            continue;
+        }
+        client.received.insert(client.received.end(), buf, buf + result);
+        if (!client.handshaken)
+        {
+            if (!this->Handshake(client))
+            {
+                return false;
+            }
+        }
+        if (client.handshaken && !this->ProcessFrames(client))
+        {
+            return false;
+        }
+    }
+}
+
+bool WebSocketServer::Handshake(Client& client)
+{
+    std::string_view request((const char*)client.received.data(), client.received.size());
+    auto end = request.find("\r\n\r\n");
+    if (end == std::string_view::npos)
+    {
+        return client.received.size() <= maxRequestSize;
+    }
+    request = request.substr(0, end + 2);
+    auto key = FindHeader(request, "Sec-WebSocket-Key");
+    std::string accept;
+    std::string response;
+    if (!request.starts_with("GET ") || !HasToken(FindHeader(request, "Upgrade"), "websocket") || !HasToken(FindHeader(request, "Connection"), "Upgrade") || key.empty())
+    {
+        // WebSocketの要求ではない
+        response = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+    else if (FindHeader(request, "Sec-WebSocket-Version") != "13")
+    {
+        response = "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+    else if (!IsAllowedOrigin(FindHeader(request, "Origin")))
+    {
+        response = "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+    else if (!ParseChannel(request, client.channel))
+    {
+        response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+    else if (!ComputeAcceptKey(key, accept))
+    {
+        response = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+    else
+    {
+        response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " + accept + "\r\n\r\n";
+        client.handshaken = true;
+    }
+    client.closing = !client.handshaken;
+    client.received.erase(client.received.begin(), client.received.begin() + end + 4);
+    auto frame = std::make_shared<std::vector<BYTE>>(response.begin(), response.end());
+    client.queue.push_back(frame);
+    client.queueSize += frame->size();
+    return true;
+}
+
+bool WebSocketServer::ProcessFrames(Client& client)
+{
+    auto&& received = client.received;
+    size_t pos = 0;
+    while (received.size() - pos >= 2)
+    {
+        auto p = received.data() + pos;
+        auto available = received.size() - pos;
+        auto opcode = p[0] & 0x0f;
+        bool masked = !!(p[1] & 0x80);
+        uint64_t length = p[1] & 0x7f;
+        size_t headerSize = 2;
+        if (length == 126)
+        {
+            headerSize += 2;
+        }
+        else if (length == 127)
+        {
+            headerSize += 8;
+        }
+        // クライアントからのフレームは必ずマスクされる
+        if (!masked)
+        {
+            return false;
+        }
+        headerSize += 4;
+        if (available < headerSize)
+        {
+            break;
+        }
+        if (length >= 126)
+        {
+            length = 0;
+            for (size_t i = 2; i < headerSize - 4; i++)
+            {
+                length = (length << 8) | p[i];
+            }
+        }
+        if (length > maxReceivedFrameSize)
+        {
+            return false;
+        }
+        if (available < headerSize + length)
+        {
+            break;
+        }
+        auto mask = p + headerSize - 4;
+        auto payload = p + headerSize;
+        for (size_t i = 0; i < length; i++)
+        {
+            payload[i] ^= mask[i & 3];
+        }
+        if (opcode == opcodeClose)
+        {
+            auto frame = MakeFrame(opcodeClose, payload, std::min<size_t>((size_t)length, 2));
+            client.queue.push_back(frame);
+            client.queueSize += frame->size();
+            client.closing = true;
+            pos = received.size();
+            break;
+        }
+        if (opcode == opcodePing)
+        {
+            this->Enqueue(client, MakeFrame(opcodePong, payload, (size_t)length));
+        }
+        pos += headerSize + (size_t)length;
+    }
+    received.erase(received.begin(), received.begin() + pos);
+    return true;
+}
+
+bool WebSocketServer::Send(Client& client)
+{
+    while (!client.queue.empty())
+    {
+        auto&& frame = client.queue.front();
+        auto remaining = frame->size() - client.sentOffset;
+        auto result = send(client.socket, (const char*)frame->data() + client.sentOffset, (int)std::min<size_t>(remaining, INT_MAX), 0);
+        if (result == SOCKET_ERROR)
+        {
+            // 送れるようになればFD_WRITEが通知される
+            return WSAGetLastError() == WSAEWOULDBLOCK;
+        }
+        client.sentOffset += result;
+        if (client.sentOffset < frame->size())
+        {
+            continue;
+        }
+        client.queueSize -= frame->size();
+        client.queue.pop_front();
+        client.sentOffset = 0;
+    }
+    return !client.closing;
+}
+
+void WebSocketServer::CloseClient(Client& client)
+{
+    if (client.socket != INVALID_SOCKET)
+    {
+        closesocket(client.socket);
+        client.socket = INVALID_SOCKET;
+    }
+    if (client.event != WSA_INVALID_EVENT)
+    {
+        WSACloseEvent(client.event);
+        client.event = WSA_INVALID_EVENT;
+    }
+}
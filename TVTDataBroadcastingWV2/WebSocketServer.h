@@ -0,0 +1,84 @@
+﻿#pragma once
+#include <winsock2.h>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// クライアントが接続するパスで選ぶ配信内容
+enum class WebSocketChannel
+{
+    // "/" TSをバイナリメッセージで
+    Stream,
+    // "/decoded" TSDecoderで解析したものをweb-bmlのResponseMessageのテキストメッセージで
+    Decoded,
+    Count,
+};
+
+// ループバックのみで待ち受ける簡易WebSocketサーバ
+// 受信データを複数のクライアントに配る用途なのでクライアントからのメッセージはping/close以外無視する
+// フレームは一度だけ組み立ててクライアント間で共有し、送信はクライアントごとのキューから専用のスレッドで行う
+class WebSocketServer
+{
+public:
+    struct Statistics
+    {
+        size_t clients = 0;
+        // キューが溢れて捨てたバイト数と回数
+        uint64_t droppedBytes = 0;
+        uint64_t overflows = 0;
+    };
+private:
+    using Frame = std::shared_ptr<const std::vector<BYTE>>;
+    struct Client
+    {
+        SOCKET socket = INVALID_SOCKET;
+        WSAEVENT event = WSA_INVALID_EVENT;
+        bool handshaken = false;
+        WebSocketChannel channel = WebSocketChannel::Stream;
+        // キューを送り終えたら切断する
+        bool closing = false;
+        std::vector<BYTE> received;
+        std::deque<Frame> queue;
+        size_t queueSize = 0;
+        // queueの先頭のフレームの送信済みバイト数
+        size_t sentOffset = 0;
+    };
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Client>> clients;
+    std::thread thread;
+    SOCKET listenSocket = INVALID_SOCKET;
+    WSAEVENT listenEvent = WSA_INVALID_EVENT;
+    HANDLE wakeEvent = nullptr;
+    std::atomic<bool> stopRequested;
+    // 接続がなければフレームを組み立てない
+    std::atomic<size_t> channelClientCounts[(size_t)WebSocketChannel::Count];
+    bool wsaStarted = false;
+    size_t maxClientQueueSize = 0;
+    Frame resetFrame;
+    Statistics statistics;
+
+    static Frame MakeFrame(BYTE opcode, const BYTE* data, size_t size);
+    void Run();
+    void Broadcast(WebSocketChannel channel, const Frame& frame);
+    void Enqueue(Client& client, const Frame& frame);
+    void Accept();
+    bool Receive(Client& client);
+    bool Handshake(Client& client);
+    bool ProcessFrames(Client& client);
+    bool Send(Client& client);
+    void CloseClient(Client& client);
+public:
+    WebSocketServer();
+    ~WebSocketServer();
+    WebSocketServer(const WebSocketServer&) = delete;
+    WebSocketServer& operator=(const WebSocketServer&) = delete;
+    // 127.0.0.1:portで待ち受ける maxClientQueueSizeを超えて送信が滞ったクライアントのキューは捨ててstreamResetを送る
+    bool Start(unsigned short port, size_t maxClientQueueSize);
+    void Stop();
+    // どのスレッドからも呼び出せる channelに接続しているクライアントにのみ送る
+    bool HasClients(WebSocketChannel channel) const;
+    void BroadcastBinary(WebSocketChannel channel, const BYTE* data, size_t size);
+    void BroadcastText(WebSocketChannel channel, const char* utf8, size_t size);
+    Statistics GetStatistics();
+};
@@ -0,0 +1,190 @@
+﻿#include "pch.h"
+#include "base64.h"
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <immintrin.h>
+#define BASE64_X86
+#endif
+
+static const WCHAR base64Table[65] = L"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static size_t EncodeBase64Scalar(const BYTE* src, size_t size, WCHAR* dst)
+{
+    auto start = dst;
+    size_t i = 0;
+    for (; i + 3 <= size; i += 3)
+    {
+        DWORD triplet = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+        dst[0] = base64Table[triplet >> 18];
+        dst[1] = base64Table[(triplet >> 12) & 63];
+        dst[2] = base64Table[(triplet >> 6) & 63];
+        dst[3] = base64Table[triplet & 63];
+        dst += 4;
+    }
+    if (i + 1 == size)
+    {
+        dst[0] = base64Table[src[i] >> 2];
+        dst[1] = base64Table[(src[i] & 3) << 4];
+        dst[2] = L'=';
+        dst[3] = L'=';
+        dst += 4;
+    }
+    else if (i + 2 == size)
+    {
+        dst[0] = base64Table[src[i] >> 2];
+        dst[1] = base64Table[((src[i] & 3) << 4) | (src[i + 1] >> 4)];
+        dst[2] = base64Table[(src[i + 1] & 15) << 2];
+        dst[3] = L'=';
+        dst += 4;
+    }
+    return dst - start;
+}
+
+#ifdef BASE64_X86
+// http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html
+// 3バイトずつ4つの6bitの値に分けてから文字に変換する
+
+// 12バイトを16個の6bitの値に展開する
+static inline __m128i Base64Unpack(__m128i in)
+{
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    auto t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    auto t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    auto t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    auto t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+// 0..63の値を文字に変換する
+static inline __m128i Base64Lookup(__m128i indices)
+{
+    // 0..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+    auto result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    // 0..25 -> 13, 26..51 -> 0
+    auto less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    auto shift = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+    );
+    result = _mm_shuffle_epi8(shift, result);
+    return _mm_add_epi8(result, indices);
+}
+
+static size_t EncodeBase64SSSE3(const BYTE* src, size_t size, WCHAR* dst)
+{
+    auto start = dst;
+    auto zero = _mm_setzero_si128();
+    // 16バイト読み込んで12バイト使う
+    while (size >= 16)
+    {
+        auto in = _mm_loadu_si128((const __m128i*)src);
+        auto chars = Base64Lookup(Base64Unpack(in));
+        _mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi8(chars, zero));
+        _mm_storeu_si128((__m128i*)(dst + 8), _mm_unpackhi_epi8(chars, zero));
+        src += 12;
+        size -= 12;
+        dst += 16;
+    }
+    dst += EncodeBase64Scalar(src, size, dst);
+    return dst - start;
+}
+
+static inline __m256i Base64Unpack(__m256i in)
+{
+    in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1
+    ));
+    auto t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    auto t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    auto t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    auto t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    return _mm256_or_si256(t1, t3);
+}
+
+static inline __m256i Base64Lookup(__m256i indices)
+{
+    auto result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    auto less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    auto shift = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+    );
+    result = _mm256_shuffle_epi8(shift, result);
+    return _mm256_add_epi8(result, indices);
+}
+
+static size_t EncodeBase64AVX2(const BYTE* src, size_t size, WCHAR* dst)
+{
+    auto start = dst;
+    // 各レーンに12バイトずつ入れて24バイトを32文字にする
+    while (size >= 28)
+    {
+        auto lo = _mm_loadu_si128((const __m128i*)src);
+        auto hi = _mm_loadu_si128((const __m128i*)(src + 12));
+        auto in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        auto chars = Base64Lookup(Base64Unpack(in));
+        _mm256_storeu_si256((__m256i*)dst, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(chars)));
+        _mm256_storeu_si256((__m256i*)(dst + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(chars, 1)));
+        src += 24;
+        size -= 24;
+        dst += 32;
+    }
+    dst += EncodeBase64SSSE3(src, size, dst);
+    return dst - start;
+}
+
+enum class Base64Implementation
+{
+    Scalar,
+    SSSE3,
+    AVX2,
+};
+
+static Base64Implementation DetectBase64Implementation()
+{
+    int info[4];
+    __cpuid(info, 0);
+    auto maxLeaf = info[0];
+    if (maxLeaf < 1)
+    {
+        return Base64Implementation::Scalar;
+    }
+    __cpuid(info, 1);
+    bool ssse3 = !!(info[2] & (1 << 9));
+    bool osxsave = !!(info[2] & (1 << 27));
+    bool avx = !!(info[2] & (1 << 28));
+    if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
+    {
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5))
+        {
+            return Base64Implementation::AVX2;
+        }
+    }
+    return ssse3 ? Base64Implementation::SSSE3 : Base64Implementation::Scalar;
+}
+#endif
+
+size_t EncodeBase64(const BYTE* src, size_t size, WCHAR* dst)
+{
+    static_assert(sizeof(WCHAR) == 2, "WCHAR must be UTF-16");
+#ifdef BASE64_X86
+    static const auto implementation = DetectBase64Implementation();
+    switch (implementation)
+    {
+    case Base64Implementation::AVX2:
+        return EncodeBase64AVX2(src, size, dst);
+    case Base64Implementation::SSSE3:
+        return EncodeBase64SSSE3(src, size, dst);
+    default:
+        break;
+    }
+#endif
+    return EncodeBase64Scalar(src, size, dst);
+}
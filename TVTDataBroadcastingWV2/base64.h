@@ -0,0 +1,12 @@
+﻿#pragma once
+
+// Base64の文字数
+constexpr size_t Base64EncodedLength(size_t size)
+{
+    return (size + 2) / 3 * 4;
+}
+
+// srcをBase64でdstにエンコードしdstに書き込んだ文字数を返す
+// dstにはBase64EncodedLength(size)文字分の領域が必要 (NUL終端はしない)
+// 利用可能であればAVX2, SSSE3を使う
+size_t EncodeBase64(const BYTE* src, size_t size, WCHAR* dst);
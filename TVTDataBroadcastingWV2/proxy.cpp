@@ -3,12 +3,10 @@
 
 ProxyRequest::ProxyRequest
 (
-    HINTERNET connect,
-    HINTERNET request,
     std::function<void()> errorCallback,
-    std::function<void(DWORD statusCode, LPCWSTR statusCodeText, LPCWSTR headers, size_t contentLength, BYTE* content)> callback,
+    ResponseCallback callback,
     std::vector<BYTE> payload
-) : connect(connect), request(request), errorCallback(std::move(errorCallback)), callback(std::move(callback)), payload(std::move(payload))
+) : errorCallback(std::move(errorCallback)), callback(std::move(callback)), payload(std::move(payload))
 {
 
 }
@@ -22,33 +20,209 @@ void CALLBACK ProxyRequest::StaticAsyncCallback(HINTERNET hInternet, DWORD_PTR d
     }
 }
 
-void ProxyRequest::Fail()
+void ProxyRequest::Fail(std::wstring reason)
 {
-    if (errorCallback)
+    if (failure.empty())
+    {
+        failure = std::move(reason);
+    }
+    if (pipe)
+    {
+        // ヘッダは既に返しているので読み出し側をエラーにする
+        pipe->Fail();
+        Close();
+    }
+    else if (errorCallback)
     {
         std::exchange(errorCallback, nullptr)();
         Close();
     }
 }
 
+bool ProxyRequest::QueryResponse(HINTERNET hInternet, DWORD& statusCode, std::unique_ptr<WCHAR[]>& statusText, std::wstring& headers)
+{
+    DWORD statusCodeSize = sizeof(statusCode);
+    if (!WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, nullptr, &statusCode, &statusCodeSize, nullptr))
+    {
+        return false;
+    }
+    DWORD statusTextSize;
+    if (!WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_STATUS_TEXT, nullptr, WINHTTP_NO_OUTPUT_BUFFER, &statusTextSize, nullptr) && GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+    {
+        statusText = std::unique_ptr<WCHAR[]>(new WCHAR[statusTextSize / sizeof(WCHAR)]);
+        if (!WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_STATUS_TEXT, nullptr, statusText.get(), &statusTextSize, nullptr))
+        {
+            return false;
+        }
+    }
+    DWORD headersSize;
+    if (!WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_RAW_HEADERS_CRLF, WINHTTP_HEADER_NAME_BY_INDEX, WINHTTP_NO_OUTPUT_BUFFER, &headersSize, WINHTTP_NO_HEADER_INDEX) && GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+    {
+        headers.resize(headersSize / sizeof(WCHAR));
+        if (!WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_RAW_HEADERS_CRLF, WINHTTP_HEADER_NAME_BY_INDEX, headers.data(), &headersSize, WINHTTP_NO_HEADER_INDEX))
+        {
+            return false;
+        }
+        headers.resize(headersSize / sizeof(WCHAR));
+    }
+    if (decoded)
+    {
+        headers = RewriteResponseHeaders(headers, ProxyDecodedResponseHeaderRules());
+    }
+    return true;
+}
+
+bool ProxyRequest::StartStreaming(HINTERNET hInternet)
+{
+    DWORD statusCode = 0;
+    std::unique_ptr<WCHAR[]> statusText;
+    std::wstring headers;
+    if (!QueryResponse(hInternet, statusCode, statusText, headers))
+    {
+        Fail(L"invalid-response");
+        return false;
+    }
+    // 展開した後の長さは分からない
+    DWORD contentLength = 0, contentLengthSize = sizeof(contentLength);
+    if (decoded || !WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_CONTENT_LENGTH | WINHTTP_QUERY_FLAG_NUMBER, nullptr, &contentLength, &contentLengthSize, nullptr))
+    {
+        contentLength = 0;
+    }
+    // ここから先の失敗はerrorCallbackではなくpipeで伝える
+    errorCallback = nullptr;
+    pipe = std::make_shared<ProxyPipe>(pipeCapacity);
+    if (!std::exchange(streamCallback, nullptr)(statusCode, statusText.get(), headers.c_str(), contentLength, pipe))
+    {
+        // 304で再検証できた場合など内容が不要だったので完了として数える
+        completedTime = ProxyMetrics::Now();
+        pipe->Close();
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void ProxyRequest::Complete(HINTERNET hInternet)
+{
+    completedTime = ProxyMetrics::Now();
+    if (pipe)
+    {
+        pipe->Close();
+    }
+    if (callback && !bufferOverflowed)
+    {
+        DWORD statusCode = 0;
+        std::unique_ptr<WCHAR[]> statusText;
+        std::wstring headers;
+        if (!QueryResponse(hInternet, statusCode, statusText, headers))
+        {
+            completedTime = 0;
+            Fail(L"invalid-response");
+            return;
+        }
+        callback(statusCode, statusText.get(), headers.c_str(), data);
+    }
+    if (bodyStatistics)
+    {
+        bodyStatistics->responses++;
+        bodyStatistics->receivedBytes += receivedBytes;
+        bodyStatistics->copiedBytes += copiedBytes;
+    }
+    Close();
+}
+
+void ProxyRequest::ResumeStreaming()
+{
+    if (pipe->IsReaderClosed())
+    {
+        failure = L"reader-closed";
+        Close();
+        return;
+    }
+    if (IsCancelled())
+    {
+        Fail(L"cancelled");
+        return;
+    }
+    if (!WinHttpQueryDataAvailable(request, nullptr))
+    {
+        Fail(ProxyMetrics::FailureReason(GetLastError()));
+    }
+}
+
 void ProxyRequest::AsyncCallback(HINTERNET hInternet, DWORD dwInternetStatus, LPVOID lpvStatusInformation, DWORD dwStatusInformationLength)
 {
+    if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_CONNECTED_TO_SERVER)
+    {
+        // 通知だけで処理は続くのでここでは中断しない リダイレクトで再接続した場合は最初の接続のみ数える
+        if (!connectedTime)
+        {
+            connectedTime = ProxyMetrics::Now();
+        }
+        return;
+    }
+    // CONNECTING_TO_SERVERなど完了以外の通知は送信の途中に届くので、ここで失敗させると処理中の自身を破棄してしまう
+    if (dwInternetStatus != WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE &&
+        dwInternetStatus != WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE &&
+        dwInternetStatus != WINHTTP_CALLBACK_STATUS_DATA_AVAILABLE &&
+        dwInternetStatus != WINHTTP_CALLBACK_STATUS_READ_COMPLETE &&
+        dwInternetStatus != WINHTTP_CALLBACK_STATUS_REQUEST_ERROR)
+    {
+        return;
+    }
+    // 接続や応答を待っている間は中断できないのでタイムアウトか次の通知まで待つ
+    if (dwInternetStatus != WINHTTP_CALLBACK_STATUS_REQUEST_ERROR && IsCancelled())
+    {
+        Fail(L"cancelled");
+        return;
+    }
     switch (dwInternetStatus)
     {
     case WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE:
     {
         if (!WinHttpReceiveResponse(hInternet, nullptr))
         {
-            Fail();
+            Fail(ProxyMetrics::FailureReason(GetLastError()));
             return;
         }
         break;
     }
     case WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE:
     {
+        headersTime = ProxyMetrics::Now();
+        DWORD statusCodeSize = sizeof(responseStatusCode);
+        WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, nullptr, &responseStatusCode, &statusCodeSize, nullptr);
+        if (decompression)
+        {
+            // WinHTTPはContent-Encodingを残したまま展開した内容を返す
+            WCHAR encoding[32];
+            DWORD encodingSize = sizeof(encoding);
+            DWORD encodedLengthValue = 0, encodedLengthSize = sizeof(encodedLengthValue);
+            if (WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_CONTENT_ENCODING, WINHTTP_HEADER_NAME_BY_INDEX, encoding, &encodingSize, WINHTTP_NO_HEADER_INDEX) && IsDecodedContentEncoding(ProxyTrimHeader(encoding)))
+            {
+                decoded = true;
+                if (WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_CONTENT_LENGTH | WINHTTP_QUERY_FLAG_NUMBER, nullptr, &encodedLengthValue, &encodedLengthSize, nullptr))
+                {
+                    encodedLength = encodedLengthValue;
+                }
+            }
+        }
+        if (streamCallback && !StartStreaming(hInternet))
+        {
+            return;
+        }
+        if (!pipe)
+        {
+            // 拡張のたびに移動しないようにContent-Lengthの分だけ確保しておく 展開する場合は少なくともこの大きさになる
+            DWORD contentLength = 0, contentLengthSize = sizeof(contentLength);
+            if (WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_CONTENT_LENGTH | WINHTTP_QUERY_FLAG_NUMBER, nullptr, &contentLength, &contentLengthSize, nullptr))
+            {
+                data.reserve(std::min<size_t>(contentLength, maxReservedSize));
+            }
+        }
         if (!WinHttpQueryDataAvailable(hInternet, nullptr))
         {
-            Fail();
+            Fail(ProxyMetrics::FailureReason(GetLastError()));
             return;
         }
         break;
@@ -58,65 +232,90 @@ void ProxyRequest::AsyncCallback(HINTERNET hInternet, DWORD dwInternetStatus, LP
         auto const size = *(DWORD*)lpvStatusInformation;
         if (size == 0)
         {
-            DWORD statusCode = 0, statusCodeSize = sizeof(statusCode);
-            if (!WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, nullptr, &statusCode, &statusCodeSize, nullptr))
+            Complete(hInternet);
+            break;
+        }
+        if (pipe)
+        {
+            chunk.resize(size);
+            if (!WinHttpReadData(hInternet, chunk.data(), size, nullptr))
             {
-                Fail();
+                Fail(ProxyMetrics::FailureReason(GetLastError()));
                 return;
             }
-            DWORD statusTextSize;
-            std::unique_ptr<WCHAR[]> statusText;
-            if (!WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_STATUS_TEXT, nullptr, WINHTTP_NO_OUTPUT_BUFFER, &statusTextSize, nullptr) && GetLastError() == ERROR_INSUFFICIENT_BUFFER)
-            {
-                statusText = std::unique_ptr<WCHAR[]>(new WCHAR[statusTextSize / sizeof(WCHAR)]);
-                if (!WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_STATUS_TEXT, nullptr, statusText.get(), &statusTextSize, nullptr))
-                {
-                    Fail();
-                    return;
-                }
-            }
-            DWORD headersSize;
-            std::unique_ptr<WCHAR[]> headers;
-            if (!WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_RAW_HEADERS_CRLF, WINHTTP_HEADER_NAME_BY_INDEX, WINHTTP_NO_OUTPUT_BUFFER, &headersSize, WINHTTP_NO_HEADER_INDEX) && GetLastError() == ERROR_INSUFFICIENT_BUFFER)
-            {
-                headers = std::unique_ptr<WCHAR[]>(new WCHAR[headersSize / sizeof(WCHAR)]);
-                if (!WinHttpQueryHeaders(hInternet, WINHTTP_QUERY_RAW_HEADERS_CRLF, WINHTTP_HEADER_NAME_BY_INDEX, headers.get(), &headersSize, WINHTTP_NO_HEADER_INDEX))
-                {
-                    Fail();
-                    return;
-                }
-            }
-            callback(statusCode, statusText.get(), headers.get(), data.size(), data.data());
-            Close();
             break;
         }
         auto prevSize = data.size();
+        if (prevSize + size > data.capacity())
+        {
+            copiedBytes += prevSize;
+        }
         data.resize(prevSize + size);
         if (!WinHttpReadData(hInternet, data.data() + prevSize, size, nullptr))
         {
-            Fail();
+            Fail(ProxyMetrics::FailureReason(GetLastError()));
             return;
         }
         break;
     }
     case WINHTTP_CALLBACK_FLAG_READ_COMPLETE:
     {
+        if (pipe)
+        {
+            auto const size = dwStatusInformationLength;
+            receivedBytes += size;
+            if (callback && !bufferOverflowed)
+            {
+                if (data.size() + size > maxBufferedSize)
+                {
+                    bufferOverflowed = true;
+                    data = {};
+                }
+                else
+                {
+                    copiedBytes += size + (data.size() + size > data.capacity() ? data.size() : 0);
+                    data.insert(data.end(), chunk.data(), chunk.data() + size);
+                }
+            }
+            copiedBytes += size;
+            switch (pipe->Write(chunk.data(), size, [this]() { ResumeStreaming(); }))
+            {
+            case ProxyPipeWriteResult::Continue:
+                break;
+            case ProxyPipeWriteResult::Paused:
+                // 別のスレッドからResumeStreamingが呼ばれるのでここでは何も触らない
+                return;
+            case ProxyPipeWriteResult::ReaderClosed:
+                failure = L"reader-closed";
+                Close();
+                return;
+            }
+        }
+        else
+        {
+            receivedBytes += dwStatusInformationLength;
+        }
         if (!WinHttpQueryDataAvailable(hInternet, nullptr))
         {
-            Fail();
+            Fail(ProxyMetrics::FailureReason(GetLastError()));
             return;
         }
         break;
     }
     case WINHTTP_CALLBACK_STATUS_REQUEST_ERROR:
     {
-        auto asyncResut = (LPWINHTTP_ASYNC_RESULT*)lpvStatusInformation;
-        Fail();
+        auto asyncResult = (WINHTTP_ASYNC_RESULT*)lpvStatusInformation;
+        Fail(ProxyMetrics::FailureReason(asyncResult->dwError));
         break;
     }
     }
 }
 
+bool ProxyRequest::IsCancelled() const
+{
+    return slot && slot->IsCancelled();
+}
+
 void ProxyRequest::Close()
 {
     delete this;
@@ -128,50 +327,92 @@ bool ProxyRequest::RequestAsync
     LPCWSTR url,
     LPCWSTR verb,
     std::vector<BYTE> payload,
-    std::vector<std::pair<LPCWSTR, LPCWSTR>>& headers,
+    const std::vector<std::pair<LPCWSTR, LPCWSTR>>& headers,
+    std::shared_ptr<ProxySchedulerSlot> slot,
     std::function<void()> errorCallback,
-    std::function<void(DWORD statusCode, LPCWSTR statusCodeText, LPCWSTR headers, size_t contentLength, BYTE* content)> callback
+    ResponseCallback callback
 )
 {
-    URL_COMPONENTSW components = { sizeof(URL_COMPONENTSW) };
-    components.dwHostNameLength = 1;
-    components.dwUrlPathLength = 1;
-    if (!WinHttpCrackUrl(url, 0, 0, &components))
+    std::unique_ptr<ProxyRequest> preq(new ProxyRequest(std::move(errorCallback), std::move(callback), std::move(payload)));
+    preq->slot = std::move(slot);
+    return Send(std::move(preq), session, url, verb, headers);
+}
+
+bool ProxyRequest::RequestStreamingAsync
+(
+    ProxySession& session,
+    LPCWSTR url,
+    LPCWSTR verb,
+    std::vector<BYTE> payload,
+    const std::vector<std::pair<LPCWSTR, LPCWSTR>>& headers,
+    size_t pipeCapacity,
+    size_t maxBufferedSize,
+    std::shared_ptr<ProxySchedulerSlot> slot,
+    std::function<void()> errorCallback,
+    StreamCallback streamCallback,
+    ResponseCallback callback
+)
+{
+    std::unique_ptr<ProxyRequest> preq(new ProxyRequest(std::move(errorCallback), std::move(callback), std::move(payload)));
+    preq->slot = std::move(slot);
+    preq->streamCallback = std::move(streamCallback);
+    preq->pipeCapacity = pipeCapacity;
+    preq->maxBufferedSize = maxBufferedSize;
+    return Send(std::move(preq), session, url, verb, headers);
+}
+
+bool ProxyRequest::Send
+(
+    std::unique_ptr<ProxyRequest> preq,
+    ProxySession& session,
+    LPCWSTR url,
+    LPCWSTR verb,
+    const std::vector<std::pair<LPCWSTR, LPCWSTR>>& headers
+)
+{
+    ProxyUrl components;
+    if (!CrackProxyUrl(url, components))
     {
         return false;
     }
-    std::wstring hostName(components.lpszHostName, components.lpszHostName + components.dwHostNameLength);
-    std::wstring urlPath(components.lpszUrlPath, components.lpszUrlPath + components.dwUrlPathLength);
-    auto connect = WinHttpConnect(session.GetSession(), hostName.c_str(), components.nPort, 0);
-    if (!connect)
+    preq->metrics = session.GetMetrics();
+    preq->decompression = session.IsDecompressionEnabled();
+    preq->metricsHost = components.hostName + L":" + std::to_wstring(components.port);
+    preq->bodyStatistics = session.GetBodyStatistics();
+    // 接続のハンドルを作っても実際に接続するのはリクエストを送るときで、keep-aliveの接続はセッションが使いまわす
+    preq->connect = WinHttpConnect(session.GetSession(), components.hostName.c_str(), components.port, 0);
+    if (!preq->connect)
     {
         return false;
     }
     LPCWSTR acceptTypes[] = { L"*/*", nullptr };
-    auto request = WinHttpOpenRequest(connect, verb, urlPath.c_str(), nullptr, WINHTTP_NO_REFERER, acceptTypes, components.nScheme == INTERNET_SCHEME_HTTPS ? WINHTTP_FLAG_SECURE : 0);
+    auto request = WinHttpOpenRequest(preq->connect, verb, components.path.c_str(), nullptr, WINHTTP_NO_REFERER, acceptTypes, components.secure ? WINHTTP_FLAG_SECURE : 0);
     if (!request)
     {
-        WinHttpCloseHandle(connect);
         return false;
     }
+    preq->request = request;
+    // 送信を始めた後はコールバックの中で破棄されることがあるので先に登録する
+    preq->runningRequests = session.GetRunningRequests();
+    {
+        std::lock_guard<std::mutex> lock(preq->runningRequests->mutex);
+        preq->runningRequests->requests.insert(preq.get());
+    }
     DWORD securityFlags = SECURITY_FLAG_IGNORE_ALL_CERT_ERRORS;
     WinHttpSetOption(request, WINHTTP_OPTION_SECURITY_FLAGS, &securityFlags, sizeof(securityFlags));
-    std::unique_ptr<ProxyRequest> preq(new ProxyRequest(connect, request, std::move(errorCallback), std::move(callback), std::move(payload)));
-    if (WinHttpSetStatusCallback(request, StaticAsyncCallback, WINHTTP_CALLBACK_FLAG_ALL_COMPLETIONS, 0) == WINHTTP_INVALID_STATUS_CALLBACK)
+    if (WinHttpSetStatusCallback(request, StaticAsyncCallback, WINHTTP_CALLBACK_FLAG_ALL_COMPLETIONS | WINHTTP_CALLBACK_FLAG_CONNECT_TO_SERVER, 0) == WINHTTP_INVALID_STATUS_CALLBACK)
     {
         return false;
     }
     for (auto&& header : headers)
     {
-        auto headers = std::wstring(header.first) + L": " + header.second;
         // CRLFが含まれている不正なヘッダを除外
-        // CRLFの直後に空白かタブがあればヘッダの区切りではなくトークンの区切りとして扱われるためこの処理は正しくない
-        // ただし含めたリクエストを送る処理はないしfetchに含めることもできないし問題ない
-        if (headers.find(L'\r') != std::wstring::npos || headers.find(L'\n') != std::wstring::npos)
+        auto headers = FormatRequestHeader(header.first, header.second);
+        if (!headers)
         {
             continue;
         }
-        if (!WinHttpAddRequestHeaders(request, headers.data(), headers.size(), WINHTTP_ADDREQ_FLAG_ADD))
+        if (!WinHttpAddRequestHeaders(request, headers->data(), headers->size(), WINHTTP_ADDREQ_FLAG_ADD))
         {
             return false;
         }
@@ -186,8 +427,10 @@ bool ProxyRequest::RequestAsync
     {
         swprintf_s(additionalHeader, L"Content-Length: %zu", payloadSize);
     }
+    preq->sendTime = ProxyMetrics::Now();
     if (!WinHttpSendRequest(request, payloadSize == 0 ? WINHTTP_NO_ADDITIONAL_HEADERS : additionalHeader, -1, preq->payload.data(), payloadSize, WINHTTP_IGNORE_REQUEST_TOTAL_LENGTH, (DWORD_PTR)preq.get()))
     {
+        preq->failure = ProxyMetrics::FailureReason(GetLastError());
         return false;
     }
     // AsyncCallback中でdelete thisされる
@@ -197,13 +440,91 @@ bool ProxyRequest::RequestAsync
 
 ProxyRequest::~ProxyRequest()
 {
-    WinHttpCloseHandle(request);
-    WinHttpCloseHandle(connect);
+    if (metrics)
+    {
+        metrics->Record(metricsHost, [this](ProxyMetrics::Host& host)
+        {
+            if (connectedTime)
+            {
+                host.connectMilliseconds.Add(connectedTime - sendTime);
+            }
+            if (headersTime)
+            {
+                host.firstByteMilliseconds.Add(headersTime - sendTime);
+            }
+            if (completedTime)
+            {
+                host.totalMilliseconds.Add(completedTime - sendTime);
+                host.responseBytes.Add(receivedBytes);
+                host.statusCodes[responseStatusCode]++;
+                if (decoded)
+                {
+                    host.decodedResponses++;
+                    // 圧縮率は長さが分かるものだけで求める
+                    if (encodedLength)
+                    {
+                        host.encodedBytes += encodedLength;
+                        host.decodedBytes += receivedBytes;
+                    }
+                }
+            }
+            else
+            {
+                host.failures[!failure.empty() ? failure : sendTime ? L"aborted" : L"not-sent"]++;
+            }
+        });
+    }
+    // CancelAllが閉じている途中でないことを確かめてから外す
+    auto closed = false;
+    if (runningRequests)
+    {
+        std::lock_guard<std::mutex> lock(runningRequests->mutex);
+        runningRequests->requests.erase(this);
+        closed = requestClosed;
+    }
+    if (request && !closed)
+    {
+        WinHttpCloseHandle(request);
+    }
+    if (connect)
+    {
+        WinHttpCloseHandle(connect);
+    }
+}
+
+void ProxyRequest::CancelAll(ProxyRunningRequests& running)
+{
+    std::lock_guard<std::mutex> lock(running.mutex);
+    for (auto&& preq : running.requests)
+    {
+        // 破棄するときはmutexを取るのでここでは生きている
+        if (preq->request && !preq->requestClosed)
+        {
+            preq->requestClosed = true;
+            WinHttpCloseHandle(preq->request);
+        }
+    }
 }
 
-ProxySession::ProxySession()
+ProxySession::ProxySession(DWORD maxConnectionsPerServer, DWORD connectTimeoutMilliseconds, DWORD receiveTimeoutMilliseconds, bool decompression)
 {
     this->session = WinHttpOpen(nullptr, WINHTTP_ACCESS_TYPE_AUTOMATIC_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, WINHTTP_FLAG_ASYNC);
+    if (this->session)
+    {
+        WinHttpSetTimeouts(this->session, connectTimeoutMilliseconds, connectTimeoutMilliseconds, receiveTimeoutMilliseconds, receiveTimeoutMilliseconds);
+        if (decompression)
+        {
+            // 対応していない場合は失敗するので圧縮されていない応答だけを受け取る
+            DWORD flags = WINHTTP_DECOMPRESSION_FLAG_GZIP | WINHTTP_DECOMPRESSION_FLAG_DEFLATE;
+            this->decompression = WinHttpSetOption(this->session, WINHTTP_OPTION_DECOMPRESSION, &flags, sizeof(flags));
+        }
+        if (maxConnectionsPerServer)
+        {
+            // 超えた分のリクエストはWinHTTPが接続が空くまで待たせる
+            WinHttpSetOption(this->session, WINHTTP_OPTION_MAX_CONNS_PER_SERVER, &maxConnectionsPerServer, sizeof(maxConnectionsPerServer));
+            WinHttpSetOption(this->session, WINHTTP_OPTION_MAX_CONNS_PER_1_0_SERVER, &maxConnectionsPerServer, sizeof(maxConnectionsPerServer));
+        }
+    }
 }
 
 ProxySession::~ProxySession()
@@ -215,3 +536,59 @@ HINTERNET ProxySession::GetSession()
 {
     return this->session;
 }
+
+const std::shared_ptr<ProxyBodyStatistics>& ProxySession::GetBodyStatistics()
+{
+    return this->bodyStatistics;
+}
+
+const std::shared_ptr<ProxyMetrics>& ProxySession::GetMetrics()
+{
+    return this->metrics;
+}
+
+const std::shared_ptr<ProxyRunningRequests>& ProxySession::GetRunningRequests()
+{
+    return this->runningRequests;
+}
+
+bool ProxySession::IsDecompressionEnabled()
+{
+    return this->decompression;
+}
+
+bool ProxySession::RequestAsync
+(
+    const wchar_t* url,
+    const wchar_t* verb,
+    std::vector<uint8_t> payload,
+    const std::vector<std::pair<const wchar_t*, const wchar_t*>>& headers,
+    std::shared_ptr<ProxySchedulerSlot> slot,
+    ErrorCallback errorCallback,
+    ResponseCallback callback
+)
+{
+    return ProxyRequest::RequestAsync(*this, url, verb, std::move(payload), headers, std::move(slot), std::move(errorCallback), std::move(callback));
+}
+
+bool ProxySession::RequestStreamingAsync
+(
+    const wchar_t* url,
+    const wchar_t* verb,
+    std::vector<uint8_t> payload,
+    const std::vector<std::pair<const wchar_t*, const wchar_t*>>& headers,
+    size_t pipeCapacity,
+    size_t maxBufferedSize,
+    std::shared_ptr<ProxySchedulerSlot> slot,
+    ErrorCallback errorCallback,
+    StreamCallback streamCallback,
+    ResponseCallback callback
+)
+{
+    return ProxyRequest::RequestStreamingAsync(*this, url, verb, std::move(payload), headers, pipeCapacity, maxBufferedSize, std::move(slot), std::move(errorCallback), std::move(streamCallback), callback ? ProxyRequest::ResponseCallback(std::move(callback)) : nullptr);
+}
+
+void ProxySession::CancelAll()
+{
+    ProxyRequest::CancelAll(*this->runningRequests);
+}
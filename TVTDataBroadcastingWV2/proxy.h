@@ -1,37 +1,148 @@
 #pragma once
 #include <winhttp.h>
+#include "ProxyStream.h"
+#include "ProxyTransport.h"
+#include "ProxyMetrics.h"
 
-class ProxySession
+// M̓e̗ʂƁAMĂy[WɕԂ܂łɃRs[
+// Mp̃obt@̊gɂړƁAXg[~OꍇpipeƃLbVp̃obt@ւ݂̏𐔂
+struct ProxyBodyStatistics
+{
+    std::atomic<uint64_t> responses = 0;
+    std::atomic<uint64_t> receivedBytes = 0;
+    std::atomic<uint64_t> copiedBytes = 0;
+};
+
+class ProxyRequest;
+
+// sProxyRequest CancelAllŃnh悤ɃZbVƃNGXgŋL
+struct ProxyRunningRequests
+{
+    std::mutex mutex;
+    std::unordered_set<ProxyRequest*> requests;
+};
+
+class ProxySession : public ProxyTransport
 {
     HINTERNET session;
+    std::shared_ptr<ProxyRunningRequests> runningRequests = std::make_shared<ProxyRunningRequests>();
+    std::shared_ptr<ProxyBodyStatistics> bodyStatistics = std::make_shared<ProxyBodyStatistics>();
+    std::shared_ptr<ProxyMetrics> metrics = std::make_shared<ProxyMetrics>();
+    bool decompression = false;
 public:
     HINTERNET GetSession();
-    ProxySession();
+    const std::shared_ptr<ProxyBodyStatistics>& GetBodyStatistics();
+    const std::shared_ptr<ProxyMetrics>& GetMetrics();
+    const std::shared_ptr<ProxyRunningRequests>& GetRunningRequests();
+    // WinHTTPgzip, deflateWJ
+    bool IsDecompressionEnabled();
+    // ڑ̓ZbVkeep-aliveŕێĎg܂킷 maxConnectionsPerServer0łȂ΃T[o[Ƃ̐ڑ܂łɐ
+    // ^CAEg0łΖ O͐ڑɁAM͎MɊ܂߂Đ
+    // decompressionłAccept-Encoding: gzip, deflate𑗂ĎMȂWJ (Windows 8.1ȍ~)
+    ProxySession(DWORD maxConnectionsPerServer, DWORD connectTimeoutMilliseconds, DWORD receiveTimeoutMilliseconds, bool decompression);
     ~ProxySession();
     ProxySession(const ProxySession&) = delete;
     ProxySession& operator=(const ProxySession&) = delete;
+    // ProxyRequest::RequestAsyncĂ
+    bool RequestAsync
+    (
+        const wchar_t* url,
+        const wchar_t* verb,
+        std::vector<uint8_t> payload,
+        const std::vector<std::pair<const wchar_t*, const wchar_t*>>& headers,
+        std::shared_ptr<ProxySchedulerSlot> slot,
+        ErrorCallback errorCallback,
+        ResponseCallback callback
+    ) override;
+    // ProxyRequest::RequestStreamingAsyncĂ
+    bool RequestStreamingAsync
+    (
+        const wchar_t* url,
+        const wchar_t* verb,
+        std::vector<uint8_t> payload,
+        const std::vector<std::pair<const wchar_t*, const wchar_t*>>& headers,
+        size_t pipeCapacity,
+        size_t maxBufferedSize,
+        std::shared_ptr<ProxySchedulerSlot> slot,
+        ErrorCallback errorCallback,
+        StreamCallback streamCallback,
+        ResponseCallback callback
+    ) override;
+    // ProxyRequest::CancelAllĂ
+    void CancelAll() override;
 };
 
 class ProxyRequest
 {
+public:
+    // content͌ĂяomoveĈĂ悢
+    using ResponseCallback = std::function<void(DWORD statusCode, LPCWSTR statusCodeText, LPCWSTR headers, std::vector<BYTE>& content)>;
+    // falseԂꍇe͎MɏI
+    using StreamCallback = std::function<bool(DWORD statusCode, LPCWSTR statusCodeText, LPCWSTR headers, ULONGLONG contentLength, std::shared_ptr<ProxyPipe> pipe)>;
+private:
     HINTERNET connect = nullptr;
     HINTERNET request = nullptr;
-    // Xg[~Ô͖ʓ|KvȂ̂ňUSēǂݍłԂ
+    // MOj܂runningRequestsɓo^Ă
+    std::shared_ptr<ProxyRunningRequests> runningRequests;
+    // CancelAllrequestꍇ runningRequests->mutexŕی삷
+    bool requestClosed = false;
+    std::shared_ptr<ProxyBodyStatistics> bodyStatistics;
+    // j܂œs̘gg ĂΎ̒ʒmŒf
+    std::shared_ptr<ProxySchedulerSlot> slot;
+    uint64_t receivedBytes = 0;
+    uint64_t copiedBytes = 0;
+    // jƂɃzXg:|[gƂ̏vԂƌʂL^
+    std::shared_ptr<ProxyMetrics> metrics;
+    std::wstring metricsHost;
+    ULONGLONG sendTime = 0;
+    // Vڑꍇ̂
+    ULONGLONG connectedTime = 0;
+    ULONGLONG headersTime = 0;
+    ULONGLONG completedTime = 0;
+    DWORD responseStatusCode = 0;
+    std::wstring failure;
+    // WinHTTPWJꍇ y[WɕԂwb_Content-Encoding, Content-Length菜
+    bool decompression = false;
+    bool decoded = false;
+    // kꂽeContent-Length `N`ȂǂŕȂ0
+    ULONGLONG encodedLength = 0;
+    // Xg[~OȂꍇ͈USēǂݍłԂ
+    // Xg[~OꍇcallbackmaxBufferedSize܂Œ߂Ă
     std::vector<BYTE> data;
+    size_t maxBufferedSize = SIZE_MAX;
+    // sContent-Lengthŋȗ̈mۂȂ悤ɗ\͂܂łɂ
+    static constexpr size_t maxReservedSize = 64 * 1024 * 1024;
+    bool bufferOverflowed = false;
     std::function<void()> errorCallback;
-    std::function<void(DWORD statusCode, LPCWSTR statusCodeText, LPCWSTR headers, size_t contentLength, BYTE* content)> callback;
+    ResponseCallback callback;
     std::vector<BYTE> payload;
+    // Xg[~Oꍇ wb_󂯎_streamCallbackĂсAepipeɏ
+    StreamCallback streamCallback;
+    std::shared_ptr<ProxyPipe> pipe;
+    size_t pipeCapacity = 0;
+    std::vector<BYTE> chunk;
     ProxyRequest
     (
-        HINTERNET connect,
-        HINTERNET request,
         std::function<void()> errorCallback,
-        std::function<void(DWORD statusCode, LPCWSTR statusCodeText, LPCWSTR headers, size_t contentLength, BYTE* content)> callback,
+        ResponseCallback callback,
         std::vector<BYTE> payload
     );
     static void CALLBACK StaticAsyncCallback(HINTERNET hInternet, DWORD_PTR dwContext, DWORD dwInternetStatus, LPVOID lpvStatusInformation, DWORD dwStatusInformationLength);
-    void Fail();
+    static bool Send
+    (
+        std::unique_ptr<ProxyRequest> preq,
+        ProxySession& session,
+        LPCWSTR url,
+        LPCWSTR verb,
+        const std::vector<std::pair<LPCWSTR, LPCWSTR>>& headers
+    );
+    bool QueryResponse(HINTERNET hInternet, DWORD& statusCode, std::unique_ptr<WCHAR[]>& statusText, std::wstring& headers);
+    void Fail(std::wstring reason);
+    bool IsCancelled() const;
     void AsyncCallback(HINTERNET hInternet, DWORD dwInternetStatus, LPVOID lpvStatusInformation, DWORD dwStatusInformationLength);
+    bool StartStreaming(HINTERNET hInternet);
+    void Complete(HINTERNET hInternet);
+    void ResumeStreaming();
     void Close();
 public:
     // 񓯊HTTPNGXgs
@@ -42,10 +153,31 @@ public:
         LPCWSTR url,
         LPCWSTR verb,
         std::vector<BYTE> payload,
-        std::vector<std::pair<LPCWSTR, LPCWSTR>>& headers,
+        const std::vector<std::pair<LPCWSTR, LPCWSTR>>& headers,
+        std::shared_ptr<ProxySchedulerSlot> slot,
+        std::function<void()> errorCallback,
+        ResponseCallback callback
+    );
+    // wb_󂯎_streamCallbackĂ΂Ae͓͂pipeœǂݏo
+    // pipepipeCapacityȏ㗭܂Γǂݏo܂ŎM~߂
+    // callbackΓemaxBufferedSizeȉꍇɌSĎMɌĂ΂
+    static bool RequestStreamingAsync
+    (
+        ProxySession& session,
+        LPCWSTR url,
+        LPCWSTR verb,
+        std::vector<BYTE> payload,
+        const std::vector<std::pair<LPCWSTR, LPCWSTR>>& headers,
+        size_t pipeCapacity,
+        size_t maxBufferedSize,
+        std::shared_ptr<ProxySchedulerSlot> slot,
         std::function<void()> errorCallback,
-        std::function<void(DWORD statusCode, LPCWSTR statusCodeText, LPCWSTR headers, size_t contentLength, BYTE* content)> callback
+        StreamCallback streamCallback,
+        ResponseCallback callback
     );
+    // s̃NGXg̃nhđ҂Ă鏈𒆒f
+    // fNGXgWINHTTP_CALLBACK_STATUS_REQUEST_ERRORAXg[~O~߂Ăꍇ͍ĊJƂɎsĔj
+    static void CancelAll(ProxyRunningRequests& running);
     ~ProxyRequest();
     ProxyRequest(const ProxyRequest&) = delete;
     ProxyRequest& operator=(const ProxyRequest&) = delete;
@@ -0,0 +1,105 @@
+﻿// EncodeBase64の各実装を以前のループと比べて結果が一致することを確かめ、速度を測る
+// 実装はbase64.cpp内のstatic関数なので直接読み込む
+#include "../base64.cpp"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// user-030より前にPostPacketBlockで使っていたループ
+static size_t EncodeBase64Previous(const BYTE* buffer, size_t packetBlockSize, WCHAR* buf)
+{
+    static const WCHAR base64[66] = L"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=";
+    size_t pos = 0;
+    for (size_t i = 0; i < packetBlockSize; i += 3)
+    {
+        buf[pos] = base64[buffer[i] >> 2];
+        pos += 1;
+        buf[pos] = base64[((buffer[i] & 3) << 4) | (i + 1 < packetBlockSize ? buffer[i + 1] >> 4 : 0)];
+        pos += 1;
+        buf[pos] = base64[i + 1 < packetBlockSize ? ((buffer[i + 1] & 15) << 2) |
+                                                    (i + 2 < packetBlockSize ? buffer[i + 2] >> 6 : 0) : 64];
+        pos += 1;
+        buf[pos] = base64[i + 2 < packetBlockSize ? buffer[i + 2] & 63 : 64];
+        pos += 1;
+    }
+    return pos;
+}
+
+struct Implementation
+{
+    const char* name;
+    size_t (*encode)(const BYTE* src, size_t size, WCHAR* dst);
+    bool available;
+};
+
+int main(int argc, char** argv)
+{
+    // 引数でブロックの大きさ(バイト)と回数を変えられる 既定はTSパケット500個分
+    size_t blockSize = argc > 1 ? (size_t)strtoull(argv[1], nullptr, 10) : 188 * 500;
+    int iterations = argc > 2 ? atoi(argv[2]) : 2000;
+#ifdef BASE64_X86
+    auto detected = DetectBase64Implementation();
+#endif
+    Implementation implementations[] = {
+        { "previous", EncodeBase64Previous, true },
+        { "scalar", EncodeBase64Scalar, true },
+#ifdef BASE64_X86
+        { "ssse3", EncodeBase64SSSE3, detected != Base64Implementation::Scalar },
+        { "avx2", EncodeBase64AVX2, detected == Base64Implementation::AVX2 },
+#endif
+        { "EncodeBase64", EncodeBase64, true },
+    };
+    std::mt19937 random(1);
+    std::vector<BYTE> data(std::max<size_t>(blockSize, 4096));
+    for (auto&& b : data)
+    {
+        b = (BYTE)random();
+    }
+    std::vector<WCHAR> expected(Base64EncodedLength(data.size()));
+    std::vector<WCHAR> actual(expected.size());
+    // 各実装の端数の処理を全て通るように短いものは全ての長さを試す
+    for (size_t size = 0; size <= data.size(); size += size < 256 ? 1 : 997)
+    {
+        auto expectedLength = EncodeBase64Previous(data.data(), size, expected.data());
+        for (auto&& implementation : implementations)
+        {
+            if (!implementation.available)
+            {
+                continue;
+            }
+            auto length = implementation.encode(data.data(), size, actual.data());
+            if (length != expectedLength || length != Base64EncodedLength(size) || memcmp(expected.data(), actual.data(), length * sizeof(WCHAR)))
+            {
+                printf("FAIL: %s differs from the previous loop at %zu bytes\n", implementation.name, size);
+                return 1;
+            }
+        }
+    }
+    printf("block=%zu bytes, iterations=%d\n", blockSize, iterations);
+    double previousMicroseconds = 0;
+    for (auto&& implementation : implementations)
+    {
+        if (!implementation.available)
+        {
+            printf("%-12s  not supported on this CPU\n", implementation.name);
+            continue;
+        }
+        // 1回目はキャッシュを温めるだけ
+        implementation.encode(data.data(), blockSize, actual.data());
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+        {
+            implementation.encode(data.data(), blockSize, actual.data());
+            // 結果を使わないループとして消されないようにする
+            __asm__ volatile("" : : "r"(actual.data()) : "memory");
+        }
+        auto microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+        if (!previousMicroseconds)
+        {
+            previousMicroseconds = microseconds;
+        }
+        printf("%-12s %8.1f us/block %8.1f MB/s %5.1fx\n", implementation.name, microseconds, blockSize / microseconds, previousMicroseconds / microseconds);
+    }
+    return 0;
+}
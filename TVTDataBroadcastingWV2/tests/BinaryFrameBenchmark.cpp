@@ -0,0 +1,187 @@
+﻿// ページに送るメッセージの大きさと組み立てる速度をBase64/JSONとBinaryFrameで比べる
+// 大きさはPostWebMessageAsJsonに渡すUTF-16の文字列のバイト数
+#include "../BinaryFrame.h"
+#include "../base64.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <vector>
+
+static const WCHAR base64Head[] = LR"({"type":"streamBase64","data":")";
+static const WCHAR binaryHead[] = LR"({"type":"streamBinary","data":")";
+static const WCHAR tail[] = LR"("})";
+
+// JsonStreamTransport::PostPacketsのBase64の場合と同じ文字列を組み立てて文字数を返す
+static size_t BuildBase64Message(const uint8_t* data, size_t size, std::vector<WCHAR>& buffer)
+{
+    buffer.resize(_countof(base64Head) + Base64EncodedLength(size) + _countof(tail));
+    size_t pos = _countof(base64Head) - 1;
+    memcpy(buffer.data(), base64Head, pos * sizeof(WCHAR));
+    pos += EncodeBase64(data, size, buffer.data() + pos);
+    memcpy(buffer.data() + pos, tail, sizeof(tail));
+    return pos + _countof(tail) - 1;
+}
+
+// JsonStreamTransport::PostBinaryFrameと同じ文字列を組み立てて文字数を返す
+static size_t BuildBinaryMessage(const uint8_t* frames, size_t size, std::vector<WCHAR>& buffer)
+{
+    buffer.resize(_countof(binaryHead) + PackedUtf16Length(size) + _countof(tail));
+    size_t pos = _countof(binaryHead) - 1;
+    memcpy(buffer.data(), binaryHead, pos * sizeof(WCHAR));
+    Utf16Packer packer(reinterpret_cast<uint16_t*>(buffer.data() + pos));
+    packer.Write(frames, size);
+    pos = reinterpret_cast<WCHAR*>(packer.Finish()) - buffer.data();
+    memcpy(buffer.data() + pos, tail, sizeof(tail));
+    return pos + _countof(tail) - 1;
+}
+
+struct Result
+{
+    size_t bytes;
+    double microseconds;
+};
+
+static Result Measure(int iterations, const std::function<size_t()>& build)
+{
+    // 1回目はキャッシュを温めるだけ
+    auto bytes = build();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        build();
+    }
+    auto microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+    return { bytes, microseconds };
+}
+
+static void Print(const char* name, size_t inputSize, const Result& result, const Result& baseline)
+{
+    printf("  %-28s %9zu bytes %6.2fx %9.2f us %8.1f MB/s\n", name, result.bytes, (double)result.bytes / inputSize, result.microseconds, inputSize / result.microseconds);
+    if (&result != &baseline)
+    {
+        printf("  %-28s %9.1f%% of the size, %.2fx the time\n", "", 100.0 * result.bytes / baseline.bytes, result.microseconds / baseline.microseconds);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    std::mt19937 random(1);
+    std::vector<WCHAR> buffer;
+    std::vector<uint8_t> frames;
+
+    {
+        // TSパケット500個分のブロック
+        std::vector<uint8_t> packets(188 * 500);
+        for (size_t i = 0; i < packets.size(); i++)
+        {
+            packets[i] = i % 188 ? (uint8_t)random() : 0x47;
+        }
+        printf("TS block (%zu bytes)\n", packets.size());
+        auto base64 = Measure(iterations, [&]
+        {
+            return BuildBase64Message(packets.data(), packets.size(), buffer) * sizeof(WCHAR);
+        });
+        auto binary = Measure(iterations, [&]
+        {
+            frames.clear();
+            AppendBinaryFrame(frames, BINARY_FRAME_PACKETS, packets.data(), packets.size());
+            return BuildBinaryMessage(frames.data(), frames.size(), buffer) * sizeof(WCHAR);
+        });
+        Print("streamBase64", packets.size(), base64, base64);
+        Print("streamBinary PACKETS", packets.size(), binary, base64);
+    }
+
+    {
+        // 字幕のPES 以前はページがTSから組み立ててResponseMessageのdataを数値の配列で受け取っていた
+        std::vector<uint8_t> pes(binaryFramePESHeaderSize + 400);
+        for (auto&& b : pes)
+        {
+            b = (uint8_t)random();
+        }
+        pes[0] = 0xbd;
+        pes[1] = binaryFramePESFlagPTS;
+        printf("subtitle PES (%zu bytes)\n", pes.size() - binaryFramePESHeaderSize);
+        std::string json;
+        auto jsonResult = Measure(iterations * 50, [&]
+        {
+            BinaryFrameView frame = { BINARY_FRAME_PES, 0, pes.data(), pes.size() };
+            FormatResponseMessage(frame, json);
+            return json.size();
+        });
+        auto binary = Measure(iterations * 50, [&]
+        {
+            frames.clear();
+            AppendBinaryFrame(frames, BINARY_FRAME_PES, pes.data(), pes.size());
+            return BuildBinaryMessage(frames.data(), frames.size(), buffer) * sizeof(WCHAR);
+        });
+        Print("ResponseMessage JSON (UTF-8)", pes.size() - binaryFramePESHeaderSize, jsonResult, jsonResult);
+        Print("streamBinary PES", pes.size() - binaryFramePESHeaderSize, binary, jsonResult);
+    }
+
+    {
+        // データカルーセルのモジュールとセクション
+        std::vector<uint8_t> module(64 * 1024);
+        for (auto&& b : module)
+        {
+            b = (uint8_t)random();
+        }
+        printf("module (%zu bytes)\n", module.size());
+        auto base64 = Measure(iterations, [&]
+        {
+            return BuildBase64Message(module.data(), module.size(), buffer) * sizeof(WCHAR);
+        });
+        auto binary = Measure(iterations, [&]
+        {
+            frames.clear();
+            AppendModuleFrame(frames, 0x40, 1, module.data(), module.size());
+            return BuildBinaryMessage(frames.data(), frames.size(), buffer) * sizeof(WCHAR);
+        });
+        Print("Base64", module.size(), base64, base64);
+        Print("streamBinary MODULE", module.size(), binary, base64);
+        std::vector<uint8_t> section(1024);
+        for (auto&& b : section)
+        {
+            b = (uint8_t)random();
+        }
+        printf("section (%zu bytes)\n", section.size());
+        base64 = Measure(iterations * 20, [&]
+        {
+            return BuildBase64Message(section.data(), section.size(), buffer) * sizeof(WCHAR);
+        });
+        binary = Measure(iterations * 20, [&]
+        {
+            frames.clear();
+            AppendSectionFrame(frames, 0x0010, section.data(), section.size());
+            return BuildBinaryMessage(frames.data(), frames.size(), buffer) * sizeof(WCHAR);
+        });
+        Print("Base64", section.size(), base64, base64);
+        Print("streamBinary SECTION", section.size(), binary, base64);
+    }
+
+    {
+        // 受け取る側で戻す速さ (ページではbinary_frame.tsのunpackUtf16で同じことをする)
+        std::vector<uint8_t> packets(188 * 500);
+        for (auto&& b : packets)
+        {
+            b = (uint8_t)random();
+        }
+        frames.clear();
+        AppendBinaryFrame(frames, BINARY_FRAME_PACKETS, packets.data(), packets.size());
+        auto length = BuildBinaryMessage(frames.data(), frames.size(), buffer) - (_countof(binaryHead) - 1) - (_countof(tail) - 1);
+        std::vector<uint8_t> unpacked(UnpackedUtf16Size(length));
+        auto unpack = Measure(iterations, [&]
+        {
+            return UnpackUtf16(reinterpret_cast<const uint16_t*>(buffer.data() + _countof(binaryHead) - 1), length, unpacked.data());
+        });
+        if (unpack.bytes < frames.size() || memcmp(unpacked.data(), frames.data(), frames.size()))
+        {
+            printf("FAIL: UnpackUtf16 did not restore the frame\n");
+            return 1;
+        }
+        printf("unpack TS block\n");
+        Print("UnpackUtf16", packets.size(), unpack, unpack);
+    }
+    return 0;
+}
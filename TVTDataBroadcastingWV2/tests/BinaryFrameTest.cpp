@@ -0,0 +1,291 @@
+﻿// BinaryFrame.hのフレームを書き込んで文字列に詰め、戻して読み込んだものが一致することを確かめる
+#include "../BinaryFrame.h"
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+static std::vector<uint8_t> RandomBytes(std::mt19937& random, size_t size)
+{
+    std::vector<uint8_t> data(size);
+    for (auto&& b : data)
+    {
+        b = (uint8_t)random();
+    }
+    return data;
+}
+
+// 分けて詰めてから戻す 戻したものはフレームの長さより最大1バイト長い
+static std::vector<uint8_t> PackAndUnpack(const std::vector<uint8_t>& frames, size_t split)
+{
+    std::vector<uint16_t> packed(PackedUtf16Length(frames.size()));
+    Utf16Packer packer(packed.data());
+    split = std::min(split, frames.size());
+    packer.Write(frames.data(), split);
+    packer.Write(frames.data() + split, frames.size() - split);
+    CHECK(packer.Finish() == packed.data() + packed.size());
+    for (auto c : packed)
+    {
+        CHECK(c >= 0x4000 && c <= 0xbfff);
+    }
+    std::vector<uint8_t> unpacked(UnpackedUtf16Size(packed.size()));
+    auto size = UnpackUtf16(packed.data(), packed.size(), unpacked.data());
+    CHECK(size >= frames.size() && size <= frames.size() + 1);
+    unpacked.resize(size);
+    return unpacked;
+}
+
+static void TestAllTypes()
+{
+    std::mt19937 random(1);
+    auto packets = RandomBytes(random, 188 * 3);
+    auto section = RandomBytes(random, 1021);
+    auto module = RandomBytes(random, 4093);
+    auto pesData = RandomBytes(random, 77);
+    static const char control[] = R"({"type":"streamReset"})";
+    static const char response[] = R"({"type":"currentTime","timeUnixMillis":1700000000000})";
+    uint64_t pts = (1ull << 33) - 1;
+    uint64_t pcrBase = 0x123456789ull;
+
+    std::vector<uint8_t> frames;
+    AppendBinaryFrame(frames, BINARY_FRAME_PACKETS, packets.data(), packets.size());
+    AppendSectionFrame(frames, 0x1fff, section.data(), section.size());
+    AppendModuleFrame(frames, 0x40, 0xabcd, module.data(), module.size());
+    auto timestamp = AppendBinaryFrame(frames, BINARY_FRAME_TIMESTAMP, 10);
+    for (int i = 0; i < 8; i++)
+    {
+        timestamp[i] = (uint8_t)(pcrBase >> (i * 8));
+    }
+    timestamp[8] = (uint8_t)299;
+    timestamp[9] = (uint8_t)(299 >> 8);
+    AppendBinaryFrame(frames, BINARY_FRAME_CONTROL, control, sizeof(control) - 1);
+    auto pes = AppendBinaryFrame(frames, BINARY_FRAME_PES, binaryFramePESHeaderSize + pesData.size());
+    pes[0] = 0xbd;
+    pes[1] = binaryFramePESFlagPTS;
+    for (int i = 0; i < 8; i++)
+    {
+        pes[2 + i] = (uint8_t)(pts >> (i * 8));
+    }
+    memcpy(pes + binaryFramePESHeaderSize, pesData.data(), pesData.size());
+    AppendBinaryFrame(frames, BINARY_FRAME_RESPONSE, response, sizeof(response) - 1);
+    // 空のセクションとモジュール
+    AppendSectionFrame(frames, 0x0010, nullptr, 0);
+    AppendModuleFrame(frames, 0x41, 0, nullptr, 0);
+
+    // 詰める位置をずらしてビットの端数の処理を全て通る
+    for (size_t split = 0; split < 16; split++)
+    {
+        auto unpacked = PackAndUnpack(frames, split);
+        CHECK(!memcmp(unpacked.data(), frames.data(), frames.size()));
+        BinaryFrameReader reader(unpacked.data(), unpacked.size());
+        BinaryFrameView frame;
+        int count = 0;
+        while (reader.Next(frame))
+        {
+            uint16_t pid = 0;
+            uint8_t componentTag = 0;
+            uint16_t moduleId = 0;
+            const uint8_t* data = nullptr;
+            size_t size = 0;
+            switch (count++)
+            {
+            case 0:
+                CHECK(frame.type == BINARY_FRAME_PACKETS);
+                CHECK(frame.size == packets.size() && !memcmp(frame.payload, packets.data(), packets.size()));
+                break;
+            case 1:
+                CHECK(ReadSectionFrame(frame, pid, data, size));
+                CHECK(pid == 0x1fff);
+                CHECK(size == section.size() && !memcmp(data, section.data(), size));
+                break;
+            case 2:
+                CHECK(ReadModuleFrame(frame, componentTag, moduleId, data, size));
+                CHECK(componentTag == 0x40 && moduleId == 0xabcd);
+                CHECK(size == module.size() && !memcmp(data, module.data(), size));
+                break;
+            case 3:
+                CHECK(frame.type == BINARY_FRAME_TIMESTAMP && frame.size == 10);
+                CHECK(ReadBinaryFrameUint64(frame.payload) == pcrBase);
+                CHECK((frame.payload[8] | (frame.payload[9] << 8)) == 299);
+                break;
+            case 4:
+                CHECK(frame.type == BINARY_FRAME_CONTROL);
+                CHECK(std::string((const char*)frame.payload, frame.size) == control);
+                break;
+            case 5:
+                CHECK(frame.type == BINARY_FRAME_PES && frame.size == binaryFramePESHeaderSize + pesData.size());
+                CHECK(frame.payload[0] == 0xbd && frame.payload[1] == binaryFramePESFlagPTS);
+                CHECK(ReadBinaryFrameUint64(frame.payload + 2) == pts);
+                CHECK(!memcmp(frame.payload + binaryFramePESHeaderSize, pesData.data(), pesData.size()));
+                break;
+            case 6:
+                CHECK(frame.type == BINARY_FRAME_RESPONSE);
+                CHECK(std::string((const char*)frame.payload, frame.size) == response);
+                break;
+            case 7:
+                CHECK(ReadSectionFrame(frame, pid, data, size));
+                CHECK(pid == 0x0010 && size == 0);
+                // 種類が違えば読まない
+                CHECK(!ReadModuleFrame(frame, componentTag, moduleId, data, size));
+                break;
+            case 8:
+                CHECK(ReadModuleFrame(frame, componentTag, moduleId, data, size));
+                CHECK(componentTag == 0x41 && moduleId == 0 && size == 0);
+                break;
+            }
+        }
+        CHECK(count == 9);
+        CHECK(!reader.HasError());
+    }
+}
+
+static void TestPackedLengths()
+{
+    std::mt19937 random(2);
+    for (size_t size = 0; size < 2000; size++)
+    {
+        auto data = RandomBytes(random, size);
+        auto unpacked = PackAndUnpack(data, size / 3);
+        CHECK(!memcmp(unpacked.data(), data.data(), size));
+    }
+    // 範囲外の文字があれば戻さない
+    uint16_t invalid[] = { 0x4000, 0x3fff };
+    uint8_t out[8];
+    CHECK(UnpackUtf16(invalid, 2, out) == 0);
+    invalid[1] = 0xc000;
+    CHECK(UnpackUtf16(invalid, 2, out) == 0);
+}
+
+static void TestReaderErrors()
+{
+    std::vector<uint8_t> frames;
+    AppendBinaryFrame(frames, BINARY_FRAME_CONTROL, "{}", 2);
+    // 知らない種類は読み飛ばす
+    AppendBinaryFrame(frames, (BinaryFrameType)100, "xyz", 3);
+    AppendBinaryFrame(frames, BINARY_FRAME_CONTROL, "[]", 2);
+    BinaryFrameView frame;
+    {
+        // ヘッダに満たない余りは無視する
+        auto data = frames;
+        data.insert(data.end(), { binaryFrameVersion, 1, 0 });
+        BinaryFrameReader reader(data.data(), data.size());
+        int count = 0;
+        while (reader.Next(frame))
+        {
+            count++;
+        }
+        CHECK(count == 2);
+        CHECK(!reader.HasError());
+    }
+    {
+        // 長さが足りなければ読まない
+        BinaryFrameReader reader(frames.data(), frames.size() - 1);
+        CHECK(reader.Next(frame));
+        CHECK(!reader.Next(frame));
+        CHECK(reader.HasError());
+    }
+    {
+        auto data = frames;
+        data[0] = binaryFrameVersion + 1;
+        BinaryFrameReader reader(data.data(), data.size());
+        CHECK(!reader.Next(frame));
+        CHECK(reader.HasError());
+    }
+    {
+        // 短すぎるSECTIONとMODULE
+        std::vector<uint8_t> data;
+        AppendBinaryFrame(data, BINARY_FRAME_SECTION, "x", 1);
+        AppendBinaryFrame(data, BINARY_FRAME_MODULE, "xy", 2);
+        BinaryFrameReader reader(data.data(), data.size());
+        uint16_t pid = 0;
+        uint8_t componentTag = 0;
+        uint16_t moduleId = 0;
+        const uint8_t* payload = nullptr;
+        size_t size = 0;
+        CHECK(reader.Next(frame));
+        CHECK(!ReadSectionFrame(frame, pid, payload, size));
+        CHECK(reader.Next(frame));
+        CHECK(!ReadModuleFrame(frame, componentTag, moduleId, payload, size));
+    }
+}
+
+static void TestFormatResponseMessage()
+{
+    std::vector<uint8_t> frames;
+    auto pes = AppendBinaryFrame(frames, BINARY_FRAME_PES, binaryFramePESHeaderSize + 3);
+    uint64_t pts = 900045;
+    pes[0] = 0xbd;
+    pes[1] = binaryFramePESFlagPTS;
+    for (int i = 0; i < 8; i++)
+    {
+        pes[2 + i] = (uint8_t)(pts >> (i * 8));
+    }
+    pes[10] = 1;
+    pes[11] = 2;
+    pes[12] = 255;
+    pes = AppendBinaryFrame(frames, BINARY_FRAME_PES, binaryFramePESHeaderSize);
+    pes[0] = 0xbf;
+    auto timestamp = AppendBinaryFrame(frames, BINARY_FRAME_TIMESTAMP, 10);
+    uint64_t pcrBase = (1ull << 33) - 1;
+    for (int i = 0; i < 8; i++)
+    {
+        timestamp[i] = (uint8_t)(pcrBase >> (i * 8));
+    }
+    timestamp[8] = (uint8_t)299;
+    timestamp[9] = (uint8_t)(299 >> 8);
+    static const char response[] = R"({"type":"currentTime","timeUnixMillis":1})";
+    AppendBinaryFrame(frames, BINARY_FRAME_RESPONSE, response, sizeof(response) - 1);
+    AppendBinaryFrame(frames, BINARY_FRAME_PACKETS, "x", 1);
+    const char* expected[] = {
+        R"({"type":"pes","streamId":189,"data":[1,2,255],"pts":10000.5})",
+        R"({"type":"pes","streamId":191,"data":[]})",
+        R"({"type":"pcr","pcrBase":8589934591,"pcrExtension":299})",
+        response,
+    };
+    BinaryFrameReader reader(frames.data(), frames.size());
+    BinaryFrameView frame;
+    std::string json;
+    size_t count = 0;
+    while (reader.Next(frame))
+    {
+        if (count < _countof(expected))
+        {
+            CHECK(FormatResponseMessage(frame, json));
+            CHECK(json == expected[count]);
+        }
+        else
+        {
+            // PACKETSはResponseMessageにならない
+            CHECK(!FormatResponseMessage(frame, json));
+        }
+        count++;
+    }
+    CHECK(count == _countof(expected) + 1);
+}
+
+int main()
+{
+    TestAllTypes();
+    TestPackedLengths();
+    TestReaderErrors();
+    TestFormatResponseMessage();
+    if (failures)
+    {
+        printf("BinaryFrameTest: %d failures\n", failures);
+        return 1;
+    }
+    puts("BinaryFrameTest: OK");
+    return 0;
+}
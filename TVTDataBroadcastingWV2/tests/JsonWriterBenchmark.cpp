@@ -0,0 +1,112 @@
+﻿// キー操作でページに送るkeyメッセージの作成にかかる時間を
+// user-031より前のnlohmann::json、stringstream、UTF-16への変換を経由するものとJsonMessageWriterで比べる
+#include "../JsonWriter.h"
+#include "../thirdparty/json.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <vector>
+
+// utf8StrToWStringと同じくMultiByteToWideCharのように長さを数えてから確保して変換する
+static size_t DecodeUTF8(const char* s, WCHAR* dst)
+{
+    size_t length = 0;
+    auto p = (const unsigned char*)s;
+    while (*p)
+    {
+        uint32_t c = *p++;
+        int trail = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+        c &= trail ? 0x3f >> trail : 0x7f;
+        for (; trail && (*p & 0xc0) == 0x80; trail--)
+        {
+            c = (c << 6) | (*p++ & 0x3f);
+        }
+        if (c >= 0x10000)
+        {
+            if (dst)
+            {
+                dst[length] = (WCHAR)(0xd800 + ((c - 0x10000) >> 10));
+                dst[length + 1] = (WCHAR)(0xdc00 + (c & 0x3ff));
+            }
+            length += 2;
+        }
+        else
+        {
+            if (dst)
+            {
+                dst[length] = (WCHAR)c;
+            }
+            length++;
+        }
+    }
+    return length;
+}
+
+static std::wstring utf8StrToWString(const char* s)
+{
+    std::wstring result(DecodeUTF8(s, nullptr), 0);
+    DecodeUTF8(s, &result[0]);
+    return result;
+}
+
+// PostWebMessageAsJsonの代わり 渡された文字列を読んで最適化で消されないようにする
+static size_t posted;
+static void Post(LPCWSTR json)
+{
+    posted += json[0] + json[1];
+}
+
+template<class Function>
+static void Measure(const char* name, int iterations, Function function)
+{
+    std::vector<double> samples(iterations);
+    for (int i = 0; i < iterations; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        function(i);
+        samples[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    }
+    std::sort(samples.begin(), samples.end());
+    double total = 0;
+    for (auto sample : samples)
+    {
+        total += sample;
+    }
+    printf("%-18s mean %7.1f ns, median %7.1f ns, p99 %7.1f ns\n", name, total / iterations, samples[iterations / 2], samples[iterations * 99 / 100]);
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+    // nlohmann::jsonはキーの順序が異なるので読み直して同じ値になることを確かめる
+    {
+        nlohmann::json expected{ { "type", "key" }, { "keyCode", 21 } };
+        JsonMessageWriter writer;
+        std::string actual;
+        for (auto p = writer.Begin(L"key").Add(L"keyCode", 21).End(); *p; p++)
+        {
+            actual += (char)*p;
+        }
+        if (nlohmann::json::parse(actual) != expected)
+        {
+            puts("FAIL: JsonMessageWriter differs from nlohmann::json");
+            return 1;
+        }
+    }
+    printf("key message, iterations=%d\n", iterations);
+    Measure("nlohmann::json", iterations, [](int i)
+    {
+        nlohmann::json msg{ { "type", "key" }, { "keyCode", i & 31 } };
+        std::stringstream ss;
+        ss << msg;
+        auto wjson = utf8StrToWString(ss.str().c_str());
+        Post(wjson.c_str());
+    });
+    JsonMessageWriter writer;
+    Measure("JsonMessageWriter", iterations, [&writer](int i)
+    {
+        Post(writer.Begin(L"key").Add(L"keyCode", i & 31).End());
+    });
+    return posted ? 0 : 1;
+}
@@ -0,0 +1,187 @@
+// ProxyPipelineとPosixProxyTransportでProxyStubServer.pyに負荷をかけ、接続の使いまわしやサーバーごとの接続数の上限、スケジューラ、同じGETのまとめ、ストリーミングの効果を測る
+//   ./ProxyLoadBenchmark [--keep-alive] [--max-conns N] [--max-per-host N] [--stream KB] [--same-url] [-n リクエスト数] [-c 同時実行数] URL
+// プラグイン本体では同じProxyPipelineをWinHTTPのProxySessionにつなぎ、ProxyMaxConnectionsPerServerなどをiniで設定する
+#include "../PosixProxyTransport.h"
+#include "../ProxyPipeline.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Results
+{
+    std::mutex mutex;
+    std::condition_variable finished;
+    int running = 0;
+    int succeeded = 0;
+    int failed = 0;
+    // スタブサーバーが起動してから受け付けた接続の通し番号の範囲
+    unsigned long firstConnection = ULONG_MAX;
+    unsigned long lastConnection = 0;
+    std::vector<double> latencies;
+    // ストリーミングした内容を読み出すスレッド
+    std::vector<std::thread> readers;
+};
+
+// ページの代わりに応答を受け取って所要時間を数える
+class BenchmarkResponder : public ProxyResponder, public std::enable_shared_from_this<BenchmarkResponder>
+{
+    Results& results;
+    std::chrono::steady_clock::time_point sent = std::chrono::steady_clock::now();
+
+    void Done(bool ok, const std::wstring& headers)
+    {
+        auto milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - this->sent).count();
+        std::lock_guard<std::mutex> lock(this->results.mutex);
+        if (ok)
+        {
+            this->results.succeeded++;
+            this->results.latencies.push_back(milliseconds);
+            auto count = headers.find(L"X-Connection-Count: ");
+            if (count != std::wstring::npos)
+            {
+                auto number = wcstoul(headers.c_str() + count + 20, nullptr, 10);
+                this->results.firstConnection = std::min(this->results.firstConnection, number);
+                this->results.lastConnection = std::max(this->results.lastConnection, number);
+            }
+        }
+        else
+        {
+            this->results.failed++;
+        }
+        this->results.running--;
+        this->results.finished.notify_all();
+    }
+public:
+    explicit BenchmarkResponder(Results& results) : results(results)
+    {
+    }
+
+    void Respond(uint32_t statusCode, const std::wstring&, const std::wstring& headers, std::shared_ptr<const void>, const uint8_t*, size_t, const std::wstring&) override
+    {
+        this->Done(statusCode == 200, headers);
+    }
+
+    void RespondStreaming(uint32_t statusCode, const std::wstring&, const std::wstring& headers, std::shared_ptr<ProxyPipe> pipe, size_t reader, uint64_t, const std::wstring&) override
+    {
+        // WebView2と同じく別のスレッドから終端まで読む
+        std::lock_guard<std::mutex> lock(this->results.mutex);
+        this->results.readers.emplace_back([self = this->shared_from_this(), statusCode, headers, pipe, reader]
+        {
+            uint8_t buffer[16384];
+            size_t read;
+            bool ok;
+            while ((ok = pipe->Read(reader, buffer, sizeof(buffer), read)) && read)
+            {
+            }
+            pipe->CloseReader(reader);
+            self->Done(ok && statusCode == 200, headers);
+        });
+    }
+
+    void Fail() override
+    {
+        this->Done(false, std::wstring());
+    }
+};
+
+int main(int argc, char** argv)
+{
+    bool keepAlive = false;
+    bool sameUrl = false;
+    size_t maxConnections = 0;
+    size_t maxPerHost = 0;
+    size_t streamKilobytes = 0;
+    int requests = 1000;
+    int concurrency = 32;
+    std::wstring url;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--keep-alive")
+        {
+            keepAlive = true;
+        }
+        else if (arg == "--same-url")
+        {
+            sameUrl = true;
+        }
+        else if (arg == "--max-conns" && i + 1 < argc)
+        {
+            maxConnections = (size_t)strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--max-per-host" && i + 1 < argc)
+        {
+            maxPerHost = (size_t)strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--stream" && i + 1 < argc)
+        {
+            streamKilobytes = (size_t)strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "-n" && i + 1 < argc)
+        {
+            requests = atoi(argv[++i]);
+        }
+        else if (arg == "-c" && i + 1 < argc)
+        {
+            concurrency = atoi(argv[++i]);
+        }
+        else
+        {
+            url.assign(arg.begin(), arg.end());
+        }
+    }
+    if (url.empty() || requests <= 0 || concurrency <= 0)
+    {
+        fprintf(stderr, "usage: %s [--keep-alive] [--max-conns N] [--max-per-host N] [--stream KB] [--same-url] [-n requests] [-c concurrency] URL\n", argv[0]);
+        return 2;
+    }
+    auto transport = std::make_shared<PosixProxyTransport>(30, keepAlive, maxConnections);
+    ProxyPipelineOptions options;
+    options.responseHeaderRules = { { ProxyHeaderAction::Replace, L"Access-Control-Allow-Origin", L"https://tvtdatabroadcastingwv2.invalid" } };
+    options.streamBufferSize = streamKilobytes * 1024;
+    options.maxRequestsPerHost = maxPerHost;
+    auto pipeline = std::make_shared<ProxyPipeline>(transport, nullptr, std::move(options));
+    Results results;
+    results.latencies.reserve(requests);
+    // まとめられないように既定ではリクエストごとにURLを変える スタブサーバーは知らないクエリを無視する
+    auto separator = url.find(L'?') == std::wstring::npos ? L"?n=" : L"&n=";
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < requests; i++)
+    {
+        {
+            std::unique_lock<std::mutex> lock(results.mutex);
+            results.finished.wait(lock, [&] { return results.running < concurrency; });
+            results.running++;
+        }
+        auto responder = std::make_shared<BenchmarkResponder>(results);
+        pipeline->Request(sameUrl ? url : url + separator + std::to_wstring(i), L"GET", {}, {}, ProxyPriority::Document, std::move(responder));
+    }
+    {
+        std::unique_lock<std::mutex> lock(results.mutex);
+        results.finished.wait(lock, [&] { return results.running == 0; });
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (auto&& reader : results.readers)
+    {
+        reader.join();
+    }
+    std::sort(results.latencies.begin(), results.latencies.end());
+    auto percentile = [&results](double p)
+    {
+        return results.latencies.empty() ? 0.0 : results.latencies[std::min(results.latencies.size() - 1, (size_t)(results.latencies.size() * p))];
+    };
+    auto statistics = transport->GetStatistics();
+    auto scheduler = pipeline->GetSchedulerStatistics();
+    printf("%-10s max-conns=%-3zu per-host=%-3zu stream=%-4zu %s ok=%d failed=%d %7.0f req/s p50=%6.1f ms p99=%6.1f ms connected=%llu reused=%llu waited=%llu delayed=%llu coalesced=%llu server-connections=%lu\n",
+        keepAlive ? "keep-alive" : "close", maxConnections, maxPerHost, streamKilobytes, sameUrl ? "same-url" : "distinct", results.succeeded, results.failed, requests / seconds, percentile(0.5), percentile(0.99),
+        (unsigned long long)statistics.connected, (unsigned long long)statistics.reused, (unsigned long long)statistics.waited, (unsigned long long)scheduler.delayed, (unsigned long long)pipeline->GetStatistics().coalesced,
+        results.lastConnection >= results.firstConnection ? results.lastConnection - results.firstConnection + 1 : 0);
+    pipeline->CancelAll();
+    return results.failed ? 1 : 0;
+}
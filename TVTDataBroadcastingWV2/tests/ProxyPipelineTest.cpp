@@ -0,0 +1,666 @@
+﻿// ProxyPipelineのキャッシュ、同じGETのまとめ、ヘッダの書き換え、優先度、取り消し、サーキットブレーカーを上流の代わりの実装で確かめる
+// ProxyArchiveの記録の読み書きとProxyReplayTransportの再生もここで確かめる
+#include "../ProxyArchive.h"
+#include "../ProxyPipeline.h"
+#include <cstdio>
+#include <future>
+#include <map>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+// 受け取ったリクエストを保持し、テストから応答か失敗を返す 既定のRequestStreamingAsyncを使う
+class FakeTransport : public ProxyTransport
+{
+public:
+    struct Request
+    {
+        std::wstring url;
+        std::wstring verb;
+        std::vector<std::pair<std::wstring, std::wstring>> headers;
+        std::shared_ptr<ProxySchedulerSlot> slot;
+        ErrorCallback errorCallback;
+        ResponseCallback callback;
+    };
+    std::vector<Request> requests;
+    int cancelled = 0;
+
+    bool RequestAsync
+    (
+        const wchar_t* url,
+        const wchar_t* verb,
+        std::vector<uint8_t>,
+        const std::vector<std::pair<const wchar_t*, const wchar_t*>>& headers,
+        std::shared_ptr<ProxySchedulerSlot> slot,
+        ErrorCallback errorCallback,
+        ResponseCallback callback
+    ) override
+    {
+        this->requests.push_back({ url, verb, std::vector<std::pair<std::wstring, std::wstring>>(headers.begin(), headers.end()), std::move(slot), std::move(errorCallback), std::move(callback) });
+        return true;
+    }
+
+    void CancelAll() override
+    {
+        this->cancelled++;
+    }
+
+    std::wstring Header(size_t index, const std::wstring& name) const
+    {
+        for (auto&& [headerName, value] : this->requests[index].headers)
+        {
+            if (ProxyEqualsIgnoreCase(headerName, name))
+            {
+                return value;
+            }
+        }
+        return std::wstring();
+    }
+
+    // 枠を返すと待っていたリクエストが開始されてrequestsに追加されるので取り出してから呼ぶ
+    void Respond(size_t index, uint32_t statusCode, const wchar_t* headers, const std::string& body)
+    {
+        auto callback = std::move(this->requests[index].callback);
+        auto slot = std::move(this->requests[index].slot);
+        // 実際の実装と同じく終われば両方のコールバックを捨てる
+        this->requests[index].errorCallback = nullptr;
+        std::vector<uint8_t> content(body.begin(), body.end());
+        callback(statusCode, statusCode == 304 ? L"Not Modified" : L"OK", headers, content);
+    }
+
+    void Fail(size_t index)
+    {
+        auto errorCallback = std::move(this->requests[index].errorCallback);
+        auto slot = std::move(this->requests[index].slot);
+        this->requests[index].callback = nullptr;
+        errorCallback();
+    }
+};
+
+// メモリにのみ置くキャッシュ 時刻はテストが進める
+class FakeCache : public ProxyResponseCache
+{
+public:
+    std::map<std::wstring, Entry> entries;
+    int64_t now = 1000;
+    int stored = 0;
+    int revalidated = 0;
+    int bypassed = 0;
+
+    int64_t Now() override
+    {
+        return this->now;
+    }
+
+    ProxyCacheMode RequestHeaderMode(LPCWSTR name, LPCWSTR value) override
+    {
+        return ProxyEqualsIgnoreCase(name, L"Cache-Control") && ProxyEqualsIgnoreCase(value, L"no-store") ? ProxyCacheMode::Bypass : ProxyCacheMode::Use;
+    }
+
+    Entry Lookup(const std::wstring& url, int64_t) override
+    {
+        auto it = this->entries.find(url);
+        return it == this->entries.end() ? nullptr : it->second;
+    }
+
+    Entry Store(const std::wstring& url, DWORD statusCode, LPCWSTR statusCodeText, LPCWSTR headers, std::vector<BYTE>& content, int64_t requestTime) override
+    {
+        auto entry = std::make_shared<ProxyCacheEntry>();
+        entry->statusCode = statusCode;
+        entry->statusCodeText = statusCodeText;
+        entry->headers = headers;
+        entry->content = std::move(content);
+        entry->responseTime = requestTime;
+        entry->freshUntil = requestTime + 60;
+        this->entries[url] = entry;
+        this->stored++;
+        return entry;
+    }
+
+    Entry Revalidate(const std::wstring& url, const Entry& stale, LPCWSTR, int64_t requestTime) override
+    {
+        auto entry = std::make_shared<ProxyCacheEntry>(*stale);
+        entry->freshUntil = requestTime + 60;
+        this->entries[url] = entry;
+        this->revalidated++;
+        return entry;
+    }
+
+    void Invalidate(const std::wstring& url) override
+    {
+        this->entries.erase(url);
+    }
+
+    void CountBypass() override
+    {
+        this->bypassed++;
+    }
+
+    size_t MaxEntrySize() const override
+    {
+        return 1024;
+    }
+};
+
+class TestResponder : public ProxyResponder
+{
+public:
+    enum class Result
+    {
+        None,
+        Responded,
+        Streaming,
+        Failed,
+    };
+    Result result = Result::None;
+    int calls = 0;
+    uint32_t statusCode = 0;
+    std::wstring headers;
+    std::wstring host;
+    std::string body;
+    std::shared_ptr<ProxyPipe> pipe;
+    size_t reader = 0;
+
+    void Respond(uint32_t statusCode, const std::wstring&, const std::wstring& headers, std::shared_ptr<const void>, const uint8_t* content, size_t contentSize, const std::wstring& host) override
+    {
+        this->result = Result::Responded;
+        this->calls++;
+        this->statusCode = statusCode;
+        this->headers = headers;
+        this->host = host;
+        this->body.assign((const char*)content, contentSize);
+    }
+
+    void RespondStreaming(uint32_t statusCode, const std::wstring&, const std::wstring& headers, std::shared_ptr<ProxyPipe> pipe, size_t reader, uint64_t, const std::wstring& host) override
+    {
+        this->result = Result::Streaming;
+        this->calls++;
+        this->statusCode = statusCode;
+        this->headers = headers;
+        this->host = host;
+        this->pipe = std::move(pipe);
+        this->reader = reader;
+    }
+
+    void Fail() override
+    {
+        this->result = Result::Failed;
+        this->calls++;
+    }
+
+    // 書き込み側が閉じた後に呼ぶこと
+    std::string ReadAll()
+    {
+        std::string content;
+        uint8_t buffer[3];
+        size_t read;
+        while (this->pipe->Read(this->reader, buffer, sizeof(buffer), read) && read)
+        {
+            content.append((const char*)buffer, read);
+        }
+        this->pipe->CloseReader(this->reader);
+        return content;
+    }
+};
+
+static const wchar_t okHeaders[] = L"HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\nContent-Length: 5\r\n\r\n";
+
+static std::shared_ptr<ProxyPipeline> MakePipeline(std::shared_ptr<FakeTransport> transport, std::shared_ptr<FakeCache> cache, ProxyPipelineOptions options = {})
+{
+    options.responseHeaderRules = { { ProxyHeaderAction::Replace, L"Access-Control-Allow-Origin", L"https://tvtdatabroadcastingwv2.invalid" } };
+    return std::make_shared<ProxyPipeline>(std::move(transport), std::move(cache), std::move(options));
+}
+
+static void TestHeaderRules()
+{
+    ProxyHeaderRules rules;
+    CHECK(ParseProxyHeaderRules(L" -Server | =Cache-Control: max-age=300|+X-Added: 1||+X-Added:2 ", rules));
+    CHECK(rules.size() == 4);
+    if (rules.size() == 4)
+    {
+        CHECK(rules[0].action == ProxyHeaderAction::Drop && rules[0].name == L"Server" && rules[0].value.empty());
+        CHECK(rules[1].action == ProxyHeaderAction::Replace && rules[1].name == L"Cache-Control" && rules[1].value == L"max-age=300");
+        CHECK(rules[2].action == ProxyHeaderAction::Add && rules[2].name == L"X-Added" && rules[2].value == L"1");
+        CHECK(rules[3].action == ProxyHeaderAction::Add && rules[3].value == L"2");
+    }
+    // 読めないものは捨てて、読めたものだけ追加する
+    ProxyHeaderRules invalid;
+    CHECK(!ParseProxyHeaderRules(L"Server|-|=NoValue|+: value|*X: 1|-Via", invalid));
+    CHECK(invalid.size() == 1 && invalid[0].action == ProxyHeaderAction::Drop && invalid[0].name == L"Via");
+
+    // 応答ヘッダ Dropは大文字小文字を区別せず全て取り除き、Replaceは最初の1つだけを置き換えて残りは取り除く
+    ProxyHeaderRules responseRules;
+    CHECK(ParseProxyHeaderRules(L"-Server|=Cache-Control: max-age=300|+X-Added: 1|=X-Missing: yes|=X-Missing: hidden", responseRules));
+    CHECK(RewriteResponseHeaders(
+        L"HTTP/1.1 200 OK\r\n"
+        L"server: a\r\n"
+        L"Cache-Control: no-store\r\n"
+        L"Content-Type: text/html\r\n"
+        L"cache-control: private\r\n"
+        L"X-Added: 0\r\n"
+        L"Server: b\r\n"
+        L"\r\n", responseRules) ==
+        L"HTTP/1.1 200 OK\r\n"
+        L"Cache-Control: max-age=300\r\n"
+        L"Content-Type: text/html\r\n"
+        L"X-Added: 0\r\n"
+        // Addは既にあっても追加し、なかったReplaceは同じ名前の最初のルールだけを追加する
+        L"X-Added: 1\r\n"
+        L"X-Missing: yes\r\n");
+    CHECK(RewriteResponseHeaders(L"HTTP/1.1 204 No Content\r\n\r\n", {}) == L"HTTP/1.1 204 No Content\r\n");
+
+    // リクエストヘッダも同じルールで書き換える
+    ProxyHeaderRules requestRules;
+    CHECK(ParseProxyHeaderRules(L"-Cookie|=Accept: */*|+X-Request: 1|=X-Missing: yes", requestRules));
+    std::vector<std::pair<const wchar_t*, const wchar_t*>> headers
+    {
+        { L"Cookie", L"a=b" },
+        { L"User-Agent", L"test" },
+        { L"accept", L"text/html" },
+        { L"COOKIE", L"c=d" },
+        { L"Accept", L"image/png" },
+    };
+    RewriteRequestHeaders(headers, requestRules);
+    std::vector<std::pair<std::wstring, std::wstring>> rewritten(headers.begin(), headers.end());
+    CHECK((rewritten == std::vector<std::pair<std::wstring, std::wstring>>
+    {
+        { L"User-Agent", L"test" },
+        { L"Accept", L"*/*" },
+        { L"X-Request", L"1" },
+        { L"X-Missing", L"yes" },
+    }));
+}
+
+static void TestCoalescing()
+{
+    auto transport = std::make_shared<FakeTransport>();
+    ProxyPipelineOptions options;
+    options.requestHeaderRules = { { ProxyHeaderAction::Add, L"X-Test", L"1" } };
+    auto pipeline = MakePipeline(transport, nullptr, options);
+    std::vector<std::pair<std::wstring, std::wstring>> headers{ { L"Cookie", L"a=b" }, { L"Content-Type", L"text/plain" } };
+    auto first = std::make_shared<TestResponder>();
+    auto second = std::make_shared<TestResponder>();
+    auto other = std::make_shared<TestResponder>();
+    pipeline->Request(L"http://example.com/a", L"GET", {}, headers, ProxyPriority::Document, first);
+    pipeline->Request(L"http://example.com/a", L"GET", {}, headers, ProxyPriority::Document, second);
+    // 転送するヘッダが違えばまとめない
+    pipeline->Request(L"http://example.com/a", L"GET", {}, {}, ProxyPriority::Document, other);
+    CHECK(transport->requests.size() == 2);
+    CHECK(pipeline->GetStatistics().coalesced == 1);
+    CHECK(pipeline->GetStatistics().inFlight == 2);
+    // 許可したものだけを転送し、ルールで追加する
+    CHECK(transport->Header(0, L"Content-Type") == L"text/plain");
+    CHECK(transport->Header(0, L"Cookie").empty());
+    CHECK(transport->Header(0, L"Pragma") == L"no-cache");
+    CHECK(transport->Header(0, L"Accept-Language") == L"ja");
+    CHECK(transport->Header(0, L"X-Test") == L"1");
+    transport->Respond(0, 200, okHeaders, "hello");
+    for (auto&& responder : { first, second })
+    {
+        CHECK(responder->result == TestResponder::Result::Responded && responder->calls == 1);
+        CHECK(responder->statusCode == 200 && responder->body == "hello");
+        CHECK(responder->host == L"example.com:80");
+        CHECK(responder->headers.find(L"Access-Control-Allow-Origin: https://tvtdatabroadcastingwv2.invalid") != std::wstring::npos);
+    }
+    CHECK(other->result == TestResponder::Result::None);
+    CHECK(pipeline->GetStatistics().inFlight == 1);
+    // 応答を受け取った後は新しく上流に出す
+    auto third = std::make_shared<TestResponder>();
+    pipeline->Request(L"http://example.com/a", L"GET", {}, headers, ProxyPriority::Document, third);
+    CHECK(transport->requests.size() == 3);
+    transport->Respond(1, 200, okHeaders, "other");
+    transport->Respond(2, 200, okHeaders, "third");
+    CHECK(other->body == "other" && third->body == "third");
+    CHECK(pipeline->GetStatistics().inFlight == 0);
+    pipeline->CancelAll();
+}
+
+static void TestPost()
+{
+    auto transport = std::make_shared<FakeTransport>();
+    auto cache = std::make_shared<FakeCache>();
+    auto pipeline = MakePipeline(transport, cache);
+    cache->entries[L"http://example.com/post"] = std::make_shared<ProxyCacheEntry>();
+    auto first = std::make_shared<TestResponder>();
+    auto second = std::make_shared<TestResponder>();
+    // POSTはまとめず、保持している応答を捨てる
+    pipeline->Request(L"http://example.com/post", L"POST", { 1, 2, 3 }, {}, ProxyPriority::Document, first);
+    pipeline->Request(L"http://example.com/post", L"POST", { 1, 2, 3 }, {}, ProxyPriority::Document, second);
+    CHECK(transport->requests.size() == 2);
+    CHECK(cache->entries.empty());
+    transport->Fail(0);
+    CHECK(first->result == TestResponder::Result::Failed);
+    transport->Respond(1, 200, okHeaders, "ok");
+    CHECK(second->result == TestResponder::Result::Responded && second->body == "ok");
+    // POSTの応答は保存しない
+    CHECK(cache->stored == 0);
+    pipeline->CancelAll();
+}
+
+static void TestCache()
+{
+    auto transport = std::make_shared<FakeTransport>();
+    auto cache = std::make_shared<FakeCache>();
+    auto pipeline = MakePipeline(transport, cache);
+    auto first = std::make_shared<TestResponder>();
+    pipeline->Request(L"http://example.com/c", L"GET", {}, {}, ProxyPriority::Document, first);
+    CHECK(transport->requests.size() == 1);
+    transport->Respond(0, 200, okHeaders, "cached");
+    CHECK(cache->stored == 1);
+    // 期限内であれば上流に出さずに返す
+    auto hit = std::make_shared<TestResponder>();
+    pipeline->Request(L"http://example.com/c", L"GET", {}, {}, ProxyPriority::Document, hit);
+    CHECK(transport->requests.size() == 1);
+    CHECK(hit->result == TestResponder::Result::Responded && hit->body == "cached" && hit->host.empty());
+    // 期限切れであればETagで再検証する
+    auto entry = std::make_shared<ProxyCacheEntry>(*cache->entries[L"http://example.com/c"]);
+    entry->etag = L"\"v1\"";
+    entry->freshUntil = 0;
+    cache->entries[L"http://example.com/c"] = entry;
+    auto stale = std::make_shared<TestResponder>();
+    pipeline->Request(L"http://example.com/c", L"GET", {}, {}, ProxyPriority::Document, stale);
+    CHECK(transport->requests.size() == 2);
+    CHECK(transport->Header(1, L"If-None-Match") == L"\"v1\"");
+    transport->Respond(1, 304, L"HTTP/1.1 304 Not Modified\r\n\r\n", "");
+    CHECK(cache->revalidated == 1);
+    CHECK(stale->result == TestResponder::Result::Responded && stale->statusCode == 200 && stale->body == "cached");
+    // no-storeであれば使わず、保存もしない
+    auto bypass = std::make_shared<TestResponder>();
+    pipeline->Request(L"http://example.com/c", L"GET", {}, { { L"Cache-Control", L"no-store" } }, ProxyPriority::Document, bypass);
+    CHECK(cache->bypassed == 1);
+    CHECK(transport->requests.size() == 3);
+    transport->Respond(2, 200, okHeaders, "fresh");
+    CHECK(bypass->body == "fresh");
+    CHECK(cache->stored == 1);
+    pipeline->CancelAll();
+}
+
+static void TestStreaming()
+{
+    auto transport = std::make_shared<FakeTransport>();
+    auto cache = std::make_shared<FakeCache>();
+    ProxyPipelineOptions options;
+    options.streamBufferSize = 4;
+    auto pipeline = MakePipeline(transport, cache, options);
+    auto first = std::make_shared<TestResponder>();
+    auto second = std::make_shared<TestResponder>();
+    pipeline->Request(L"http://example.com/s", L"GET", {}, {}, ProxyPriority::Document, first);
+    pipeline->Request(L"http://example.com/s", L"GET", {}, {}, ProxyPriority::Document, second);
+    CHECK(transport->requests.size() == 1);
+    transport->Respond(0, 200, okHeaders, "streamed body");
+    for (auto&& responder : { first, second })
+    {
+        CHECK(responder->result == TestResponder::Result::Streaming);
+        CHECK(responder->ReadAll() == "streamed body");
+        CHECK(responder->headers.find(L"Access-Control-Allow-Origin: https://tvtdatabroadcastingwv2.invalid") != std::wstring::npos);
+    }
+    // 全て受信した後にキャッシュに保存する
+    CHECK(cache->stored == 1);
+    pipeline->CancelAll();
+}
+
+static void TestPriorityAndCancel()
+{
+    auto transport = std::make_shared<FakeTransport>();
+    ProxyPipelineOptions options;
+    options.maxRequests = 1;
+    options.circuitBreakerFailures = 1;
+    options.circuitBreakerCoolDownMilliseconds = 60000;
+    auto pipeline = MakePipeline(transport, nullptr, options);
+    auto running = std::make_shared<TestResponder>();
+    auto post = std::make_shared<TestResponder>();
+    auto image = std::make_shared<TestResponder>();
+    auto document = std::make_shared<TestResponder>();
+    pipeline->Request(L"http://example.com/running", L"GET", {}, {}, ProxyPriority::Document, running);
+    pipeline->Request(L"http://example.com/post", L"POST", {}, {}, ProxyPriority::Document, post);
+    pipeline->Request(L"http://example.com/image", L"GET", {}, {}, ProxyPriority::Resource, image);
+    pipeline->Request(L"http://example.com/document", L"GET", {}, {}, ProxyPriority::Document, document);
+    CHECK(transport->requests.size() == 1);
+    CHECK(pipeline->GetSchedulerStatistics().waiting == 3);
+    // ページの表示に必要なものから開始し、POSTは最後にする
+    transport->Respond(0, 200, okHeaders, "0");
+    CHECK(transport->requests.size() == 2 && transport->requests[1].url == L"http://example.com/document");
+    transport->Respond(1, 200, okHeaders, "1");
+    CHECK(transport->requests.size() == 3 && transport->requests[2].url == L"http://example.com/image");
+    // 待っているものはすぐに失敗させ、実行中のものは中断を求める
+    pipeline->CancelAll();
+    CHECK(post->result == TestResponder::Result::Failed);
+    CHECK(transport->requests[2].slot->IsCancelled());
+    // 実行中のものはtransportが中断する
+    CHECK(transport->cancelled == 1);
+    transport->Fail(2);
+    CHECK(image->result == TestResponder::Result::Failed);
+    // 取り消したものはサーキットブレーカーに数えない
+    auto after = std::make_shared<TestResponder>();
+    pipeline->Request(L"http://example.com/after", L"GET", {}, {}, ProxyPriority::Document, after);
+    CHECK(transport->requests.size() == 4);
+    CHECK(pipeline->GetCircuitBreakerStatistics().opened == 0);
+    transport->Respond(3, 200, okHeaders, "after");
+    CHECK(after->body == "after");
+    pipeline->CancelAll();
+}
+
+static void TestCircuitBreaker()
+{
+    auto transport = std::make_shared<FakeTransport>();
+    ProxyPipelineOptions options;
+    options.maxRequests = 1;
+    options.circuitBreakerFailures = 2;
+    options.circuitBreakerCoolDownMilliseconds = 60000;
+    std::map<std::wstring, int> rejected;
+    options.recordRejected = [&rejected](const std::wstring& host)
+    {
+        rejected[host]++;
+    };
+    auto pipeline = MakePipeline(transport, nullptr, options);
+    for (int i = 0; i < 2; i++)
+    {
+        auto responder = std::make_shared<TestResponder>();
+        pipeline->Request(L"http://down.example/" + std::to_wstring(i), L"GET", {}, {}, ProxyPriority::Document, responder);
+        transport->Fail(transport->requests.size() - 1);
+        CHECK(responder->result == TestResponder::Result::Failed);
+    }
+    CHECK(pipeline->GetCircuitBreakerStatistics().opened == 1);
+    // 他のホストは止めない
+    auto other = std::make_shared<TestResponder>();
+    pipeline->Request(L"http://up.example/", L"GET", {}, {}, ProxyPriority::Document, other);
+    CHECK(transport->requests.size() == 3);
+    // しきい値に達したホストへは上流に出さず、枠が空くのも待たずにすぐ失敗させる
+    auto fast = std::make_shared<TestResponder>();
+    pipeline->Request(L"http://down.example/2", L"GET", {}, {}, ProxyPriority::Document, fast);
+    CHECK(fast->result == TestResponder::Result::Failed);
+    CHECK(pipeline->GetSchedulerStatistics().waiting == 0);
+    CHECK(rejected[L"down.example:80"] == 1);
+    CHECK(pipeline->GetCircuitBreakerStatistics().rejected == 1);
+    transport->Respond(2, 200, okHeaders, "up");
+    CHECK(other->body == "up");
+    CHECK(transport->requests.size() == 3);
+    pipeline->CancelAll();
+}
+
+static ProxyExchange MakeExchange(const wchar_t* method, const wchar_t* url, const std::string& requestBody, const std::string& responseBody, uint64_t durationMilliseconds = 0)
+{
+    ProxyExchange exchange;
+    exchange.durationMilliseconds = durationMilliseconds;
+    exchange.method = method;
+    exchange.url = url;
+    exchange.requestBody.assign(requestBody.begin(), requestBody.end());
+    exchange.statusCode = 200;
+    exchange.statusCodeText = L"OK";
+    exchange.responseHeaders = okHeaders;
+    exchange.responseBody.assign(responseBody.begin(), responseBody.end());
+    return exchange;
+}
+
+static void TestArchive()
+{
+    auto first = MakeExchange(L"POST", L"http://example.com/あ", "request", "response", 12);
+    first.startMilliseconds = 34;
+    first.requestHeaders = { { L"Content-Type", L"text/plain" }, { L"X-テスト", L"値" } };
+    auto second = MakeExchange(L"GET", L"http://example.com/failed", "", "");
+    second.statusCode = 0;
+    second.statusCodeText.clear();
+    second.responseHeaders.clear();
+    auto path = std::filesystem::temp_directory_path() / "ProxyPipelineTest.tpa";
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(ProxyArchiveFormat::magic, sizeof(ProxyArchiveFormat::magic));
+        for (auto&& exchange : { first, second })
+        {
+            auto record = ProxyArchiveFormat::Encode(exchange);
+            file.write(record.data(), record.size());
+        }
+        // 書き込み中に終了したときのように最後のレコードが途中で切れている
+        auto truncated = ProxyArchiveFormat::Encode(first);
+        file.write(truncated.data(), truncated.size() - 3);
+    }
+    std::vector<ProxyExchange> exchanges;
+    CHECK(ProxyReadArchive(path, exchanges));
+    CHECK(exchanges.size() == 2);
+    if (exchanges.size() == 2)
+    {
+        auto& decoded = exchanges[0];
+        CHECK(decoded.startMilliseconds == 34 && decoded.durationMilliseconds == 12);
+        CHECK(decoded.method == first.method && decoded.url == first.url);
+        CHECK(decoded.requestHeaders == first.requestHeaders);
+        CHECK(decoded.requestBody == first.requestBody);
+        CHECK(decoded.statusCode == 200 && decoded.statusCodeText == L"OK");
+        CHECK(decoded.responseHeaders == first.responseHeaders);
+        CHECK(decoded.responseBody == first.responseBody);
+        CHECK(exchanges[1].statusCode == 0 && exchanges[1].url == second.url && exchanges[1].responseBody.empty());
+    }
+    // 形式が違うファイルは読まない
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file << "TPA0";
+    }
+    exchanges.clear();
+    CHECK(!ProxyReadArchive(path, exchanges));
+    std::filesystem::remove(path);
+}
+
+// 再生した応答の内容 失敗すれば"(failed)"
+static std::string Replay(ProxyReplayTransport& transport, const wchar_t* method, const wchar_t* url, const std::string& body)
+{
+    auto result = std::make_shared<std::promise<std::string>>();
+    auto future = result->get_future();
+    if (!transport.RequestAsync(url, method, std::vector<uint8_t>(body.begin(), body.end()), {}, nullptr, [result]()
+    {
+        result->set_value("(failed)");
+    }, [result](uint32_t, const wchar_t*, const wchar_t*, std::vector<uint8_t>& content)
+    {
+        result->set_value(std::string(content.begin(), content.end()));
+    }))
+    {
+        return "(missing)";
+    }
+    return future.get();
+}
+
+static void TestReplay()
+{
+    ProxyReplayTransport transport(
+    {
+        MakeExchange(L"POST", L"http://example.com/answer", "a", "first"),
+        MakeExchange(L"POST", L"http://example.com/answer", "b", "second"),
+        MakeExchange(L"GET", L"http://example.com/", "", "page"),
+    }, 0);
+    CHECK(transport.Size() == 3);
+    // 2つ目と内容が一致しても1つ目は使ったことにしない
+    CHECK(Replay(transport, L"POST", L"http://example.com/answer", "b") == "second");
+    CHECK(Replay(transport, L"POST", L"http://example.com/answer", "c") == "first");
+    // 使い切れば最後のものを返し続ける
+    CHECK(Replay(transport, L"POST", L"http://example.com/answer", "a") == "second");
+    CHECK(Replay(transport, L"GET", L"http://example.com/", "") == "page");
+    CHECK(Replay(transport, L"GET", L"http://example.com/", "") == "page");
+    CHECK(Replay(transport, L"GET", L"http://example.com/missing", "") == "(missing)");
+    auto statistics = transport.GetStatistics();
+    CHECK(statistics.hits == 5 && statistics.misses == 1);
+}
+
+// 応答か失敗を別のスレッドから知らせる 応答はreleaseが済むまで返さない
+class SignalResponder : public TestResponder
+{
+public:
+    std::promise<void> done;
+    std::shared_future<void> release;
+
+    void Respond(uint32_t statusCode, const std::wstring& statusCodeText, const std::wstring& headers, std::shared_ptr<const void> owner, const uint8_t* content, size_t contentSize, const std::wstring& host) override
+    {
+        if (this->release.valid())
+        {
+            this->release.wait();
+        }
+        TestResponder::Respond(statusCode, statusCodeText, headers, std::move(owner), content, contentSize, host);
+        this->done.set_value();
+    }
+
+    void Fail() override
+    {
+        TestResponder::Fail();
+        this->done.set_value();
+    }
+};
+
+// プラグインを無効にするときと同じく応答を待っているうちにパイプラインとトランスポートを手放す
+// 応答のコールバックがパイプラインの最後の参照を持つので、再生のスレッドの中でトランスポートが破棄される
+static void TestReplayTeardown(bool cancel)
+{
+    auto destroyed = std::make_shared<std::promise<void>>();
+    auto destroyedFuture = destroyed->get_future();
+    std::shared_ptr<ProxyReplayTransport> transport(new ProxyReplayTransport({ MakeExchange(L"GET", L"http://example.com/", "", "page", cancel ? 60000 : 0) }, 100), [destroyed](ProxyReplayTransport* transport)
+    {
+        delete transport;
+        destroyed->set_value();
+    });
+    auto pipeline = std::make_shared<ProxyPipeline>(transport, nullptr, ProxyPipelineOptions());
+    auto responder = std::make_shared<SignalResponder>();
+    std::promise<void> released;
+    responder->release = released.get_future().share();
+    auto done = responder->done.get_future();
+    pipeline->Request(L"http://example.com/", L"GET", {}, {}, ProxyPriority::Document, responder);
+    if (cancel)
+    {
+        pipeline->CancelAll();
+    }
+    pipeline = nullptr;
+    transport = nullptr;
+    released.set_value();
+    // 取り消したものは記録した所要時間を待たずに失敗し、どちらもトランスポートの破棄が終わる
+    CHECK(done.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+    CHECK(destroyedFuture.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+    CHECK(responder->result == (cancel ? TestResponder::Result::Failed : TestResponder::Result::Responded));
+}
+
+int main()
+{
+    TestHeaderRules();
+    TestCoalescing();
+    TestPost();
+    TestCache();
+    TestStreaming();
+    TestPriorityAndCancel();
+    TestCircuitBreaker();
+    TestArchive();
+    TestReplay();
+    TestReplayTeardown(false);
+    TestReplayTeardown(true);
+    if (failures)
+    {
+        printf("ProxyPipelineTest: %d failures\n", failures);
+        return 1;
+    }
+    puts("ProxyPipelineTest: OK");
+    return 0;
+}
@@ -0,0 +1,73 @@
+# ProxyLoadBenchmark用のスタブサーバー
+#   python3 ProxyStubServer.py ポート [接続ごとの遅延ミリ秒]
+# 接続ごとの遅延は新しい接続の最初の応答を遅らせる (TCP/TLSのハンドシェイクの往復時間の代わり)
+# GET /大きさ          大きさバイトの内容をContent-Lengthで返す
+# GET /chunked/大きさ  チャンク形式で返す
+# ?delay=ミリ秒        応答までの遅延 (上流の往復時間の代わり)
+# POST                 受け取った内容をそのまま返す
+# HTTP/1.1のkeep-aliveに対応し、受け付けた接続の数を X-Connection-Count で返す
+import http.server
+import itertools
+import sys
+import time
+import urllib.parse
+
+connection_counter = itertools.count(1)
+connect_delay = int(sys.argv[2]) / 1000 if len(sys.argv) > 2 else 0
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    # ヘッダと内容を別々に書き込むのでNagleで内容が相手の遅延ACKを待たないようにする
+    disable_nagle_algorithm = True
+
+    def log_message(self, *args):
+        pass
+
+    def setup(self):
+        super().setup()
+        self.connection_number = next(connection_counter)
+        if connect_delay:
+            time.sleep(connect_delay)
+
+    def delay(self, query):
+        milliseconds = int(query.get("delay", ["0"])[0])
+        if milliseconds:
+            time.sleep(milliseconds / 1000)
+
+    def do_GET(self):
+        url = urllib.parse.urlsplit(self.path)
+        query = urllib.parse.parse_qs(url.query)
+        self.delay(query)
+        size = int(url.path.rsplit("/", 1)[-1] or 1024)
+        body = b"x" * size
+        self.send_response(200)
+        self.send_header("X-Connection-Count", str(self.connection_number))
+        if url.path.startswith("/chunked/"):
+            self.send_header("Transfer-Encoding", "chunked")
+            self.end_headers()
+            for i in range(0, size, 4000):
+                chunk = body[i:i + 4000]
+                self.wfile.write(b"%x\r\n" % len(chunk) + chunk + b"\r\n")
+            self.wfile.write(b"0\r\n\r\n")
+        else:
+            self.send_header("Content-Length", str(size))
+            self.end_headers()
+            self.wfile.write(body)
+
+    def do_POST(self):
+        url = urllib.parse.urlsplit(self.path)
+        self.delay(urllib.parse.parse_qs(url.query))
+        body = self.rfile.read(int(self.headers["Content-Length"]))
+        self.send_response(200)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+
+class Server(http.server.ThreadingHTTPServer):
+    request_queue_size = 1024
+    daemon_threads = True
+
+
+Server(("127.0.0.1", int(sys.argv[1])), Handler).serve_forever()
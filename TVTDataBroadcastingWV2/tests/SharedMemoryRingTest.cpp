@@ -0,0 +1,269 @@
+﻿// SharedMemoryRingをPOSIX共有メモリで動かして書き込み側と読み込み側の動作を確かめる
+// 末尾での折り返し、空きがないときの破棄、別プロセスからの読み込み
+#include "../SharedMemoryRing.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+static std::string RingName(const char* suffix)
+{
+    return "/tbwr_test_" + std::to_string(getpid()) + "_" + suffix;
+}
+
+// 連番と長さから決まる内容のフレームを作る
+static std::vector<uint8_t> MakeFrame(uint32_t sequence, size_t size)
+{
+    std::vector<uint8_t> frame(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        frame[i] = (uint8_t)(sequence * 31 + i);
+    }
+    if (size >= sizeof(sequence))
+    {
+        memcpy(frame.data(), &sequence, sizeof(sequence));
+    }
+    return frame;
+}
+
+static bool IsFrame(const uint8_t* data, size_t size, uint32_t sequence)
+{
+    auto expected = MakeFrame(sequence, size);
+    return !memcmp(data, expected.data(), size);
+}
+
+static void TestOpen()
+{
+    auto name = RingName("open");
+    SharedMemoryRing writerRing;
+    CHECK(writerRing.Create(name.c_str(), 1000));
+    CHECK(writerRing.Header()->capacity == 1000);
+    SharedMemoryRing readerRing;
+    CHECK(readerRing.Open(name.c_str()));
+    SharedMemoryRing missing;
+    CHECK(!missing.Open(RingName("missing").c_str()));
+    // 8の倍数に切り上げられる
+    SharedMemoryRing odd;
+    CHECK(odd.Create(RingName("odd").c_str(), 1001));
+    CHECK(odd.Header()->capacity == 1008);
+}
+
+// 書いては読むを繰り返してカーソルが容量の何倍にもなるまで進め、末尾の余りを読み飛ばせることを確かめる
+static void TestWraparound()
+{
+    auto name = RingName("wrap");
+    SharedMemoryRing writerRing;
+    CHECK(writerRing.Create(name.c_str(), 256));
+    SharedMemoryRing readerRing;
+    CHECK(readerRing.Open(name.c_str()));
+    SharedMemoryRingWriter writer(writerRing);
+    SharedMemoryRingReader reader(readerRing);
+    auto header = writerRing.Header();
+    uint64_t paddedWrites = 0;
+    for (uint32_t sequence = 0; sequence < 10000; sequence++)
+    {
+        // 8バイト境界に揃わない大きさも混ぜる
+        size_t size = 4 + sequence % 97;
+        auto frame = MakeFrame(sequence, size);
+        auto before = header->writeCursor.load();
+        CHECK(writer.Write(SHARED_MEMORY_RING_FRAME_PACKETS, frame.data(), frame.size()));
+        auto written = header->writeCursor.load() - before;
+        CHECK(written % 8 == 0);
+        if (written > SharedMemoryRingAlign(sizeof(SharedMemoryRingFrameHeader) + size))
+        {
+            paddedWrites++;
+            // 余りを埋めた分も含めて先頭から書かれている
+            CHECK(header->writeCursor.load() % header->capacity == SharedMemoryRingAlign(sizeof(SharedMemoryRingFrameHeader) + size) % header->capacity);
+        }
+        SharedMemoryRingFrameType type;
+        const uint8_t* data = nullptr;
+        size_t readSize = 0;
+        CHECK(reader.Peek(type, data, readSize));
+        CHECK(type == SHARED_MEMORY_RING_FRAME_PACKETS);
+        CHECK(readSize == size);
+        CHECK(IsFrame(data, readSize, sequence));
+        reader.Advance();
+        CHECK(!reader.Peek(type, data, readSize));
+        CHECK(header->readCursor.load() == header->writeCursor.load());
+    }
+    CHECK(paddedWrites > 0);
+    CHECK(header->writeCursor.load() > header->capacity * 100);
+    CHECK(header->droppedFrames.load() == 0);
+}
+
+// 読み込み側が止まっているときは書き込まずに破棄し、読まれていないフレームを壊さない
+static void TestOverrun()
+{
+    auto name = RingName("overrun");
+    SharedMemoryRing writerRing;
+    CHECK(writerRing.Create(name.c_str(), 512));
+    SharedMemoryRing readerRing;
+    CHECK(readerRing.Open(name.c_str()));
+    SharedMemoryRingWriter writer(writerRing);
+    SharedMemoryRingReader reader(readerRing);
+    auto header = writerRing.Header();
+    // 少し進めて折り返しをまたぐ位置から始める
+    for (uint32_t sequence = 0; sequence < 3; sequence++)
+    {
+        auto frame = MakeFrame(sequence, 100);
+        CHECK(writer.Write(SHARED_MEMORY_RING_FRAME_PACKETS, frame.data(), frame.size()));
+        SharedMemoryRingFrameType type;
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        CHECK(reader.Peek(type, data, size));
+        reader.Advance();
+    }
+    uint32_t sequence = 100;
+    uint32_t firstSequence = sequence;
+    while (true)
+    {
+        auto frame = MakeFrame(sequence, 60);
+        if (!writer.Write(SHARED_MEMORY_RING_FRAME_PACKETS, frame.data(), frame.size()))
+        {
+            break;
+        }
+        sequence++;
+    }
+    auto stored = sequence - firstSequence;
+    CHECK(stored >= 6);
+    CHECK(header->droppedFrames.load() == 1);
+    // 何度試しても空きができるまでは破棄される
+    auto frame = MakeFrame(999, 60);
+    CHECK(!writer.Write(SHARED_MEMORY_RING_FRAME_PACKETS, frame.data(), frame.size()));
+    CHECK(header->droppedFrames.load() == 2);
+    CHECK(header->writeCursor.load() - header->readCursor.load() <= header->capacity);
+    // 1つ読めば次が書ける
+    SharedMemoryRingFrameType type;
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    CHECK(reader.Peek(type, data, size));
+    CHECK(IsFrame(data, size, firstSequence));
+    reader.Advance();
+    frame = MakeFrame(sequence, 60);
+    CHECK(writer.Write(SHARED_MEMORY_RING_FRAME_PACKETS, frame.data(), frame.size()));
+    sequence++;
+    // 残りは書いた順に全て壊れずに読める
+    for (auto expected = firstSequence + 1; expected < sequence; expected++)
+    {
+        CHECK(reader.Peek(type, data, size));
+        CHECK(size == 60 && IsFrame(data, size, expected));
+        reader.Advance();
+    }
+    CHECK(!reader.Peek(type, data, size));
+    // 容量を超えるフレームは空いていても書けない
+    std::vector<uint8_t> large(header->capacity);
+    CHECK(!writer.Write(SHARED_MEMORY_RING_FRAME_PACKETS, large.data(), large.size()));
+    CHECK(header->droppedFrames.load() == 3);
+    // データのないフレーム
+    CHECK(writer.Write(SHARED_MEMORY_RING_FRAME_RESET, nullptr, 0));
+    CHECK(reader.Peek(type, data, size));
+    CHECK(type == SHARED_MEMORY_RING_FRAME_RESET && size == 0);
+    reader.Advance();
+}
+
+// 別のプロセスで読み込む 読み込み側を待たずに書くので破棄されたフレームの数と合わせて全て数えられることを確かめる
+static void TestCrossProcess()
+{
+    auto name = RingName("process");
+    const uint32_t frameCount = 200000;
+    SharedMemoryRing writerRing;
+    CHECK(writerRing.Create(name.c_str(), 64 * 1024));
+    auto pid = fork();
+    if (pid == 0)
+    {
+        SharedMemoryRing readerRing;
+        if (!readerRing.Open(name.c_str()))
+        {
+            _exit(2);
+        }
+        SharedMemoryRingReader reader(readerRing);
+        uint64_t received = 0;
+        int64_t last = -1;
+        while (true)
+        {
+            SharedMemoryRingFrameType type;
+            const uint8_t* data = nullptr;
+            size_t size = 0;
+            if (!reader.Peek(type, data, size))
+            {
+                continue;
+            }
+            if (type == SHARED_MEMORY_RING_FRAME_RESET)
+            {
+                reader.Advance();
+                break;
+            }
+            uint32_t sequence;
+            memcpy(&sequence, data, sizeof(sequence));
+            // 破棄されたフレームがあっても順番は入れ替わらず内容も壊れない
+            if ((int64_t)sequence <= last || size != 4 + sequence % 1500 || !IsFrame(data, size, sequence))
+            {
+                _exit(3);
+            }
+            last = sequence;
+            received++;
+            reader.Advance();
+        }
+        // 受信した数を書き込み側に返す
+        memcpy(readerRing.Data(), &received, sizeof(received));
+        _exit(0);
+    }
+    CHECK(pid > 0);
+    SharedMemoryRingWriter writer(writerRing);
+    uint64_t written = 0;
+    for (uint32_t sequence = 0; sequence < frameCount; sequence++)
+    {
+        auto frame = MakeFrame(sequence, 4 + sequence % 1500);
+        if (writer.Write(SHARED_MEMORY_RING_FRAME_PACKETS, frame.data(), frame.size()))
+        {
+            written++;
+        }
+        // 時々止まって読み込み側が追い付く場合と溢れる場合の両方を起こす
+        if (sequence % 64 == 0)
+        {
+            usleep(20);
+        }
+    }
+    // 終わりを示すフレームは必ず届ける
+    while (!writer.Write(SHARED_MEMORY_RING_FRAME_RESET, nullptr, 0))
+    {
+        writerRing.Header()->droppedFrames.fetch_sub(1);
+        usleep(100);
+    }
+    int status = 0;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    uint64_t received;
+    memcpy(&received, writerRing.Data(), sizeof(received));
+    auto dropped = writerRing.Header()->droppedFrames.load();
+    CHECK(received == written);
+    CHECK(written + dropped == frameCount);
+    printf("  cross process: %llu frames received, %llu dropped\n", (unsigned long long)received, (unsigned long long)dropped);
+}
+
+int main()
+{
+    TestOpen();
+    TestWraparound();
+    TestOverrun();
+    TestCrossProcess();
+    if (failures)
+    {
+        printf("SharedMemoryRingTest: %d failures\n", failures);
+        return 1;
+    }
+    puts("SharedMemoryRingTest: OK");
+    return 0;
+}
@@ -0,0 +1,16 @@
+﻿#pragma once
+// Linuxでテストをビルドするときにpch.hの代わりに-includeで読み込む
+// pch.hはWindowsとWebView2のヘッダを読み込むのでインクルードガードを先に定義して読み込ませない
+#define PCH_H
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// LinuxのWCHARは4バイトになる UTF-16であることが必要なものは-fshort-wcharでビルドする
+// (その場合libstdc++のstd::wstringは使えない)
+typedef unsigned char BYTE;
+typedef wchar_t WCHAR;
+typedef uint32_t DWORD;
+typedef const wchar_t* LPCWSTR;
+#define _countof(array) (sizeof(array) / sizeof((array)[0]))
@@ -0,0 +1,18 @@
+﻿#pragma once
+// MSVCの<intrin.h>のうちbase64.cppが使うものをGCCで用意する (__cpuidexはGCC 11以降の<cpuid.h>にある)
+#include <cpuid.h>
+#include <immintrin.h>
+
+#undef __cpuid
+static inline void __cpuid(int info[4], int leaf)
+{
+    __cpuid_count(leaf, 0, info[0], info[1], info[2], info[3]);
+}
+
+static inline unsigned long long TestXGetBV(unsigned int index)
+{
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+    return ((unsigned long long)edx << 32) | eax;
+}
+#define _xgetbv TestXGetBV
@@ -2,6 +2,7 @@ import { ComponentPMT, ResponseMessage } from "../web-bml/lib/ws_api";
 import { BMLBrowser, BMLBrowserFontFace, EPG, Indicator, IP, InputApplication, InputCancelReason, InputCharacterType } from "../web-bml/client/bml_browser";
 import { decodeTS } from "../web-bml/lib/decode_ts";
 import { CaptionPlayer } from "../web-bml/client/player/caption_player";
+import { BinaryFrameType, readBinaryFrames, readPESFrame, readTimestampFrame, unpackUtf16 } from "./binary_frame";
 
 declare global {
     interface Window {
@@ -12,6 +13,7 @@ declare global {
             }
         };
         sendMessage?(data: ToWebViewMessage): FromWebViewMessage | null;
+        benchmarkKeyPress?(keyCode: number, count?: number): Promise<KeyPressBenchmarkResult>;
         bmlBrowser?: BMLBrowser;
     }
 }
@@ -72,20 +74,25 @@ export class StatusBarIndicator implements Indicator {
 }
 
 const params = new URLSearchParams(location.search);
-const networkId = Number(params.get("networkId")) ?? undefined;
-const serviceId = Number(params.get("serviceId")) ?? undefined;
+let networkId = Number(params.get("networkId")) ?? undefined;
+let serviceId = Number(params.get("serviceId")) ?? undefined;
 
 // BML文書と動画と字幕が入る要素
 const browserElement = document.getElementById("data-broadcasting-browser")!;
 // 動画が入っている要素
 const videoContainer = browserElement.querySelector(".arib-video-container") as HTMLElement;
 // BML文書が入る要素
-const contentElement = browserElement.querySelector(".data-broadcasting-browser-content") as HTMLElement;
+let contentElement = browserElement.querySelector(".data-broadcasting-browser-content") as HTMLElement;
 // BML用フォント
 const roundGothic: BMLBrowserFontFace = { source: "url('../dist/KosugiMaru-Regular.woff2'), local('MS Gothic')" };
 const boldRoundGothic: BMLBrowserFontFace = { source: "url('../dist/KosugiMaru-Bold.woff2'), local('MS Gothic')" };
 const squareGothic: BMLBrowserFontFace = { source: "url('../dist/Kosugi-Regular.woff2'), local('MS Gothic')" };
 const ccContainer = browserElement.querySelector(".arib-video-cc-container") as HTMLElement;
+// 非表示時に動画が入る要素
+const videoInvisibleContainer = browserElement.querySelector(".arib-video-invisible-container") as HTMLElement;
+// サービス切り替え時に戻す大きさ
+const initialBrowserWidth = browserElement.style.width;
+const initialBrowserHeight = browserElement.style.height;
 const player = new CaptionPlayer(document.createElement("video"), ccContainer);
 // リモコン
 const remoteControl = new StatusBarIndicator(browserElement.querySelector(".remote-control-receiving-status")!, browserElement.querySelector(".remote-control-networking-status")!);
@@ -220,86 +227,10 @@ function X_DPA_startResidentApp(appName: string, showAV: number, returnURI: stri
     return NaN;
 }
 
-const bmlBrowser = new BMLBrowser({
-    containerElement: contentElement,
-    mediaElement: videoContainer,
-    indicator: remoteControl,
-    fonts: {
-        roundGothic,
-        boldRoundGothic,
-        squareGothic
-    },
-    epg,
-    videoPlaneModeEnabled: true,
-    audioNodeProvider: {
-        getAudioDestinationNode() {
-            return gainNode;
-        }
-    },
-    ip: apiIP,
-    inputApplication,
-    greg: {
-        getReg(index) {
-            return window.sessionStorage.getItem(`Greg[${index}]`) ?? "";
-        },
-        setReg(index, value) {
-            window.sessionStorage.setItem(`Greg[${index}]`, value);
-        },
-    },
-    setMainAudioStreamCallback(componentId, channelId) {
-        const index = audioESList.findIndex(x => x.componentId === componentId);
-        const es = audioESList[index];
-        if (es == null) {
-            return false;
-        }
-        postMessage({
-            type: "changeMainAudioStream",
-            componentId,
-            index,
-            pid: es.pid,
-            channelId,
-        });
-        return true;
-    },
-    X_DPA_startResidentApp,
-});
-
 function isFullScreenVideo(): boolean {
     return videoContainer.clientWidth === browserElement.clientWidth && videoContainer.clientHeight === browserElement.clientHeight;
 }
 
-// trueであればデータ放送の上に動画を表示させる非表示状態
-bmlBrowser.addEventListener("invisible", (evt) => {
-    console.log("invisible", evt.detail);
-    if (evt.detail) {
-        contentElement.style.clipPath = "inset(0px)";
-    } else {
-        contentElement.style.clipPath = "";
-    }
-    postMessage({
-        type: "invisible",
-        invisible: evt.detail || isFullScreenVideo(),
-    });
-});
-
-bmlBrowser.addEventListener("load", (evt) => {
-    console.log("load", evt.detail);
-    const width = evt.detail.resolution.width + "px";
-    const aspectNum = evt.detail.displayAspectRatio.numerator;
-    const aspectDen = evt.detail.displayAspectRatio.denominator;
-    const scaleY = (evt.detail.resolution.width / evt.detail.resolution.height) / (aspectNum / aspectDen);
-    const transform = `scaleY(${scaleY})`;
-    const height = (evt.detail.resolution.height * scaleY) + "px";
-    if (browserElement.style.width !== width || browserElement.style.height !== height || contentElement.style.transform !== transform) {
-        browserElement.style.width = width;
-        browserElement.style.height = height;
-        contentElement.style.transform = transform;
-        ccContainer.style.width = width;
-        ccContainer.style.height = height;
-        onResized();
-    }
-});
-
 type FromWebViewMessage = {
     type: "videoChanged",
     left: number,
@@ -361,39 +292,125 @@ type FromWebViewMessage = {
     type: "startBrowser",
     uri: string,
     fullscreen: boolean,
+} | {
+    type: "capabilities",
+    serviceChanged: boolean,
+    // 受け取れるストリームの形式
+    streamFormats: string[],
 };
 
-bmlBrowser.addEventListener("videochanged", (evt) => {
-    const { left, top, right, bottom } = evt.detail.boundingRect;
-    postMessage({
-        type: "videoChanged",
-        left: left * window.devicePixelRatio,
-        top: top * window.devicePixelRatio,
-        right: right * window.devicePixelRatio,
-        bottom: bottom * window.devicePixelRatio,
-        invisible: (bmlBrowser.content.invisible ?? true) || isFullScreenVideo(),
+function createBMLBrowser(contentElement: HTMLElement): BMLBrowser {
+    const bmlBrowser = new BMLBrowser({
+        containerElement: contentElement,
+        mediaElement: videoContainer,
+        indicator: remoteControl,
+        fonts: {
+            roundGothic,
+            boldRoundGothic,
+            squareGothic
+        },
+        epg,
+        videoPlaneModeEnabled: true,
+        audioNodeProvider: {
+            getAudioDestinationNode() {
+                return gainNode;
+            }
+        },
+        ip: apiIP,
+        inputApplication,
+        greg: {
+            getReg(index) {
+                return window.sessionStorage.getItem(`Greg[${index}]`) ?? "";
+            },
+            setReg(index, value) {
+                window.sessionStorage.setItem(`Greg[${index}]`, value);
+            },
+        },
+        setMainAudioStreamCallback(componentId, channelId) {
+            const index = audioESList.findIndex(x => x.componentId === componentId);
+            const es = audioESList[index];
+            if (es == null) {
+                return false;
+            }
+            postMessage({
+                type: "changeMainAudioStream",
+                componentId,
+                index,
+                pid: es.pid,
+                channelId,
+            });
+            return true;
+        },
+        X_DPA_startResidentApp,
     });
-});
 
-bmlBrowser.addEventListener("usedkeylistchanged", (evt) => {
-    const { usedKeyList } = evt.detail;
-    postMessage({
-        type: "usedKeyList",
-        usedKeyList: Object.fromEntries([...usedKeyList.values()].map(x => [x, true])),
+    // trueであればデータ放送の上に動画を表示させる非表示状態
+    bmlBrowser.addEventListener("invisible", (evt) => {
+        console.log("invisible", evt.detail);
+        if (evt.detail) {
+            contentElement.style.clipPath = "inset(0px)";
+        } else {
+            contentElement.style.clipPath = "";
+        }
+        postMessage({
+            type: "invisible",
+            invisible: evt.detail || isFullScreenVideo(),
+        });
     });
-});
 
-bmlBrowser.addEventListener("audiostreamchanged", (evt) => {
-    const { componentId, channelId } = evt.detail;
-    const index = audioESList.findIndex(x => x.componentId === componentId);
-    postMessage({
-        type: "changeAudioStream",
-        componentId,
-        index,
-        pid: audioESList[index]?.pid,
-        channelId,
+    bmlBrowser.addEventListener("load", (evt) => {
+        console.log("load", evt.detail);
+        const width = evt.detail.resolution.width + "px";
+        const aspectNum = evt.detail.displayAspectRatio.numerator;
+        const aspectDen = evt.detail.displayAspectRatio.denominator;
+        const scaleY = (evt.detail.resolution.width / evt.detail.resolution.height) / (aspectNum / aspectDen);
+        const transform = `scaleY(${scaleY})`;
+        const height = (evt.detail.resolution.height * scaleY) + "px";
+        if (browserElement.style.width !== width || browserElement.style.height !== height || contentElement.style.transform !== transform) {
+            browserElement.style.width = width;
+            browserElement.style.height = height;
+            contentElement.style.transform = transform;
+            ccContainer.style.width = width;
+            ccContainer.style.height = height;
+            onResized();
+        }
     });
-});
+
+    bmlBrowser.addEventListener("videochanged", (evt) => {
+        const { left, top, right, bottom } = evt.detail.boundingRect;
+        postMessage({
+            type: "videoChanged",
+            left: left * window.devicePixelRatio,
+            top: top * window.devicePixelRatio,
+            right: right * window.devicePixelRatio,
+            bottom: bottom * window.devicePixelRatio,
+            invisible: (bmlBrowser.content.invisible ?? true) || isFullScreenVideo(),
+        });
+    });
+
+    bmlBrowser.addEventListener("usedkeylistchanged", (evt) => {
+        const { usedKeyList } = evt.detail;
+        postMessage({
+            type: "usedKeyList",
+            usedKeyList: Object.fromEntries([...usedKeyList.values()].map(x => [x, true])),
+        });
+    });
+
+    bmlBrowser.addEventListener("audiostreamchanged", (evt) => {
+        const { componentId, channelId } = evt.detail;
+        const index = audioESList.findIndex(x => x.componentId === componentId);
+        postMessage({
+            type: "changeAudioStream",
+            componentId,
+            index,
+            pid: audioESList[index]?.pid,
+            channelId,
+        });
+    });
+    return bmlBrowser;
+}
+
+let bmlBrowser = createBMLBrowser(contentElement);
 
 let pcr: number | undefined;
 
@@ -416,7 +433,11 @@ let pmtRetrieved = false;
 let cProfile = false;
 let oneSegLaunched = false;
 
-function onMessage(msg: ResponseMessage) {
+// プラグイン側で解析されたPESはdataが数値の配列ではなくUint8Arrayのまま届く
+type DecodedPESMessage = Omit<Extract<ResponseMessage, { type: "pes" }>, "data"> & { data: Uint8Array };
+type StreamMessage = ResponseMessage | DecodedPESMessage;
+
+function onMessage(msg: StreamMessage) {
     if (msg.type === "pes") {
         player.push(msg.streamId, Uint8Array.from(msg.data), msg.pts);
     } else if (msg.type === "pcr") {
@@ -450,13 +471,17 @@ function onMessage(msg: ResponseMessage) {
     bmlBrowser.emitMessage(msg);
 }
 
-const tsStream = decodeTS({
-    sendCallback: onMessage,
-    serviceId,
-    parsePES: true,
-});
+function createTSStream() {
+    const tsStream = decodeTS({
+        sendCallback: onMessage,
+        serviceId,
+        parsePES: true,
+    });
+    tsStream.on("data", () => { });
+    return tsStream;
+}
 
-tsStream.on("data", () => { });
+let tsStream = createTSStream();
 
 type ToWebViewMessage = {
     type: "stream",
@@ -466,6 +491,11 @@ type ToWebViewMessage = {
     type: "streamBase64",
     data: string,
     time?: number,
+} | {
+    type: "streamBinary",
+    data: string,
+} | {
+    type: "streamReset",
 } | {
     type: "key",
     keyCode: number,
@@ -503,6 +533,10 @@ type ToWebViewMessage = {
     channelId: number,
 } | {
     type: "launchOneSeg",
+} | {
+    type: "serviceChanged",
+    networkId: number,
+    serviceId: number,
 };
 
 // 1分間無操作であればデータ取得中の表示を消す
@@ -536,6 +570,41 @@ function onWebViewMessage(data: ToWebViewMessage, reply: (data: FromWebViewMessa
         if (prevPCR !== curPCR && curPCR != null) {
             player.updateTime(curPCR - 450);
         }
+    } else if (data.type === "streamBinary") {
+        const frames = unpackUtf16(data.data);
+        if (frames == null) {
+            return;
+        }
+        const prevPCR = pcr;
+        for (const frame of readBinaryFrames(frames)) {
+            if (frame.type === BinaryFrameType.Control) {
+                onWebViewMessage(JSON.parse(new TextDecoder().decode(frame.payload)), reply);
+                continue;
+            }
+            if (!oneSegLaunched && cProfile) {
+                continue;
+            }
+            if (frame.type === BinaryFrameType.Packets) {
+                tsStream.parse(Buffer.from(frame.payload.buffer, frame.payload.byteOffset, frame.payload.byteLength));
+            } else if (frame.type === BinaryFrameType.Timestamp) {
+                // プラグイン側で解析されたものはdecodeTSが作るResponseMessageと同じ形にする
+                onMessage({ type: "pcr", ...readTimestampFrame(frame.payload) } as ResponseMessage);
+            } else if (frame.type === BinaryFrameType.PES) {
+                const pes = readPESFrame(frame.payload);
+                const message: DecodedPESMessage = { type: "pes", streamId: pes.streamId, data: pes.data, pts: pes.pts == null ? undefined : pes.pts / 90 };
+                onMessage(message);
+            } else if (frame.type === BinaryFrameType.Response) {
+                onMessage(JSON.parse(new TextDecoder().decode(frame.payload)) as ResponseMessage);
+            }
+        }
+        const curPCR = pcr;
+        if (prevPCR !== curPCR && curPCR != null) {
+            player.updateTime(curPCR - 450);
+        }
+    } else if (data.type === "streamReset") {
+        // シークなどでPCRが不連続になったので組み立て途中のセクションやPESを捨てる
+        tsStream = createTSStream();
+        pcr = undefined;
     } else if (data.type === "key") {
         remoteControlStatusContainer.style.visibility = "visible";
         bmlBrowser.content.processKeyDown(data.keyCode);
@@ -601,9 +670,47 @@ function onWebViewMessage(data: ToWebViewMessage, reply: (data: FromWebViewMessa
     } else if (data.type === "launchOneSeg") {
         oneSegLaunched = true;
         browserElement.style.visibility = "visible";
+    } else if (data.type === "serviceChanged") {
+        if (data.networkId !== networkId || data.serviceId !== serviceId) {
+            changeService(data.networkId, data.serviceId);
+        }
     }
 }
 
+// ページを読み込み直さずにサービスを切り替える
+// フォントやAudioContext、字幕の再生などはそのまま使いまわしてBML文書とTSの状態のみ作り直す
+function changeService(newNetworkId: number, newServiceId: number) {
+    networkId = newNetworkId;
+    serviceId = newServiceId;
+    history.replaceState(null, "", `${location.pathname}?serviceId=${serviceId}&networkId=${networkId}`);
+    inputApplication.cancel("other");
+    // 古い文書のタイマーやイベント、読み込み中のリソースなどを破棄する
+    bmlBrowser.destroy();
+    // BML文書中に移動されている可能性があるので動画を元の位置に戻してから文書を破棄する
+    videoInvisibleContainer.appendChild(videoContainer);
+    const newContentElement = contentElement.cloneNode(false) as HTMLElement;
+    newContentElement.style.clipPath = "";
+    newContentElement.style.transform = "";
+    contentElement.replaceWith(newContentElement);
+    contentElement = newContentElement;
+    bmlBrowser = createBMLBrowser(contentElement);
+    window.bmlBrowser = bmlBrowser;
+    pcr = undefined;
+    audioESList = [];
+    pmtRetrieved = false;
+    cProfile = false;
+    oneSegLaunched = false;
+    tsStream = createTSStream();
+    browserElement.style.visibility = "visible";
+    browserElement.style.width = initialBrowserWidth;
+    browserElement.style.height = initialBrowserHeight;
+    ccContainer.style.width = initialBrowserWidth;
+    ccContainer.style.height = initialBrowserHeight;
+    remoteControlStatusContainer.style.visibility = "hidden";
+    remoteControlStatusTimeout = Number.MAX_VALUE;
+    onResized();
+}
+
 window.chrome.webview.addEventListener("message", (ev: any) => onWebViewMessage(ev.data as ToWebViewMessage, window.chrome.webview.postMessage));
 
 window.sendMessage = (data: ToWebViewMessage): FromWebViewMessage | null => {
@@ -612,6 +719,50 @@ window.sendMessage = (data: ToWebViewMessage): FromWebViewMessage | null => {
     return result;
 };
 
+type KeyPressBenchmarkResult = {
+    count: number,
+    // onWebViewMessageが返るまで (ミリ秒)
+    dispatch: { mean: number, median: number, p99: number },
+    // BML文書のイベント処理などのマイクロタスクも終わるまで (ミリ秒)
+    handled: { mean: number, median: number, p99: number },
+};
+
+function summarizeSamples(samples: number[]) {
+    samples.sort((a, b) => a - b);
+    return {
+        mean: samples.reduce((a, b) => a + b, 0) / samples.length,
+        median: samples[Math.floor(samples.length / 2)],
+        p99: samples[Math.floor(samples.length * 99 / 100)],
+    };
+}
+
+// DevToolsのコンソールから実行するキー操作の処理時間の計測
+// プラグインから届くものと同じkeyメッセージを読み込んでから処理させる 実際にキーを押したことになるので文書が遷移することがある
+window.benchmarkKeyPress = async (keyCode: number, count = 100): Promise<KeyPressBenchmarkResult> => {
+    // setTimeoutは入れ子になると遅延が足されるのでMessageChannelで次のタスクまで待つ
+    const channel = new MessageChannel();
+    const nextTask = () => new Promise<void>(resolve => {
+        channel.port1.onmessage = () => resolve();
+        channel.port2.postMessage(null);
+    });
+    const dispatch: number[] = [];
+    const handled: number[] = [];
+    for (let i = 0; i < count; i++) {
+        await nextTask();
+        const start = performance.now();
+        onWebViewMessage(JSON.parse(`{"type":"key","keyCode":${keyCode}}`), () => { });
+        dispatch.push(performance.now() - start);
+        await nextTask();
+        handled.push(performance.now() - start);
+    }
+    channel.port1.close();
+    return {
+        count,
+        dispatch: summarizeSamples(dispatch),
+        handled: summarizeSamples(handled),
+    };
+};
+
 function onResized() {
     const windowWidth = document.documentElement.clientWidth;
     const windowHeight = document.documentElement.clientHeight;
@@ -638,3 +789,10 @@ window.addEventListener("resize", onResized);
 onResized();
 
 window.bmlBrowser = bmlBrowser;
+
+postMessage({
+    type: "capabilities",
+    serviceChanged: true,
+    // decoded1: 字幕のPES、PCR、TDT/TOTはプラグイン側で解析されたものを受け取る
+    streamFormats: ["binary1", "decoded1"],
+});
@@ -0,0 +1,103 @@
+// TVTDataBroadcastingWV2/BinaryFrame.hの読み込み側
+// [version:1][type:1][flags:2][length:4][payload:length]を並べたものを15ビットずつU+4000からU+BFFFの文字に詰めた文字列で受け取る
+
+export const binaryFrameVersion = 1;
+
+export const enum BinaryFrameType {
+    Packets = 1,
+    Section = 2,
+    Module = 3,
+    Timestamp = 4,
+    Control = 5,
+    PES = 6,
+    Response = 7,
+}
+
+export type BinaryFrame = {
+    type: BinaryFrameType,
+    flags: number,
+    payload: Uint8Array,
+};
+
+const packedBase = 0x4000;
+
+export function unpackUtf16(packed: string): Uint8Array | null {
+    const out = new Uint8Array(Math.floor(packed.length * 15 / 8));
+    let bits = 0;
+    let bitCount = 0;
+    let size = 0;
+    for (let i = 0; i < packed.length; i++) {
+        const value = packed.charCodeAt(i) - packedBase;
+        if (value < 0 || value > 0x7fff) {
+            return null;
+        }
+        bits = (bits << 15) | value;
+        bitCount += 15;
+        while (bitCount >= 8) {
+            bitCount -= 8;
+            out[size++] = (bits >> bitCount) & 0xff;
+        }
+        bits &= (1 << bitCount) - 1;
+    }
+    return out;
+}
+
+// 知らない種類のフレームは読み飛ばす 末尾のヘッダに満たない余りは無視する
+export function* readBinaryFrames(data: Uint8Array): Generator<BinaryFrame> {
+    let pos = 0;
+    while (data.length - pos >= 8) {
+        if (data[pos] !== binaryFrameVersion) {
+            return;
+        }
+        const type = data[pos + 1];
+        const flags = data[pos + 2] | (data[pos + 3] << 8);
+        const length = (data[pos + 4] | (data[pos + 5] << 8) | (data[pos + 6] << 16) | (data[pos + 7] << 24)) >>> 0;
+        if (data.length - pos - 8 < length) {
+            return;
+        }
+        const payload = data.subarray(pos + 8, pos + 8 + length);
+        pos += 8 + length;
+        if (type >= BinaryFrameType.Packets && type <= BinaryFrameType.Response) {
+            yield { type, flags, payload };
+        }
+    }
+}
+
+function readUint33(payload: Uint8Array, offset: number): number {
+    const view = new DataView(payload.buffer, payload.byteOffset + offset, 8);
+    return view.getUint32(0, true) + view.getUint32(4, true) * 0x100000000;
+}
+
+// Timestampフレームのprogram_clock_reference_baseとprogram_clock_reference_extension
+export function readTimestampFrame(payload: Uint8Array): { pcrBase: number, pcrExtension: number } {
+    return {
+        pcrBase: readUint33(payload, 0),
+        pcrExtension: payload[8] | (payload[9] << 8),
+    };
+}
+
+// PESフレームのstream_id、PTS(90kHz)とPES_packet_data_byte
+export function readPESFrame(payload: Uint8Array): { streamId: number, pts?: number, data: Uint8Array } {
+    return {
+        streamId: payload[0],
+        pts: (payload[1] & 1) ? readUint33(payload, 2) : undefined,
+        data: payload.subarray(10),
+    };
+}
+
+// Sectionフレームのパケットが含まれていたPIDとセクション
+export function readSectionFrame(payload: Uint8Array): { pid: number, section: Uint8Array } {
+    return {
+        pid: payload[0] | (payload[1] << 8),
+        section: payload.subarray(2),
+    };
+}
+
+// Moduleフレームのcomponent_tag、moduleIdとモジュールの中身
+export function readModuleFrame(payload: Uint8Array): { componentTag: number, moduleId: number, data: Uint8Array } {
+    return {
+        componentTag: payload[0],
+        moduleId: payload[1] | (payload[2] << 8),
+        data: payload.subarray(3),
+    };
+}